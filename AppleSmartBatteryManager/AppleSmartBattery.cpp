@@ -137,6 +137,27 @@ typedef int MachinePath;
 
 #define kFinishPolling          0xF1
 
+// Slot in CommandTable::slot for a state, or -1 if it has no direct slot
+static inline int stateSlot(uint32_t state)
+{
+    if (state == kTransactionRestart)
+        return kNumStateSlots - 1;
+    if (state & ~(kStage2 | 0xFF))
+        return -1;
+    return (state & 0xFF) | ((state & kStage2) ? 0x100 : 0);
+}
+
+// Index into CommandTable::next for a machine path, or -1
+static inline int machinePathIndex(int path)
+{
+    switch (path) {
+        case kBoot:     return 0;
+        case kFull:     return 1;
+        case kUserVis:  return 2;
+        default:        return -1;
+    }
+}
+
 
 #define super IOPMPowerSource
 
@@ -174,10 +195,26 @@ bool AppleSmartBattery::init(void)
 
     fProvider = NULL;
     fWorkLoop = NULL;
+    fIdentitySerial = NULL;
 
     return true;
 }
 
+/******************************************************************************
+ * AppleSmartBattery::free
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::free(void)
+{
+    if (fIdentitySerial) {
+        fIdentitySerial->release();
+        fIdentitySerial = NULL;
+    }
+
+    super::free();
+}
+
 
 /******************************************************************************
  * AppleSmartBattery::start
@@ -198,6 +235,8 @@ bool AppleSmartBattery::start(IOService *provider)
 
     fPollingNow             = false;
     fCancelPolling          = false;
+    fPollDeferred           = false;
+    fDeferredPollPath       = kFull;
     fRetryAttempts          = 0;
     fPermanentFailure       = false;
     fFullyDischarged        = false;
@@ -207,6 +246,12 @@ bool AppleSmartBattery::start(IOService *provider)
     fAvgCurrent             = 0;
     fInflowDisabled         = false;
     fRebootPolling          = false;
+    fBatchCount             = 0;
+    fBatchDisabled          = false;
+    fIdentitySerial         = NULL;
+    fIdentityValid          = false;
+    fIdentityReadFailed     = false;
+    fPropertiesGeneration   = 0;
     fCellVoltages           = NULL;
     fSystemSleeping         = false;
     fPowerServiceToAck      = NULL;
@@ -310,29 +355,84 @@ void AppleSmartBattery::initializeCommands(void)
         {kFinishPolling,            0, 0, 0, NULL,                              kBoot | kFull | kUserVis}
     };
     
+    int count = sizeof(local_cmd) / sizeof(CommandStruct);
+    int i, path, next;
+
     cmdTable.table = NULL;
     cmdTable.count = 0;
-    
+    bzero(cmdTable.slot, sizeof(cmdTable.slot));
+
+    if (count > kMaxCommands) {
+        BattLog("AppleSmartBattery: command table has %d entries, max %d\n", count, kMaxCommands);
+        return;
+    }
+
     if ((cmdTable.table = (CommandStruct *)IOMalloc(sizeof(local_cmd)))) {
-        cmdTable.count = sizeof(local_cmd) / sizeof(CommandStruct);
+        cmdTable.count = count;
         bcopy(&local_cmd, cmdTable.table, sizeof(local_cmd));
+    } else {
+        return;
+    }
+
+    // Precompute each state's table index and the next command on each path,
+    // so the state machine never has to search the table.
+    for (i = 0; i < count; i++) {
+        int s = stateSlot(cmdTable.table[i].cmd);
+
+        if (s < 0 || cmdTable.slot[s]) {
+            BattLog("AppleSmartBattery: no direct slot for state 0x%x\n", cmdTable.table[i].cmd);
+            continue;
+        }
+        cmdTable.slot[s] = i + 1;
+    }
+
+    for (path = 0; path < kNumMachinePaths; path++) {
+        next = -1;
+        for (i = count - 1; i >= 0; i--) {
+            cmdTable.next[path][i] = next;
+            if (cmdTable.table[i].pathBits & (1 << path))
+                next = i;
+        }
     }
 }
 
 /******************************************************************************
- * AppleSmartBattery::commandForState
+ * AppleSmartBattery::commandIndexForState
  *
  ******************************************************************************/
-CommandStruct *AppleSmartBattery::commandForState(uint32_t state)
+int AppleSmartBattery::commandIndexForState(uint32_t state)
 {
-    if (cmdTable.table) {
-        for (int i=0; i<cmdTable.count; i++) {
-            if (state == cmdTable.table[i].cmd) {
-                return &cmdTable.table[i];
-            }
+    int s, i;
+
+    if (!cmdTable.table) {
+        return -1;
+    }
+
+    s = stateSlot(state);
+    if ((s >= 0) && cmdTable.slot[s]
+        && (cmdTable.table[cmdTable.slot[s] - 1].cmd == state))
+    {
+        return cmdTable.slot[s] - 1;
+    }
+
+    // Not in the slot map; only possible if two states share a slot
+    for (i = 0; i < cmdTable.count; i++) {
+        if (state == cmdTable.table[i].cmd) {
+            return i;
         }
     }
-    return NULL;
+    return -1;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::commandForState
+ *
+ ******************************************************************************/
+CommandStruct *AppleSmartBattery::commandForState(uint32_t state)
+{
+    int i = commandIndexForState(state);
+
+    return (i >= 0) ? &cmdTable.table[i] : NULL;
 }
 
 /******************************************************************************
@@ -384,21 +484,34 @@ command_started:
 bool AppleSmartBattery::initiateNextTransaction(uint32_t state)
 {
     int found_current_index = 0;
+    int path = machinePathIndex(fMachinePath);
     const CommandStruct *cs = NULL;
 
-    if (!cmdTable.table) {
+    found_current_index = commandIndexForState(state);
+    if (found_current_index < 0) {
         return false;
     }
-    
-    // Find index for "state" in cmd_machine
-    for (found_current_index = 0; found_current_index < cmdTable.count; found_current_index++) {
-        if (cmdTable.table[found_current_index].cmd == state) {
-            break;
-        }
-    }
+
     // Find next state to read for fMachinePath
-    if (++found_current_index < cmdTable.count) {
-        for (; found_current_index<cmdTable.count; found_current_index++)
+    if (path >= 0) {
+        found_current_index = cmdTable.next[path][found_current_index];
+
+        // Skip identity reads that are already cached for this pack
+        while ((found_current_index >= 0)
+               && isCachedIdentityCommand(&cmdTable.table[found_current_index]))
+        {
+            found_current_index = cmdTable.next[path][found_current_index];
+        }
+
+        if (found_current_index >= 0)
+        {
+            cs = &cmdTable.table[found_current_index];
+
+            if (isBatchableCommand(cs) && initiateBatchTransaction(found_current_index))
+                return true;
+        }
+    } else {
+        for (found_current_index++; found_current_index<cmdTable.count; found_current_index++)
         {
             if (0 != (cmdTable.table[found_current_index].pathBits & fMachinePath))
             {
@@ -415,25 +528,189 @@ bool AppleSmartBattery::initiateNextTransaction(uint32_t state)
 }
 
 /******************************************************************************
- * AppleSmartBattery::retryCurrentTransaction
+ * AppleSmartBattery::isBatchableCommand
  *
+ * Boot-path-only reads are published as-is and don't feed the state machine,
+ * so consecutive ones can go to the SMBus controller as a single batch.
  ******************************************************************************/
-bool AppleSmartBattery::retryCurrentTransaction(uint32_t state)
+bool AppleSmartBattery::isBatchableCommand(const CommandStruct *cs)
 {
-    int found_current_index = 0;
-    const CommandStruct *cs = NULL;
+    return (!fBatchDisabled
+            && !fIdentityValid
+            && (kBoot == fMachinePath)
+            && (kBoot == cs->pathBits)
+            && ((kWord == cs->protocol) || (kBlock == cs->protocol)
+                || (kBlockData == cs->protocol)));
+}
 
-    if (!cmdTable.table) {
-        return false;
+/******************************************************************************
+ * AppleSmartBattery::isCachedIdentityCommand
+ *
+ * Once a boot path poll has read the pack's static data, later boot path
+ * polls only re-read the hardware serial to confirm it's the same pack.
+ ******************************************************************************/
+bool AppleSmartBattery::isCachedIdentityCommand(const CommandStruct *cs)
+{
+    return (fIdentityValid
+            && (kBoot == cs->pathBits)
+            && (kBAppleHardwareSerialCmd != cs->cmd));
+}
+
+/******************************************************************************
+ * AppleSmartBattery::updateBatteryIdentity
+ *
+ ******************************************************************************/
+void AppleSmartBattery::updateBatteryIdentity(const uint8_t *serial)
+{
+    const OSSymbol *sym = OSSymbol::withCString((const char *)serial);
+
+    if (!sym)
+        return;
+
+    // OSSymbols are unique, so a different pointer is a different serial
+    if (fIdentityValid && (fIdentitySerial != sym))
+    {
+        BattLog("SmartBattery: pack identity changed; re-reading boot path.\n");
+        fIdentityValid = false;
+        fMachinePath = kBoot;
+        fRebootPolling = true;
     }
 
-    // Find index for "state" in cmd_machine
-    for (found_current_index = 0; found_current_index < cmdTable.count; found_current_index++) {
-        if (cmdTable.table[found_current_index].cmd == state) {
-            cs = &cmdTable.table[found_current_index];
+    if (fIdentitySerial)
+        fIdentitySerial->release();
+    fIdentitySerial = sym;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::invalidateBatteryIdentity
+ *
+ ******************************************************************************/
+void AppleSmartBattery::invalidateBatteryIdentity(void)
+{
+    fIdentityValid = false;
+    if (fIdentitySerial) {
+        fIdentitySerial->release();
+        fIdentitySerial = NULL;
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBattery::initiateBatchTransaction
+ *
+ ******************************************************************************/
+bool AppleSmartBattery::initiateBatchTransaction(int index)
+{
+    const CommandStruct     *cs;
+    IOSMBusTransaction      *t;
+    int                     i;
+
+    fBatchCount = 0;
+    for (i = index; (i >= 0) && (fBatchCount < kMaxBatchCommands); i = cmdTable.next[0][i])
+    {
+        cs = &cmdTable.table[i];
+        if (!isBatchableCommand(cs))
             break;
+
+        t = &fBatchTransactions[fBatchCount];
+        bzero(t, sizeof(IOSMBusTransaction));
+        t->protocol = (kWord == cs->protocol) ? kIOSMBusProtocolReadWord : kIOSMBusProtocolReadBlock;
+        t->address  = cs->addr;
+        t->command  = cs->cmd;
+        fBatchStates[fBatchCount++] = cs->cmd;
+    }
+
+    // Not worth a batch
+    if (fBatchCount < 2) {
+        fBatchCount = 0;
+        return false;
+    }
+
+    /* Don't put a batch on the bus a user client has taken exclusively.
+     * Stop this poll the way a completion would, and pick it back up once
+     * access is released.
+     */
+    if (fStalledByUserClient) {
+        fBatchCount = 0;
+        deferPoll(fMachinePath);
+        handlePollingFinished(false);
+        return true;
+    }
+
+    if (kIOReturnSuccess != fProvider->performTransactionBatch(
+                    fBatchTransactions, fBatchCount,
+                    OSMemberFunctionCast(IOSMBusTransactionCompletion,
+                      this, &AppleSmartBattery::batchTransactionCompletion),
+                    (OSObject *)this,
+                    (void *)(uintptr_t)fBatchStates[0]))
+    {
+        fBatchCount = 0;
+        return false;
+    }
+
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::batchTransactionCompletion
+ * -> Runs in workloop context
+ *
+ ******************************************************************************/
+bool AppleSmartBattery::batchTransactionCompletion(
+    void *ref,
+    IOSMBusTransaction *transaction)
+{
+    IOSMBusTransaction      *t;
+    uint16_t                val16;
+    int                     count = fBatchCount;
+    int                     i;
+
+    fBatchCount = 0;
+
+    if (transactionCompletion_shouldAbortTransactions(transaction)) {
+        handlePollingFinished(false);
+        return true;
+    }
+
+    if (fRebootPolling) {
+        return transactionCompletion((void *)kTransactionRestart, NULL);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        t = &fBatchTransactions[i];
+
+        BattLog("batch transaction state = 0x%02x; status = 0x%02x\n",
+                fBatchStates[i], t->status);
+
+        if ((kIOSMBusStatusOK != t->status)
+            || ((kBDesignCapacityCmd == t->command)
+                && (0 == t->receiveData[0]) && (0 == t->receiveData[1])))
+        {
+            // Let the single transaction path and its retry policy take
+            // over from the first read that didn't succeed.
+            fBatchDisabled = true;
+            return retryCurrentTransaction(fBatchStates[i]);
         }
+
+        val16 = (t->receiveData[1] << 8) | t->receiveData[0];
+        if (kBAppleHardwareSerialCmd == fBatchStates[i])
+            updateBatteryIdentity(t->receiveData);
+        handleSetItAndForgetIt(fBatchStates[i], val16, t->receiveData, t->receiveDataCount);
+    }
+
+    if (count) {
+        initiateNextTransaction(fBatchStates[count - 1]);
     }
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::retryCurrentTransaction
+ *
+ ******************************************************************************/
+bool AppleSmartBattery::retryCurrentTransaction(uint32_t state)
+{
+    const CommandStruct *cs = commandForState(state);
     
     if (cs)
         return initiateTransaction(cs, true);
@@ -550,6 +827,7 @@ bool AppleSmartBattery::pollBatteryState(int type)
      */
     if (fStalledByUserClient) {
         BattLog("AppleSmartBattery::pollBatteryState was stalled by an exclusive user client.\n");
+        deferPoll(type);
         return false;
     }
 
@@ -590,6 +868,27 @@ bool AppleSmartBattery::pollBatteryState(int type)
     }
 }
 
+/******************************************************************************
+ * AppleSmartBattery::deferPoll
+ *
+ * Records a poll that couldn't run while a user client holds exclusive
+ * access. Requests are coalesced into the most inclusive path seen
+ * (kBoot reads a superset of kFull, which reads a superset of kUserVis), so
+ * a single poll catches up on all of them once access is released.
+ ******************************************************************************/
+
+void AppleSmartBattery::deferPoll(int type)
+{
+    if (kUseLastPath == type) {
+        type = fMachinePath ? fMachinePath : kFull;
+    }
+
+    if (!fPollDeferred || (type < fDeferredPollPath)) {
+        fDeferredPollPath = type;
+    }
+    fPollDeferred = true;
+}
+
 void AppleSmartBattery::handleBatteryInserted(void)
 {
     clearBatteryState(false);
@@ -721,8 +1020,14 @@ void AppleSmartBattery::handleExclusiveAccess(bool exclusive)
         fStalledByUserClient = false;
 
         // Restore battery state
-        // Do a complete battery poll
-        pollBatteryState(kFull);
+        // Do a complete battery poll, or a boot path poll if one was missed
+        // (e.g. the battery was swapped while the bus was held).
+        int path = kFull;
+        if (fPollDeferred && (fDeferredPollPath < path)) {
+            path = fDeferredPollPath;
+        }
+        fPollDeferred = false;
+        pollBatteryState(path);
     }
 }
 
@@ -766,6 +1071,8 @@ bool AppleSmartBattery::transactionCompletion_shouldAbortTransactions(IOSMBusTra
      */
     if (fStalledByUserClient)
     {
+        // Pick the interrupted poll back up once access is released
+        deferPoll(fMachinePath);
         return true;
     }
 
@@ -906,6 +1213,12 @@ void AppleSmartBattery::handlePollingFinished(bool visitedEntirePath)
             fInitialPollCountdown--;
         }
 
+        // A complete boot path read caches the pack's identity until the
+        // battery is removed or inserted.
+        if ((kBoot == fMachinePath) && !fIdentityReadFailed && fIdentitySerial) {
+            fIdentityValid = true;
+        }
+
         rebuildLegacyIOBatteryInfo();
         updateStatus();
     }
@@ -942,7 +1255,7 @@ bool AppleSmartBattery::handleSetItAndForgetIt(int state, int val16, const uint8
         else if (this_command->protocol == kBlock) {
             publishSym = OSSymbol::withCString((const char *)str32);
             if (publishSym) {
-                setPSProperty(this_command->setItAndForgetItSym, (OSObject *)publishSym);
+                setTrackedProperty(this_command->setItAndForgetItSym, (OSObject *)publishSym);
                 publishSym->release();
                 return true;
             }
@@ -950,7 +1263,7 @@ bool AppleSmartBattery::handleSetItAndForgetIt(int state, int val16, const uint8
         else if (this_command->protocol == kBlockData) {
             publishData = OSData::withBytes((const void *)str32, len);
             if (publishData) {
-                setPSProperty(this_command->setItAndForgetItSym, (OSObject *)publishData);
+                setTrackedProperty(this_command->setItAndForgetItSym, (OSObject *)publishData);
                 publishData->release();
                 return true;
             }
@@ -960,6 +1273,22 @@ bool AppleSmartBattery::handleSetItAndForgetIt(int state, int val16, const uint8
     return false;
 }
 
+/******************************************************************************
+ * AppleSmartBattery::setTrackedProperty
+ *
+ * Publishes a string or data property that isn't part of SmartBatterySnapshot,
+ * and bumps fPropertiesGeneration if its value changed.
+ ******************************************************************************/
+void AppleSmartBattery::setTrackedProperty(const OSSymbol *key, OSObject *val)
+{
+    OSObject *old = properties->getObject(key);
+
+    if (!old || !old->isEqualTo(val)) {
+        fPropertiesGeneration++;
+    }
+    setPSProperty(key, val);
+}
+
 /******************************************************************************
  * AppleSmartBattery::transactionCompletion
  * -> Runs in workloop context
@@ -1022,6 +1351,13 @@ bool AppleSmartBattery::transactionCompletion(
         transaction_success = (kIOSMBusStatusOK == transaction->status);
         if (transaction_success) {
             val16 = (transaction->receiveData[1] << 8) | transaction->receiveData[0];
+
+            if (kBAppleHardwareSerialCmd == next_state)
+                updateBatteryIdentity(transaction->receiveData);
+        } else if (kBoot == fMachinePath) {
+            const CommandStruct *cs = commandForState(next_state);
+            if (cs && (kBoot == cs->pathBits))
+                fIdentityReadFailed = true;
         }
 
         // Is it a set it and forget it command?
@@ -1037,6 +1373,8 @@ bool AppleSmartBattery::transactionCompletion(
     case kTransactionRestart:
 
         fCancelPolling = false;
+        fBatchDisabled = false;
+        fIdentityReadFailed = false;
         fPollingNow = true;
 
         /* Initialize battery read timeout to catch any longstanding stalls. */
@@ -1147,6 +1485,9 @@ bool AppleSmartBattery::transactionCompletion(
                 == (kBTerminateDischargeAlarmBit | kBTerminateChargeAlarmBit))
             {
                 logReadError(kErrorPermanentFailure, 0, transaction);
+                if (errorCondition() != _PermanentFailureSym) {
+                    fPropertiesGeneration++;
+                }
                 setErrorCondition((OSSymbol *)_PermanentFailureSym);
 
                 fPermanentFailure = true;
@@ -1302,6 +1643,8 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
     fACConnected            = -1;
     fAvgCurrent             = 0;
 
+    invalidateBatteryIdentity();
+
     setBatteryInstalled(false);
     setIsCharging(false);
     setCurrentCapacity(0);
@@ -1331,6 +1674,8 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
     properties->removeObject(_PFStatusSym);
     removeProperty(_PFStatusSym);
 
+    fPropertiesGeneration++;
+
     rebuildLegacyIOBatteryInfo();
 
     logReadError(kErrorClearBattery, 0, NULL);
@@ -1424,6 +1769,64 @@ bool AppleSmartBattery::fullyCharged(void)
     return (kOSBooleanTrue == properties->getObject(_FullyChargedSym));
 }
 
+static int32_t getPSInt(OSDictionary *props, const char *key, int32_t defaultValue)
+{
+    OSNumber *n = OSDynamicCast(OSNumber, props->getObject(key));
+
+    return n ? (int32_t)n->unsigned32BitValue() : defaultValue;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::copySnapshot
+ * -> Runs on the command gate
+ *
+ * Fills in the fixed layout battery state handed to powerd, straight from
+ * the values already published in the registry.
+ ******************************************************************************/
+IOReturn AppleSmartBattery::copySnapshot(SmartBatterySnapshot *snapshot)
+{
+    OSNumber    *n;
+
+    bzero(snapshot, sizeof(SmartBatterySnapshot));
+
+    snapshot->version = kSBSnapshotVersion;
+    snapshot->propertiesGeneration = fPropertiesGeneration;
+
+    if (externalConnected())        snapshot->flags |= kSBSnapshotExternalConnected;
+    if (externalChargeCapable())    snapshot->flags |= kSBSnapshotExternalChargeCapable;
+    if (batteryInstalled())         snapshot->flags |= kSBSnapshotBatteryInstalled;
+    if (isCharging())               snapshot->flags |= kSBSnapshotIsCharging;
+    if (fullyCharged())             snapshot->flags |= kSBSnapshotFullyCharged;
+
+    snapshot->voltage           = voltage();
+    snapshot->currentCapacity   = currentCapacity();
+    snapshot->maxCapacity       = maxCapacity();
+    snapshot->timeRemaining     = timeRemaining();
+    snapshot->amperage          = amperage();
+    snapshot->cycleCount        = cycleCount();
+    snapshot->location          = location();
+
+    snapshot->designCapacity    = getPSInt(properties, kIOPMPSDesignCapacityKey, 0);
+    // Published as a 16 bit number; sign extend it
+    snapshot->instantAmperage   = (int16_t)getPSInt(properties, "InstantAmperage", 0);
+    snapshot->maxErr            = getPSInt(properties, kIOPMPSMaxErrKey, 0);
+    snapshot->pfStatus          = getPSInt(properties, "PermanentFailureStatus", 0);
+
+    if ((n = OSDynamicCast(OSNumber, getProperty(kIOPMPSInvalidWakeSecondsKey)))) {
+        snapshot->invalidWakeSecs = n->unsigned32BitValue();
+        snapshot->flags |= kSBSnapshotHasInvalidWakeSecs;
+    }
+
+    if ((n = OSDynamicCast(OSNumber, getProperty(kBootPathKey))))
+        snapshot->bootPathUpdated = n->unsigned32BitValue();
+    if ((n = OSDynamicCast(OSNumber, getProperty(kFullPathKey))))
+        snapshot->fullPathUpdated = n->unsigned32BitValue();
+    if ((n = OSDynamicCast(OSNumber, getProperty(kUserVisPathKey))))
+        snapshot->userVisPathUpdated = n->unsigned32BitValue();
+
+    return kIOReturnSuccess;
+}
+
 
 /******************************************************************************
  ******************************************************************************
@@ -36,6 +36,7 @@
 #define kBatteryPollingDebugKey     "BatteryPollingPeriodOverride"
 
 class AppleSmartBatteryManager;
+struct SmartBatterySnapshot;
 
 typedef struct {
     uint32_t cmd;
@@ -46,9 +47,18 @@ typedef struct {
     int pathBits;
 } CommandStruct;
 
+#define kMaxCommands            64
+#define kNumMachinePaths        3       // kBoot, kFull, kUserVis
+#define kNumStateSlots          513     // Command byte, a plane for kStage2 states, and restart
+#define kMaxBatchCommands       16
+
 typedef struct {
     CommandStruct   *table;
     int             count;
+    // Index of the next command on each machine path, or -1
+    int8_t          next[kNumMachinePaths][kMaxCommands];
+    // Table index + 1 for each state, 0 if none; see stateSlot()
+    uint8_t         slot[kNumStateSlots];
 } CommandTable;
 
 class AppleSmartBattery : public IOPMPowerSource {
@@ -59,6 +69,9 @@ protected:
     IOWorkLoop                  *fWorkLoop;
     IOTimerEventSource          *fBatteryReadAllTimer;
     bool                        fStalledByUserClient;
+    // Most inclusive poll path requested while stalled; replayed on release
+    bool                        fPollDeferred;
+    uint16_t                    fDeferredPollPath;
     bool                        fCancelPolling;
     bool                        fPollingNow;
     IOSMBusTransaction          fTransaction;
@@ -88,6 +101,20 @@ protected:
 
     CommandTable                cmdTable;
 
+    // Boot path reads submitted with AppleSmartBatteryManager::performTransactionBatch()
+    IOSMBusTransaction          fBatchTransactions[kMaxBatchCommands];
+    uint32_t                    fBatchStates[kMaxBatchCommands];
+    int                         fBatchCount;
+    bool                        fBatchDisabled;
+
+    // Static pack identity read on the kBoot path, keyed by its hardware serial
+    const OSSymbol              *fIdentitySerial;
+    bool                        fIdentityValid;
+    bool                        fIdentityReadFailed;
+
+    // Bumped when a property outside of SmartBatterySnapshot changes
+    uint32_t                    fPropertiesGeneration;
+
     IOACPIPlatformDevice        *fACPIProvider;
 
     
@@ -137,18 +164,27 @@ protected:
     void    constructAppleSerialNumber(void);
     
     CommandStruct *commandForState(uint32_t state);
+    int     commandIndexForState(uint32_t state);
     void    initializeCommands(void);
     bool    initiateTransaction(const CommandStruct *cs, bool retry);
     bool    initiateNextTransaction(uint32_t state);
+    bool    initiateBatchTransaction(int index);
+    bool    isBatchableCommand(const CommandStruct *cs);
+    bool    isCachedIdentityCommand(const CommandStruct *cs);
+    void    updateBatteryIdentity(const uint8_t *serial);
+    void    invalidateBatteryIdentity(void);
     bool    retryCurrentTransaction(uint32_t state);
     bool    handleSetItAndForgetIt(int state, int val16,
                                    const uint8_t *str32, uint32_t len);
+    void    setTrackedProperty(const OSSymbol *key, OSObject *val);
 
 public:
     static AppleSmartBattery *smartBattery(void);
     virtual bool init(void);
     virtual bool start(IOService *provider);
+    virtual void free(void);
     bool    pollBatteryState(int path);
+    IOReturn copySnapshot(struct SmartBatterySnapshot *snapshot);
     void    handleBatteryInserted(void);
     void    handleBatteryRemoved(void);
     void    handleInflowDisabled(bool inflow_state);
@@ -168,8 +204,10 @@ protected:
     void    rebuildLegacyIOBatteryInfo(void);
 
     bool        transactionCompletion(void *ref, IOSMBusTransaction *transaction);
+    bool        batchTransactionCompletion(void *ref, IOSMBusTransaction *transaction);
     uint32_t    transactionCompletion_requiresRetryGetMicroSec(IOSMBusTransaction *transaction);
     bool        transactionCompletion_shouldAbortTransactions(IOSMBusTransaction *transaction);
+    void        deferPoll(int type);
     void        handlePollingFinished(bool visitedEntirePath);
 
     IOReturn readWordAsync(uint32_t refnum, uint8_t address, uint8_t cmd);
@@ -349,6 +349,82 @@ IOReturn AppleSmartBatteryManager::performTransaction(
                 reference);
 }
 
+/* 
+ * performTransactionBatch
+ * 
+ * Called by smart battery children
+ */
+IOReturn AppleSmartBatteryManager::performTransactionBatch(
+    IOSMBusTransaction * transactions,
+    int count,
+    IOSMBusTransactionCompletion completion,
+    OSObject * target,
+    void * reference)
+{
+    IOReturn    ret;
+    int         i;
+
+    if (!transactions || (count <= 0) || !completion)
+        return kIOReturnBadArgument;
+
+    if (fExclusiveUserClient)
+        return kIOReturnExclusiveAccess;
+
+    if (fBatchRemaining)
+        return kIOReturnBusy;
+
+    fBatchTransactions  = transactions;
+    fBatchCompletion    = completion;
+    fBatchTarget        = target;
+    fBatchReference     = reference;
+    fBatchRemaining     = count;
+
+    for (i = 0; i < count; i++)
+    {
+        ret = fProvider->performTransaction(&transactions[i],
+                    OSMemberFunctionCast(IOSMBusTransactionCompletion,
+                        this, &AppleSmartBatteryManager::batchTransactionCompletion),
+                    (OSObject *)this,
+                    (void *)&transactions[i]);
+
+        if (kIOReturnSuccess != ret) {
+            break;
+        }
+    }
+
+    if (0 == i) {
+        // Nothing was queued; let the caller fall back to single transactions
+        fBatchRemaining = 0;
+        return ret;
+    }
+
+    // Transactions that couldn't be queued complete immediately as failed
+    for (; i < count; i++) {
+        transactions[i].status = kIOSMBusStatusPECError;
+        batchTransactionCompletion((void *)&transactions[i], &transactions[i]);
+    }
+
+    return kIOReturnSuccess;
+}
+
+/* 
+ * batchTransactionCompletion
+ * -> Runs in workloop context
+ */
+bool AppleSmartBatteryManager::batchTransactionCompletion(
+    void *ref,
+    IOSMBusTransaction *transaction)
+{
+    if (fBatchRemaining <= 0)
+        return false;
+
+    if (0 == --fBatchRemaining) {
+        (*fBatchCompletion)(fBatchTarget, fBatchReference, fBatchTransactions);
+    }
+
+    return true;
+}
+
 /* 
  * setPowerState
  * 
@@ -549,6 +625,16 @@ bool AppleSmartBatteryManager::requestPoll(int type) {
     return ret;
 }
 
+IOReturn AppleSmartBatteryManager::copySnapshot(SmartBatterySnapshot *snapshot) {
+    if (!fBattery || !snapshot) {
+        return kIOReturnNotReady;
+    }
+
+    return fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action,
+                           fBattery, &AppleSmartBattery::copySnapshot),
+                           (void *)snapshot, NULL, NULL, NULL);
+}
+
 void AppleSmartBatteryManager::gatedSendCommand(
     int cmd, 
     int level, 
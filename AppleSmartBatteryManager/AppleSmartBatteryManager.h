@@ -34,6 +34,7 @@ void BattLog(const char *fmt, ...);
 
 class AppleSmartBattery;
 class AppleSmartBatteryManagerUserClient;
+struct SmartBatterySnapshot;
 
 /*
  * Support for external transactions (from user space)
@@ -94,6 +95,15 @@ public:
 				    OSObject * target = 0,
 				    void * reference = 0);
 
+    // Queues 'count' transactions with the SMBus controller in one go.
+    // 'completion' is called once, with the first transaction, after all
+    // of them have completed. Only one batch may be outstanding.
+    IOReturn performTransactionBatch(IOSMBusTransaction * transactions,
+                                     int count,
+                                     IOSMBusTransactionCompletion completion,
+                                     OSObject * target,
+                                     void * reference);
+
     IOReturn setPowerState(unsigned long which, IOService *whom);
 
     IOReturn message(UInt32 type, IOService *provider, void * argument);
@@ -110,7 +120,10 @@ public:
     bool hasExclusiveClient(void);
     
     bool requestPoll(int type);
-    
+
+    // Called by AppleSmartBatteryManagerUserClient
+    IOReturn copySnapshot(struct SmartBatterySnapshot *snapshot);
+
 private:
     // Called by AppleSmartBatteryManagerUserClient
     IOReturn inhibitCharging(int level);        
@@ -134,6 +147,8 @@ private:
     // transactionCompletion is the guts of the state machine
     bool    transactionCompletion(void *ref, IOSMBusTransaction *transaction);
 
+    bool    batchTransactionCompletion(void *ref, IOSMBusTransaction *transaction);
+
 private:
     IOSMBusTransaction          fTransaction;
     IOCommandGate               * fBatteryGate;
@@ -141,6 +156,13 @@ private:
     IOSMBusController           * fProvider;
     AppleSmartBattery           * fBattery;
     bool                        fExclusiveUserClient;
+
+    // Outstanding performTransactionBatch()
+    IOSMBusTransaction          * fBatchTransactions;
+    int                         fBatchRemaining;
+    IOSMBusTransactionCompletion fBatchCompletion;
+    OSObject                    * fBatchTarget;
+    void                        * fBatchReference;
 };
 
 #endif
@@ -224,7 +224,17 @@ AppleSmartBatteryManagerUserClient::externalMethod(
         case kSBRequestPoll:
             // 1 scalar in; 0 scalar out
             return fOwner->requestPoll(arguments->scalarInput[0]);
-            
+
+        case kSBCopySnapshot:
+            // 0 scalar in; struct out
+            if (!arguments->structureOutput
+                || (arguments->structureOutputSize < sizeof(SmartBatterySnapshot)))
+            {
+                return kIOReturnBadArgument;
+            }
+            arguments->structureOutputSize = sizeof(SmartBatterySnapshot);
+            return fOwner->copySnapshot((SmartBatterySnapshot *)arguments->structureOutput);
+
         default:
             return kIOReturnBadArgument;
     }
@@ -36,10 +36,53 @@ enum {
     kSBChargeInhibit        = 1,
     kSBSetPollingInterval   = 2,
     kSBSMBusReadWriteWord   = 3,
-    kSBRequestPoll          = 4
+    kSBRequestPoll          = 4,
+    kSBCopySnapshot         = 5
 };
 
-#define kNumBattMethods     5
+#define kNumBattMethods     6
+
+/*
+ * kSBCopySnapshot
+ *
+ * Fixed layout copy of the battery state published in the registry, read
+ * by powerd in one call on each battery update. Mirrored in pmconfigd's
+ * PrivateLib.h; bump kSBSnapshotVersion on any layout change.
+ */
+#define kSBSnapshotVersion      1
+
+enum {
+    kSBSnapshotExternalConnected        = (1 << 0),
+    kSBSnapshotExternalChargeCapable    = (1 << 1),
+    kSBSnapshotBatteryInstalled         = (1 << 2),
+    kSBSnapshotIsCharging               = (1 << 3),
+    kSBSnapshotFullyCharged             = (1 << 4),
+    kSBSnapshotHasInvalidWakeSecs       = (1 << 5)
+};
+
+typedef struct SmartBatterySnapshot {
+    uint32_t        version;
+    uint32_t        flags;
+    // Bumped whenever a string, data or identity property changes;
+    // powerd refreshes its copy of the registry properties only then.
+    uint32_t        propertiesGeneration;
+    uint32_t        pfStatus;
+    int32_t         voltage;
+    int32_t         currentCapacity;
+    int32_t         maxCapacity;
+    int32_t         designCapacity;
+    int32_t         timeRemaining;
+    int32_t         instantAmperage;
+    int32_t         amperage;
+    int32_t         maxErr;
+    int32_t         cycleCount;
+    int32_t         location;
+    int32_t         invalidWakeSecs;
+    // Calendar seconds at which each polling path last finished
+    uint32_t        bootPathUpdated;
+    uint32_t        fullPathUpdated;
+    uint32_t        userVisPathUpdated;
+} SmartBatterySnapshot;
 
 /*
  * user client types
@@ -0,0 +1,714 @@
+//
+//  powerassertions-benchmark.c
+//
+//  Measures assertion create/release/setproperty throughput and latency
+//  as seen by clients of powerd.
+//
+
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include <mach/mach_time.h>
+#include <libproc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/***
+
+ This tool drives powerd's assertion interfaces from several threads in
+ several processes at once, and reports for each scenario:
+    - ops/sec across all clients
+    - p50/p99/p999 client-observed latency
+    - powerd CPU time consumed and its resident size afterwards
+
+ Scenarios:
+    untimed     Create, SetProperty, Release with no timeout
+    timed       Same, but each assertion carries a timeout, so powerd
+                arms and cancels a timer on every op
+    types       Create/Release cycling through the assertion types that
+                map to distinct kerAssertionType bits
+    deathstorm  Child processes create assertions and exit without
+                releasing them; measures how long powerd takes to reap them
+
+ The numbers are informational. The tool prints [FAIL] only when an
+ assertion call returns an error, a client process dies, or powerd does not
+ reap the storm's assertions; timings are not judged.
+
+ With no arguments it runs a short smoke pass, since iopmruntests.py runs
+ everything installed in /AppleInternal/CoreOS/PowerManagement/ that way.
+ Use -l for a full-size run; options after -l override its sizes.
+
+ Usage: powerassertions-benchmark [-l] [-t threads] [-p processes] [-n iterations]
+                                  [-c storm children] [-a storm assertions per child]
+
+ ***/
+
+enum {
+    kOpCreate = 0,
+    kOpSetProperty,
+    kOpRelease,
+    kOpCount
+};
+
+static const char *kOpNames[kOpCount] = { "create", "setproperty", "release" };
+
+typedef enum {
+    kScenarioUntimed,
+    kScenarioTimed,
+    kScenarioTypes
+} Scenario;
+
+static CFStringRef kSweepTypes[] = {
+    kIOPMAssertionTypePreventUserIdleSystemSleep,
+    kIOPMAssertionTypePreventUserIdleDisplaySleep,
+    kIOPMAssertionTypePreventSystemSleep,
+    kIOPMAssertionTypeNoIdleSleep,
+    kIOPMAssertionTypeNoDisplaySleep,
+    kIOPMAssertNetworkClientActive,
+    kIOPMAssertionTypeBackgroundTask,
+    kIOPMAssertionTypeApplePushServiceTask,
+    kIOPMAssertInteractivePushServiceTask,
+    kIOPMAssertPreventDiskIdle,
+    kIOPMAssertionTypeNeedsCPU,
+    kIOPMAssertionTypeSystemIsActive,
+    kIOPMAssertionTypeDenySystemSleep
+};
+
+static const int kSweepTypesCount = sizeof(kSweepTypes)/sizeof(CFStringRef);
+
+static const CFTimeInterval kTimedAssertionTimeout      = 60.0;
+static const CFTimeInterval kStormReapTimeout           = 30.0;
+
+typedef struct {
+    int                 threads;
+    int                 processes;
+    int                 iterations;
+    int                 stormChildren;
+    int                 stormAssertions;
+} Options;
+
+static const Options                kLongRun = { 4, 2, 500, 32, 8 };
+static Options                      gOpts = { 2, 2, 20, 4, 4 };
+static mach_timebase_info_data_t    gTimebase;
+static pid_t                        gPowerdPID = 0;
+static int                          gFailures = 0;
+
+/* Samples for one scenario run: [process][thread][op][iteration], in mach time */
+static uint64_t                     *gSamples = NULL;
+static size_t                       gSamplesSize = 0;
+static int                          *gErrors = NULL;
+
+static pthread_mutex_t              gStartLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t               gStartCond = PTHREAD_COND_INITIALIZER;
+static bool                         gStarted = false;
+
+typedef struct {
+    Scenario            scenario;
+    int                 process;
+    int                 thread;
+} WorkerArgs;
+
+static uint64_t *sampleSlot(int process, int thread, int op)
+{
+    size_t      index;
+
+    index = (((size_t)process * gOpts.threads + thread) * kOpCount + op) * gOpts.iterations;
+    return &gSamples[index];
+}
+
+static double machToUsec(uint64_t t)
+{
+    return ((double)t * gTimebase.numer / gTimebase.denom) / 1000.0;
+}
+
+static double machToSec(uint64_t t)
+{
+    return machToUsec(t) / 1000000.0;
+}
+
+/*****************************************************************************/
+/* powerd resource usage */
+
+static pid_t findPowerd(void)
+{
+    pid_t       *pids = NULL;
+    int         bytes = 0;
+    int         count = 0;
+    int         i = 0;
+    pid_t       found = 0;
+    char        name[2*MAXCOMLEN];
+
+    bytes = proc_listpids(PROC_ALL_PIDS, 0, NULL, 0);
+    if (bytes <= 0) {
+        return 0;
+    }
+    pids = (pid_t *)malloc(bytes);
+    bytes = proc_listpids(PROC_ALL_PIDS, 0, pids, bytes);
+    count = bytes / (int)sizeof(pid_t);
+
+    for (i=0; i<count; i++) {
+        if (pids[i] == 0) continue;
+        bzero(name, sizeof(name));
+        if ((proc_name(pids[i], name, sizeof(name)) > 0) && !strcmp(name, "powerd")) {
+            found = pids[i];
+            break;
+        }
+    }
+    free(pids);
+    return found;
+}
+
+static bool sampleTaskInfo(struct proc_taskinfo *ti)
+{
+    bzero(ti, sizeof(*ti));
+    if (!gPowerdPID) {
+        return false;
+    }
+    return (proc_pidinfo(gPowerdPID, PROC_PIDTASKINFO, 0, ti, sizeof(*ti)) == sizeof(*ti));
+}
+
+/*****************************************************************************/
+/* Reporting */
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint64_t    x = *(const uint64_t *)a;
+    uint64_t    y = *(const uint64_t *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static double percentile(uint64_t *sorted, size_t n, double p)
+{
+    if (n == 0) return 0.0;
+    return machToUsec(sorted[(size_t)(p * (double)(n - 1))]);
+}
+
+static void reportRow(const char *name, size_t ops, double wallSec,
+                      uint64_t *samples, size_t n)
+{
+    double                  opsPerSec = 0.0;
+    double                  p50, p99, p999;
+
+    if (samples && n) {
+        qsort(samples, n, sizeof(uint64_t), compareSamples);
+    }
+    if (wallSec > 0.0) {
+        opsPerSec = (double)ops / wallSec;
+    }
+    p50 = percentile(samples, n, 0.50);
+    p99 = percentile(samples, n, 0.99);
+    p999 = percentile(samples, n, 0.999);
+
+    printf("%-26s %10.0f ops/s   p50 %8.1fus   p99 %8.1fus   p999 %8.1fus\n",
+           name, opsPerSec, p50, p99, p999);
+}
+
+static void reportPowerd(const char *scenario,
+                         struct proc_taskinfo *before, struct proc_taskinfo *after,
+                         double wallSec)
+{
+    uint64_t    cpu;
+
+    if (!before->pti_resident_size || !after->pti_resident_size) {
+        printf("%-26s powerd usage unavailable (run as root)\n", scenario);
+        return;
+    }
+
+    /* pti_total_* are in mach time units */
+    cpu = (after->pti_total_user + after->pti_total_system)
+        - (before->pti_total_user + before->pti_total_system);
+    printf("%-26s powerd cpu %0.3fs (%0.1f%%)   rss %llu KB (%+lld KB)\n",
+           scenario, machToSec(cpu), wallSec > 0.0 ? 100.0 * machToSec(cpu) / wallSec : 0.0,
+           after->pti_resident_size / 1024,
+           ((long long)after->pti_resident_size - (long long)before->pti_resident_size) / 1024);
+}
+
+/*****************************************************************************/
+/* Create/SetProperty/Release scenarios */
+
+static CFDictionaryRef createAssertionProperties(CFStringRef type, CFStringRef name, bool timed)
+{
+    CFMutableDictionaryRef  props = NULL;
+    CFNumberRef             levelNum = NULL;
+    CFNumberRef             timeoutNum = NULL;
+    int                     level = kIOPMAssertionLevelOn;
+    int                     timeout = (int)kTimedAssertionTimeout;
+
+    props = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    levelNum = CFNumberCreate(0, kCFNumberIntType, &level);
+
+    CFDictionarySetValue(props, kIOPMAssertionTypeKey, type);
+    CFDictionarySetValue(props, kIOPMAssertionNameKey, name);
+    CFDictionarySetValue(props, kIOPMAssertionLevelKey, levelNum);
+    CFRelease(levelNum);
+
+    if (timed) {
+        timeoutNum = CFNumberCreate(0, kCFNumberIntType, &timeout);
+        CFDictionarySetValue(props, kIOPMAssertionTimeoutKey, timeoutNum);
+        CFDictionarySetValue(props, kIOPMAssertionTimeoutActionKey, kIOPMAssertionTimeoutActionRelease);
+        CFRelease(timeoutNum);
+    }
+
+    return props;
+}
+
+static void *assertionWorker(void *arg)
+{
+    WorkerArgs          *args = (WorkerArgs *)arg;
+    CFDictionaryRef     props[kSweepTypesCount];
+    CFStringRef         name = NULL;
+    CFStringRef         renamed = NULL;
+    uint64_t            *create = sampleSlot(args->process, args->thread, kOpCreate);
+    uint64_t            *setprop = sampleSlot(args->process, args->thread, kOpSetProperty);
+    uint64_t            *release = sampleSlot(args->process, args->thread, kOpRelease);
+    int                 *errors = &gErrors[args->process * gOpts.threads + args->thread];
+    int                 propsCount = 1;
+    int                 i;
+
+    /* Build every property dictionary up front so only powerd's work is timed */
+    name = CFStringCreateWithFormat(0, 0, CFSTR("powerassertions-benchmark %d/%d"),
+                                    args->process, args->thread);
+    renamed = CFStringCreateWithFormat(0, 0, CFSTR("powerassertions-benchmark %d/%d renamed"),
+                                       args->process, args->thread);
+    if (args->scenario == kScenarioTypes) {
+        propsCount = kSweepTypesCount;
+        for (i=0; i<kSweepTypesCount; i++) {
+            props[i] = createAssertionProperties(kSweepTypes[i], name, false);
+        }
+    } else {
+        props[0] = createAssertionProperties(kIOPMAssertNetworkClientActive, name,
+                                             (args->scenario == kScenarioTimed));
+    }
+
+    pthread_mutex_lock(&gStartLock);
+    while (!gStarted) {
+        pthread_cond_wait(&gStartCond, &gStartLock);
+    }
+    pthread_mutex_unlock(&gStartLock);
+
+    for (i=0; i<gOpts.iterations; i++)
+    {
+        IOPMAssertionID     id = kIOPMNullAssertionID;
+        IOReturn            ret;
+        uint64_t            t0, t1;
+
+        t0 = mach_absolute_time();
+        ret = IOPMAssertionCreateWithProperties(props[i % propsCount], &id);
+        t1 = mach_absolute_time();
+        create[i] = t1 - t0;
+        if (kIOReturnSuccess != ret) {
+            (*errors)++;
+            continue;
+        }
+
+        if (args->scenario != kScenarioTypes) {
+            t0 = mach_absolute_time();
+            ret = IOPMAssertionSetProperty(id, kIOPMAssertionNameKey, renamed);
+            t1 = mach_absolute_time();
+            setprop[i] = t1 - t0;
+            if (kIOReturnSuccess != ret) {
+                (*errors)++;
+            }
+        }
+
+        t0 = mach_absolute_time();
+        ret = IOPMAssertionRelease(id);
+        t1 = mach_absolute_time();
+        release[i] = t1 - t0;
+        if (kIOReturnSuccess != ret) {
+            (*errors)++;
+        }
+    }
+
+    for (i=0; i<propsCount; i++) {
+        CFRelease(props[i]);
+    }
+    CFRelease(name);
+    CFRelease(renamed);
+    return NULL;
+}
+
+static void runWorkers(Scenario scenario, int process)
+{
+    pthread_t       *threads = calloc(gOpts.threads, sizeof(pthread_t));
+    WorkerArgs      *args = calloc(gOpts.threads, sizeof(WorkerArgs));
+    int             i;
+
+    gStarted = false;
+    for (i=0; i<gOpts.threads; i++) {
+        args[i].scenario = scenario;
+        args[i].process = process;
+        args[i].thread = i;
+        pthread_create(&threads[i], NULL, assertionWorker, &args[i]);
+    }
+
+    pthread_mutex_lock(&gStartLock);
+    gStarted = true;
+    pthread_cond_broadcast(&gStartCond);
+    pthread_mutex_unlock(&gStartLock);
+
+    for (i=0; i<gOpts.threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+}
+
+/*****************************************************************************/
+/* Client processes
+ *
+ * Every client process is forked before this process touches CoreFoundation
+ * or IOKit, since neither is safe to use in a child forked after they have
+ * been. Workers then sit on a command pipe for scenarios to run; storm
+ * children wait to be told to create their assertions, and then to die.
+ */
+
+typedef struct {
+    pid_t               pid;
+    int                 cmd;
+    int                 done;
+} ClientProcess;
+
+static ClientProcess    *gWorkers = NULL;
+static pid_t            *gStormPIDs = NULL;
+static int              gStormGo = -1;
+static int              gStormReady = -1;
+static int              gStormDie = -1;
+
+static void workerProcessLoop(int process, int cmd, int done)
+{
+    unsigned char   scenario;
+
+    while (read(cmd, &scenario, 1) == 1) {
+        runWorkers((Scenario)scenario, process);
+        if (write(done, &scenario, 1) != 1) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+static void stormChildLoop(int go, int ready, int die)
+{
+    CFDictionaryRef     props = NULL;
+    IOPMAssertionID     id;
+    char                c = 0;
+    int                 j;
+
+    if (read(go, &c, 1) != 1) {
+        _exit(0);
+    }
+    c = 0;
+    props = createAssertionProperties(kIOPMAssertNetworkClientActive,
+                                      CFSTR("powerassertions-benchmark deathstorm"), false);
+    for (j=0; j<gOpts.stormAssertions; j++) {
+        if (kIOReturnSuccess == IOPMAssertionCreateWithProperties(props, &id)) {
+            c++;
+        }
+    }
+    (void)write(ready, &c, 1);
+
+    /* Exit without releasing anything once the parent closes 'die' */
+    (void)read(die, &c, 1);
+    _exit(0);
+}
+
+static bool spawnClients(void)
+{
+    int     cmd[2], done[2];
+    int     go[2], ready[2], die[2];
+    int     p, i;
+
+    gWorkers = calloc(gOpts.processes, sizeof(ClientProcess));
+    for (p=1; p<gOpts.processes; p++) {
+        if ((pipe(cmd) != 0) || (pipe(done) != 0)) {
+            return false;
+        }
+        gWorkers[p].pid = fork();
+        if (gWorkers[p].pid == 0) {
+            close(cmd[1]);
+            close(done[0]);
+            workerProcessLoop(p, cmd[0], done[1]);
+        }
+        close(cmd[0]);
+        close(done[1]);
+        gWorkers[p].cmd = cmd[1];
+        gWorkers[p].done = done[0];
+        if (gWorkers[p].pid < 0) {
+            return false;
+        }
+    }
+
+    if (!gOpts.stormChildren) {
+        return true;
+    }
+    if ((pipe(go) != 0) || (pipe(ready) != 0) || (pipe(die) != 0)) {
+        return false;
+    }
+    gStormPIDs = calloc(gOpts.stormChildren, sizeof(pid_t));
+    for (i=0; i<gOpts.stormChildren; i++) {
+        gStormPIDs[i] = fork();
+        if (gStormPIDs[i] == 0) {
+            close(go[1]);
+            close(ready[0]);
+            close(die[1]);
+            stormChildLoop(go[0], ready[1], die[0]);
+        }
+        if (gStormPIDs[i] < 0) {
+            return false;
+        }
+    }
+    close(go[0]);
+    close(ready[1]);
+    close(die[0]);
+    gStormGo = go[1];
+    gStormReady = ready[0];
+    gStormDie = die[1];
+    return true;
+}
+
+static void reapClients(void)
+{
+    int     p, i;
+
+    for (p=1; p<gOpts.processes; p++) {
+        if (gWorkers[p].pid > 0) {
+            close(gWorkers[p].cmd);
+            close(gWorkers[p].done);
+            waitpid(gWorkers[p].pid, NULL, 0);
+        }
+    }
+    if (gStormPIDs) {
+        if (gStormGo >= 0) close(gStormGo);
+        if (gStormDie >= 0) close(gStormDie);
+        for (i=0; i<gOpts.stormChildren; i++) {
+            if (gStormPIDs[i] > 0) {
+                waitpid(gStormPIDs[i], NULL, 0);
+            }
+        }
+    }
+}
+
+/*****************************************************************************/
+
+static void runScenario(Scenario scenario, const char *scenarioName)
+{
+    struct proc_taskinfo    before, after;
+    unsigned char           cmd = (unsigned char)scenario;
+    int                     p, op, i;
+    int                     errors = 0;
+    uint64_t                t0, t1;
+    double                  wallSec;
+    size_t                  perOp = (size_t)gOpts.processes * gOpts.threads * gOpts.iterations;
+    uint64_t                *merged = NULL;
+    char                    rowName[64];
+
+    bzero(gSamples, gSamplesSize);
+    bzero(gErrors, sizeof(int) * gOpts.processes * gOpts.threads);
+
+    sampleTaskInfo(&before);
+    t0 = mach_absolute_time();
+    for (p=1; p<gOpts.processes; p++) {
+        (void)write(gWorkers[p].cmd, &cmd, 1);
+    }
+    runWorkers(scenario, 0);
+    for (p=1; p<gOpts.processes; p++) {
+        if (read(gWorkers[p].done, &cmd, 1) != 1) {
+            printf("[FAIL] %s: client process %d exited early\n", scenarioName, gWorkers[p].pid);
+            gFailures++;
+        }
+    }
+    t1 = mach_absolute_time();
+    sampleTaskInfo(&after);
+    wallSec = machToSec(t1 - t0);
+
+    for (i=0; i<gOpts.processes * gOpts.threads; i++) {
+        errors += gErrors[i];
+    }
+    if (errors) {
+        printf("[FAIL] %s: %d assertion calls returned an error\n", scenarioName, errors);
+        gFailures++;
+    }
+
+    merged = malloc(perOp * sizeof(uint64_t));
+    for (op=0; op<kOpCount; op++)
+    {
+        size_t  n = 0;
+
+        if ((op == kOpSetProperty) && (scenario == kScenarioTypes)) {
+            continue;
+        }
+        for (p=0; p<gOpts.processes; p++) {
+            for (i=0; i<gOpts.threads; i++) {
+                memcpy(&merged[n], sampleSlot(p, i, op), gOpts.iterations * sizeof(uint64_t));
+                n += gOpts.iterations;
+            }
+        }
+
+        /* Throughput per op uses the scenario's wall time, so rows in a
+         * scenario sum to its total call rate */
+        snprintf(rowName, sizeof(rowName), "%s/%s", scenarioName, kOpNames[op]);
+        reportRow(rowName, n, wallSec, merged, n);
+    }
+    free(merged);
+
+    reportPowerd(scenarioName, &before, &after, wallSec);
+}
+
+/*****************************************************************************/
+/* Client death storm */
+
+static bool anyAssertionsHeldBy(pid_t *pids, int count)
+{
+    CFDictionaryRef     byProcess = NULL;
+    bool                found = false;
+    int                 i;
+
+    if ((kIOReturnSuccess != IOPMCopyAssertionsByProcess(&byProcess)) || !byProcess) {
+        return false;
+    }
+    for (i=0; i<count && !found; i++) {
+        CFNumberRef pidNum = CFNumberCreate(0, kCFNumberIntType, &pids[i]);
+        found = CFDictionaryContainsKey(byProcess, pidNum);
+        CFRelease(pidNum);
+    }
+    CFRelease(byProcess);
+    return found;
+}
+
+static void runDeathStorm(void)
+{
+    struct proc_taskinfo    before, after;
+    int                     i;
+    int                     created = 0;
+    char                    c = 0;
+    uint64_t                t0, t1;
+    uint64_t                reap;
+    double                  reapSec;
+
+    for (i=0; i<gOpts.stormChildren; i++) {
+        (void)write(gStormGo, &c, 1);
+    }
+    for (i=0; i<gOpts.stormChildren; i++) {
+        if (read(gStormReady, &c, 1) == 1) {
+            created += c;
+        }
+    }
+
+    /* All clients die together */
+    sampleTaskInfo(&before);
+    close(gStormDie);
+    gStormDie = -1;
+    for (i=0; i<gOpts.stormChildren; i++) {
+        waitpid(gStormPIDs[i], NULL, 0);
+    }
+
+    /* Time from the last client's death until powerd no longer lists any of them */
+    t0 = mach_absolute_time();
+    while (anyAssertionsHeldBy(gStormPIDs, gOpts.stormChildren)) {
+        if (machToSec(mach_absolute_time() - t0) > kStormReapTimeout) {
+            printf("[FAIL] deathstorm: powerd still holds dead clients' assertions after %0.0fs\n",
+                   kStormReapTimeout);
+            gFailures++;
+            break;
+        }
+        usleep(1000);
+    }
+    t1 = mach_absolute_time();
+    sampleTaskInfo(&after);
+
+    for (i=0; i<gOpts.stormChildren; i++) {
+        gStormPIDs[i] = 0;
+    }
+
+    reap = t1 - t0;
+    reapSec = machToSec(reap);
+    printf("deathstorm: %d clients, %d assertions reaped in %0.1fms\n",
+           gOpts.stormChildren, created, reapSec * 1000.0);
+    reportRow("deathstorm/reap", created, reapSec, &reap, 1);
+    reportPowerd("deathstorm", &before, &after, reapSec);
+}
+
+/*****************************************************************************/
+
+static void usage(const char *me)
+{
+    printf("usage: %s [-l] [-t threads] [-p processes] [-n iterations] "
+           "[-c storm children] [-a storm assertions]\n", me);
+}
+
+int main(int argc, char *argv[])
+{
+    int     ch;
+
+    while ((ch = getopt(argc, argv, "lt:p:n:c:a:h")) != -1) {
+        switch (ch) {
+            case 'l':   gOpts = kLongRun;                       break;
+            case 't':   gOpts.threads = atoi(optarg);           break;
+            case 'p':   gOpts.processes = atoi(optarg);         break;
+            case 'n':   gOpts.iterations = atoi(optarg);        break;
+            case 'c':   gOpts.stormChildren = atoi(optarg);     break;
+            case 'a':   gOpts.stormAssertions = atoi(optarg);   break;
+            default:    usage(argv[0]);                         return 1;
+        }
+    }
+    if ((gOpts.threads < 1) || (gOpts.processes < 1) || (gOpts.iterations < 1)
+        || (gOpts.stormChildren < 0) || (gOpts.stormAssertions < 1) || (gOpts.stormAssertions > 127))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mach_timebase_info(&gTimebase);
+    gPowerdPID = findPowerd();
+
+    /* Shared with the client processes so every sample lands in one place */
+    gSamplesSize = (size_t)gOpts.processes * gOpts.threads * kOpCount * gOpts.iterations * sizeof(uint64_t);
+    gSamples = mmap(NULL, gSamplesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    gErrors = mmap(NULL, sizeof(int) * gOpts.processes * gOpts.threads,
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if ((MAP_FAILED == gSamples) || (MAP_FAILED == gErrors)) {
+        printf("[FAIL] Unable to allocate %zu bytes of sample space\n", gSamplesSize);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!spawnClients()) {
+        printf("[FAIL] Unable to start client processes\n");
+        reapClients();
+        return 1;
+    }
+
+    printf("Executing powerassertions-benchmark: %d processes x %d threads x %d iterations; "
+           "deathstorm %d clients x %d assertions.\n",
+           gOpts.processes, gOpts.threads, gOpts.iterations,
+           gOpts.stormChildren, gOpts.stormAssertions);
+    if (!gPowerdPID) {
+        printf("powerd not found; its CPU and memory use will not be reported.\n");
+    }
+
+    runScenario(kScenarioTimed, "timed");
+    runScenario(kScenarioTypes, "types");
+    runScenario(kScenarioUntimed, "untimed");
+    if (gOpts.stormChildren) {
+        runDeathStorm();
+    }
+    reapClients();
+
+    if (gFailures) {
+        printf("[FAIL] powerassertions-benchmark: %d errors\n", gFailures);
+        return 1;
+    }
+    printf("[PASS] powerassertions-benchmark\n");
+    return 0;
+}
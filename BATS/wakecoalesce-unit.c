@@ -0,0 +1,85 @@
+//
+//  wakecoalesce-unit.c
+//
+//  Exercises powerd's sleep-time wake request coalescer directly,
+//  without going to sleep.
+//
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../pmconfigd/WakeCoalesce.h"
+
+#define kCandidatesMax      8
+
+typedef struct {
+    CFAbsoluteTime      when;       // seconds from the test's base time
+    CFTimeInterval      leeway;
+    wakeType_e          type;
+} Request;
+
+static int failures = 0;
+
+static void check(
+    const char          *name,
+    const Request       *requests,
+    int                 count,
+    CFAbsoluteTime      expectWhen,
+    wakeType_e          expectType,
+    int                 expectCoalesced)
+{
+    WakeCandidate       candidates[kCandidatesMax];
+    WakeCandidateHeap   heap = { candidates, 0, kCandidatesMax };
+    // Well past wakeHeapPush()'s one minute floor
+    CFAbsoluteTime      base = CFAbsoluteTimeGetCurrent() + 3600;
+    CFAbsoluteTime      fireAt;
+    wakeType_e          type = kChooseWakeTypeCount;
+    int                 chosenReq = -1;
+    int                 coalesced = 0;
+    int                 i;
+
+    for (i = 0; i < count; i++) {
+        wakeHeapPush(&heap, base + requests[i].when, requests[i].leeway, requests[i].type, i);
+    }
+
+    fireAt = wakeHeapCoalesce(&heap, &type, &chosenReq, &coalesced);
+    if (count)
+        fireAt -= base;
+
+    if ((fireAt != expectWhen) || (count && (type != expectType)) || (coalesced != expectCoalesced)) {
+        printf("[FAIL] %s: fired at %+.0f type %d coalesced %d; expected %+.0f type %d coalesced %d\n",
+               name, fireAt, type, coalesced, expectWhen, expectType, expectCoalesced);
+        failures++;
+        return;
+    }
+    printf("[PASS] %s\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const Request lone[] = {
+        { 0, 300, kChooseMaintenance } };
+    const Request merged[] = {
+        { 0, 300, kChooseMaintenance },
+        { 100, 0, kChooseSleepServiceWake } };
+    const Request apart[] = {
+        { 0, 0, kChooseMaintenance },
+        { 100, 0, kChooseTimerPlugin } };
+    const Request tightens[] = {
+        { 0, 300, kChooseMaintenance },
+        { 50, 20, kChooseTimerPlugin },
+        { 100, 0, kChooseSleepServiceWake } };
+    const Request withUser[] = {
+        { 0, 300, kChooseMaintenance },
+        { 50, 0, kChooseFullWake } };
+
+    check("Empty heap", NULL, 0, kCFAbsoluteTimeIntervalSince1904, kChooseWakeTypeCount, 0);
+    check("Lone request with leeway fires at its own time", lone, 1, 0, kChooseMaintenance, 1);
+    check("Later request within leeway shares the wake", merged, 2, 100, kChooseSleepServiceWake, 2);
+    check("Requests without leeway stay apart", apart, 2, 0, kChooseMaintenance, 1);
+    check("Tighter deadline stops the merge", tightens, 3, 50, kChooseTimerPlugin, 2);
+    check("User wake makes a shared wake a full wake", withUser, 2, 50, kChooseFullWake, 2);
+
+    return failures ? 1 : 0;
+}
@@ -10,6 +10,13 @@
 #include <IOKit/ps/IOPowerSourcesPrivate.h>
 #include <IOKit/ps/IOPSKeys.h>
 #include <IOKit/IOCFSerialize.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+#include <libproc.h>
+#include <getopt.h>
+#include <notify.h>
+#include <string.h>
+#include <sys/param.h>
 
 static CFDictionaryRef      copyNextPSDictionary(void);
 static CFStringRef          copyNextPSType(void);
@@ -18,12 +25,17 @@ static void iterateCreateSetRelease(int iterations);
 static bool verifyThatAPublishedPowerSourceIsNamed(CFStringRef checkname);
 static void createAndCheckForExistence(CFStringRef useName);
 static void fillAndReleaseAllPowerSourceSlots(int count);
+static int  runUpdateStorm(int argc, char * const argv[]);
 
 static const int kTryDictionaries = 5;
 static const int kMaxPSCount = 7;
 
 int main(int argc, const char * argv[])
 {
+    if ((argc > 1) && !strcmp(argv[1], "--storm")) {
+        return runUpdateStorm(argc - 1, (char * const *)&argv[1]);
+    }
+
     for (int i = 0; i< 3; i++)
     {
         iterateCreateSetRelease(kTryDictionaries);
@@ -326,3 +338,402 @@ static CFDictionaryRef copyNextPSDictionary(void)
                               &kCFTypeDictionaryValueCallBacks);
 
 }
+
+
+//******************************************************************************
+//******************************************************************************
+//******************************************************************************
+//
+// Update storm benchmark
+//
+//  IOPSCreatePowerSource-simple --storm [--sources N] [--rate updates/sec]
+//                                       [--duration sec] [--readers N]
+//
+// Registers up to N power sources (powerd caps how many one process may
+// publish; we use as many as it grants), then pushes IOPSSetPowerSourceDetails
+// updates round-robin at the requested aggregate rate. Each update carries a
+// sequence number, so the readers - each its own kIOPSNotifyAnyPowerSource
+// registration calling IOPSCopyPowerSourcesInfo - can tell which update they
+// see and when. Reports:
+//
+//  set         IOPSSetPowerSourceDetails round trip
+//  notify      update sent to a reader's notification firing
+//  publish     update sent to a reader seeing it in IOPSCopyPowerSourcesInfo
+//  coalesced   updates a reader never saw because a later one overtook them
+//  powerd      CPU time per update
+//
+
+#define kStormSequenceKey       "StormSequence"
+#define kStormSourceUpdateKey   "StormSourceUpdate"
+
+typedef struct {
+    int                 sources;
+    int                 rate;
+    int                 duration;
+    int                 readers;
+} StormOptions;
+
+typedef struct {
+    dispatch_queue_t    queue;
+    int                 token;
+    int                 *lastUpdate;        // per source
+    uint64_t            *notifySamples;
+    uint64_t            *publishSamples;
+    int                 notifyCount;
+    int                 publishCount;
+    int                 capacity;
+    int                 coalesced;
+} StormReader;
+
+static mach_timebase_info_data_t    gStormTimebase;
+static uint64_t                     *gStormSent = NULL;     // mach time each sequence was sent
+static volatile int                 gStormLastSent = -1;
+
+static double stormMachToUS(uint64_t t)
+{
+    return ((double)t * gStormTimebase.numer / gStormTimebase.denom) / 1000.0;
+}
+
+static int stormCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void stormReport(const char *label, uint64_t *samples, int count)
+{
+    if (!count) {
+        printf("  %-10s (no samples)\n", label);
+        return;
+    }
+    qsort(samples, count, sizeof(uint64_t), stormCompare);
+    printf("  %-10s n=%-7d p50 %9.1fus   p99 %9.1fus   max %9.1fus\n", label, count,
+           stormMachToUS(samples[(int)(0.50 * (count - 1))]),
+           stormMachToUS(samples[(int)(0.99 * (count - 1))]),
+           stormMachToUS(samples[count - 1]));
+}
+
+static pid_t stormFindPowerd(void)
+{
+    pid_t   *pids = NULL;
+    int     bytes, count, i;
+    pid_t   found = 0;
+    char    name[2*MAXCOMLEN];
+
+    bytes = proc_listpids(PROC_ALL_PIDS, 0, NULL, 0);
+    if (bytes <= 0) {
+        return 0;
+    }
+    pids = malloc(bytes);
+    bytes = proc_listpids(PROC_ALL_PIDS, 0, pids, bytes);
+    count = bytes / (int)sizeof(pid_t);
+    for (i=0; i<count && !found; i++) {
+        bzero(name, sizeof(name));
+        if (pids[i] && (proc_name(pids[i], name, sizeof(name)) > 0) && !strcmp(name, "powerd")) {
+            found = pids[i];
+        }
+    }
+    free(pids);
+    return found;
+}
+
+static uint64_t stormPowerdCPU(pid_t powerd)
+{
+    struct proc_taskinfo    ti;
+
+    if (!powerd || (proc_pidinfo(powerd, PROC_PIDTASKINFO, 0, &ti, sizeof(ti)) != sizeof(ti))) {
+        return 0;
+    }
+    // mach time units
+    return ti.pti_total_user + ti.pti_total_system;
+}
+
+static int stormNumber(CFDictionaryRef d, const char *key)
+{
+    CFNumberRef     num = CFDictionaryGetValue(d, CFSTR(key));
+    int             val = -1;
+
+    if (num && (CFGetTypeID(num) == CFNumberGetTypeID())) {
+        CFNumberGetValue(num, kCFNumberIntType, &val);
+    }
+    return val;
+}
+
+static void stormReaderFired(StormReader *reader, int sources)
+{
+    uint64_t    fired = mach_absolute_time();
+    int         lastSent = gStormLastSent;
+    CFTypeRef   blob = NULL;
+    CFArrayRef  list = NULL;
+    CFIndex     i;
+
+    if ((lastSent >= 0) && (reader->notifyCount < reader->capacity)) {
+        reader->notifySamples[reader->notifyCount++] = fired - gStormSent[lastSent];
+    }
+
+    blob = IOPSCopyPowerSourcesInfo();
+    if (blob) {
+        list = IOPSCopyPowerSourcesList(blob);
+    }
+    if (!list) {
+        goto exit;
+    }
+
+    for (i=0; i<CFArrayGetCount(list); i++)
+    {
+        CFDictionaryRef d = IOPSGetPowerSourceDescription(blob, CFArrayGetValueAtIndex(list, i));
+        int             seq, update, src;
+
+        if (!d || ((seq = stormNumber(d, kStormSequenceKey)) < 0)) {
+            continue;
+        }
+        update = stormNumber(d, kStormSourceUpdateKey);
+        src = seq % sources;
+        if (update <= reader->lastUpdate[src]) {
+            continue;
+        }
+
+        reader->coalesced += update - reader->lastUpdate[src] - 1;
+        reader->lastUpdate[src] = update;
+        if (reader->publishCount < reader->capacity) {
+            reader->publishSamples[reader->publishCount++] = mach_absolute_time() - gStormSent[seq];
+        }
+    }
+
+exit:
+    if (list) {
+        CFRelease(list);
+    }
+    if (blob) {
+        CFRelease(blob);
+    }
+}
+
+static CFDictionaryRef stormCopyUpdate(CFDictionaryRef base, int src, int seq, int update)
+{
+    CFMutableDictionaryRef  d = CFDictionaryCreateMutableCopy(0, 0, base);
+    CFStringRef             name;
+    CFNumberRef             num;
+    int                     capacity = 1000 + (update % 5000);
+
+    name = CFStringCreateWithFormat(0, 0, CFSTR("com.iokit.IOPSCreatePowerSource.storm.%d"), src);
+    CFDictionarySetValue(d, CFSTR(kIOPSNameKey), name);
+    CFRelease(name);
+
+    num = CFNumberCreate(0, kCFNumberIntType, &capacity);
+    CFDictionarySetValue(d, CFSTR(kIOPSCurrentCapacityKey), num);
+    CFRelease(num);
+
+    num = CFNumberCreate(0, kCFNumberIntType, &seq);
+    CFDictionarySetValue(d, CFSTR(kStormSequenceKey), num);
+    CFRelease(num);
+
+    num = CFNumberCreate(0, kCFNumberIntType, &update);
+    CFDictionarySetValue(d, CFSTR(kStormSourceUpdateKey), num);
+    CFRelease(num);
+
+    return d;
+}
+
+static int runUpdateStorm(int argc, char * const argv[])
+{
+    static struct option long_opts[] = {
+        { "sources",    required_argument,  NULL, 's' },
+        { "rate",       required_argument,  NULL, 'r' },
+        { "duration",   required_argument,  NULL, 'd' },
+        { "readers",    required_argument,  NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    StormOptions            opts = { kMaxPSCount, 100, 10, 4 };
+    IOPSPowerSourceID       *ids = NULL;
+    StormReader             *readers = NULL;
+    CFDictionaryRef         base = NULL;
+    dispatch_queue_t        sendq = NULL;
+    dispatch_source_t       timer = NULL;
+    dispatch_semaphore_t    finished = NULL;
+    uint64_t                *setSamples = NULL;
+    uint64_t                *allNotify = NULL, *allPublish = NULL;
+    __block int             sent = 0;
+    __block int             failures = 0;
+    int                     total, registered = 0;
+    int                     notifyTotal = 0, publishTotal = 0, coalesced = 0;
+    int                     ch, i;
+    pid_t                   powerd;
+    uint64_t                cpuBefore, cpuAfter;
+    IOReturn                ret;
+
+    optind = 1;
+    while ((ch = getopt_long(argc, argv, "s:r:d:n:", long_opts, NULL)) != -1) {
+        switch (ch) {
+            case 's':   opts.sources = atoi(optarg);    break;
+            case 'r':   opts.rate = atoi(optarg);       break;
+            case 'd':   opts.duration = atoi(optarg);   break;
+            case 'n':   opts.readers = atoi(optarg);    break;
+            default:
+                printf("usage: IOPSCreatePowerSource-simple --storm [--sources N] [--rate updates/sec] "
+                       "[--duration sec] [--readers N]\n");
+                return 1;
+        }
+    }
+    if ((opts.sources < 1) || (opts.rate < 1) || (opts.duration < 1) || (opts.readers < 0)) {
+        printf("[FAIL] --sources, --rate and --duration must be positive\n");
+        return 1;
+    }
+
+    mach_timebase_info(&gStormTimebase);
+    total = opts.rate * opts.duration;
+    gStormSent = calloc(total, sizeof(uint64_t));
+    setSamples = calloc(total, sizeof(uint64_t));
+
+    /*
+     * Register as many sources as powerd will give us
+     */
+    ids = calloc(opts.sources, sizeof(IOPSPowerSourceID));
+    for (i=0; i<opts.sources; i++) {
+        ret = IOPSCreatePowerSource(&ids[i]);
+        if (kIOReturnNoSpace == ret) {
+            break;
+        }
+        if (kIOReturnSuccess != ret) {
+            printf("[FAIL] Failure return 0x%08x from IOPSCreatePowerSource\n", ret);
+            return 1;
+        }
+        registered++;
+    }
+    if (!registered) {
+        printf("[FAIL] powerd didn't grant any power sources\n");
+        return 1;
+    }
+    if (registered < opts.sources) {
+        printf("powerd granted %d of %d requested power sources.\n", registered, opts.sources);
+    }
+
+    /*
+     * Readers
+     */
+    readers = calloc(opts.readers, sizeof(StormReader));
+    for (i=0; i<opts.readers; i++)
+    {
+        StormReader *reader = &readers[i];
+        char        qname[64];
+
+        snprintf(qname, sizeof(qname), "com.apple.iokit.IOPSCreatePowerSource.reader%d", i);
+        reader->queue = dispatch_queue_create(qname, DISPATCH_QUEUE_SERIAL);
+        reader->lastUpdate = calloc(registered, sizeof(int));
+        memset(reader->lastUpdate, 0xff, registered * sizeof(int));   // -1
+        reader->capacity = total;
+        reader->notifySamples = calloc(total, sizeof(uint64_t));
+        reader->publishSamples = calloc(total, sizeof(uint64_t));
+
+        if (NOTIFY_STATUS_OK != notify_register_dispatch(kIOPSNotifyAnyPowerSource, &reader->token,
+                                                         reader->queue,
+                                                         ^(int t) { stormReaderFired(reader, registered); }))
+        {
+            printf("[FAIL] reader %d couldn't register for %s\n", i, kIOPSNotifyAnyPowerSource);
+            return 1;
+        }
+    }
+
+    /*
+     * Writer
+     */
+    base = copyNextPSDictionary();
+    powerd = stormFindPowerd();
+    cpuBefore = stormPowerdCPU(powerd);
+    finished = dispatch_semaphore_create(0);
+    sendq = dispatch_queue_create("com.apple.iokit.IOPSCreatePowerSource.sender", DISPATCH_QUEUE_SERIAL);
+    timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, sendq);
+
+    printf("Storming %d power sources with %d updates/sec for %ds; %d readers.\n",
+           registered, opts.rate, opts.duration, opts.readers);
+    fflush(stdout);
+
+    dispatch_source_set_timer(timer, DISPATCH_TIME_NOW, NSEC_PER_SEC / opts.rate, 0);
+    dispatch_source_set_event_handler(timer, ^{
+        CFDictionaryRef update;
+        uint64_t        t0;
+        IOReturn        setRet;
+        int             src = sent % registered;
+
+        if (sent >= total) {
+            dispatch_source_cancel(timer);
+            return;
+        }
+
+        update = stormCopyUpdate(base, src, sent, sent / registered);
+
+        t0 = mach_absolute_time();
+        gStormSent[sent] = t0;
+        gStormLastSent = sent;
+        setRet = IOPSSetPowerSourceDetails(ids[src], update);
+        setSamples[sent] = mach_absolute_time() - t0;
+        CFRelease(update);
+
+        if (kIOReturnSuccess != setRet) {
+            printf("[FAIL] Failure return 0x%08x from IOPSSetPowerSourceDetails\n", setRet);
+            failures++;
+        }
+        sent++;
+    });
+    dispatch_source_set_cancel_handler(timer, ^{
+        dispatch_semaphore_signal(finished);
+    });
+    dispatch_resume(timer);
+
+    dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+
+    // Let the last updates reach the readers
+    sleep(1);
+    cpuAfter = stormPowerdCPU(powerd);
+
+    for (i=0; i<opts.readers; i++) {
+        notify_cancel(readers[i].token);
+        dispatch_sync(readers[i].queue, ^{ });
+    }
+    for (i=0; i<registered; i++) {
+        IOPSReleasePowerSource(ids[i]);
+    }
+
+    /*
+     * Report
+     */
+    for (i=0; i<opts.readers; i++) {
+        notifyTotal += readers[i].notifyCount;
+        publishTotal += readers[i].publishCount;
+        coalesced += readers[i].coalesced;
+    }
+    allNotify = calloc(notifyTotal + 1, sizeof(uint64_t));
+    allPublish = calloc(publishTotal + 1, sizeof(uint64_t));
+    notifyTotal = publishTotal = 0;
+    for (i=0; i<opts.readers; i++) {
+        memcpy(&allNotify[notifyTotal], readers[i].notifySamples, readers[i].notifyCount * sizeof(uint64_t));
+        notifyTotal += readers[i].notifyCount;
+        memcpy(&allPublish[publishTotal], readers[i].publishSamples, readers[i].publishCount * sizeof(uint64_t));
+        publishTotal += readers[i].publishCount;
+    }
+
+    printf("Sent %d updates.\n", sent);
+    stormReport("set", setSamples, sent);
+    stormReport("notify", allNotify, notifyTotal);
+    stormReport("publish", allPublish, publishTotal);
+    if (opts.readers) {
+        printf("  coalesced  %d of %d updates per reader on average\n", coalesced / opts.readers, sent);
+    }
+    if (powerd && cpuAfter) {
+        double cpuUS = stormMachToUS(cpuAfter - cpuBefore);
+        printf("  powerd     %0.3fs CPU, %0.1fus per update\n", cpuUS / 1000000.0, sent ? cpuUS / sent : 0.0);
+    } else {
+        printf("  powerd     CPU usage unavailable (run as root)\n");
+    }
+
+    if (opts.readers && !publishTotal) {
+        printf("[FAIL] No reader ever observed an update\n");
+        failures++;
+    }
+    printf("%s IOPSCreatePowerSource-simple --storm\n", failures ? "[FAIL]" : "[PASS]");
+
+    CFRelease(base);
+    return failures ? 1 : 0;
+}
@@ -24,9 +24,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
+#include <ctype.h>
 
 #include <dispatch/dispatch.h>
 #include <CoreFoundation/CFNumber.h>
@@ -62,12 +65,27 @@ static CFStringRef        kLocalizationBundlePath = CFSTR("/System/Library/CoreS
 
 #define kAssertionNameString    "caffeinate command-line tool"
 
+#define kAssertionMapCount      (sizeof(assertionMap)/sizeof(AssertionMapEntry))
+#define kMaxWaitPIDs            64
+
 int createAssertions(const char *progname, AssertionFlag flags, long timeout);
 void forkChild(char *argv[]);
 void usage(void);
+void watchProcess(pid_t pid, AssertionFlag flags);
+void readProcessList(AssertionFlag defaultFlags);
 
 pid_t   waitforpid;
 
+/*
+ * Shared mode (-w given more than once, or -W). One assertion of each type
+ * is held for all watched processes; holdCount[] counts the processes that
+ * want it, and the assertion is released when the last of them exits.
+ */
+static IOPMAssertionID  heldAssertion[kAssertionMapCount];
+static long             holdCount[kAssertionMapCount];
+static long             watchedCount;
+static bool             readingInput;
+
 
 int
 main(int argc, char *argv[])
@@ -76,9 +94,13 @@ main(int argc, char *argv[])
     char ch;
     unsigned long timeout = 0;
     dispatch_source_t   disp_src;
+    pid_t   waitpids[kMaxWaitPIDs];
+    int     waitcount = 0;
+    bool    readPIDs = false;
+    int     i;
 
     errno = 0;
-    while ((ch = getopt(argc, argv, "mdhisut:w:")) != -1) {
+    while ((ch = getopt(argc, argv, "mdhisut:w:W")) != -1) {
         switch((char)ch) {
             case 'm':
                 flags |= kDiskAssertionFlag;
@@ -100,10 +122,14 @@ main(int argc, char *argv[])
                 break;
             case 'w':
                 waitforpid = strtol(optarg, NULL, 0);
-                if (waitforpid == 0 && errno != 0) {
+                if ((waitforpid == 0 && errno != 0) || (waitcount == kMaxWaitPIDs)) {
                     usage();
                     exit(EXIT_FAILURE);
                 }
+                waitpids[waitcount++] = waitforpid;
+                break;
+            case 'W':
+                readPIDs = true;
                 break;
 
             case 't':
@@ -132,6 +158,25 @@ main(int argc, char *argv[])
         if (createAssertions(*argv, flags, timeout)) {
             exit(EXIT_FAILURE);
         }
+    } else if (readPIDs || (waitcount > 1)) {
+        if (flags & kUserActiveAssertionFlag) {
+            fprintf(stderr, "-u is not supported with multiple processes\n");
+            exit(EXIT_FAILURE);
+        }
+        if (timeout) {
+            dispatch_time_t d_timeout = dispatch_time(DISPATCH_TIME_NOW, timeout * NSEC_PER_SEC);
+            dispatch_after(d_timeout, dispatch_get_main_queue(), ^{
+                           exit(EXIT_SUCCESS);
+                           });
+        }
+        for (i = 0; i < waitcount; i++) {
+            watchProcess(waitpids[i], flags);
+        }
+        if (readPIDs) {
+            readProcessList(flags);
+        } else if (watchedCount == 0) {
+            exit(EXIT_SUCCESS);
+        }
     } else {
         if (timeout) {
             dispatch_time_t d_timeout = dispatch_time(DISPATCH_TIME_NOW, timeout * NSEC_PER_SEC);
@@ -236,6 +281,173 @@ finish:
     return result;
 }
 
+static IOReturn
+holdAssertions(AssertionFlag flags)
+{
+    IOReturn result = kIOReturnSuccess;
+    u_int i = 0;
+
+    for (i = 0; i < kAssertionMapCount; ++i)
+    {
+        AssertionMapEntry *entry = assertionMap + i;
+
+        if (!(flags & entry->assertionFlag)) continue;
+        if (holdCount[i]++) continue;
+
+        result = IOPMAssertionCreateWithDescription(entry->assertionType,
+                    CFSTR(kAssertionNameString), CFSTR("caffeinate asserting on behalf of watched processes"),
+                    kHumanReadableReason, kLocalizationBundlePath,
+                    0, kIOPMAssertionTimeoutActionRelease,
+                    &heldAssertion[i]);
+
+        if (result != kIOReturnSuccess)
+        {
+            fprintf(stderr, "Failed to create %s assertion\n",
+                CFStringGetCStringPtr(entry->assertionType, kCFStringEncodingMacRoman));
+            heldAssertion[i] = kIOPMNullAssertionID;
+        }
+    }
+
+    return result;
+}
+
+static void
+dropAssertions(AssertionFlag flags)
+{
+    u_int i = 0;
+
+    for (i = 0; i < kAssertionMapCount; ++i)
+    {
+        if (!(flags & assertionMap[i].assertionFlag) || (holdCount[i] == 0)) continue;
+        if (--holdCount[i]) continue;
+
+        if (heldAssertion[i] != kIOPMNullAssertionID) {
+            IOPMAssertionRelease(heldAssertion[i]);
+            heldAssertion[i] = kIOPMNullAssertionID;
+        }
+    }
+}
+
+/*
+ * Holds the assertions in 'flags' until 'pid' exits. The exit is
+ * delivered by a DISPATCH_SOURCE_TYPE_PROC source (EVFILT_PROC).
+ */
+void
+watchProcess(pid_t pid, AssertionFlag flags)
+{
+    dispatch_source_t source;
+
+    if ((pid <= 0) || ((kill(pid, 0) == -1) && (errno == ESRCH))) {
+        fprintf(stderr, "No such process %d\n", pid);
+        return;
+    }
+
+    source = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, pid,
+        DISPATCH_PROC_EXIT, dispatch_get_main_queue());
+    if (!source) {
+        return;
+    }
+
+    holdAssertions(flags);
+    watchedCount++;
+
+    dispatch_source_set_event_handler(source, ^{
+        dispatch_source_cancel(source);
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        dropAssertions(flags);
+        dispatch_release(source);
+        if ((--watchedCount == 0) && !readingInput) {
+            exit(EXIT_SUCCESS);
+        }
+    });
+    dispatch_resume(source);
+}
+
+static void
+parseProcessLine(char *line, AssertionFlag defaultFlags)
+{
+    AssertionFlag flags = kDefaultAssertionFlag;
+    char *end = NULL;
+    pid_t pid;
+
+    pid = (pid_t)strtol(line, &end, 0);
+    if (end == line) {
+        if (*line) fprintf(stderr, "Ignoring \"%s\"\n", line);
+        return;
+    }
+
+    for (; *end; end++) {
+        switch (*end) {
+            case 'd': flags |= kDisplayAssertionFlag; break;
+            case 'i': flags |= kIdleAssertionFlag; break;
+            case 'm': flags |= kDiskAssertionFlag; break;
+            case 's': flags |= kSystemAssertionFlag; break;
+            default:
+                if (!isspace(*end) && (*end != '-')) {
+                    fprintf(stderr, "Ignoring \"%s\"\n", line);
+                    return;
+                }
+        }
+    }
+
+    watchProcess(pid, flags ? flags : defaultFlags);
+}
+
+/*
+ * Reads "pid [-dims]" lines from stdin, one per process to hold
+ * assertions for. Lines without flags use the command line's flags.
+ * caffeinate exits once stdin is closed and every process has exited.
+ */
+void
+readProcessList(AssertionFlag defaultFlags)
+{
+    static char         line[128];
+    static size_t       len;
+    dispatch_source_t   source;
+
+    source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, STDIN_FILENO,
+        0, dispatch_get_main_queue());
+    if (!source) {
+        exit(EXIT_FAILURE);
+    }
+    readingInput = true;
+
+    dispatch_source_set_event_handler(source, ^{
+        char    buf[512];
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        ssize_t i;
+
+        if (n <= 0) {
+            if ((n == -1) && (errno == EINTR || errno == EAGAIN)) return;
+            dispatch_source_cancel(source);
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                line[len] = 0;
+                parseProcessLine(line, defaultFlags);
+                len = 0;
+            } else if (len < sizeof(line) - 1) {
+                line[len++] = buf[i];
+            }
+        }
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        if (len) {
+            line[len] = 0;
+            parseProcessLine(line, defaultFlags);
+            len = 0;
+        }
+        readingInput = false;
+        dispatch_release(source);
+        if (watchedCount == 0) {
+            exit(EXIT_SUCCESS);
+        }
+    });
+    dispatch_resume(source);
+}
+
 void
 forkChild(char *argv[])
 {
@@ -292,6 +504,6 @@ forkChild(char *argv[])
 void
 usage(void)
 {
-    fprintf(stderr, "usage: caffeinate [-disu] [-t timeout] [-w Process ID] [command arguments...]\n");
+    fprintf(stderr, "usage: caffeinate [-disu] [-t timeout] [-w Process ID ...] [-W] [command arguments...]\n");
     return;
 }
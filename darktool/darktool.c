@@ -32,6 +32,9 @@
         --createassertion applepushservice --assertiontimeout 120 --enterdarkwake \
         --iterations 1 \
         --sleepnow
+
+ darktool --soak 100 --maintenancewake 60 --soakassertions backgroundtask,applepushservice \
+        --assertiontimeout 10 --soakfullwakeevery 10 --csv /tmp/soak.csv
  
  */
 
@@ -62,6 +65,13 @@ struct args_struct {
     /* "do" prefix indicates 0/1 are the only acceptable values */
     int doAction[kActionsCount];
     int doRequestWake[kRequestWakeCount];
+
+    /* --soak */
+    int                 soakCycles;
+    int                 soakFullWakeEvery;
+    CFStringRef         soakAssertions[8];
+    int                 soakAssertionCount;
+    char                csvPath[255];
 };
 typedef struct args_struct args_struct;
 
@@ -132,11 +142,6 @@ static DTOption darktool_options[] =
         "Runs the specified command.",
         { NULL }, { NULL }},
     
-    { {kActionGet,
-        no_argument, NULL, 'g'}, kActionType,
-        "Print all darktool system settings.",
-        { NULL }, { NULL }},
-
 
     { {kActionClaim,
         no_argument, &args.doAction[kActionClaimIndex], 1}, kActionType,
@@ -148,6 +153,17 @@ static DTOption darktool_options[] =
         "For internal testing - creates a power source object with IOPSCreatePowerSource.",
         { NULL }, { NULL }},
 
+    { {kActionSoak,
+        required_argument, &args.doAction[kActionSoakIndex], 1}, kActionType,
+        "Soak test: sleeps the system, and cycles through sleep, DarkWake and (optionally) FullWake for the specified number of cycles, then prints latency percentiles and per-cycle CSV. Uses a maintenance wake unless another wake request is given.",
+        { NULL },
+        { kOptionSleepInterval, kOptionSoakAssertions, kOptionAssertionTimeout, kOptionSoakFullWakeEvery, kOptionCSV, NULL }},
+
+    { {kActionGet,
+        no_argument, NULL, 'g'}, kActionType,
+        "Print all darktool system settings.",
+        { NULL }, { NULL }},
+
 /* Options
  */
 /*
@@ -214,6 +230,21 @@ static DTOption darktool_options[] =
         "When set, darktool will not accelerate DarkWake linger interval, or BackgroundTask interval. Usually testers want sleep & DarkWake cycles to occur as quickly as possible, without standard user delays; so if this setting isn't specified darktool will call \'pmset btinterval 0\' and \'pmset dwlinterval 0\'.",
         { NULL }, { NULL } },
     
+    { {kOptionSoakAssertions,
+        required_argument, NULL, 0}, kOptionType,
+        "With --soak, a comma separated list of assertions (as named for --createassertion) to create upon each DarkWake. Each is held for --assertiontimeout seconds.",
+        { NULL }, { NULL } },
+
+    { {kOptionSoakFullWakeEvery,
+        required_argument, NULL, 0}, kOptionType,
+        "With --soak, promotes every <n>th DarkWake to a FullWake with IOPMAssertionDeclareUserActivity, then puts the system back to sleep.",
+        { NULL }, { NULL } },
+
+    { {kOptionCSV,
+        required_argument, NULL, 0}, kOptionType,
+        "With --soak, writes the per-cycle CSV to the specified file instead of stdout.",
+        { NULL }, { NULL } },
+
     { {"help", no_argument, NULL, 'h'}, kNilType, NULL, { NULL }, { NULL } },
     
     { {NULL, 0, NULL, 0}, kNilType, NULL, { NULL }, { NULL } }
@@ -251,11 +282,16 @@ int main(int argc, char *argv[])
     if (args.doRequestWake[kIOPMConnectRequestBackgroundIndex]
         || args.doRequestWake[kIOPMConnectRequestSleepServiceIndex]
         || args.doRequestWake[kIOPMConnectRequestMaintenanceIndex]
-        || args.doAction[kExitIfNextWakeIsNotPushIndex])
+        || args.doAction[kExitIfNextWakeIsNotPushIndex]
+        || args.doAction[kActionSoakIndex])
 //        || args.doAction[kPrintDarkWakeResidencyTimeIndex])
     {
         createPMConnectionListener();
     }
+
+    if (args.doAction[kActionSoakIndex]) {
+        soakBegin();
+    }
     
     if (args.doItWhen & kDoItUponACAttach) {
         int out_token;
@@ -405,6 +441,12 @@ static void usage(void)
     printf("    darktool --sleepservicewake 60 \n\
            --createassertion applepushservice --assertiontimeout 120 --enterdarkwake \n\
            --sleepnow --iterations 1");
+
+    printf("\n\n -> Soak 100 maintenance DarkWakes at 60 second intervals, holding a BackgroundTask assertion for 10s\n\
+    in each, promoting every 10th to FullWake. Print latency percentiles and save per-cycle CSV.\n");
+    printf("    darktool --soak 100 --maintenancewake 60 \n\
+           --soakassertions backgroundtask --assertiontimeout 10 \n\
+           --soakfullwakeevery 10 --csv /tmp/soak.csv");
     
     printf("\n");
 
@@ -524,6 +566,43 @@ static bool parse_it_all(int argc, char *argv[]) {
                 exit(1);
             }
         }
+        else if (arg && !strcmp(arg, kActionSoak)) {
+            args.soakCycles = (int)strtol(optarg, NULL, 10);
+            if (args.soakCycles <= 0) {
+                printf("Error: --%s takes a positive number of cycles.\n", kActionSoak);
+                exit(1);
+            }
+        }
+        else if (arg && !strcmp(arg, kOptionSoakFullWakeEvery)) {
+            args.soakFullWakeEvery = (int)strtol(optarg, NULL, 10);
+        }
+        else if (arg && !strcmp(arg, kOptionCSV)) {
+            strlcpy(args.csvPath, optarg, sizeof(args.csvPath));
+        }
+        else if (arg && !strcmp(arg, kOptionSoakAssertions)) {
+            char    list[255];
+            char    *next = list;
+            char    *name;
+
+            strlcpy(list, optarg, sizeof(list));
+            while ((name = strsep(&next, ","))) {
+                int j;
+
+                if (!*name) continue;
+                for (j=0; j<g.assertionsArgCount; j++) {
+                    if (!strcmp(g.assertionTypes[j].arg, name)) break;
+                }
+                if (j == g.assertionsArgCount) {
+                    printf("Unrecognized assertion type %s.\n", name);
+                    exit(1);
+                }
+                if (args.soakAssertionCount == sizeof(args.soakAssertions)/sizeof(args.soakAssertions[0])) {
+                    printf("Error: too many --%s assertions.\n", kOptionSoakAssertions);
+                    exit(1);
+                }
+                args.soakAssertions[args.soakAssertionCount++] = g.assertionTypes[j].assertionType;
+            }
+        }
         else if (arg && !strcmp(arg, kActionExec)) {
             strlcpy(args.exec, optarg, sizeof(args.exec));
             if (!args.exec[0]) {
@@ -542,6 +621,12 @@ static bool parse_it_all(int argc, char *argv[]) {
             exit(1);
         }
     }
+
+    if (args.doAction[kActionSoakIndex]
+        && !args.doRequestWake[kIOPMConnectRequestSleepServiceIndex]
+        && !args.doRequestWake[kIOPMConnectRequestMaintenanceIndex]) {
+        args.doRequestWake[kIOPMConnectRequestMaintenanceIndex] = 1;
+    }
     
     return true;
 }
@@ -565,6 +650,12 @@ static void print_the_plan(void)
             if (kActionExecIndex == i) {
                 printf(" \"%s\"", args.exec);
             } else
+            if (kActionSoakIndex == i) {
+                printf(" %d cycles", args.soakCycles);
+                if (args.soakFullWakeEvery > 0) {
+                    printf(", FullWake every %d", args.soakFullWakeEvery);
+                }
+            } else
             if (kCallIndex == i)
             {
                 printf(" %s", args.callIOKit);
@@ -998,6 +1089,10 @@ static void myPMConnectionHandler(
         exit(0);
     }
     
+    if (args.doAction[kActionSoakIndex]) {
+        soakTransition(previousCapabilities, capabilities);
+    }
+
     previousCapabilities = capabilities;
     
 
@@ -1115,6 +1210,248 @@ static CFDictionaryRef HandleMaintenanceCapabilitiesChanged(IOPMSystemPowerState
     return ackDictionary;
 }
 
+/*************************************************************************/
+/*
+ * Soak test. Each cycle starts when the system goes to sleep, and ends
+ * when the DarkWake that follows it goes back to sleep or into FullWake.
+ * All times are measured with CFAbsoluteTimeGetCurrent() from IOPMConnection
+ * callbacks, so they include powerd's and darktool's notification latency.
+ */
+
+typedef struct {
+    double      timeToSleep;        // IOPMSleepSystem() to the sleep notification; NAN for idle/DarkWake sleeps
+    double      wakeLatency;        // scheduled wake date to the DarkWake notification
+    double      darkWakeDuration;   // DarkWake notification to the next sleep or FullWake
+    double      fullWakeLatency;    // IOPMAssertionDeclareUserActivity() to the FullWake notification; NAN if not promoted
+} SoakCycle;
+
+#define kSoakMetricCount        4
+#define kSoakResleepDelaySec    5
+
+static const char *soakMetricNames[kSoakMetricCount] = {
+    "time_to_sleep", "wake_latency", "darkwake_duration", "fullwake_latency"
+};
+
+static struct {
+    SoakCycle           *cycles;
+    int                 completed;
+    SoakCycle           current;
+    CFAbsoluteTime      sleepRequested;
+    CFAbsoluteTime      sleptAt;
+    CFAbsoluteTime      darkWakeAt;
+    CFAbsoluteTime      fullWakeRequested;
+} soak;
+
+static void soakRequestSleep(void)
+{
+    io_connect_t    connect;
+    IOReturn        ret;
+
+    connect = IOPMFindPowerManagement(kIOMasterPortDefault);
+    soak.sleepRequested = CFAbsoluteTimeGetCurrent();
+    ret = IOPMSleepSystem(connect);
+    if (kIOReturnSuccess != ret) {
+        printf("Error: Couldn't put the system to sleep. IOPMSleepSystem() returns error 0x%08x\n", ret);
+        soakReport();
+        exit(1);
+    }
+    IOServiceClose(connect);
+}
+
+static void soakResetCycle(void)
+{
+    soak.current.timeToSleep = NAN;
+    soak.current.wakeLatency = NAN;
+    soak.current.darkWakeDuration = NAN;
+    soak.current.fullWakeLatency = NAN;
+    soak.darkWakeAt = 0;
+    soak.fullWakeRequested = 0;
+}
+
+static void soakBegin(void)
+{
+    soak.cycles = calloc(args.soakCycles, sizeof(SoakCycle));
+    if (!soak.cycles) {
+        printf("Error: couldn't allocate %d soak cycles.\n", args.soakCycles);
+        exit(1);
+    }
+    soakResetCycle();
+
+    PMTestLog("Soak: starting %d cycles.\n", args.soakCycles);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kSoakResleepDelaySec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+        soakRequestSleep();
+    });
+}
+
+static void soakEndCycle(void)
+{
+    IOPMAssertionID     _id;
+
+    soak.cycles[soak.completed++] = soak.current;
+    soakResetCycle();
+
+    if (soak.completed < args.soakCycles) {
+        return;
+    }
+
+    PMTestLog("Soak: completed %d cycles.\n", soak.completed);
+    soakReport();
+    IOPMAssertionDeclareUserActivity(g.invokedStr, kIOPMUserActiveLocal, &_id);
+    exit(0);
+}
+
+static void soakTransition(IOPMSystemPowerStateCapabilities from,
+                           IOPMSystemPowerStateCapabilities to)
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    int             i;
+
+    if (IOPMIsASleep(to))
+    {
+        if (soak.darkWakeAt) {
+            soak.current.darkWakeDuration = now - soak.darkWakeAt;
+            soakEndCycle();
+        }
+        if (soak.sleepRequested) {
+            soak.current.timeToSleep = now - soak.sleepRequested;
+            soak.sleepRequested = 0;
+        }
+        soak.sleptAt = now;
+    }
+    else if (IOPMIsADarkWake(to) && !IOPMIsADarkWake(from))
+    {
+        if (soak.sleptAt) {
+            soak.current.wakeLatency = now - (soak.sleptAt + (CFTimeInterval)args.sleepIntervalSec);
+        }
+        soak.darkWakeAt = now;
+
+        for (i=0; i<args.soakAssertionCount; i++) {
+            execute_Assertion(args.soakAssertions[i], args.assertionTimeoutSec);
+        }
+
+        if ((args.soakFullWakeEvery > 0)
+            && ((soak.completed + 1) % args.soakFullWakeEvery == 0))
+        {
+            IOPMAssertionID     _id;
+
+            soak.fullWakeRequested = CFAbsoluteTimeGetCurrent();
+            IOPMAssertionDeclareUserActivity(CFSTR("darktool soak"), kIOPMUserActiveLocal, &_id);
+        }
+    }
+    else if (IOPMIsAUserWake(to) && !IOPMIsAUserWake(from))
+    {
+        if (soak.darkWakeAt) {
+            soak.current.darkWakeDuration = now - soak.darkWakeAt;
+        }
+        if (soak.fullWakeRequested) {
+            soak.current.fullWakeLatency = now - soak.fullWakeRequested;
+        }
+        soakEndCycle();
+
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kSoakResleepDelaySec * NSEC_PER_SEC)),
+                       dispatch_get_main_queue(), ^{
+            soakRequestSleep();
+        });
+    }
+}
+
+static int soakCompareDouble(const void *a, const void *b)
+{
+    double  x = *(const double *)a;
+    double  y = *(const double *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static double soakMetric(SoakCycle *c, int metric)
+{
+    switch (metric) {
+        case 0:     return c->timeToSleep;
+        case 1:     return c->wakeLatency;
+        case 2:     return c->darkWakeDuration;
+        default:    return c->fullWakeLatency;
+    }
+}
+
+/* Nearest-rank percentile of the 'count' sorted samples */
+static double soakPercentile(double *sorted, int count, int pct)
+{
+    int     rank = (int)ceil((pct / 100.0) * count);
+
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static void soakReport(void)
+{
+    double      *samples = NULL;
+    FILE        *csv = stdout;
+    int         metric, i, count;
+
+    samples = calloc(soak.completed ? soak.completed : 1, sizeof(double));
+    if (!samples) {
+        return;
+    }
+
+    printf("\n%-20s %6s %10s %10s %10s %10s %10s\n",
+           "Metric (sec)", "n", "min", "p50", "p90", "p99", "max");
+    for (metric=0; metric<kSoakMetricCount; metric++)
+    {
+        count = 0;
+        for (i=0; i<soak.completed; i++) {
+            double v = soakMetric(&soak.cycles[i], metric);
+            if (!isnan(v)) samples[count++] = v;
+        }
+        if (count == 0) {
+            printf("%-20s %6d\n", soakMetricNames[metric], 0);
+            continue;
+        }
+        qsort(samples, count, sizeof(double), soakCompareDouble);
+        printf("%-20s %6d %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+               soakMetricNames[metric], count, samples[0],
+               soakPercentile(samples, count, 50),
+               soakPercentile(samples, count, 90),
+               soakPercentile(samples, count, 99),
+               samples[count - 1]);
+    }
+    free(samples);
+
+    if (args.csvPath[0]) {
+        if (!(csv = fopen(args.csvPath, "w"))) {
+            printf("Error: couldn't open %s for CSV output; using stdout.\n", args.csvPath);
+            csv = stdout;
+        }
+    }
+    if (csv == stdout) {
+        printf("\n");
+    }
+
+    fprintf(csv, "cycle");
+    for (metric=0; metric<kSoakMetricCount; metric++) {
+        fprintf(csv, ",%s", soakMetricNames[metric]);
+    }
+    fprintf(csv, "\n");
+    for (i=0; i<soak.completed; i++) {
+        fprintf(csv, "%d", i + 1);
+        for (metric=0; metric<kSoakMetricCount; metric++) {
+            double v = soakMetric(&soak.cycles[i], metric);
+            if (isnan(v)) {
+                fprintf(csv, ",");
+            } else {
+                fprintf(csv, ",%.3f", v);
+            }
+        }
+        fprintf(csv, "\n");
+    }
+
+    if (csv != stdout) {
+        fclose(csv);
+        printf("Wrote %d cycles to %s\n", soak.completed, args.csvPath);
+    }
+    fflush(stdout);
+}
+
 static void print_everything_dark(void)
 {
     
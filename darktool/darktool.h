@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <notify.h>
+#include <math.h>
 
 #define PMTestLog(x...)  do {print_pretty_date(false); printf(x);} while(0);
 #define PMTestPass  printf
@@ -93,6 +94,11 @@ static void _CFDictionarySetDate(
 
 static void cacheArgvString(int argc, char *argv[]);
 
+static void soakBegin(void);
+static void soakTransition(IOPMSystemPowerStateCapabilities from,
+                           IOPMSystemPowerStateCapabilities to);
+static void soakReport(void);
+
 
 /*************************************************************************/
 /*
@@ -133,6 +139,7 @@ typedef enum {
     kActionExecIndex,
     kActionClaimIndex,
     kActionCreatePowerSourceIndex,
+    kActionSoakIndex,
     kActionsCount   // kActionsCount must always be the last item in this list
 } DarkToolActions;
 
@@ -167,6 +174,9 @@ typedef enum {
 #define kOptionSleepNow                                 "sleepnow"
 #define kOptionIterations                               "iterations"
 #define kOptionStandardSleepIntervals                   "standardsleepintervals"
+#define kOptionSoakAssertions                           "soakassertions"
+#define kOptionSoakFullWakeEvery                        "soakfullwakeevery"
+#define kOptionCSV                                      "csv"
 
 /*
  * Actions - caller may specify only one
@@ -187,6 +197,7 @@ typedef enum {
 #define kActionExec                                     "exec"
 #define kActionClaim                                    "claim"
 #define kActionCreatePowerSource                        "createPowerSource"
+#define kActionSoak                                     "soak"
 
 #define kArgIOPMConnection                              "iopmconnection"
 #define kArgIORegisterForSystemPower                    "ioregisterforsystempower"
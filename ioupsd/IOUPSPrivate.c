@@ -69,6 +69,13 @@ Boolean IOUPSMIGServerIsRunning(mach_port_t * bootstrap_port_ref, mach_port_t *
                         &active);
 
     if (BOOTSTRAP_SUCCESS == kern_result) {
+        // Hand the server port back to callers that asked for it;
+        // they own the send right.
+        if (upsd_port_ref) {
+            *upsd_port_ref = active;
+        } else {
+            mach_port_deallocate(mach_task_self(), active);
+        }
         return true;
     } else {
         // For any result other than SUCCESS, we presume the server is
@@ -146,3 +153,58 @@ IOReturn IOUPSGetCapabilities(mach_port_t connect, int upsID, CFSetRef *capabili
     return ret;
 }
 
+IOReturn IOUPSGetEventSince(mach_port_t connect, int upsID, uint64_t *generation, CFDictionaryRef *event)
+{
+    IOReturn                ret;
+    vm_offset_t             buffer = 0;
+    mach_msg_type_number_t  bufferSize = 0;
+    uint64_t                currentGeneration = 0;
+
+    if (!connect || !generation || !event)
+        return kIOReturnBadArgument;
+
+    *event = NULL;
+
+    ret = io_ups_get_event_since(connect, upsID, *generation,
+                &currentGeneration, &buffer, &bufferSize);
+
+    if ( ret != kIOReturnSuccess )
+        return ret;
+
+    if (buffer && bufferSize) {
+        *event = IOCFUnserialize((const char *)buffer, kCFAllocatorDefault, kNilOptions, NULL);
+        vm_deallocate(mach_task_self(), (vm_address_t)buffer, bufferSize);
+    }
+
+    *generation = currentGeneration;
+
+    return ret;
+}
+
+IOReturn IOUPSGetCapabilitiesSince(mach_port_t connect, int upsID, uint64_t *generation, CFSetRef *capabilities)
+{
+    IOReturn                ret;
+    vm_offset_t             buffer = 0;
+    mach_msg_type_number_t  bufferSize = 0;
+    uint64_t                currentGeneration = 0;
+
+    if (!connect || !generation || !capabilities)
+        return kIOReturnBadArgument;
+
+    *capabilities = NULL;
+
+    ret = io_ups_get_capabilities_since(connect, upsID, *generation,
+                &currentGeneration, &buffer, &bufferSize);
+
+    if ( ret != kIOReturnSuccess )
+        return ret;
+
+    if (buffer && bufferSize) {
+        *capabilities = IOCFUnserialize((const char *)buffer, kCFAllocatorDefault, kNilOptions, NULL);
+        vm_deallocate(mach_task_self(), (vm_address_t)buffer, bufferSize);
+    }
+
+    *generation = currentGeneration;
+
+    return ret;
+}
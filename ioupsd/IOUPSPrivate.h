@@ -54,4 +54,20 @@ IOReturn IOUPSGetEvent(mach_port_t connect, int upsID, CFDictionaryRef *event);
 
 IOReturn IOUPSGetCapabilities(mach_port_t connect, int upsID, CFSetRef *capabilities);
 
+/*!
+    @function IOUPSGetEventSince
+    @abstract Returns the UPS's event only if it changed.
+    @discussion Pass the generation returned by the previous call, or 0 the
+    first time; it is updated on return. *event is NULL if nothing changed
+    since that generation, otherwise the caller must release it.
+*/
+IOReturn IOUPSGetEventSince(mach_port_t connect, int upsID, uint64_t *generation, CFDictionaryRef *event);
+
+/*!
+    @function IOUPSGetCapabilitiesSince
+    @abstract Returns the UPS's capabilities only if they changed.
+    @discussion Same contract as IOUPSGetEventSince.
+*/
+IOReturn IOUPSGetCapabilitiesSince(mach_port_t connect, int upsID, uint64_t *generation, CFSetRef *capabilities);
+
 #endif /* !_IOKIT_PM_IOUPSPRIVATE_H */
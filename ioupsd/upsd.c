@@ -55,6 +55,14 @@
 
 #define kDefaultUPSName		"Generic UPS"
 
+// UPS updates are published at most once per interval, unless the power
+// source state changes or the charge moves while on battery. The interval
+// can be changed with the PublishInterval preference in com.apple.ioupsd.
+#define kUPSPreferencesDomain           CFSTR("com.apple.ioupsd")
+#define kUPSPublishIntervalPrefKey      CFSTR("PublishInterval")
+#define kDefaultUPSPublishInterval      5.0
+#define kUPSPublishTimerParked          1.0e9
+
 //---------------------------------------------------------------------------
 // Globals
 //---------------------------------------------------------------------------
@@ -64,10 +72,23 @@ static CFMutableArrayRef        gUPSDataArrayRef = NULL;
 static unsigned int             gUPSCount = 0;
 static IONotificationPortRef	gNotifyPort = NULL;
 static io_iterator_t            gAddedIter = MACH_PORT_NULL;
+static CFTimeInterval           gPublishInterval = kDefaultUPSPublishInterval;
+static uint64_t                 gReplyGeneration = 0;
 
 //---------------------------------------------------------------------------
 // TypeDefs
 //---------------------------------------------------------------------------
+// A serialized MIG reply. The buffer is page aligned and handed to the
+// kernel as-is, so the reply is sent copy-on-write rather than copied.
+// Each change to its contents takes a new generation.
+typedef struct UPSReplyCache {
+    vm_address_t            buffer;
+    vm_size_t               bufferSize;
+    mach_msg_type_number_t  length;
+    uint64_t                generation;
+    Boolean                 stale;
+} UPSReplyCache;
+
 typedef struct UPSData {
     IOPSPowerSourceID       powerSourceID;
     io_object_t             notification;
@@ -77,6 +98,16 @@ typedef struct UPSData {
     CFMutableDictionaryRef  upsStoreDict;
     CFRunLoopSourceRef      upsEventSource;
     CFRunLoopTimerRef       upsEventTimer;
+
+    // Rate limiting of IOPSSetPowerSourceDetails()
+    CFRunLoopTimerRef       publishTimer;
+    CFAbsoluteTime          lastPublishTime;
+    Boolean                 publishPending;
+    int                     lastPublishedPercent;
+
+    // Replies for the MIG get routines
+    UPSReplyCache           eventCache;
+    UPSReplyCache           capabilitiesCache;
 } UPSData;
 
 typedef UPSData *UPSDataRef;
@@ -95,11 +126,26 @@ static void DeviceNotification(void *refCon, io_service_t service,
 static void UPSEventCallback(void * target, IOReturn result, void *refcon,
                              void *sender, CFDictionaryRef event);
 static void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event);
+static void PublishUPSState(UPSDataRef upsDataRef);
+static void UPSPublishTimerCallback(CFRunLoopTimerRef timer, void *info);
+static void ReadPublishInterval(void);
 static UPSDataRef GetPrivateData( CFDictionaryRef properties );
 static IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
                                            CFDictionaryRef properties,
                                            CFSetRef capabilities);
 static Boolean SetupMIGServer();
+static IOReturn UpdateReplyCache(UPSReplyCache *cache, CFTypeRef object);
+static void ReleaseReplyCache(UPSReplyCache *cache);
+static UPSDataRef GetUPSDataForID(int upsID);
+static IOReturn GetEventReply(UPSDataRef upsDataRef, UPSReplyCache **reply);
+kern_return_t _io_ups_get_event_since(mach_port_t server, int upsID,
+                                      uint64_t generation, uint64_t *currentGeneration,
+                                      vm_offset_t *eventBufferPtr,
+                                      mach_msg_type_number_t *eventBufferSizePtr);
+kern_return_t _io_ups_get_capabilities_since(mach_port_t server, int upsID,
+                                             uint64_t generation, uint64_t *currentGeneration,
+                                             vm_offset_t *capabilitiesBufferPtr,
+                                             mach_msg_type_number_t *capabilitiesBufferSizePtr);
 
 //---------------------------------------------------------------------------
 // main
@@ -108,6 +154,11 @@ static Boolean SetupMIGServer();
 int main (int argc, const char *argv[]) {
     openlog("upsd", LOG_PID|LOG_NDELAY, LOG_USER);
     signal(SIGINT, SignalHandler);
+    ReadPublishInterval();
+    // Generations must not repeat across relaunches: a client still holding
+    // one from a previous ioupsd would be told "not modified". Start each
+    // instance in its own range, from its launch time and pid.
+    gReplyGeneration = ((uint64_t)time(NULL) << 24) | ((uint64_t)getpid() & 0xFFFFFF);
     SetupMIGServer();
     // Listen for any HID Power Devices or Battery Systems
     InitUPSNotifications(kIOPowerDeviceUsageKey);
@@ -375,6 +426,9 @@ void UPSDeviceAdded(void *refCon, io_iterator_t iterator) {
             if (kr != kIOReturnSuccess)
                 goto UPSDEVICEADDED_FAIL;
 
+            UpdateReplyCache(&upsDataRef->capabilitiesCache, upsCapabilites);
+            upsDataRef->eventCache.stale = true;
+
             kr = CreatePowerManagerUPSEntry(upsDataRef, upsProperties, upsCapabilites);
 
             if (kr != kIOReturnSuccess)
@@ -474,6 +528,16 @@ void DeviceNotification(void *refCon, io_service_t service,
             upsDataRef->notification = MACH_PORT_NULL;
         }
         
+        if (upsDataRef->publishTimer) {
+            CFRunLoopTimerInvalidate(upsDataRef->publishTimer);
+            CFRelease(upsDataRef->publishTimer);
+            upsDataRef->publishTimer = NULL;
+        }
+        upsDataRef->publishPending = false;
+
+        ReleaseReplyCache(&upsDataRef->eventCache);
+        ReleaseReplyCache(&upsDataRef->capabilitiesCache);
+
         if (upsDataRef->upsStoreDict) {
             CFRelease(upsDataRef->upsStoreDict);
             upsDataRef->upsStoreDict = NULL;
@@ -503,41 +567,176 @@ void DeviceNotification(void *refCon, io_service_t service,
 //---------------------------------------------------------------------------
 void UPSEventCallback(void *target, IOReturn result, void *refcon, void *sender,
                       CFDictionaryRef event) {
+    // The serialized event is rebuilt the next time a client asks for it
+    ((UPSDataRef) refcon)->eventCache.stale = true;
     ProcessUPSEvent((UPSDataRef) refcon, event);
 }
 
+//---------------------------------------------------------------------------
+// ReadPublishInterval
+//
+//---------------------------------------------------------------------------
+void ReadPublishInterval(void) {
+    CFNumberRef interval;
+    double      seconds;
+
+    interval = CFPreferencesCopyAppValue(kUPSPublishIntervalPrefKey,
+                                         kUPSPreferencesDomain);
+    if (!interval)
+        return;
+
+    if ((CFGetTypeID(interval) == CFNumberGetTypeID())
+        && CFNumberGetValue(interval, kCFNumberDoubleType, &seconds)
+        && (seconds >= 0.0))
+    {
+        gPublishInterval = seconds;
+    }
+    CFRelease(interval);
+}
+
+//---------------------------------------------------------------------------
+// GetPercentRemaining
+//
+// Returns the charge in percent, as UPSLowPower computes it, or -1.
+//---------------------------------------------------------------------------
+static int GetPercentRemaining(CFDictionaryRef upsStoreDict) {
+    CFNumberRef current, max;
+    int         c = 0, m = 0;
+
+    current = CFDictionaryGetValue(upsStoreDict, CFSTR(kIOPSCurrentCapacityKey));
+    max = CFDictionaryGetValue(upsStoreDict, CFSTR(kIOPSMaxCapacityKey));
+    if (!current || !max
+        || !CFNumberGetValue(current, kCFNumberIntType, &c)
+        || !CFNumberGetValue(max, kCFNumberIntType, &m)
+        || (m <= 0))
+    {
+        return -1;
+    }
+    return (int)(100.0 * ((double)c) / ((double)m));
+}
+
+//---------------------------------------------------------------------------
+// MergeUPSEventValue
+//
+// Copies one key of an event into upsStoreDict if its value changed.
+//---------------------------------------------------------------------------
+typedef struct {
+    CFMutableDictionaryRef  upsStoreDict;
+    Boolean                 changed;
+    Boolean                 urgent;
+} UPSMergeContext;
+
+static void MergeUPSEventValue(const void *key, const void *value, void *context) {
+    UPSMergeContext *merge = (UPSMergeContext *)context;
+    CFTypeRef       lastValue;
+
+    lastValue = CFDictionaryGetValue(merge->upsStoreDict, key);
+    if (lastValue && CFEqual(lastValue, value))
+        return;
+
+    CFDictionarySetValue(merge->upsStoreDict, key, value);
+    merge->changed = true;
+
+    // UPSLowPower acts on power source state transitions right away
+    if (CFEqual(key, CFSTR(kIOPSPowerSourceStateKey))
+        || CFEqual(key, CFSTR(kIOPSIsPresentKey)))
+    {
+        merge->urgent = true;
+    }
+}
+
 //---------------------------------------------------------------------------
 // ProcessUPSEvent
 //
 //---------------------------------------------------------------------------
 void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event) {
-    UInt32 count, index;
-    
-    if (!upsDataRef || !event)
+    UPSMergeContext merge;
+    CFTypeRef       state;
+    CFAbsoluteTime  now;
+    int             percent;
+
+    if (!upsDataRef || !event || !upsDataRef->upsStoreDict)
         return;
-      
-    if ((count = CFDictionaryGetCount(event))) {
-        CFTypeRef *keys     = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
-        CFTypeRef *values   = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
 
-        CFDictionaryGetKeysAndValues(event, (const void **)keys,
-                                     (const void **)values);
-        
-        for (index = 0; index < count; index++) {
-            CFDictionarySetValue(upsDataRef->upsStoreDict, keys[index],
-                                 values[index]);
-        }
-        
-        free (keys);
-        free (values);
-        
-        IOReturn result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID,
-                                                    upsDataRef->upsStoreDict);
-        if (result != kIOReturnSuccess) {
-            // TODO: do I need to deal with this?
+    merge.upsStoreDict = upsDataRef->upsStoreDict;
+    merge.changed = false;
+    merge.urgent = false;
+    CFDictionaryApplyFunction(event, MergeUPSEventValue, &merge);
+
+    if (!merge.changed)
+        return;
+
+    // While on battery power, UPSLowPower checks each change in charge
+    // against the shutdown threshold; don't hold those back either.
+    state = CFDictionaryGetValue(upsDataRef->upsStoreDict, CFSTR(kIOPSPowerSourceStateKey));
+    percent = GetPercentRemaining(upsDataRef->upsStoreDict);
+    if (state && CFEqual(state, CFSTR(kIOPSBatteryPowerValue))
+        && (percent != upsDataRef->lastPublishedPercent))
+    {
+        merge.urgent = true;
+    }
+
+    now = CFAbsoluteTimeGetCurrent();
+    if (merge.urgent
+        || (now - upsDataRef->lastPublishTime >= gPublishInterval))
+    {
+        PublishUPSState(upsDataRef);
+        return;
+    }
+
+    // Fold the rest of this burst into one update at the end of the interval
+    if (upsDataRef->publishPending)
+        return;
+
+    if (!upsDataRef->publishTimer) {
+        CFRunLoopTimerContext context = { 0, upsDataRef, NULL, NULL, NULL };
+
+        // A one-shot timer is invalidated once it fires; give it a huge
+        // interval instead, and re-arm it with SetNextFireDate.
+        upsDataRef->publishTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                        upsDataRef->lastPublishTime + gPublishInterval,
+                                        kUPSPublishTimerParked, 0, 0,
+                                        UPSPublishTimerCallback, &context);
+        if (!upsDataRef->publishTimer) {
+            PublishUPSState(upsDataRef);
+            return;
         }
-        notify_post(kIOPSNotifyTimeRemaining);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), upsDataRef->publishTimer,
+                          kCFRunLoopDefaultMode);
     }
+    CFRunLoopTimerSetNextFireDate(upsDataRef->publishTimer,
+                                  upsDataRef->lastPublishTime + gPublishInterval);
+    upsDataRef->publishPending = true;
+}
+
+//---------------------------------------------------------------------------
+// UPSPublishTimerCallback
+//
+//---------------------------------------------------------------------------
+void UPSPublishTimerCallback(CFRunLoopTimerRef timer, void *info) {
+    UPSDataRef upsDataRef = (UPSDataRef)info;
+
+    if (upsDataRef && upsDataRef->publishPending)
+        PublishUPSState(upsDataRef);
+}
+
+//---------------------------------------------------------------------------
+// PublishUPSState
+//
+//---------------------------------------------------------------------------
+void PublishUPSState(UPSDataRef upsDataRef) {
+    IOReturn result;
+
+    upsDataRef->publishPending = false;
+    upsDataRef->lastPublishTime = CFAbsoluteTimeGetCurrent();
+    upsDataRef->lastPublishedPercent = GetPercentRemaining(upsDataRef->upsStoreDict);
+
+    result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID,
+                                       upsDataRef->upsStoreDict);
+    if (result != kIOReturnSuccess) {
+        // TODO: do I need to deal with this?
+    }
+    notify_post(kIOPSNotifyTimeRemaining);
 }
 
 
@@ -742,6 +941,10 @@ IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
         // Store our SystemConfiguration variables in our private data
         //
         upsDataRef->upsStoreDict = upsStoreDict;
+        // The first event from the device goes out right away
+        upsDataRef->lastPublishTime = 0;
+        upsDataRef->lastPublishedPercent = GetPercentRemaining(upsStoreDict);
+        upsDataRef->publishPending = false;
         
     } else if (upsStoreDict) {
         CFRelease(upsStoreDict);
@@ -751,6 +954,114 @@ IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
 }
 
 
+//---------------------------------------------------------------------------
+// UpdateReplyCache
+//
+// Serializes object into cache. The generation only moves if the bytes
+// differ from what the cache already holds.
+//---------------------------------------------------------------------------
+IOReturn UpdateReplyCache(UPSReplyCache *cache, CFTypeRef object) {
+    CFDataRef serializedData;
+    CFIndex length;
+    vm_address_t buffer;
+    vm_size_t bufferSize;
+
+    if (!object)
+        return kIOReturnError;
+
+    serializedData = (CFDataRef)IOCFSerialize(object, kNilOptions);
+    if (!serializedData)
+        return kIOReturnError;
+
+    length = CFDataGetLength(serializedData);
+
+    if (cache->buffer && (cache->length == length) &&
+        !memcmp((void *)cache->buffer, CFDataGetBytePtr(serializedData), length)) {
+        cache->stale = false;
+        CFRelease(serializedData);
+        return kIOReturnSuccess;
+    }
+
+    if (!cache->buffer || (cache->bufferSize < length)) {
+        bufferSize = round_page(length);
+        if (KERN_SUCCESS != vm_allocate(mach_task_self(), &buffer,
+                                        bufferSize, TRUE)) {
+            CFRelease(serializedData);
+            return kIOReturnNoMemory;
+        }
+        ReleaseReplyCache(cache);
+        cache->buffer = buffer;
+        cache->bufferSize = bufferSize;
+    }
+
+    memcpy((void *)cache->buffer, CFDataGetBytePtr(serializedData), length);
+    cache->length = (mach_msg_type_number_t)length;
+    cache->generation = ++gReplyGeneration;
+    cache->stale = false;
+
+    CFRelease(serializedData);
+
+    return kIOReturnSuccess;
+}
+
+//---------------------------------------------------------------------------
+// ReleaseReplyCache
+//
+//---------------------------------------------------------------------------
+void ReleaseReplyCache(UPSReplyCache *cache) {
+    if (cache->buffer)
+        vm_deallocate(mach_task_self(), cache->buffer, cache->bufferSize);
+
+    bzero(cache, sizeof(UPSReplyCache));
+}
+
+//---------------------------------------------------------------------------
+// GetUPSDataForID
+//
+//---------------------------------------------------------------------------
+UPSDataRef GetUPSDataForID(int upsID) {
+    CFMutableDataRef data;
+    UPSDataRef upsDataRef;
+
+    if (!gUPSDataArrayRef || (upsID < 0) ||
+        (upsID >= CFArrayGetCount(gUPSDataArrayRef)))
+        return NULL;
+
+    data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, upsID);
+    upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
+
+    if (!upsDataRef || !upsDataRef->upsPlugInInterface)
+        return NULL;
+
+    return upsDataRef;
+}
+
+//---------------------------------------------------------------------------
+// GetEventReply
+//
+// Returns the serialized event, asking the plug-in again only if an event
+// has come in since it was last serialized.
+//---------------------------------------------------------------------------
+IOReturn GetEventReply(UPSDataRef upsDataRef, UPSReplyCache **reply) {
+    CFDictionaryRef event = NULL;
+    IOReturn res;
+
+    if (upsDataRef->eventCache.stale || !upsDataRef->eventCache.buffer) {
+        res = (*upsDataRef->upsPlugInInterface)->getEvent(upsDataRef->upsPlugInInterface, &event);
+
+        if ((res != kIOReturnSuccess) || !event)
+            return kIOReturnError;
+
+        res = UpdateReplyCache(&upsDataRef->eventCache, event);
+        if (res != kIOReturnSuccess)
+            return res;
+    }
+
+    *reply = &upsDataRef->eventCache;
+    return kIOReturnSuccess;
+}
+
+
 //===========================================================================
 // MIG Routines
 //===========================================================================
@@ -795,49 +1106,12 @@ kern_return_t _io_ups_send_command(mach_port_t server, int upsID,
 // return a CFDictionaryRef that is serialized.
 //---------------------------------------------------------------------------
 kern_return_t _io_ups_get_event( mach_port_t server, int upsID,
-                                void **eventBufferPtr,
-                                IOByteCount *eventBufferSizePtr) {
-    CFDictionaryRef	event;
-    CFMutableDataRef data;
-    CFDataRef serializedData;
-    UPSDataRef upsDataRef;
-    IOReturn res = kIOReturnError;
-        
-    if (!eventBufferPtr || !eventBufferSizePtr ||
-        !gUPSDataArrayRef || (upsID >= CFArrayGetCount(gUPSDataArrayRef))) {
-        
-        return kIOReturnBadArgument;
-    }
-    
-    data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, upsID);
-    upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
-    
-    if (!upsDataRef || !upsDataRef->upsPlugInInterface)
-        return kIOReturnBadArgument;
-
-    res = (*upsDataRef->upsPlugInInterface)->getEvent(upsDataRef->upsPlugInInterface, &event);
-    
-    if ((res != kIOReturnSuccess) || !event)
-        return kIOReturnError;
-        
-
-    serializedData = (CFDataRef)IOCFSerialize(event, kNilOptions);
-    
-    if (!serializedData)
-        return kIOReturnError;
-        
-    *eventBufferSizePtr = CFDataGetLength(serializedData);
-
-    vm_allocate(mach_task_self(), (vm_address_t *)eventBufferPtr,
-                *eventBufferSizePtr, TRUE);
+                                vm_offset_t *eventBufferPtr,
+                                mach_msg_type_number_t *eventBufferSizePtr) {
+    uint64_t generation;
 
-    if(*eventBufferPtr)
-        memcpy(*eventBufferPtr, CFDataGetBytePtr(serializedData),
-               *eventBufferSizePtr);
-
-    CFRelease(serializedData);
-
-    return res;
+    return _io_ups_get_event_since(server, upsID, 0, &generation,
+                                   eventBufferPtr, eventBufferSizePtr);
 }
 
 //---------------------------------------------------------------------------
@@ -847,48 +1121,94 @@ kern_return_t _io_ups_get_event( mach_port_t server, int upsID,
 // return a CFSetRef that is serialized.
 //---------------------------------------------------------------------------
 kern_return_t _io_ups_get_capabilities(mach_port_t server, int upsID,
-                                       void **capabilitiesBufferPtr,
-                                       IOByteCount *capabilitiesBufferSizePtr) {
-    CFSetRef capabilities;
-    CFMutableDataRef data;
-    CFDataRef serializedData;
+                                       vm_offset_t *capabilitiesBufferPtr,
+                                       mach_msg_type_number_t *capabilitiesBufferSizePtr) {
+    uint64_t generation;
+
+    return _io_ups_get_capabilities_since(server, upsID, 0, &generation,
+                                          capabilitiesBufferPtr,
+                                          capabilitiesBufferSizePtr);
+}
+
+//---------------------------------------------------------------------------
+// _io_ups_get_event_since
+//
+// Same as _io_ups_get_event, but returns an empty buffer if the event is
+// still the one the caller saw at 'generation'.
+//---------------------------------------------------------------------------
+kern_return_t _io_ups_get_event_since(mach_port_t server, int upsID,
+                                      uint64_t generation,
+                                      uint64_t *currentGeneration,
+                                      vm_offset_t *eventBufferPtr,
+                                      mach_msg_type_number_t *eventBufferSizePtr) {
     UPSDataRef upsDataRef;
-    IOReturn res = kIOReturnError;
-        
-    if (!capabilitiesBufferPtr || !capabilitiesBufferSizePtr ||
-        !gUPSDataArrayRef || (upsID >= CFArrayGetCount(gUPSDataArrayRef))) {
-        
+    UPSReplyCache *reply = NULL;
+    IOReturn res;
+
+    if (!currentGeneration || !eventBufferPtr || !eventBufferSizePtr)
+        return kIOReturnBadArgument;
+
+    *eventBufferPtr = 0;
+    *eventBufferSizePtr = 0;
+
+    if (!(upsDataRef = GetUPSDataForID(upsID)))
         return kIOReturnBadArgument;
+
+    res = GetEventReply(upsDataRef, &reply);
+    if (res != kIOReturnSuccess)
+        return res;
+
+    *currentGeneration = reply->generation;
+    if (generation != reply->generation) {
+        *eventBufferPtr = reply->buffer;
+        *eventBufferSizePtr = reply->length;
     }
-    
-    data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, upsID);
-    upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
-    
-    if (!upsDataRef || !upsDataRef->upsPlugInInterface)
+
+    return kIOReturnSuccess;
+}
+
+//---------------------------------------------------------------------------
+// _io_ups_get_capabilities_since
+//
+// Same as _io_ups_get_capabilities, but returns an empty buffer if the
+// capabilities are still the ones the caller saw at 'generation'.
+//---------------------------------------------------------------------------
+kern_return_t _io_ups_get_capabilities_since(mach_port_t server, int upsID,
+                                             uint64_t generation,
+                                             uint64_t *currentGeneration,
+                                             vm_offset_t *capabilitiesBufferPtr,
+                                             mach_msg_type_number_t *capabilitiesBufferSizePtr) {
+    CFSetRef capabilities = NULL;
+    UPSDataRef upsDataRef;
+    UPSReplyCache *reply;
+    IOReturn res;
+
+    if (!currentGeneration || !capabilitiesBufferPtr || !capabilitiesBufferSizePtr)
         return kIOReturnBadArgument;
 
-    res = (*upsDataRef->upsPlugInInterface)->getCapabilities(upsDataRef->upsPlugInInterface,
-                                                             &capabilities);
-    
-    if ((res != kIOReturnSuccess) || !capabilities)
-        return kIOReturnError;
-        
+    *capabilitiesBufferPtr = 0;
+    *capabilitiesBufferSizePtr = 0;
 
-    serializedData = (CFDataRef)IOCFSerialize(capabilities, kNilOptions);
-    
-    if (!serializedData)
-        return kIOReturnError;
-        
-    *capabilitiesBufferSizePtr = CFDataGetLength(serializedData);
+    if (!(upsDataRef = GetUPSDataForID(upsID)))
+        return kIOReturnBadArgument;
 
-    vm_allocate(mach_task_self(), (vm_address_t *)capabilitiesBufferPtr,
-                *capabilitiesBufferSizePtr, TRUE);
+    reply = &upsDataRef->capabilitiesCache;
+    if (!reply->buffer) {
+        res = (*upsDataRef->upsPlugInInterface)->getCapabilities(upsDataRef->upsPlugInInterface,
+                                                                 &capabilities);
+        if ((res != kIOReturnSuccess) || !capabilities)
+            return kIOReturnError;
 
-    if (*capabilitiesBufferPtr)
-        memcpy(*capabilitiesBufferPtr, CFDataGetBytePtr(serializedData),
-               *capabilitiesBufferSizePtr);
+        res = UpdateReplyCache(reply, capabilities);
+        if (res != kIOReturnSuccess)
+            return res;
+    }
 
-    CFRelease(serializedData);
+    *currentGeneration = reply->generation;
+    if (generation != reply->generation) {
+        *capabilitiesBufferPtr = reply->buffer;
+        *capabilitiesBufferSizePtr = reply->length;
+    }
 
-    return res;
-}
\ No newline at end of file
+    return kIOReturnSuccess;
+}
@@ -117,8 +117,9 @@ static bool             purgePastEvents(PowerEventBehavior *);
 static void             copyScheduledPowerChangeArrays(void);
 static CFDictionaryRef  copyEarliestUpcoming(PowerEventBehavior *);
 static CFDateRef        _getScheduledEventDate(CFDictionaryRef);
-static CFArrayRef       copyMergedEventArray(PowerEventBehavior *, 
-                                             PowerEventBehavior *);
+static CFIndex          firstEventIndexAtOrAfter(CFArrayRef, CFAbsoluteTime);
+static CFComparisonResult compareEvDatesInsert(CFDictionaryRef, 
+                                             CFDictionaryRef, void *);
 static CFComparisonResult compareEvDates(CFDictionaryRef, 
                                              CFDictionaryRef, void *);
 
@@ -452,18 +453,37 @@ schedulePowerEventType(CFStringRef type)
 }
 
 __private_extern__ CFTimeInterval getEarliestRequestAutoWake(void)
+{
+    return getEarliestRequestAutoWakeWithLeeway(NULL);
+}
+
+/*
+ * Also returns the event's kPMPowerEventLeewayKey - how much later than
+ * requested the wake may happen - so it can coalesce with other wake requests.
+ */
+__private_extern__ CFTimeInterval getEarliestRequestAutoWakeWithLeeway(CFTimeInterval *leeway)
 {
     CFDictionaryRef     one_event = NULL;
     CFDateRef           event_date = NULL;
+    CFNumberRef         leeway_num = NULL;
     CFTimeInterval      absTime = 0.0;
     
+    if (leeway) {
+        *leeway = 0.0;
+    }
     if (!(one_event = copyEarliestUpcoming(&wakeBehavior))) {
         return 0.0;
     }
-    if (!(event_date = _getScheduledEventDate(one_event))) {
-        return 0.0;
+    if ((event_date = _getScheduledEventDate(one_event))) {
+        absTime = CFDateGetAbsoluteTime(event_date);
+    }
+    if (leeway
+        && (leeway_num = isA_CFNumber(CFDictionaryGetValue(one_event, CFSTR(kPMPowerEventLeewayKey)))))
+    {
+        CFNumberGetValue(leeway_num, kCFNumberDoubleType, leeway);
+        if (*leeway < 0.0) *leeway = 0.0;
+        if (*leeway > kPMWakeLeewayMax) *leeway = kPMWakeLeewayMax;
     }
-    absTime = CFDateGetAbsoluteTime(event_date);
     CFRelease(one_event);
     return absTime;
 }
@@ -707,45 +727,41 @@ static CFDictionaryRef
 copyEarliestUpcoming(PowerEventBehavior *b)
 {
     CFArrayRef              arr = NULL;
-    CFDateRef               now = NULL;
+    CFArrayRef              shared = NULL;
+    CFAbsoluteTime          after;
     CFDictionaryRef         the_result = NULL;
+    CFDictionaryRef         shared_result = NULL;
     CFDictionaryRef         repeatEvent = NULL;
-    CFIndex                 i, count;
+    CFIndex                 i;
     CFComparisonResult      eq;
 
     if(!b) return NULL;
 
-    // wake and poweron types get merged with wakeorpoweron array
-    if(b->sharedEvents) {
-
-        // musst release arr later
-        arr = copyMergedEventArray(b, b->sharedEvents);
+    // Both arrays are kept sorted by date, so the earliest upcoming entry
+    // is the first one >MIN_SCHEDULE_TIME seconds in the future.
+    after = CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME;
 
-    } else {
-        arr = b->array;
+    arr = b->array;
+    if (arr && ((i = firstEventIndexAtOrAfter(arr, after)) < CFArrayGetCount(arr))) {
+        the_result = CFArrayGetValueAtIndex(arr, i);
     }
 
-    // If the array is NULL, we have no work to do.
-    if (arr && (count = CFArrayGetCount(arr)) != 0) {
-
-        
-        now = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME);
-
-        // iterate through all past entries, stopping at one occurring  
-        // >MIN_SCHEDULE_TIME seconds in the future, or at the end of the array
-        i = 0;
-        while( (i < count)
-            && !isEntryValidAndFuturistic(CFArrayGetValueAtIndex(arr, i), now) )
-        {
-            i++;
+    // wake and poweron types also pick up the earliest wakeorpoweron event
+    if (b->sharedEvents && (shared = b->sharedEvents->array)
+        && ((i = firstEventIndexAtOrAfter(shared, after)) < CFArrayGetCount(shared)))
+    {
+        shared_result = CFArrayGetValueAtIndex(shared, i);
+        if (kCFCompareLessThan == compareEvDates(shared_result, the_result, 0)) {
+            the_result = shared_result;
         }
-        CFRelease(now);
+    }
 
-        if(i < count) 
-        {
-            the_result = CFArrayGetValueAtIndex(arr, i);
-            CFRetain(the_result);
-        }
+    if (!_getScheduledEventDate(isA_CFDictionary(the_result))) {
+        // No usable date
+        the_result = NULL;
+    }
+    if (the_result) {
+        CFRetain(the_result);
     }
 
     // Compare against the repeat event, if there is any
@@ -767,14 +783,12 @@ copyEarliestUpcoming(PowerEventBehavior *b)
         }
     }
     
-    if(arr && b->sharedEvents) CFRelease(arr);
-    
     return the_result;
 }
 
 /*
  *
- * comapareEvDates() - internal sorting helper for copyMergedEventArray()
+ * comapareEvDates() - internal sorting helper for the date-sorted event arrays
  *
  */
  static CFComparisonResult 
@@ -797,53 +811,53 @@ compareEvDates(
     return CFDateCompare(d1, d2, 0);
 }
 
+/*
+ * compareEvDatesInsert() - CFArrayBSearchValues comparator for addEvent().
+ * Never reports equality, so the search lands after events with the same date.
+ */
+static CFComparisonResult
+compareEvDatesInsert(
+    CFDictionaryRef a1,
+    CFDictionaryRef a2,
+    void *c __unused)
+{
+    return (kCFCompareLessThan == compareEvDates(a1, a2, 0)) ?
+                kCFCompareLessThan : kCFCompareGreaterThan;
+}
+
 /*
  *
- * copyMergedEventArray
+ * firstEventIndexAtOrAfter
  *
- * Takes two PowerEventBehavior*, merges their CFArray array members into one 
- * mutable array, sorted by date.
+ * Binary search of a date-sorted event array for the first event at or after
+ * 'after'. Entries without a date sort to the end, per compareEvDates().
+ * Returns CFArrayGetCount(arr) if there is none.
  */
-static CFArrayRef       
-copyMergedEventArray(
-    PowerEventBehavior *a, 
-    PowerEventBehavior *b)
+static CFIndex
+firstEventIndexAtOrAfter(CFArrayRef arr, CFAbsoluteTime after)
 {
-    CFMutableArrayRef       merged;
-    CFIndex                 bcount;
-    CFRange                 rng;
+    CFIndex     lo = 0;
+    CFIndex     hi = CFArrayGetCount(arr);
+    CFIndex     mid;
+    CFDateRef   d;
 
-    if(!a || !b) return NULL;
-    if(!a->array && !b->array) return NULL;
-    if(!a->array) return CFRetain(b->array);
-    if(!b->array) return CFRetain(a->array);
-
-    // merge!
-    merged = CFArrayCreateMutableCopy(0, 0, a->array);
-    
-    bcount = CFArrayGetCount(b->array);
-    rng =  CFRangeMake(0, bcount);
-    CFArrayAppendArray(merged, b->array, rng);
-
-    // sort!
-    // We sort using the same compare_dates function used in IOKitUser
-    // pwr_mgt/IOPMAutoWake.c. Arrays must be sorted identically to how
-    // they would be there.
-    bcount = CFArrayGetCount(merged);
-    rng =  CFRangeMake(0, bcount);
-    CFArraySortValues(merged, rng, (CFComparatorFunction)compareEvDates, 0);
-
-    // caller must release
-    return merged;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        d = _getScheduledEventDate(isA_CFDictionary(CFArrayGetValueAtIndex(arr, mid)));
+        if (d && (CFDateGetAbsoluteTime(d) < after)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-
-
-
-
 static CFDateRef
 _getScheduledEventDate(CFDictionaryRef event)
 {
+    if (!event) return NULL;
     return isA_CFDate(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey)));
 }
 
@@ -905,13 +919,13 @@ addEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
         // First clear off any expired events
         purgePastEvents(behave);
 
-        CFArrayAppendValue(behave->array, event);
-
-        // XXX: Manual sorting is probably better than using CFArraySortValues()
-        // Element is being added to already sorted array
-        CFArraySortValues( 
-                behave->array, CFRangeMake(0, CFArrayGetCount(behave->array)),
-                (CFComparatorFunction)compareEvDates, 0);
+        // Element is being added to an already sorted array; insert it
+        // after any events with the same date.
+        CFArrayInsertValueAtIndex(behave->array,
+                CFArrayBSearchValues(behave->array,
+                        CFRangeMake(0, CFArrayGetCount(behave->array)),
+                        event, (CFComparatorFunction)compareEvDatesInsert, 0),
+                event);
     }
     else {
         behave->array = CFArrayCreateMutable(
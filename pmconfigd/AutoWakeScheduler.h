@@ -41,5 +41,6 @@ __private_extern__ IOReturn         createSCSession(SCPreferencesRef *prefs, uid
 __private_extern__ void             schedulePowerEventType(CFStringRef type);
 __private_extern__ void             destroySCSession(SCPreferencesRef prefs, int unlock);
 __private_extern__ CFTimeInterval   getEarliestRequestAutoWake(void);
+__private_extern__ CFTimeInterval   getEarliestRequestAutoWakeWithLeeway(CFTimeInterval *leeway);
 
 #endif // _AutoWakeScheduler_h_
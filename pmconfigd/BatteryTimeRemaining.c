@@ -34,6 +34,11 @@
 #include <asl.h>
 #include <bsm/libbsm.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libkern/OSAtomic.h>
 
 #include "powermanagementServer.h" // mig generated
 #include "BatteryTimeRemaining.h"
@@ -63,6 +68,75 @@
 ****/
 
 
+/* PSLogRecord
+ * One charge log entry, as returned by _io_ps_copy_chargelog().
+ */
+enum {
+    kPSLogStateNone         = 0,
+    kPSLogStateAC           = 1,
+    kPSLogStateBattery      = 2,
+    kPSLogStateOff          = 3
+};
+
+enum {
+    kPSLogHasCurrentCap     = (1 << 0),
+    kPSLogHasMaxCap         = (1 << 1),
+    kPSLogHasCurrent        = (1 << 2),
+    kPSLogHasIsCharging     = (1 << 3),
+    kPSLogIsCharging        = (1 << 4),
+    kPSLogIsCharged         = (1 << 5)
+};
+
+typedef struct {
+    CFAbsoluteTime      time;
+    int32_t             tzOffset;       // Seconds east of GMT
+    int32_t             currentCap;
+    int32_t             maxCap;
+    int32_t             current;
+    uint8_t             state;          // kPSLogState*
+    uint8_t             flags;          // kPSLog*
+    uint16_t            reserved;
+} PSLogRecord;
+
+#define kBattLogMaxEntries      64
+#define kBattLogVersion         1
+
+/* PSLogRing
+ * Oldest record is at (next - count) modulo kBattLogMaxEntries. The internal
+ * battery's ring is a shared mapping of kBattLogPath, so it survives
+ * powerd restarts without any explicit writes.
+ */
+typedef struct {
+    uint32_t            version;
+    uint32_t            recordSize;
+    uint32_t            count;
+    uint32_t            next;
+    PSLogRecord         records[kBattLogMaxEntries];
+} PSLogRing;
+
+#define kBattLogPath            "/var/db/com.apple.powerd.chargelog"
+
+/* PSSummary
+ * The fields of a power source description that power source selection
+ * and the combined estimates need, parsed once per description change.
+ */
+enum {
+    kPSKindNone             = 0,
+    kPSKindInternal         = 1,
+    kPSKindUPS              = 2,
+    kPSKindOther            = 3,
+    kPSKindCount            = 4
+};
+
+typedef struct {
+    uint8_t             kind;           // kPSKind*
+    uint8_t             state;          // kPSLogState*
+    bool                isCharging;
+    int                 currentCap;
+    int                 maxCap;
+    int                 timeToEmpty;    // Minutes, -1 if unknown
+} PSSummary;
+
 /* PSStruct 
  * Contains all the details about each power source that the system describes.
  * This struct is the backbone of the IOPowerSources() IOKit API for
@@ -80,19 +154,59 @@ typedef struct {
     // This is the most current recorded state of this power source.
     CFDictionaryRef     description;
 
+    // Power source generation at which description last changed,
+    // and the kPSChanged* keys that changed then.
+    uint64_t            generation;
+    uint32_t            changedMask;
+
+    // Parsed from description; see aggregatePowerSource()
+    PSSummary           summary;
+
+    // Optional shared memory channel; see BatteryTimeRemaining.h
+    PSSharedRecord          *shared;
+    int                     sharedNotifyToken;
+    uint32_t                sharedSeq;
+
     // log of previous battery updates, maintained as ring buffer
-    CFMutableArrayRef       log;         
-    CFIndex                 logIdx;         // Index for next record
+    PSLogRing               *log;
     uint64_t                logUpdate_ts;   // Timestamp of last log
 } PSStruct;
 
-#define kBattLogMaxEntries      64
 #define kBattLogUpdateFreq      (5*60)  // 5 mins
 
 #define kPSMaxCount   7
 
+/* IOPSCreatePowerSource() psids start at kPSIDBase, and encode their
+ * gPSList slot as (psid - kPSIDBase) % kPSMaxCount.
+ */
+#define kPSIDBase     5000
+
 static PSStruct gPSList[kPSMaxCount];
 
+// Bumped whenever a description in gPSList changes, or a power source goes away
+static uint64_t         gPSGeneration = 0;
+static uint64_t         gPSRemovedGeneration = 0;
+static uint64_t         gPSPublishedGeneration = 0;
+
+/* PSAggregate
+ * Running totals over the summaries of every source in gPSList, by kind.
+ * Each description change subtracts the source's old summary and adds its
+ * new one, so nothing is recomputed from scratch.
+ */
+typedef struct {
+    int                 count[kPSKindCount];
+    int                 onBattery[kPSKindCount];
+    int                 charging[kPSKindCount];
+    int                 currentCap[kPSKindCount];
+    int                 maxCap[kPSKindCount];
+    PSStruct            *activeBattery;
+    PSStruct            *activeUPS;
+} PSAggregate;
+static PSAggregate      gPSAggregate;
+
+// _io_ps_copy_powersources_info() reply snapshot; cleared whenever gPSGeneration moves
+static CFDataRef        gPSSerialized = NULL;
+
 // kBattNotCharging checks for (int16_t)-1 invalid current readings
 #define kBattNotCharging        0xffff
 
@@ -105,6 +219,47 @@ typedef struct {
 } SlewStruct;
 SlewStruct *slew = NULL;
 
+/*
+ * kTREstimatorKalman tracks the battery's mean current with a one state
+ * Kalman filter, fed the average and instantaneous current on every update.
+ * Its variance is reset after a discontinuity, so the first samples are
+ * taken nearly as-is and the estimate settles within a poll or two; after
+ * that, process noise scaled by the horizon decides how quickly it follows
+ * a real change in load.
+ */
+#define kTRKalmanInitialVariance    (1.0e8)             // mA^2; no prior
+#define kTRKalmanAvgVariance        (100.0 * 100.0)     // mA^2
+#define kTRKalmanInstantVariance    (400.0 * 400.0)     // mA^2
+#define kTRKalmanDriftVariance      (500.0 * 500.0)     // mA^2 per horizon
+#define kTRKalmanSettledVariance    (150.0 * 150.0)     // mA^2
+#define kTRKalmanMinCurrent         10                  // mA
+#define kTRHorizonDefaultS          300
+#define kTRHorizonMinS              30
+#define kTRHorizonMaxS              3600
+typedef struct {
+    double              current;        // mA; negative while discharging
+    double              variance;
+    CFAbsoluteTime      lastSample;
+    bool                valid;
+} TRKalmanStruct;
+static TRKalmanStruct   kalman;
+
+
+/*
+ * The user visible poll interval adapts to how fast the battery is changing.
+ * It doubles, up to kPollIntervalMaxS, while charge and current are stable,
+ * and drops back to kPollIntervalMinS on AC changes, near the low battery
+ * warnings or when readings move. A large move also escalates the next poll
+ * to a full read.
+ */
+#define kPollIntervalMinS           60
+#define kPollIntervalMaxS           300
+#define kPollStablePercentDelta     1
+#define kPollStableAmperageDelta    100     // mA
+#define kPollEscalatePercentDelta   3
+#define kPollEscalateAmperageDelta  1000    // mA
+#define kPollNearWarningPercent     10
+#define kPollNearWarningMinutes     30
 
 // Battery health calculation constants
 #define kSmartBattReserve_mAh    200.0
@@ -120,17 +275,29 @@ typedef struct {
     bool             selectionHasSwitched;
     int              psTimeRemainingNotifyToken;
     int              psPercentChangeNotifyToken;
+    bool             primed;
     bool             noPoll;
     bool             needsNotifyAC;
     PSStruct         *internal;
+    int              pollIntervalS;
+    bool             pollFullNext;
+    int              lastPollPercent;
+    int              lastPollAmperage;
+    int              lastPollExternal;
+    int              trEstimator;
+    int              trHorizonS;
 } BatteryControl;
 static BatteryControl   control;
 
 
 // forward declarations
 static PSStruct         *iops_newps(int pid, int psid);
+static void             setPowerSourceDescription(PSStruct *ps, CFDictionaryRef description);
+static void             powerSourceRemoved(PSStruct *ps);
+static void             aggregatePowerSource(PSStruct *ps);
 static void             _initializeBatteryCalculations(void);
 static void             checkTimeRemainingValid(IOPMBattery **batts);
+static bool             timeRemainingIsSettled(void);
 static CFDictionaryRef packageKernelPowerSource(IOPMBattery *b);
 
 static void             _discontinuityOccurred(void);
@@ -165,7 +332,13 @@ BatteryTimeRemaining_prime(void)
 {
 
     bzero(gPSList, sizeof(gPSList));
+    bzero(&gPSAggregate, sizeof(PSAggregate));
     bzero(&control, sizeof(BatteryControl));
+    control.primed = true;
+    control.pollIntervalS = kPollIntervalMinS;
+    control.lastPollExternal = -1;
+    control.trEstimator = kTREstimatorSlew;
+    control.trHorizonS = kTRHorizonDefaultS;
 
     notify_register_check(kIOPSTimeRemainingNotificationKey,
                           &control.psTimeRemainingNotifyToken);
@@ -199,6 +372,24 @@ BatteryTimeRemainingSleepWakeNotification(natural_t messageType)
     }
 }
 
+/*
+ * A kernel power source was published. Sets up the internal battery's
+ * calculations if this is the first battery, and reads it right away, so
+ * polling runs again after a spell with no batteries.
+ */
+__private_extern__ void
+BatteryTimeRemainingBatteryMatched(void)
+{
+    // Sources found before BatteryTimeRemaining_prime() are picked up there
+    if (!control.primed || (0 == _batteryCount()))
+        return;
+
+    if (!control.internal) {
+        _initializeBatteryCalculations();
+    }
+    startBatteryPoll(kImmediateFullPoll);
+}
+
 /*
  * When we wake from sleep, we call this function to make note of the
  * battery time remaining discontinuity after the RTC resyncs with the CPU.
@@ -219,6 +410,7 @@ static void _discontinuityOccurred(void)
     if (slew) {
         bzero(slew, sizeof(SlewStruct));
     }
+    bzero(&kalman, sizeof(TRKalmanStruct));
     control.lastDiscontinuity = CFAbsoluteTimeGetCurrent();
     
     // Kick off a battery poll now,
@@ -250,29 +442,12 @@ static void     _initializeBatteryCalculations(void)
 }
 
 #if !TARGET_OS_EMBEDDED
-static CFAbsoluteTime getASBMPropertyCFAbsoluteTime(CFStringRef key)
+static CFAbsoluteTime secsSince1970ToCFAbsoluteTime(uint32_t secs)
 {
-    CFNumberRef     secSince1970 = NULL;
-    IOPMBattery     **b = _batteries();
-    uint32_t        secs = 0;
-    CFAbsoluteTime  return_val = 0.0;
-/*
-    if (b && b[0] && b[0]->me)
-    {
-        secSince1970 = IORegistryEntryCreateCFProperty(b[0]->me, key, 0, 0);
-        if (secSince1970) {
-*/
-    if (b && b[0] && b[0]->properties)
-    {
-        secSince1970 = CFDictionaryGetValue(b[0]->properties, key);
-        if (secSince1970) {
-            CFNumberGetValue(secSince1970, kCFNumberIntType, &secs);
-//            CFRelease(secSince1970);
-            return_val = (CFAbsoluteTime)secs - kCFAbsoluteTimeIntervalSince1970;
-        }
+    if (!secs) {
+        return 0.0;
     }
-    
-    return return_val;
+    return (CFAbsoluteTime)secs - kCFAbsoluteTimeIntervalSince1970;
 }
 
 static CFTimeInterval mostRecent(CFTimeInterval a, CFTimeInterval b, CFTimeInterval c)
@@ -287,16 +462,63 @@ static CFTimeInterval mostRecent(CFTimeInterval a, CFTimeInterval b, CFTimeInter
 static dispatch_source_t batteryPollingTimer = NULL;
 #endif
 
+static PSLogRing *mapLogBuffer(bool persistent)
+{
+    size_t          len = round_page(sizeof(PSLogRing));
+    PSLogRing       *ring = NULL;
+    struct stat     sb;
+    int             fd = -1;
+
+    if (persistent) {
+        fd = open(kBattLogPath, O_RDWR | O_CREAT, 0644);
+    }
+
+    if (fd >= 0)
+    {
+        if ((0 == fstat(fd, &sb)) && ((size_t)sb.st_size == len || 0 == ftruncate(fd, len)))
+        {
+            ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    else {
+        ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    }
+
+    if (MAP_FAILED == ring || !ring) {
+        return NULL;
+    }
+
+    // Discard anything left by a different layout, or a torn file
+    if ((kBattLogVersion != ring->version)
+        || (sizeof(PSLogRecord) != ring->recordSize)
+        || (ring->count > kBattLogMaxEntries)
+        || (ring->next >= kBattLogMaxEntries))
+    {
+        bzero(ring, sizeof(PSLogRing));
+        ring->version = kBattLogVersion;
+        ring->recordSize = sizeof(PSLogRecord);
+    }
+    PMMemoryCharge(kPMMemBatteryLogs, len);
+
+    return ring;
+}
+
+static void unmapLogBuffer(PSLogRing *ring)
+{
+    if (ring) {
+        munmap(ring, round_page(sizeof(PSLogRing)));
+        PMMemoryCharge(kPMMemBatteryLogs, -(ssize_t)round_page(sizeof(PSLogRing)));
+    }
+}
+
 static void updateLogBuffer(PSStruct *ps, bool asyncEvent)
 {
     uint64_t        curTime = getMonotonicTime();
     CFTypeRef       n;
-    CFDateRef       date = NULL;
-    CFTimeZoneRef   tz = NULL;
-    CFTimeInterval  diff = 0;
-    CFAbsoluteTime  absTime;
-
-    CFMutableDictionaryRef  entry = NULL;
+    PSLogRecord     *rec;
+    time_t          now;
+    struct tm       local;
 
     if ((ps == NULL) || (isA_CFDictionary(ps->description) == NULL)) return;
 
@@ -304,79 +526,67 @@ static void updateLogBuffer(PSStruct *ps, bool asyncEvent)
         return;
 
     if (ps->log == NULL) {
-        ps->log = CFArrayCreateMutable(NULL, kBattLogMaxEntries, &kCFTypeArrayCallBacks);
+        ps->log = mapLogBuffer(ps == control.internal);
 
         if (ps->log == NULL) return;
     }
 
-    entry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, 
-                                      &kCFTypeDictionaryValueCallBacks);
-    if (!entry) return;
+    rec = &ps->log->records[ps->log->next];
+    bzero(rec, sizeof(PSLogRecord));
 
     // Current time of this activity
-    tz = CFTimeZoneCopySystem();
-    if (tz == NULL) {
-        goto exit;
-    }
-    absTime = CFAbsoluteTimeGetCurrent();
-    date = CFDateCreate(0, absTime);
-    if (date == NULL) {
-        goto exit;
-    }
-    CFDictionarySetValue(entry, CFSTR(kIOPSBattLogEntryTime), date);
-
-    diff = CFTimeZoneGetSecondsFromGMT(tz, absTime);
-    n = CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &diff);
-    if (n) {
-        CFDictionarySetValue(entry, CFSTR(kIOPSBattLogEntryTZ), n);
-        CFRelease(n);
+    rec->time = CFAbsoluteTimeGetCurrent();
+    now = time(NULL);
+    if (localtime_r(&now, &local)) {
+        rec->tzOffset = (int32_t)local.tm_gmtoff;
     }
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSCurrentCapacityKey));
-    if (n) CFDictionarySetValue(entry, CFSTR(kIOPSCurrentCapacityKey), n);
+    if (isA_CFNumber(n) && CFNumberGetValue(n, kCFNumberSInt32Type, &rec->currentCap))
+        rec->flags |= kPSLogHasCurrentCap;
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSMaxCapacityKey));
-    if (n) CFDictionarySetValue(entry, CFSTR(kIOPSMaxCapacityKey), n);
+    if (isA_CFNumber(n) && CFNumberGetValue(n, kCFNumberSInt32Type, &rec->maxCap))
+        rec->flags |= kPSLogHasMaxCap;
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSPowerSourceStateKey));
-    if (n) CFDictionarySetValue(entry, CFSTR(kIOPSPowerSourceStateKey), n);
+    if (isA_CFString(n)) {
+        if (CFEqual(n, CFSTR(kIOPSACPowerValue)))
+            rec->state = kPSLogStateAC;
+        else if (CFEqual(n, CFSTR(kIOPSBatteryPowerValue)))
+            rec->state = kPSLogStateBattery;
+        else if (CFEqual(n, CFSTR(kIOPSOffLineValue)))
+            rec->state = kPSLogStateOff;
+    }
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSIsChargingKey));
-    if (n) CFDictionarySetValue(entry, CFSTR(kIOPSIsChargingKey), n);
+    if (isA_CFBoolean(n)) {
+        rec->flags |= kPSLogHasIsCharging;
+        if (kCFBooleanTrue == n)
+            rec->flags |= kPSLogIsCharging;
+    }
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSCurrentKey));
-    if (n) CFDictionarySetValue(entry, CFSTR(kIOPSCurrentKey), n);
+    if (isA_CFNumber(n) && CFNumberGetValue(n, kCFNumberSInt32Type, &rec->current))
+        rec->flags |= kPSLogHasCurrent;
 
     n = CFDictionaryGetValue(ps->description, CFSTR(kIOPSIsChargedKey));
-    if (n) 
-        CFDictionarySetValue(entry, CFSTR(kIOPSIsChargedKey), n);
-    else
-        CFDictionarySetValue(entry, CFSTR(kIOPSIsChargedKey), kCFBooleanFalse);
-
-    CFArraySetValueAtIndex(ps->log, ps->logIdx , entry);
-    ps->logIdx = (++ps->logIdx) % kBattLogMaxEntries;
+    if (kCFBooleanTrue == n)
+        rec->flags |= kPSLogIsCharged;
 
+    ps->log->next = (ps->log->next + 1) % kBattLogMaxEntries;
+    if (ps->log->count < kBattLogMaxEntries)
+        ps->log->count++;
 
     ps->logUpdate_ts = curTime;
-
-exit:
-    if (entry) CFRelease(entry);
-    if (tz) CFRelease(tz);
-    if (date) CFRelease(date);
 }
 
-#ifndef kBootPathKey
-#define kBootPathKey             "BootPathUpdated"
-#define kFullPathKey             "FullPathUpdated"
-#define kUserVisPathKey          "UserVisiblePathUpdated"
-#endif
-
 static bool startBatteryPoll(PollCommand doCommand)
 {
 #if !TARGET_OS_EMBEDDED
-    const static CFTimeInterval     kUserVisibleMinFrequency = 55.0;
     const static CFTimeInterval     kFullMinFrequency = 595.0;
-    const static uint64_t           kPollIntervalNS = 60ULL * NSEC_PER_SEC;
+    CFTimeInterval                  userVisibleMinFrequency = control.pollIntervalS - 5.0;
+    uint64_t                        pollIntervalNS = control.pollIntervalS * NSEC_PER_SEC;
     
     CFAbsoluteTime                  lastBootUpdate = 0.0;
     CFAbsoluteTime                  lastUserVisibleUpdate = 0.0;
@@ -388,7 +598,9 @@ static bool startBatteryPoll(PollCommand doCommand)
     bool                            doUserVisible = false;
     bool                            doFull = false;
     
-    if (!_batteries())
+    IOPMBattery                     **b = _batteries();
+
+    if (!b || !b[0])
         return false;
     
     if (control.noPoll)
@@ -397,19 +609,19 @@ static bool startBatteryPoll(PollCommand doCommand)
         return false;
     }
     
-    if (kImmediateFullPoll == doCommand) {
+    if ((kImmediateFullPoll == doCommand) || control.pollFullNext) {
         doFull = true;
     } else {
         
-        lastUpdateTime = getASBMPropertyCFAbsoluteTime(CFSTR(kBootPathKey));
+        lastUpdateTime = secsSince1970ToCFAbsoluteTime(b[0]->bootPathUpdated);
         if (lastUpdateTime < now) lastBootUpdate = lastUpdateTime;
-        lastUpdateTime = getASBMPropertyCFAbsoluteTime(CFSTR(kFullPathKey));
+        lastUpdateTime = secsSince1970ToCFAbsoluteTime(b[0]->fullPathUpdated);
         if (lastUpdateTime < now) lastFullUpdate = lastUpdateTime;
-        lastUpdateTime = getASBMPropertyCFAbsoluteTime(CFSTR(kUserVisPathKey));
+        lastUpdateTime = secsSince1970ToCFAbsoluteTime(b[0]->userVisPathUpdated);
         if (lastUpdateTime < now) lastUserVisibleUpdate = lastUpdateTime;
         
         sinceUserVisible = now - mostRecent(lastBootUpdate, lastFullUpdate, lastUserVisibleUpdate);
-        if (sinceUserVisible > kUserVisibleMinFrequency) {
+        if (sinceUserVisible > userVisibleMinFrequency) {
             doUserVisible = true;
         }
 
@@ -420,12 +632,13 @@ static bool startBatteryPoll(PollCommand doCommand)
     }
     
     if (doFull) {
+        control.pollFullNext = false;
         IOPSRequestBatteryUpdate(kIOPSReadAll);
     } else if (doUserVisible) {
         IOPSRequestBatteryUpdate(kIOPSReadUserVisible);
     } else {
-        // We'll wait until kPollIntervalNS has elapsed since the last user visible poll.
-        uint64_t checkAgainNS = kPollIntervalNS - (sinceUserVisible*NSEC_PER_SEC);
+        // We'll wait until pollIntervalNS has elapsed since the last user visible poll.
+        uint64_t checkAgainNS = pollIntervalNS - (sinceUserVisible*NSEC_PER_SEC);
 
         if (!batteryPollingTimer) {
             batteryPollingTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
@@ -460,6 +673,36 @@ __private_extern__ void BatterySetNoPoll(bool noPoll)
 #define kTimeThresholdEarly          20
 #define kTimeThresholdFinal          10
 
+static void updateBatteryPollInterval(IOPMBattery *b, int percentRemaining)
+{
+    int     interval = control.pollIntervalS;
+    int     external = b->externalConnected ? 1 : 0;
+    int     percentDelta = abs(percentRemaining - control.lastPollPercent);
+    int     amperageDelta = abs(b->instantAmperage - control.lastPollAmperage);
+
+    if (external != control.lastPollExternal) {
+        interval = kPollIntervalMinS;
+    } else if ((percentDelta >= kPollEscalatePercentDelta)
+               || (amperageDelta >= kPollEscalateAmperageDelta)) {
+        interval = kPollIntervalMinS;
+        control.pollFullNext = true;
+    } else if (!external
+               && ((percentRemaining <= kPollNearWarningPercent)
+                   || ((b->swCalculatedTR > 0) && (b->swCalculatedTR < kPollNearWarningMinutes)))) {
+        interval = kPollIntervalMinS;
+    } else if ((percentDelta <= kPollStablePercentDelta)
+               && ((amperageDelta <= kPollStableAmperageDelta) || timeRemainingIsSettled())) {
+        interval = MIN(interval * 2, kPollIntervalMaxS);
+    } else {
+        interval = kPollIntervalMinS;
+    }
+
+    control.pollIntervalS = interval;
+    control.lastPollPercent = percentRemaining;
+    control.lastPollAmperage = b->instantAmperage;
+    control.lastPollExternal = external;
+}
+
 static void publish_IOPSBatteryGetWarningLevel(
     IOPMBattery *b,
     int combinedTime)
@@ -532,7 +775,7 @@ static void publish_IOPSBatteryGetWarningLevel(
             PMStoreSetValue(lowBatteryKey, newlevel );
             CFRelease(newlevel);
             
-            notify_post(kIOPSNotifyLowBattery);
+            PMStoreNotifyPost(kIOPSNotifyLowBattery);
             if ((newWarningLevel != prevLoggedLevel) && (newWarningLevel != kIOPSLowBatteryWarningNone)) {
                 logASLLowBatteryWarning(newWarningLevel, combinedTime, b->currentCap);
                 prevLoggedLevel = newWarningLevel;
@@ -667,13 +910,11 @@ kernelPowerSourcesDidChange(IOPMBattery *b)
     int                         percentRemaining = 0;
     IOPMBattery               **_batts = _batteries();
 
-    /*
-     * Initiate the next battery poll; or start a timer to poll
-     * when the 60sec user visible polling timer expres.
-     */
-    startBatteryPoll(kPeriodicPoll);
-
     if (0 == _batteryCount()) {
+        // Start the next battery from the fastest interval
+        control.pollIntervalS = kPollIntervalMinS;
+        control.pollFullNext = false;
+        control.lastPollExternal = -1;
         return;
     }
 
@@ -705,16 +946,20 @@ kernelPowerSourcesDidChange(IOPMBattery *b)
     // b->swCalculatedPR is used by packageKernelPowerSource()
     b->swCalculatedPR = percentRemaining;
 
+    /*
+     * Initiate the next battery poll; or start a timer to poll
+     * when the user visible polling interval expires.
+     */
+    updateBatteryPollInterval(b, percentRemaining);
+    startBatteryPoll(kPeriodicPoll);
+
     /************************************************************************
      *
      * PUBLISH: SCDynamicStoreSetValue / IOPSCopyPowerSourcesInfo()
      *
      ************************************************************************/
     if (control.internal) {
-        if (control.internal->description) {
-            CFRelease(control.internal->description);
-        }
-        control.internal->description = packageKernelPowerSource(b);
+        setPowerSourceDescription(control.internal, packageKernelPowerSource(b));
         updateLogBuffer(control.internal, false);
     }
 
@@ -731,10 +976,10 @@ static void HandlePublishAllPowerSources(void)
     bool                        tr_posted;
     bool                        ups_externalConnected = false;
     bool                        externalConnected, tr_unknown, is_charging, fully_charged;
-    CFDictionaryRef             ups = NULL;
+    PSStruct                    *ups = gPSAggregate.activeUPS;
     int                         ups_tr = -1;
 
-    if ((0 == _batteryCount()) && ((ups = getActiveUPSDictionary()) == NULL) ) {
+    if ((0 == _batteryCount()) && (NULL == ups)) {
         return;
     }
 
@@ -752,15 +997,12 @@ static void HandlePublishAllPowerSources(void)
     }
 
     if (ups) {
-        CFNumberRef num_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSTimeToEmptyKey));
-        if (num_cf) {
-            CFNumberGetValue(num_cf, kCFNumberIntType, &ups_tr);
-            if (ups_tr != -1) combinedTime += ups_tr;
-        }
+        ups_tr = ups->summary.timeToEmpty;
+        if (ups_tr != -1) combinedTime += ups_tr;
 
-        CFStringRef src = CFDictionaryGetValue(ups, CFSTR(kIOPSPowerSourceStateKey));
-        if (src && (CFStringCompare(src, CFSTR(kIOPSACPowerValue), kNilOptions) == kCFCompareEqualTo))
-            ups_externalConnected = true;
+        // Every UPS has to be on AC for the host to be on AC
+        ups_externalConnected = (gPSAggregate.count[kPSKindUPS] > 0)
+                                && (0 == gPSAggregate.onBattery[kPSKindUPS]);
     }
     
     if (b) {
@@ -775,8 +1017,9 @@ static void HandlePublishAllPowerSources(void)
                 externalConnected = b->externalConnected;
     }
     else {
-        int mcap = 0, ccap = 0;
-        CFNumberRef mcap_cf = NULL, ccap_cf = NULL;
+        // Combined capacity of all UPSes
+        int mcap = gPSAggregate.maxCap[kPSKindUPS];
+        int ccap = gPSAggregate.currentCap[kPSKindUPS];
 
         /* ups must be non-NULL */
         externalConnected = ups_externalConnected;
@@ -788,17 +1031,9 @@ static void HandlePublishAllPowerSources(void)
             tr_unknown = true;
         }
 
-        if (CFDictionaryGetValue(ups, CFSTR(kIOPSIsChargingKey)) == kCFBooleanTrue)
+        if (gPSAggregate.charging[kPSKindUPS] > 0)
             is_charging = true;
 
-        ccap_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSCurrentCapacityKey));
-        if (ccap_cf)
-            CFNumberGetValue(ccap_cf, kCFNumberIntType, &ccap);
-
-        mcap_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSMaxCapacityKey));
-        if (mcap_cf)
-            CFNumberGetValue(mcap_cf, kCFNumberIntType, &mcap);
-
         if (ccap && mcap)
             percentRemaining = (ccap*100)/mcap;
 
@@ -855,7 +1090,11 @@ static void HandlePublishAllPowerSources(void)
     }
 
 
-    notify_post(kIOPSNotifyAnyPowerSource);
+    // Only tell clients about descriptions that actually changed
+    if (gPSPublishedGeneration != gPSGeneration) {
+        gPSPublishedGeneration = gPSGeneration;
+        notify_post(kIOPSNotifyAnyPowerSource);
+    }
 
     /************************************************************************
      *
@@ -872,6 +1111,132 @@ static void HandlePublishAllPowerSources(void)
 
 
 
+/* slewTimeRemaining
+ * Follows the battery's own average time remaining, moving the published
+ * value by at most kSlewStepMax minutes per update once it has settled.
+ */
+static int slewTimeRemaining(IOPMBattery *b)
+{
+    int     diff, step;
+
+    if ((b->hwAverageTR < 0) || (b->hwAverageTR >= kBattNotCharging)) {
+        return -1;
+    }
+
+    if (CFAbsoluteTimeGetCurrent() - control.lastDiscontinuity < kDiscontinuitySettle) {
+        return -1;
+    }
+
+    if (!slew && !(slew = calloc(1, sizeof(SlewStruct)))) {
+        return b->hwAverageTR;
+    }
+
+    if (!slew->settled) {
+        slew->showingTime = b->hwAverageTR;
+        slew->settled = true;
+        return slew->showingTime;
+    }
+
+    diff = b->hwAverageTR - slew->showingTime;
+    step = abs(diff) / 4;
+    if (step < kSlewStepMin) step = kSlewStepMin;
+    if (step > kSlewStepMax) step = kSlewStepMax;
+    if (step > abs(diff)) step = abs(diff);
+
+    slew->showingTime += (diff < 0) ? -step : step;
+    return slew->showingTime;
+}
+
+static void kalmanMeasure(double z, double r)
+{
+    double gain = kalman.variance / (kalman.variance + r);
+
+    kalman.current += gain * (z - kalman.current);
+    kalman.variance *= (1.0 - gain);
+}
+
+/* kalmanTimeRemaining
+ * O(1) time and fixed memory per sample.
+ */
+static int kalmanTimeRemaining(IOPMBattery *b)
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    double          dt;
+    int             current;
+
+    if (!kalman.valid) {
+        kalman.current = b->avgAmperage;
+        kalman.variance = kTRKalmanInitialVariance;
+    } else {
+        dt = now - kalman.lastSample;
+        if (dt > 0) {
+            kalman.variance += kTRKalmanDriftVariance * dt / control.trHorizonS;
+        }
+    }
+    kalman.lastSample = now;
+    kalman.valid = true;
+
+    kalmanMeasure(b->avgAmperage, kTRKalmanAvgVariance);
+    if (b->instantAmperage != (int16_t)kBattNotCharging) {
+        kalmanMeasure(b->instantAmperage, kTRKalmanInstantVariance);
+    }
+
+    if (kalman.variance > kTRKalmanSettledVariance) {
+        return -1;
+    }
+
+    current = (int)lround(kalman.current);
+    if (b->isCharging) {
+        if ((current < kTRKalmanMinCurrent) || (b->maxCap < b->currentCap))
+            return -1;
+        return ((b->maxCap - b->currentCap) * 60) / current;
+    }
+    if (b->externalConnected) {
+        return 0;
+    }
+    if (-current < kTRKalmanMinCurrent) {
+        return -1;
+    }
+    return (b->currentCap * 60) / -current;
+}
+
+static bool timeRemainingIsSettled(void)
+{
+    return (kTREstimatorKalman == control.trEstimator)
+            && kalman.valid && (kalman.variance <= kTRKalmanSettledVariance);
+}
+
+__private_extern__ int getTimeRemainingEstimator(void)
+{
+    return control.trEstimator;
+}
+
+__private_extern__ IOReturn setTimeRemainingEstimator(int estimator)
+{
+    if ((kTREstimatorSlew != estimator) && (kTREstimatorKalman != estimator)) {
+        return kIOReturnBadArgument;
+    }
+    if (estimator != control.trEstimator) {
+        control.trEstimator = estimator;
+        _discontinuityOccurred();
+    }
+    return kIOReturnSuccess;
+}
+
+__private_extern__ int getTimeRemainingHorizon(void)
+{
+    return control.trHorizonS;
+}
+
+__private_extern__ IOReturn setTimeRemainingHorizon(int seconds)
+{
+    if ((seconds < kTRHorizonMinS) || (seconds > kTRHorizonMaxS)) {
+        return kIOReturnBadArgument;
+    }
+    control.trHorizonS = seconds;
+    return kIOReturnSuccess;
+}
+
 /* checkTimeRemainingValid
  * Implicit inputs: battery state; battery's own time remaining estimate
  * Implicit output: estimated time remaining placed in b->swCalculatedTR; or -1 if indeterminate
@@ -888,6 +1253,16 @@ static void checkTimeRemainingValid(IOPMBattery **batts)
     for(i=0; i<batCount; i++)
     {
         b = batts[i];
+
+        // Estimator state tracks the first battery only
+        if (i > 0) {
+            b->swCalculatedTR = b->hwAverageTR;
+        } else if (kTREstimatorKalman == control.trEstimator) {
+            b->swCalculatedTR = kalmanTimeRemaining(b);
+        } else {
+            b->swCalculatedTR = slewTimeRemaining(b);
+        }
+
         // Did our calculation come out negative?
         // The average current must still be out of whack!
         if ((b->swCalculatedTR < 0) || (false == b->isPresent)) {
@@ -1496,7 +1871,7 @@ static IOReturn _readAndPublishACAdapter(bool adapterExists, CFDictionaryRef bat
     }
 
     if (success) {
-        notify_post("com.apple.system.powermanagement.poweradapter");
+        PMStoreNotifyPost("com.apple.system.powermanagement.poweradapter");
         ret = kIOReturnSuccess;
     } else {
         ret = kIOReturnLockedRead;
@@ -1518,8 +1893,15 @@ exit:
 
 
 /***********************************************************************************/
+/*
+ * iops_newps
+ *
+ * Pass psid 0 to have one assigned that maps straight to its slot.
+ */
 static PSStruct *iops_newps(int pid, int psid)
 {
+    static unsigned int     psSerial = 0;
+
     // Find the first empty slot in gPSList
     for (int i=0; i<kPSMaxCount; i++)
     {
@@ -1527,6 +1909,9 @@ static PSStruct *iops_newps(int pid, int psid)
         {
             bzero(&gPSList[i], sizeof(PSStruct));
             gPSList[i].pid = pid;
+            if (0 == psid) {
+                psid = kPSIDBase + (psSerial++ * kPSMaxCount) + i;
+            }
             gPSList[i].psid = psid;
             return &gPSList[i];
         }
@@ -1534,9 +1919,15 @@ static PSStruct *iops_newps(int pid, int psid)
 
     return NULL;
 }
-
 static PSStruct *iopsFromPSID(int _pid, int _psid)
 {
+    PSStruct    *ps;
+
+    if (_psid >= kPSIDBase) {
+        ps = &gPSList[(_psid - kPSIDBase) % kPSMaxCount];
+        return ((ps->psid == _psid) && (ps->pid == _pid)) ? ps : NULL;
+    }
+
     for (int i=0; i<kPSMaxCount; i++)
     {
         if (gPSList[i].psid == _psid
@@ -1552,111 +1943,55 @@ static PSStruct *iopsFromPSID(int _pid, int _psid)
 
 __private_extern__ CFDictionaryRef getActiveBatteryDictionary(void)
 {
+    return gPSAggregate.activeBattery ? gPSAggregate.activeBattery->description : NULL;
+}
+__private_extern__ CFDictionaryRef getActiveUPSDictionary(void)
+{
+    return gPSAggregate.activeUPS ? gPSAggregate.activeUPS->description : NULL;
+}
+__private_extern__ CFArrayRef copyPowerSourceDescriptions(void)
+{
+    CFMutableArrayRef   list = NULL;
+
     for (int i=0; i<kPSMaxCount; i++)
     {
-        if (!gPSList[i].description) {
+        if (!gPSList[i].description)
             continue;
-        }
-
-        CFStringRef transport_type = NULL;
-        transport_type = CFDictionaryGetValue(gPSList[i].description,
-                                              CFSTR(kIOPSTransportTypeKey));
-        if (isA_CFString(transport_type)
-            && ( CFEqual(transport_type, CFSTR(kIOPSInternalType))))
-        {
-            return gPSList[i].description;
-        }
+        if (!list && !(list = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks)))
+            return NULL;
+        CFArrayAppendValue(list, gPSList[i].description);
     }
-    return NULL;
+    return list;
 }
 
-__private_extern__ CFDictionaryRef getActiveUPSDictionary(void)
+__private_extern__ int getUPSDictionaries(CFDictionaryRef *upsList, int maxCount)
 {
-    for (int i=0; i<kPSMaxCount; i++)
-    {
-        if (!gPSList[i].description) {
-            continue;
-        }
+    int count = 0;
 
-        CFStringRef transport_type = NULL;
-        transport_type = CFDictionaryGetValue(gPSList[i].description,
-                                              CFSTR(kIOPSTransportTypeKey));
-        if (isA_CFString(transport_type)
-           && ( CFEqual(transport_type, CFSTR(kIOPSSerialTransportType))
-               || CFEqual(transport_type, CFSTR(kIOPSUSBTransportType))
-               || CFEqual(transport_type, CFSTR(kIOPSNetworkTransportType)) ))
-        {
-            return gPSList[i].description;
+    for (int i=0; (i<kPSMaxCount) && (count<maxCount); i++)
+    {
+        if (gPSList[i].description && (kPSKindUPS == gPSList[i].summary.kind)) {
+            upsList[count++] = gPSList[i].description;
         }
     }
-    return NULL;
+    return count;
 }
-
-
-
 __private_extern__ int getActivePSType(void)
 {
-    CFDictionaryRef activeBattery = getActiveBatteryDictionary();
-    CFDictionaryRef activeUPS = getActiveUPSDictionary();
-    CFStringRef     ps_state = NULL;
-
-    /* if (!activeBattery) is testing for whether batteries are supported on
-     * this system at all, e.g. mobile vs desktop. */
-    if(!activeBattery)
-    {
-        if(!activeUPS) {
-            // no batteries, no UPS -> AC Power
-            return kIOPSProvidedByAC;
-        } else {
-            ps_state = CFDictionaryGetValue(activeUPS,
-                                            CFSTR(kIOPSPowerSourceStateKey));
-            if(ps_state && CFEqual(ps_state, CFSTR(kIOPSACPowerValue)))
-            {
-                // no batteries, yes UPS, UPS is running off of AC power -> AC Power
-                return kIOPSProvidedByAC;
-            } else if(ps_state && CFEqual(ps_state, CFSTR(kIOPSBatteryPowerValue)))
-            {
-                // no batteries, yes UPS, UPS is running drawing its Battery power -> UPS Power
-                return kIOPSProvidedByExternalBattery;
-            }
+    PSStruct    *battery = gPSAggregate.activeBattery;
+    PSStruct    *ups = gPSAggregate.activeUPS;
 
-        }
-        // Error in the data we were passed
-        return kIOPSProvidedByAC;
-    } else {
+    if (battery && (kPSLogStateBattery == battery->summary.state)) {
+        // Yes batteries, yes running on battery power -> Battery power
+        return kIOPSProvidedByBattery;
+    }
 
-        ps_state = CFDictionaryGetValue(activeBattery,
-                                        CFSTR(kIOPSPowerSourceStateKey));
-        if(ps_state && CFEqual(ps_state,
-                               CFSTR(kIOPSBatteryPowerValue)))
-        {
-            // Yes batteries, yes running on battery power -> Battery power
-            return kIOPSProvidedByBattery;
-        }
-        else
-        {
-            // batteries are on AC power. let's check if UPS is present.
-            if (!activeUPS)
-            {
-                // yes batteries on AC power, no UPS present -> AC Power
-                return kIOPSProvidedByAC;
-            } else {
-                ps_state = CFDictionaryGetValue(activeUPS,
-                                                CFSTR(kIOPSPowerSourceStateKey));
-                if(ps_state && CFEqual(ps_state, CFSTR(kIOPSBatteryPowerValue)))
-                {
-                    // yes batteries on AC power, UPS is on its battery -> UPS Power
-                    return kIOPSProvidedByExternalBattery;
-                } else if(ps_state && CFEqual(ps_state, CFSTR(kIOPSACPowerValue)))
-                {
-                    // yes batteries on AC Power, UPS is drawing AC Power -> AC Power
-                    return kIOPSProvidedByAC;
-                }
-            }
-        }
+    if (ups && (kPSLogStateBattery == ups->summary.state)) {
+        // Batteries absent or on AC power, UPS is on its battery -> UPS Power
+        return kIOPSProvidedByExternalBattery;
     }
 
-    // Should not reach this point. Return something safe.
+    // No batteries and no UPS, or everything is drawing AC -> AC Power
     return kIOPSProvidedByAC;
 }
 
@@ -1669,7 +2004,6 @@ kern_return_t _io_ps_new_pspowersource(
     int                         *psid,              // out
     int                         *result)
 {
-    static unsigned int         gPSID = 5000;
     int                         callerPID;
     PSStruct                    *ps;
 
@@ -1678,7 +2012,7 @@ kern_return_t _io_ps_new_pspowersource(
 
     *result = kIOReturnError;
 
-    ps = iops_newps(callerPID, gPSID);
+    ps = iops_newps(callerPID, 0);
     if (!ps)
     {
         *result = kIOReturnNoSpace;
@@ -1704,10 +2038,15 @@ kern_return_t _io_ps_new_pspowersource(
         }
         if (ps->description) {
             CFRelease(ps->description);
+            ps->description = NULL;
         }
-        if (ps->log) {
-            CFRelease(ps->log);
+        unmapLogBuffer(ps->log);
+        if (ps->shared) {
+            notify_cancel(ps->sharedNotifyToken);
+            vm_deallocate(mach_task_self(), (vm_address_t)ps->shared,
+                          round_page(sizeof(PSSharedRecord)));
         }
+        powerSourceRemoved(ps);
         bzero(ps, sizeof(PSStruct));
 
         dispatch_async(dispatch_get_main_queue(), ^()
@@ -1721,7 +2060,7 @@ kern_return_t _io_ps_new_pspowersource(
     dispatch_resume(ps->procdeathsrc);
 
 
-    *psid = gPSID++;
+    *psid = (int)ps->psid;
     *result = kIOReturnSuccess;
 
 exit:
@@ -1758,10 +2097,7 @@ kern_return_t _io_ps_update_pspowersource(
         if (!next) {
             *return_code = kIOReturnNotFound;
         } else {
-            if (next->description) {
-                CFRelease(next->description);
-            }
-            next->description = details;
+            setPowerSourceDescription(next, details);
             updateLogBuffer(next, false);
             *return_code = kIOReturnSuccess;
             dispatch_async(dispatch_get_main_queue(), ^()
@@ -1796,13 +2132,157 @@ kern_return_t _io_ps_release_pspowersource(
     return 0;
 }
 
-kern_return_t _io_ps_copy_powersources_info(
-    mach_port_t            server __unused,
-    vm_offset_t             *ps_ptr,
-    mach_msg_type_number_t  *ps_len,
-    int                     *return_code)
+static void setDictionaryInt(CFMutableDictionaryRef d, CFStringRef key, int32_t val)
+{
+    CFNumberRef n = CFNumberCreate(0, kCFNumberSInt32Type, &val);
+    if (n) {
+        CFDictionarySetValue(d, key, n);
+        CFRelease(n);
+    }
+}
+
+/*
+ * readSharedPowerSource
+ *
+ * Runs when ps's client posts its notification. Takes a consistent copy
+ * of the shared record and merges it into ps's description.
+ */
+static void readSharedPowerSource(PSStruct *ps)
+{
+    PSSharedRecord          rec;
+    CFMutableDictionaryRef  d;
+    CFStringRef             state = NULL;
+    uint32_t                seq;
+    int                     tries;
+
+    if (!ps->shared || !ps->description)
+        return;
+
+    for (tries = 0; tries < 3; tries++) {
+        seq = ps->shared->seq;
+        if (seq & 1)
+            continue;
+        OSMemoryBarrier();
+        memcpy(&rec, (const void *)ps->shared, sizeof(PSSharedRecord));
+        OSMemoryBarrier();
+        if (seq == ps->shared->seq)
+            break;
+    }
+
+    // Torn or unchanged; a writer still in progress posts again when done
+    if ((tries == 3) || (seq == ps->sharedSeq) || (kPSSharedRecordVersion != rec.version))
+        return;
+    ps->sharedSeq = seq;
+
+    d = CFDictionaryCreateMutableCopy(0, 0, ps->description);
+    if (!d)
+        return;
+
+    setDictionaryInt(d, CFSTR(kIOPSCurrentCapacityKey), rec.currentCapacity);
+    setDictionaryInt(d, CFSTR(kIOPSMaxCapacityKey), rec.maxCapacity);
+    setDictionaryInt(d, CFSTR(kIOPSTimeToEmptyKey), rec.timeToEmpty);
+    setDictionaryInt(d, CFSTR(kIOPSTimeToFullChargeKey), rec.timeToFull);
+    setDictionaryInt(d, CFSTR(kIOPSCurrentKey), rec.current);
+
+    CFDictionarySetValue(d, CFSTR(kIOPSIsChargingKey),
+                         (rec.flags & kPSSharedIsCharging) ? kCFBooleanTrue : kCFBooleanFalse);
+    CFDictionarySetValue(d, CFSTR(kIOPSIsChargedKey),
+                         (rec.flags & kPSSharedIsCharged) ? kCFBooleanTrue : kCFBooleanFalse);
+    CFDictionarySetValue(d, CFSTR(kIOPSIsFinishingChargeKey),
+                         (rec.flags & kPSSharedIsFinishingCharge) ? kCFBooleanTrue : kCFBooleanFalse);
+    CFDictionarySetValue(d, CFSTR(kIOPSIsPresentKey),
+                         (rec.flags & kPSSharedIsPresent) ? kCFBooleanTrue : kCFBooleanFalse);
+
+    switch (rec.state) {
+        case kPSLogStateAC:         state = CFSTR(kIOPSACPowerValue); break;
+        case kPSLogStateBattery:    state = CFSTR(kIOPSBatteryPowerValue); break;
+        case kPSLogStateOff:        state = CFSTR(kIOPSOffLineValue); break;
+    }
+    if (state) CFDictionarySetValue(d, CFSTR(kIOPSPowerSourceStateKey), state);
+
+    setPowerSourceDescription(ps, d);
+    updateLogBuffer(ps, false);
+    HandlePublishAllPowerSources();
+}
+
+__private_extern__ void BatteryTimeRemaining_HandleSharedMemoryRequest(
+                                xpc_connection_t    peer,
+                                xpc_object_t        request,
+                                audit_token_t       token)
+{
+    xpc_object_t        reply = NULL;
+    xpc_object_t        shmem = NULL;
+    PSStruct            *ps = NULL;
+    vm_address_t        addr = 0;
+    vm_size_t           len = round_page(sizeof(PSSharedRecord));
+    char                name[128];
+    int                 callerPID;
+    IOReturn            ret = kIOReturnNotFound;
+
+    if ( !(reply = xpc_dictionary_create_reply(request)) )
+        return;
+
+    audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL,
+                        &callerPID, NULL, NULL);
+
+    ps = iopsFromPSID(callerPID, (int)xpc_dictionary_get_int64(request, kPSSharedMemoryRequestKey));
+    if (!ps) {
+        goto exit;
+    }
+
+    snprintf(name, sizeof(name), "%s%ld", kPSSharedNotifyPrefix, ps->psid);
+
+    if (!ps->shared)
+    {
+        ret = kIOReturnNoMemory;
+        if (KERN_SUCCESS != vm_allocate(mach_task_self(), &addr, len, VM_FLAGS_ANYWHERE)) {
+            goto exit;
+        }
+        ps->shared = (PSSharedRecord *)addr;
+        ps->shared->version = kPSSharedRecordVersion;
+
+        if (NOTIFY_STATUS_OK != notify_register_dispatch(name, &ps->sharedNotifyToken,
+                                    dispatch_get_main_queue(), ^(int t __unused) {
+                                        readSharedPowerSource(ps);
+                                    }))
+        {
+            vm_deallocate(mach_task_self(), addr, len);
+            ps->shared = NULL;
+            goto exit;
+        }
+    }
+
+    ret = kIOReturnNoMemory;
+    shmem = xpc_shmem_create((void *)ps->shared, len);
+    if (!shmem) {
+        goto exit;
+    }
+
+    xpc_dictionary_set_value(reply, kPSSharedMemoryKey, shmem);
+    xpc_dictionary_set_string(reply, kPSSharedMemoryNotifyKey, name);
+    ret = kIOReturnSuccess;
+
+exit:
+    xpc_dictionary_set_int64(reply, kPSSharedMemoryReturnKey, ret);
+    xpc_connection_send_message(peer, reply);
+
+    if (shmem)
+        xpc_release(shmem);
+    xpc_release(reply);
+}
+
+/*
+ * Returns the binary plist of every published description, rebuilding it
+ * only if the power source generation moved since the last request.
+ * Main queue only.
+ */
+static CFDataRef copySerializedPowerSources(void)
 {
     CFMutableArrayRef   return_value = NULL;
+    CFDataRef           data = NULL;
+
+    if (gPSSerialized)
+        return PMReplySnapshotCopy(&gPSSerialized);
 
     for (int i=0; i<kPSMaxCount; i++) {
         if (gPSList[i].description) {
@@ -1814,95 +2294,424 @@ kern_return_t _io_ps_copy_powersources_info(
         }
     }
 
-    if (!return_value) {
-        *ps_ptr = 0;
-        *ps_len = 0;
-    } else {
-        CFDataRef   d = CFPropertyListCreateData(0, return_value,
-                                                 kCFPropertyListBinaryFormat_v1_0,
-                                                 0, NULL);
+    if (return_value) {
+        data = CFPropertyListCreateData(0, return_value,
+                                        kCFPropertyListBinaryFormat_v1_0,
+                                        0, NULL);
         CFRelease(return_value);
+    }
+    PMReplySnapshotSet(&gPSSerialized, data);
+
+    return data;
+}
+
+kern_return_t _io_ps_copy_powersources_info(
+    mach_port_t            server __unused,
+    vm_offset_t             *ps_ptr,
+    mach_msg_type_number_t  *ps_len,
+    int                     *return_code)
+{
+    __block CFDataRef   serialized = NULL;
 
-        if (d) {
-            *ps_len = CFDataGetLength(d);
+    *ps_ptr = 0;
+    *ps_len = 0;
 
-            vm_allocate(mach_task_self(), (vm_address_t *)ps_ptr, *ps_len, TRUE);
+    // Served off the main queue from the snapshot alone. The main queue
+    // clears it whenever the generation moves, so any snapshot found here
+    // is current; without one, rebuild it there.
+    serialized = PMReplySnapshotCopy(&gPSSerialized);
+    if (!serialized) {
+        PMRunOnMainQueue(^{ serialized = copySerializedPowerSources(); });
+    }
 
-            memcpy((void *)*ps_ptr, CFDataGetBytePtr(d), *ps_len);
+    if (serialized) {
+        *ps_len = (mach_msg_type_number_t)CFDataGetLength(serialized);
 
-            CFRelease(d);
-        }
+        vm_allocate(mach_task_self(), (vm_address_t *)ps_ptr, *ps_len, TRUE);
+
+        memcpy((void *)*ps_ptr, CFDataGetBytePtr(serialized), *ps_len);
+        CFRelease(serialized);
     }
     *return_code = kIOReturnSuccess;
 
     return 0;
 }
 
-
-CFArrayRef copyPowerSourceLog(PSStruct *ps, CFAbsoluteTime ts)
+/*
+ * setPowerSourceDescription
+ *
+ * Takes ownership of 'description'. The power source generation only moves
+ * if the description differs from the one already recorded for 'ps'.
+ */
+static void setPowerSourceDescription(PSStruct *ps, CFDictionaryRef description)
 {
-    CFIndex         i, arrCnt;
-    CFDateRef       entry_ts = NULL;
-    CFDateRef       input_ts = NULL;
+    const struct {
+        CFStringRef     key;
+        uint32_t        bit;
+    } tracked[] = {
+        { CFSTR(kIOPSCurrentCapacityKey),   kPSChangedCurrentCapacity },
+        { CFSTR(kIOPSMaxCapacityKey),       kPSChangedMaxCapacity },
+        { CFSTR(kIOPSTimeToEmptyKey),       kPSChangedTimeToEmpty },
+        { CFSTR(kIOPSTimeToFullChargeKey),  kPSChangedTimeToFull },
+        { CFSTR(kIOPSIsChargingKey),        kPSChangedIsCharging },
+        { CFSTR(kIOPSPowerSourceStateKey),  kPSChangedPowerSourceState },
+        { CFSTR(kIOPSIsPresentKey),         kPSChangedIsPresent },
+        { CFSTR(kIOPSBatteryHealthKey),     kPSChangedHealth }
+    };
+    uint32_t        mask = 0;
+    CFTypeRef       oldValue, newValue;
+    size_t          i;
+
+    if (ps->description && description)
+    {
+        for (i = 0; i < sizeof(tracked)/sizeof(tracked[0]); i++)
+        {
+            oldValue = CFDictionaryGetValue(ps->description, tracked[i].key);
+            newValue = CFDictionaryGetValue(description, tracked[i].key);
 
-    CFDictionaryRef         entry = NULL;
-    CFMutableArrayRef       updates = NULL;
+            if ((oldValue != newValue)
+                && (!oldValue || !newValue || !CFEqual(oldValue, newValue)))
+            {
+                mask |= tracked[i].bit;
+            }
+        }
 
+        if (!mask && !CFEqual(ps->description, description)) {
+            mask = kPSChangedOther;
+        }
 
-    arrCnt = CFArrayGetCount(ps->log);
+        if (!mask) {
+            // Nothing changed; keep the description clients already have
+            CFRelease(description);
+            return;
+        }
+    }
+    else if (ps->description || description) {
+        mask = ~0U;
+    }
+    else {
+        return;
+    }
 
-    if (arrCnt == 0)
-        goto exit;
+    if (ps->description) {
+        CFRelease(ps->description);
+    }
+    ps->description = description;
+    ps->changedMask = mask;
+    ps->generation = ++gPSGeneration;
+    PMReplySnapshotSet(&gPSSerialized, NULL);
 
-    updates = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
-    if (updates == NULL) {
-        goto exit;
+    aggregatePowerSource(ps);
+}
+
+// Called once ps->description has been released
+static void powerSourceRemoved(PSStruct *ps)
+{
+    aggregatePowerSource(ps);
+    gPSRemovedGeneration = ++gPSGeneration;
+    PMReplySnapshotSet(&gPSSerialized, NULL);
+}
+
+static void summarizePowerSource(CFDictionaryRef d, PSSummary *out)
+{
+    CFTypeRef       v;
+
+    bzero(out, sizeof(PSSummary));
+    out->timeToEmpty = -1;
+
+    if (!isA_CFDictionary(d))
+        return;
+
+    v = CFDictionaryGetValue(d, CFSTR(kIOPSTransportTypeKey));
+    if (!isA_CFString(v)) {
+        out->kind = kPSKindOther;
+    } else if (CFEqual(v, CFSTR(kIOPSInternalType))) {
+        out->kind = kPSKindInternal;
+    } else if (CFEqual(v, CFSTR(kIOPSSerialTransportType))
+               || CFEqual(v, CFSTR(kIOPSUSBTransportType))
+               || CFEqual(v, CFSTR(kIOPSNetworkTransportType))) {
+        out->kind = kPSKindUPS;
+    } else {
+        out->kind = kPSKindOther;
     }
 
-    input_ts = CFDateCreate(NULL, ts);
-    if (input_ts == NULL) {
-        goto exit;
+    v = CFDictionaryGetValue(d, CFSTR(kIOPSPowerSourceStateKey));
+    if (isA_CFString(v)) {
+        if (CFEqual(v, CFSTR(kIOPSACPowerValue)))
+            out->state = kPSLogStateAC;
+        else if (CFEqual(v, CFSTR(kIOPSBatteryPowerValue)))
+            out->state = kPSLogStateBattery;
+        else if (CFEqual(v, CFSTR(kIOPSOffLineValue)))
+            out->state = kPSLogStateOff;
     }
 
-    if (arrCnt < kBattLogMaxEntries)
-        ps->logIdx = 0;
+    out->isCharging = (kCFBooleanTrue == CFDictionaryGetValue(d, CFSTR(kIOPSIsChargingKey)));
+
+    v = CFDictionaryGetValue(d, CFSTR(kIOPSCurrentCapacityKey));
+    if (isA_CFNumber(v)) CFNumberGetValue(v, kCFNumberIntType, &out->currentCap);
+
+    v = CFDictionaryGetValue(d, CFSTR(kIOPSMaxCapacityKey));
+    if (isA_CFNumber(v)) CFNumberGetValue(v, kCFNumberIntType, &out->maxCap);
+
+    v = CFDictionaryGetValue(d, CFSTR(kIOPSTimeToEmptyKey));
+    if (isA_CFNumber(v)) CFNumberGetValue(v, kCFNumberIntType, &out->timeToEmpty);
+}
+
+static void accumulateSummary(const PSSummary *sum, int sign)
+{
+    if (kPSKindNone == sum->kind)
+        return;
+
+    gPSAggregate.count[sum->kind] += sign;
+    gPSAggregate.currentCap[sum->kind] += sign * sum->currentCap;
+    gPSAggregate.maxCap[sum->kind] += sign * sum->maxCap;
+    if (kPSLogStateBattery == sum->state)
+        gPSAggregate.onBattery[sum->kind] += sign;
+    if (sum->isCharging)
+        gPSAggregate.charging[sum->kind] += sign;
+}
+
+/*
+ * selectActivePowerSources
+ *
+ * The active battery is the first internal battery. The active UPS is the
+ * one on battery power with the least time remaining, since it is the one
+ * that will run out first; if none is on battery, the first UPS.
+ */
+static void selectActivePowerSources(void)
+{
+    PSStruct    *ps, *ups = NULL, *battery = NULL;
 
-    i = ps->logIdx; 
-    do { 
-        entry = NULL;
-        if (i < arrCnt)
-            entry = CFArrayGetValueAtIndex(ps->log, i);
-        if (!isA_CFDictionary(entry)) {
-            i = (i+1) % kBattLogMaxEntries;
-            if (i >= arrCnt) i = 0;
+    for (int i=0; i<kPSMaxCount; i++)
+    {
+        ps = &gPSList[i];
+        if (!ps->description)
             continue;
+
+        if (kPSKindInternal == ps->summary.kind) {
+            if (!battery)
+                battery = ps;
+        }
+        else if (kPSKindUPS == ps->summary.kind) {
+            if (!ups) {
+                ups = ps;
+            }
+            else if (kPSLogStateBattery == ps->summary.state) {
+                if ((kPSLogStateBattery != ups->summary.state)
+                    || ((ps->summary.timeToEmpty >= 0)
+                        && ((ups->summary.timeToEmpty < 0)
+                            || (ps->summary.timeToEmpty < ups->summary.timeToEmpty))))
+                {
+                    ups = ps;
+                }
+            }
         }
+    }
 
-        if (!entry_ts) {
-            entry_ts = CFDictionaryGetValue(entry, CFSTR(kIOPSBattLogEntryTime));
+    gPSAggregate.activeBattery = battery;
+    gPSAggregate.activeUPS = ups;
+}
 
-            if ((entry_ts == NULL) || (CFDateCompare(entry_ts, input_ts, NULL) == kCFCompareLessThan)) {
-                i = (i+1) % kBattLogMaxEntries;
-                if (i >= arrCnt) i = 0;
-                entry_ts = NULL;
-                continue;
-            }
+/*
+ * aggregatePowerSource
+ *
+ * Called whenever ps->description changes, including to NULL.
+ */
+static void aggregatePowerSource(PSStruct *ps)
+{
+    PSSummary   old = ps->summary;
+
+    accumulateSummary(&old, -1);
+    summarizePowerSource(ps->description, &ps->summary);
+    accumulateSummary(&ps->summary, 1);
+
+    // Only UPS and internal battery changes can move the active sources
+    if ((kPSKindUPS == old.kind) || (kPSKindUPS == ps->summary.kind)
+        || (old.kind != ps->summary.kind))
+    {
+        selectActivePowerSources();
+    }
+}
+
+__private_extern__ uint64_t getPowerSourcesGeneration(void)
+{
+    return gPSGeneration;
+}
+
+__private_extern__ void BatteryTimeRemaining_HandleCopyChanged(
+                                xpc_connection_t    peer,
+                                xpc_object_t        request)
+{
+    xpc_object_t    reply = NULL;
+    xpc_object_t    sources = NULL;
+    uint64_t        since;
+    bool            full;
+
+    if ( !(reply = xpc_dictionary_create_reply(request)) )
+        return;
+
+    if ( !(sources = xpc_array_create(NULL, 0)) )
+        goto exit;
+
+    since = xpc_dictionary_get_uint64(request, kPSCopyChangedSinceKey);
+
+    // If a power source went away, the caller can't tell which one from a delta
+    full = (0 == since) || (since > gPSGeneration) || (since < gPSRemovedGeneration);
+
+    for (int i=0; i<kPSMaxCount; i++)
+    {
+        xpc_object_t    entry;
+        CFDataRef       d;
+
+        if (!gPSList[i].description
+            || (!full && (gPSList[i].generation <= since)))
+        {
+            continue;
         }
 
-        CFArrayAppendValue(updates, entry);
-        i = (i+1) % kBattLogMaxEntries;
-        if (i >= arrCnt) i = 0;
+        d = CFPropertyListCreateData(0, gPSList[i].description,
+                                     kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+        if (!d)
+            continue;
 
-    } while (i != ps->logIdx);
+        entry = xpc_dictionary_create(NULL, NULL, 0);
+        if (entry) {
+            xpc_dictionary_set_int64(entry, kPSCopyChangedIDKey, gPSList[i].psid);
+            xpc_dictionary_set_uint64(entry, kPSCopyChangedMaskKey,
+                                      full ? ~0U : gPSList[i].changedMask);
+            xpc_dictionary_set_data(entry, kPSCopyChangedDescriptionKey,
+                                    CFDataGetBytePtr(d), CFDataGetLength(d));
+            xpc_array_append_value(sources, entry);
+            xpc_release(entry);
+        }
+        CFRelease(d);
+    }
+
+    xpc_dictionary_set_uint64(reply, kPSCopyChangedGenerationKey, gPSGeneration);
+    xpc_dictionary_set_bool(reply, kPSCopyChangedFullKey, full);
+    xpc_dictionary_set_value(reply, kPSCopyChangedSourcesKey, sources);
 
-    CFArrayRemoveAllValues(ps->log);
-    ps->logIdx = 0;
+    xpc_connection_send_message(peer, reply);
 
 exit:
+    if (sources)
+        xpc_release(sources);
+    xpc_release(reply);
+}
 
-    if (input_ts)
-        CFRelease(input_ts);
 
+static CFDictionaryRef copyLogRecordDictionary(const PSLogRecord *rec)
+{
+    CFMutableDictionaryRef  entry = NULL;
+    CFTypeRef               n;
+    CFStringRef             state = NULL;
+    double                  tz = rec->tzOffset;
+
+    entry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                      &kCFTypeDictionaryValueCallBacks);
+    if (!entry) return NULL;
+
+    n = CFDateCreate(0, rec->time);
+    if (n) {
+        CFDictionarySetValue(entry, CFSTR(kIOPSBattLogEntryTime), n);
+        CFRelease(n);
+    }
+
+    n = CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &tz);
+    if (n) {
+        CFDictionarySetValue(entry, CFSTR(kIOPSBattLogEntryTZ), n);
+        CFRelease(n);
+    }
+
+    if (rec->flags & kPSLogHasCurrentCap) {
+        n = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &rec->currentCap);
+        if (n) {
+            CFDictionarySetValue(entry, CFSTR(kIOPSCurrentCapacityKey), n);
+            CFRelease(n);
+        }
+    }
+
+    if (rec->flags & kPSLogHasMaxCap) {
+        n = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &rec->maxCap);
+        if (n) {
+            CFDictionarySetValue(entry, CFSTR(kIOPSMaxCapacityKey), n);
+            CFRelease(n);
+        }
+    }
+
+    switch (rec->state) {
+        case kPSLogStateAC:         state = CFSTR(kIOPSACPowerValue); break;
+        case kPSLogStateBattery:    state = CFSTR(kIOPSBatteryPowerValue); break;
+        case kPSLogStateOff:        state = CFSTR(kIOPSOffLineValue); break;
+    }
+    if (state) CFDictionarySetValue(entry, CFSTR(kIOPSPowerSourceStateKey), state);
+
+    if (rec->flags & kPSLogHasIsCharging) {
+        CFDictionarySetValue(entry, CFSTR(kIOPSIsChargingKey),
+                             (rec->flags & kPSLogIsCharging) ? kCFBooleanTrue : kCFBooleanFalse);
+    }
+
+    if (rec->flags & kPSLogHasCurrent) {
+        n = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &rec->current);
+        if (n) {
+            CFDictionarySetValue(entry, CFSTR(kIOPSCurrentKey), n);
+            CFRelease(n);
+        }
+    }
+
+    CFDictionarySetValue(entry, CFSTR(kIOPSIsChargedKey),
+                         (rec->flags & kPSLogIsCharged) ? kCFBooleanTrue : kCFBooleanFalse);
+
+    return entry;
+}
+
+#define LOG_RECORD(ring, i) \
+    (&(ring)->records[((ring)->next + kBattLogMaxEntries - (ring)->count + (i)) % kBattLogMaxEntries])
+
+/*
+ * copyPowerSourceLog
+ *
+ * Returns the entries logged at or after 'ts', oldest first, and empties
+ * the log. Records are appended in time order, so the first one to return
+ * is found with a binary search.
+ */
+CFArrayRef copyPowerSourceLog(PSStruct *ps, CFAbsoluteTime ts)
+{
+    PSLogRing               *ring = ps->log;
+    CFMutableArrayRef       updates = NULL;
+    CFDictionaryRef         entry;
+    uint32_t                lo, hi, mid;
+
+    if (!ring || (ring->count == 0))
+        goto exit;
+
+    updates = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    if (updates == NULL) {
+        goto exit;
+    }
+
+    lo = 0;
+    hi = ring->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (LOG_RECORD(ring, mid)->time < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < ring->count; lo++) {
+        entry = copyLogRecordDictionary(LOG_RECORD(ring, lo));
+        if (entry) {
+            CFArrayAppendValue(updates, entry);
+            CFRelease(entry);
+        }
+    }
+
+    ring->count = 0;
+    ring->next = 0;
+
+exit:
     return updates;
 }
 
@@ -1915,8 +2724,6 @@ kern_return_t _io_ps_copy_chargelog(
     int                     *rc)
 {
     CFDataRef               serializedLog = NULL;
-    CFArrayRef              psLog = NULL;
-    CFStringRef             name = NULL;
     CFMutableDictionaryRef  logDict = NULL;
     CFErrorRef              err = NULL;
 
@@ -1934,25 +2741,32 @@ kern_return_t _io_ps_copy_chargelog(
     if (!logDict)
         goto exit;
 
-    for (int i=0; i<kPSMaxCount; i++)
-    {
-        if (!gPSList[i].log) {
-            continue;
-        }
+    // Served off the main queue; the logs are drained on the main queue and
+    // serialized here.
+    PMRunOnMainQueue(^{
+        CFArrayRef      psLog = NULL;
+        CFStringRef     name = NULL;
 
-        name = CFDictionaryGetValue(gPSList[i].description, CFSTR(kIOPSNameKey));
-        if (!isA_CFString(name)) {
-            continue;
-        }
+        for (int i=0; i<kPSMaxCount; i++)
+        {
+            if (!gPSList[i].log) {
+                continue;
+            }
 
-        psLog = copyPowerSourceLog(&gPSList[i], ts);
-        if (!psLog)
-            continue;
+            name = CFDictionaryGetValue(gPSList[i].description, CFSTR(kIOPSNameKey));
+            if (!isA_CFString(name)) {
+                continue;
+            }
 
-        CFDictionarySetValue(logDict, name, psLog);
-        CFRelease(psLog);
+            psLog = copyPowerSourceLog(&gPSList[i], ts);
+            if (!psLog)
+                continue;
 
-    }
+            CFDictionarySetValue(logDict, name, psLog);
+            CFRelease(psLog);
+
+        }
+    });
 
     serializedLog = CFPropertyListCreateData(0, logDict,
                                              kCFPropertyListBinaryFormat_v1_0, 0, &err);            
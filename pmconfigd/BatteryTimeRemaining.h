@@ -40,6 +40,8 @@ __private_extern__ void BatteryTimeRemainingSleepWakeNotification(natural_t mess
 
 __private_extern__ void BatteryTimeRemainingRTCDidResync(void);
 
+__private_extern__ void BatteryTimeRemainingBatteryMatched(void);
+
 /*!
  * Pass kInternalBattery to kernelPowerSourcesDidChange when you need 
  * PM to re-evaluate the single internal battery (modeled as an IOPMPowerSource)
@@ -54,6 +56,109 @@ __private_extern__ void BatterySetNoPoll(bool noPoll);
 
 __private_extern__ bool isFullyCharged(IOPMBattery *b);
 
+/* Power source generations
+ *
+ * Every change to a published power source description bumps the power
+ * source generation, and records which of the tracked keys changed.
+ * Removing a power source also bumps it.
+ */
+enum {
+    kPSChangedCurrentCapacity   = (1 << 0),
+    kPSChangedMaxCapacity       = (1 << 1),
+    kPSChangedTimeToEmpty       = (1 << 2),
+    kPSChangedTimeToFull        = (1 << 3),
+    kPSChangedIsCharging        = (1 << 4),
+    kPSChangedPowerSourceState  = (1 << 5),
+    kPSChangedIsPresent         = (1 << 6),
+    kPSChangedHealth            = (1 << 7),
+    kPSChangedOther             = (1 << 31)
+};
+
+__private_extern__ uint64_t getPowerSourcesGeneration(void);
+
+/* Time remaining estimators
+ * kTREstimatorSlew follows the battery's own estimate; kTREstimatorKalman
+ * filters its current readings. The horizon, in seconds, sets how fast the
+ * Kalman estimate follows a change in load.
+ */
+enum {
+    kTREstimatorSlew    = 0,
+    kTREstimatorKalman  = 1
+};
+
+__private_extern__ int getTimeRemainingEstimator(void);
+__private_extern__ IOReturn setTimeRemainingEstimator(int estimator);
+__private_extern__ int getTimeRemainingHorizon(void);
+__private_extern__ IOReturn setTimeRemainingHorizon(int seconds);
+
+/* Power sources delta request, sent on the powerd XPC service.
+ *
+ * The request carries the generation the caller last saw under
+ * kPSCopyChangedSinceKey. The reply carries the current generation, and an
+ * array with one entry for each power source whose description changed
+ * since then: its psid, the mask of changed keys, and its description as a
+ * binary plist. kPSCopyChangedFullKey is set when a power source went away
+ * since then; the array then holds every power source and the caller should
+ * drop the ones that aren't in it.
+ */
+#define kPSCopyChangedSinceKey                  "powerSourcesChangedSince"
+#define kPSCopyChangedGenerationKey             "generation"
+#define kPSCopyChangedFullKey                   "full"
+#define kPSCopyChangedSourcesKey                "powerSources"
+#define kPSCopyChangedIDKey                     "psid"
+#define kPSCopyChangedMaskKey                   "changed"
+#define kPSCopyChangedDescriptionKey            "description"
+
+__private_extern__ void BatteryTimeRemaining_HandleCopyChanged(
+                                xpc_connection_t    peer,
+                                xpc_object_t        request);
+
+/* Shared memory power source updates, requested on the powerd XPC service.
+ *
+ * A process that created a power source with IOPSCreatePowerSource() and
+ * published its details once with IOPSSetPowerSourceDetails() may ask for
+ * a shared memory channel for it, by sending its psid under
+ * kPSSharedMemoryRequestKey. The reply carries a page of shared memory
+ * holding a PSSharedRecord, and the notify(3) name to post after each
+ * update. powerd merges the record's fields into the power source's last
+ * published details; other keys keep the values from the last
+ * IOPSSetPowerSourceDetails().
+ *
+ * To update, the client increments seq to an odd value, writes the
+ * fields, increments seq again, then posts the notification.
+ */
+#define kPSSharedMemoryRequestKey               "powerSourceSharedMemory"
+#define kPSSharedMemoryKey                      "shmem"
+#define kPSSharedMemoryNotifyKey                "notifyName"
+#define kPSSharedMemoryReturnKey                "return"
+
+#define kPSSharedNotifyPrefix                   "com.apple.system.powersources.shm."
+#define kPSSharedRecordVersion                  1
+
+enum {
+    kPSSharedIsCharging         = (1 << 0),
+    kPSSharedIsCharged          = (1 << 1),
+    kPSSharedIsFinishingCharge  = (1 << 2),
+    kPSSharedIsPresent          = (1 << 3)
+};
+
+typedef struct {
+    uint32_t            version;
+    volatile uint32_t   seq;
+    uint32_t            flags;          // kPSShared*
+    uint32_t            state;          // 1: AC, 2: Battery, 3: Off Line
+    int32_t             currentCapacity;
+    int32_t             maxCapacity;
+    int32_t             timeToEmpty;    // Minutes, -1 if unknown
+    int32_t             timeToFull;     // Minutes, -1 if unknown
+    int32_t             current;        // mA
+} PSSharedRecord;
+
+__private_extern__ void BatteryTimeRemaining_HandleSharedMemoryRequest(
+                                xpc_connection_t    peer,
+                                xpc_object_t        request,
+                                audit_token_t       token);
+
 
 /* getActivePSType
  * returns one of AC, Internal Battery, or External Battery
@@ -62,6 +167,18 @@ __private_extern__ int getActivePSType(void);
 __private_extern__ CFDictionaryRef getActiveBatteryDictionary(void);
 __private_extern__ CFDictionaryRef getActiveUPSDictionary(void);
 
+/* getUPSDictionaries
+ * Fills upsList with the description of every UPS, up to maxCount of
+ * them, and returns how many it filled in. Not retained.
+ */
+__private_extern__ int getUPSDictionaries(CFDictionaryRef *upsList, int maxCount);
+
+/* copyPowerSourceDescriptions
+ * Returns the description of every published power source, or NULL if
+ * there are none. Caller releases.
+ */
+__private_extern__ CFArrayRef copyPowerSourceDescriptions(void);
+
 
 #ifndef kIOPSFailureKey
 #define kIOPSFailureKey                         "Failure"
@@ -34,22 +34,45 @@
 
 #define _kExternalMediaAssertionName 	"com.apple.powermanagement.externalmediamounted"
 
+/* DA callbacks arrive in bursts when an enclosure with many volumes
+ * attaches; the assertion is re-evaluated once the burst settles.
+ */
+#define kExternalMediaAdjustDelayMS     100
+
 /*****************************************************************************/
 
 
-static bool weLikeTheDisk(DADiskRef disk);
+static bool weLikeTheDisk(CFDictionaryRef description);
+static CFTypeRef copyDiskKey(DADiskRef disk, CFDictionaryRef *outDescription);
+static void scheduleExternalDiskAssertion(void);
 static void adjustExternalDiskAssertion(void);
 static void _DiskDisappeared(DADiskRef disk, void *context);
 static void _DiskAppeared(DADiskRef disk, void * context);
 
 /*****************************************************************************/
 
-static CFMutableSetRef      gExternalMediaSet = NULL;
-static IOPMAssertionID      gDiskAssertionID = kIOPMNullAssertionID;
-static DASessionRef         gDASession = NULL;
+static CFMutableSetRef          gExternalMediaSet = NULL;       // keys of attached media we assert for
+static bool                     gAdjustPending = false;
+static IOPMAssertionID          gDiskAssertionID = kIOPMNullAssertionID;
+static DASessionRef             gDASession = NULL;
 
 /*****************************************************************************/
 
+static void registerMatch(const void *key, const void *value)
+{
+    CFMutableDictionaryRef  match = NULL;
+
+    match = CFDictionaryCreateMutableCopy(0, 0, kDADiskDescriptionMatchVolumeMountable);
+    if (!match)
+        return;
+
+    CFDictionarySetValue(match, key, value);
+
+    DARegisterDiskAppearedCallback(gDASession, match, _DiskAppeared, NULL);
+    DARegisterDiskDisappearedCallback(gDASession, match, _DiskDisappeared, NULL);
+
+    CFRelease(match);
+}
 
 __private_extern__ void ExternalMedia_prime(void)
 {    
@@ -60,9 +83,14 @@ __private_extern__ void ExternalMedia_prime(void)
     
     gDASession = DASessionCreate(0);
     
-    DARegisterDiskAppearedCallback(gDASession, kDADiskDescriptionMatchVolumeMountable, _DiskAppeared, NULL);
-    
-    DARegisterDiskDisappearedCallback(gDASession, kDADiskDescriptionMatchVolumeMountable, _DiskDisappeared, NULL);
+    /*
+     * One registration per disk class weLikeTheDisk() accepts, so internal
+     * volumes, optical media and disk images are filtered by DA and never
+     * reach powerd. A disk matching more than one is deduplicated by key.
+     */
+    registerMatch(kDADiskDescriptionDeviceInternalKey, kCFBooleanFalse);
+    registerMatch(kDADiskDescriptionDeviceProtocolKey, CFSTR(kIOPropertyPhysicalInterconnectTypeUSB));
+    registerMatch(kDADiskDescriptionDeviceProtocolKey, CFSTR(kIOPropertyPhysicalInterconnectTypeSecureDigital));
     
     DASessionScheduleWithRunLoop(gDASession, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
     
@@ -72,32 +100,72 @@ __private_extern__ void ExternalMedia_prime(void)
 
 static void _DiskDisappeared(DADiskRef disk, void *context)
 {
-    if (weLikeTheDisk(disk))
+    CFTypeRef   key = copyDiskKey(disk, NULL);
+
+    if (key && CFSetContainsValue(gExternalMediaSet, key))
     {		
-        CFSetRemoveValue(gExternalMediaSet, disk);
+        CFSetRemoveValue(gExternalMediaSet, key);
         
-        adjustExternalDiskAssertion();
+        scheduleExternalDiskAssertion();
     }
+    if (key) CFRelease(key);
 }
 
 /*****************************************************************************/
 
 static void _DiskAppeared(DADiskRef disk, void * context)
 {
-    if (weLikeTheDisk(disk))
+    CFDictionaryRef     description = NULL;
+    CFTypeRef           key = NULL;
+
+    key = copyDiskKey(disk, &description);
+    if (!key || CFSetContainsValue(gExternalMediaSet, key))
+        goto exit;
+
+    if (weLikeTheDisk(description))
     {		
-        CFSetSetValue(gExternalMediaSet, disk);
+        CFSetSetValue(gExternalMediaSet, key);
         
-        adjustExternalDiskAssertion();
+        scheduleExternalDiskAssertion();
     }
-}
 
+exit:
+    if (description) CFRelease(description);
+    if (key) CFRelease(key);
+}
 
 /*****************************************************************************/
 
-static bool weLikeTheDisk(DADiskRef disk)
+/*
+ * Media are tracked by DA media UUID. Media without one (some card
+ * readers) fall back to the DADisk itself.
+ */
+static CFTypeRef copyDiskKey(DADiskRef disk, CFDictionaryRef *outDescription)
 {
     CFDictionaryRef     description = NULL;
+    CFTypeRef           key = NULL;
+
+    description = DADiskCopyDescription(disk);
+    if (description) {
+        key = CFDictionaryGetValue(description, kDADiskDescriptionMediaUUIDKey);
+    }
+    if (!key) {
+        key = disk;
+    }
+    CFRetain(key);
+
+    if (outDescription) {
+        *outDescription = description;
+    } else if (description) {
+        CFRelease(description);
+    }
+    return key;
+}
+
+/*****************************************************************************/
+
+static bool weLikeTheDisk(CFDictionaryRef description)
+{
     CFStringRef         protocol = NULL;
     bool                ret = false;
 
@@ -114,7 +182,6 @@ static bool weLikeTheDisk(DADiskRef disk)
       Disk Image        : Protocol = Disk Image
     */
     
-    description = DADiskCopyDescription(disk);
     if (description) {
         
         if (CFDictionaryGetValue(description, kDADiskDescriptionDeviceInternalKey) == kCFBooleanFalse) {
@@ -129,14 +196,27 @@ static bool weLikeTheDisk(DADiskRef disk)
                 ret = true;
             }
         }
-
-        CFRelease(description);
     }
     return ret;
 }
 
 /*****************************************************************************/
 
+static void scheduleExternalDiskAssertion(void)
+{
+    if (gAdjustPending)
+        return;
+
+    gAdjustPending = true;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kExternalMediaAdjustDelayMS * NSEC_PER_MSEC),
+                   dispatch_get_main_queue(), ^{
+        gAdjustPending = false;
+        adjustExternalDiskAssertion();
+    });
+}
+
+/*****************************************************************************/
+
 
 static void adjustExternalDiskAssertion()
 {
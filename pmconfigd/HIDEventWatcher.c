@@ -28,22 +28,116 @@
 #include <bsm/libbsm.h>
 #include "HIDEventWatcher.h"
 
-static CFMutableArrayRef   gHIDEventHistory = NULL;
-
 static const CFTimeInterval kFiveMinutesInSeconds   = (double)300.0;
-static const int kMaxFiveMinutesWindowsCount        = 12;
-static const int kMaxPIDRecorded                    = 10;
+
+enum {
+    kMaxFiveMinutesWindowsCount         = 12,
+    kMaxPIDRecorded                     = 10,
+    kHIDPIDHashSize                     = 32    // power of 2, > 2 * kMaxPIDRecorded
+};
 
 #define __NX_NULL_EVENT     0
 
 /*
- * gHIDEventHistory = One big CFArrayRef
+ * HIDEventRecord - HID event history for one process.
+ * windows[] is a ring of five minute buckets; windows[newest] is the
+ * current one, and older buckets precede it.
+ */
+typedef struct {
+    pid_t                               pid;
+    uint32_t                            createdSeq;     // 0 == unused record
+    int                                 newest;
+    int                                 count;
+    char                                name[2*MAXCOMLEN+1];
+    IOPMHIDPostEventActivityWindow      windows[kMaxFiveMinutesWindowsCount];
+} HIDEventRecord;
+
+/*
+ * gHIDEventRecords holds up to kMaxPIDRecorded processes; when full, the
+ * process recorded longest ago makes room for the new one.
+ * gHIDPIDIndex is an open-addressed hash from pid to record index + 1
+ * (0 == empty); it's rebuilt whenever a record is recycled.
+ *
+ * Converted to the IOPMCopyHIDPostEventHistory() CF layout only on request:
+ *   One big CFArrayRef
  *   full of CFDictionaries
  *       pid is at kIOPMHIDAppPIDKey
  *       path is at kIOPMHIDAppPathKey
- *       CFArray of buckets is at kIOPMHIDHistoryArrayKey
+ *       CFArray of buckets is at kIOPMHIDHistoryArrayKey, newest first
  *           Each bucket is a IOPMHIDPostEventActivityWindow
  */
+static HIDEventRecord   gHIDEventRecords[kMaxPIDRecorded];
+static uint8_t          gHIDPIDIndex[kHIDPIDHashSize];
+static uint32_t         gHIDEventRecordSeq = 0;
+
+static inline int hidPIDHash(pid_t pid)
+{
+    return (int)(((uint32_t)pid * 2654435761U) >> 27) & (kHIDPIDHashSize - 1);
+}
+
+static HIDEventRecord *hidRecordForPID(pid_t pid)
+{
+    int     slot = hidPIDHash(pid);
+    int     probes;
+
+    for (probes = 0; probes < kHIDPIDHashSize; probes++)
+    {
+        if (0 == gHIDPIDIndex[slot])
+            return NULL;
+        if (gHIDEventRecords[gHIDPIDIndex[slot] - 1].pid == pid)
+            return &gHIDEventRecords[gHIDPIDIndex[slot] - 1];
+        slot = (slot + 1) & (kHIDPIDHashSize - 1);
+    }
+    return NULL;
+}
+
+static void hidRebuildPIDIndex(void)
+{
+    int     i, slot;
+
+    bzero(gHIDPIDIndex, sizeof(gHIDPIDIndex));
+    for (i = 0; i < kMaxPIDRecorded; i++)
+    {
+        if (0 == gHIDEventRecords[i].createdSeq)
+            continue;
+        slot = hidPIDHash(gHIDEventRecords[i].pid);
+        while (gHIDPIDIndex[slot])
+            slot = (slot + 1) & (kHIDPIDHashSize - 1);
+        gHIDPIDIndex[slot] = i + 1;
+    }
+}
+
+static HIDEventRecord *hidCreateRecordForPID(pid_t pid)
+{
+    HIDEventRecord  *record = &gHIDEventRecords[0];
+    int             i;
+
+    // Take an unused record, or recycle the one created longest ago
+    for (i = 0; i < kMaxPIDRecorded; i++)
+    {
+        if (0 == gHIDEventRecords[i].createdSeq) {
+            record = &gHIDEventRecords[i];
+            break;
+        }
+        if (gHIDEventRecords[i].createdSeq < record->createdSeq)
+            record = &gHIDEventRecords[i];
+    }
+
+    // The records are static; they're charged once they start being used
+    if (0 == gHIDEventRecordSeq) {
+        PMMemoryCharge(kPMMemHIDHistory, sizeof(gHIDEventRecords) + sizeof(gHIDPIDIndex));
+    }
+
+    bzero(record, sizeof(*record));
+    record->pid = pid;
+    record->createdSeq = ++gHIDEventRecordSeq;
+    if (0 == proc_name(pid, record->name, sizeof(record->name))) {
+        record->name[0] = 0;
+    }
+
+    hidRebuildPIDIndex();
+    return record;
+}
 
 __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
     mach_port_t server,
@@ -52,15 +146,9 @@ __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
     int         *allowEvent)
 {
     pid_t                               callerPID;
-    CFNumberRef                         appPID = NULL;
-    int                                 _app_pid_;
-    CFMutableDictionaryRef              foundDictionary = NULL;
-    CFMutableArrayRef                   bucketsArray = NULL;
-    CFDataRef                           dataEvent = NULL;
+    HIDEventRecord                      *record = NULL;
     IOPMHIDPostEventActivityWindow      *ev = NULL;
     CFAbsoluteTime                      timeNow = CFAbsoluteTimeGetCurrent();
-    int                                 arrayCount = 0;
-    int                                 i = 0;
     
 
     if ((__NX_NULL_EVENT == _action) && (isA_NotificationDisplayWake())) {
@@ -70,129 +158,114 @@ __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
         *allowEvent = 1;
     }
 
+    audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
-    // Unwrapping big data structure...
-    if (!gHIDEventHistory) {
-        gHIDEventHistory = CFArrayCreateMutable(0, 1, &kCFTypeArrayCallBacks);
+    if (!(record = hidRecordForPID(callerPID))) {
+        record = hidCreateRecordForPID(callerPID);
     }
-    if (!gHIDEventHistory) {
-        goto exit;
-    }
-    
-    audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
-    if (0 !=(arrayCount = CFArrayGetCount(gHIDEventHistory)))
+    // Check last HID event bucket timestamp - is it more than 5 minutes old?
+    if (record->count) {
+        ev = &record->windows[record->newest];
+    }
+    if (!ev || (timeNow >= (ev->eventWindowStart + kFiveMinutesInSeconds)))
     {
-        // Scan through the array to find an existing dictionary for the given pid
-        for (i=0; i<arrayCount; i++)
-        {
-            CFMutableDictionaryRef dictionaryForApp = NULL;
-            dictionaryForApp = (CFMutableDictionaryRef)CFArrayGetValueAtIndex(gHIDEventHistory, i);
-            if (!dictionaryForApp) {
-                break;
-            }
-            appPID = CFDictionaryGetValue(dictionaryForApp, kIOPMHIDAppPIDKey);
-            if (appPID) {
-                CFNumberGetValue(appPID, kCFNumberIntType, &_app_pid_);
-                if (callerPID == _app_pid_) {
-                    foundDictionary = dictionaryForApp;
-                    break;
-                }
-            }
+        // Start a new window, overwriting the oldest once we've recorded
+        // kMaxFiveMinutesWindowsCount of them for this process.
+        record->newest = (record->newest + 1) % kMaxFiveMinutesWindowsCount;
+        if (record->count < kMaxFiveMinutesWindowsCount) {
+            record->count++;
         }
+        ev = &record->windows[record->newest];
+
+        // We align the starts of our windows with 5 minute intervals
+        ev->eventWindowStart = ((int)timeNow / (int)kFiveMinutesInSeconds) * kFiveMinutesInSeconds;
+        ev->nullEventCount = ev->hidEventCount = 0;
     }
-    
-    // Unwrapping big data structure...
-    if (!foundDictionary) {
-        foundDictionary = CFDictionaryCreateMutable(0, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        CFArrayAppendValue(gHIDEventHistory, foundDictionary);
-        CFRelease(foundDictionary);
-        
-        if (CFArrayGetCount(gHIDEventHistory) > kMaxPIDRecorded) {
-            // Limit number of PID's tracked at one time.
-            CFArrayRemoveValueAtIndex(gHIDEventHistory, 0);
-        }
-        
+
+    // We bump the count for HID activity!
+    if (__NX_NULL_EVENT == _action) {
+        ev->nullEventCount++;
+    } else {
+        ev->hidEventCount++;
+    }
+
+    return KERN_SUCCESS;
+}
+
+static CFArrayRef copyHIDEventHistory(void)
+{
+    CFMutableArrayRef       history = NULL;
+    CFMutableDictionaryRef  appDictionary = NULL;
+    CFMutableArrayRef       bucketsArray = NULL;
+    CFNumberRef             appPID = NULL;
+    CFStringRef             appName = NULL;
+    CFDataRef               dataEvent = NULL;
+    HIDEventRecord          *ordered[kMaxPIDRecorded];
+    HIDEventRecord          *record = NULL;
+    int                     count = 0;
+    int                     i, j;
+
+    // Oldest process first
+    for (i = 0; i < kMaxPIDRecorded; i++)
+    {
+        if (0 == gHIDEventRecords[i].createdSeq)
+            continue;
+        for (j = count; (j > 0) && (ordered[j-1]->createdSeq > gHIDEventRecords[i].createdSeq); j--)
+            ordered[j] = ordered[j-1];
+        ordered[j] = &gHIDEventRecords[i];
+        count++;
+    }
+
+    history = CFArrayCreateMutable(0, count, &kCFTypeArrayCallBacks);
+    if (!history)
+        return NULL;
+
+    for (i = 0; i < count; i++)
+    {
+        record = ordered[i];
+
+        appDictionary = CFDictionaryCreateMutable(0, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!appDictionary)
+            continue;
+
         /* Tag our pid */
-        appPID = CFNumberCreate(0, kCFNumberIntType, &callerPID);
+        appPID = CFNumberCreate(0, kCFNumberIntType, &record->pid);
         if (appPID) {
-            CFDictionarySetValue(foundDictionary, kIOPMHIDAppPIDKey, appPID);
+            CFDictionarySetValue(appDictionary, kIOPMHIDAppPIDKey, appPID);
             CFRelease(appPID);
         }
 
         /* Tag the process name */
-        CFStringRef appName = NULL;
-        char    appBuf[MAXPATHLEN];
-        int     len = proc_name(callerPID, appBuf, MAXPATHLEN);
-        if (0 != len) {
-            appName = CFStringCreateWithCString(0, appBuf, kCFStringEncodingMacRoman);
+        if (record->name[0]) {
+            appName = CFStringCreateWithCString(0, record->name, kCFStringEncodingMacRoman);
             if (appName) {
-                CFDictionarySetValue(foundDictionary, kIOPMHIDAppPathKey, appName);
+                CFDictionarySetValue(appDictionary, kIOPMHIDAppPathKey, appName);
                 CFRelease(appName);
             }
         }
-    }
 
-    if (!foundDictionary)
-        goto exit;
-
-    // Unwrapping big data structure...
-    bucketsArray = (CFMutableArrayRef)CFDictionaryGetValue(foundDictionary, kIOPMHIDHistoryArrayKey);
-    if (!bucketsArray) {
-        bucketsArray = CFArrayCreateMutable(0, 1, &kCFTypeArrayCallBacks);
-        CFDictionarySetValue(foundDictionary, kIOPMHIDHistoryArrayKey, bucketsArray);
-        CFRelease(bucketsArray);
-    }
-    if (!bucketsArray) 
-        goto exit;
-
-    // Check last HID event bucket timestamp - is it more than 5 minutes old?
-    bool foundWindowForEvent = false;
-    if (0 < CFArrayGetCount(bucketsArray)) {
-        dataEvent = (CFDataRef)CFArrayGetValueAtIndex(bucketsArray, 0);
-    }
-    if (dataEvent) {
-        ev = (IOPMHIDPostEventActivityWindow *)CFDataGetBytePtr(dataEvent);
-        if (timeNow < (ev->eventWindowStart + kFiveMinutesInSeconds))
-        {
-            // This HID event gets dropped into this existing 5 minute bucket.
-            // We bump the count for HID activity!
-            if (__NX_NULL_EVENT == _action) {
-                ev->nullEventCount++;
-            } else {
-                ev->hidEventCount++;
+        /* Newest bucket first */
+        bucketsArray = CFArrayCreateMutable(0, record->count, &kCFTypeArrayCallBacks);
+        if (bucketsArray) {
+            for (j = 0; j < record->count; j++) {
+                dataEvent = CFDataCreate(0,
+                        (const UInt8 *)&record->windows[(record->newest - j + kMaxFiveMinutesWindowsCount) % kMaxFiveMinutesWindowsCount],
+                        sizeof(IOPMHIDPostEventActivityWindow));
+                if (dataEvent) {
+                    CFArrayAppendValue(bucketsArray, dataEvent);
+                    CFRelease(dataEvent);
+                }
             }
-            foundWindowForEvent = true;
+            CFDictionarySetValue(appDictionary, kIOPMHIDHistoryArrayKey, bucketsArray);
+            CFRelease(bucketsArray);
         }
-    }
 
-    if (!foundWindowForEvent) {
-        IOPMHIDPostEventActivityWindow  newv;
-
-        // We align the starts of our windows with 5 minute intervals
-        newv.eventWindowStart = ((int)timeNow / (int)kFiveMinutesInSeconds) * kFiveMinutesInSeconds;
-        newv.nullEventCount = newv.hidEventCount = 0;
-        if (__NX_NULL_EVENT == _action) {
-            newv.nullEventCount++;
-        } else {
-            newv.hidEventCount++;
-        }
-    
-        dataEvent = CFDataCreate(0, (const UInt8 *)&newv, sizeof(IOPMHIDPostEventActivityWindow));
-        if (dataEvent) {
-            CFArrayInsertValueAtIndex(bucketsArray, 0, dataEvent);
-            CFRelease(dataEvent);
-        }
-        
-        // If we've recorded more than kMaxFiveMinutesWindowsCount activity windows for this process, delete the old ones.
-        while (kMaxFiveMinutesWindowsCount < CFArrayGetCount(bucketsArray)) {
-            CFArrayRemoveValueAtIndex(bucketsArray, CFArrayGetCount(bucketsArray) - 1);
-        }
-        
+        CFArrayAppendValue(history, appDictionary);
+        CFRelease(appDictionary);
     }
 
-exit:
-    return KERN_SUCCESS;
+    return history;
 }
 
 __private_extern__ kern_return_t _io_pm_hid_event_copy_history(
@@ -201,9 +274,23 @@ __private_extern__ kern_return_t _io_pm_hid_event_copy_history(
             mach_msg_type_number_t  *array_dataLen,
             int             *return_val)
 {
+    CFArrayRef  history = NULL;
     CFDataRef   sendData = NULL;
 
-    sendData = CFPropertyListCreateData(0, gHIDEventHistory, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+    *array_data = 0;
+    *array_dataLen = 0;
+
+    history = copyHIDEventHistory();
+    if (history && (0 == CFArrayGetCount(history))) {
+        // Nothing has reported a HID event yet
+        CFRelease(history);
+        *return_val = kIOReturnNotFound;
+        goto exit;
+    }
+    if (history) {
+        sendData = CFPropertyListCreateData(0, history, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+        CFRelease(history);
+    }
     if (!sendData) {
         *return_val = kIOReturnError;
         goto exit;
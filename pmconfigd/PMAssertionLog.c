@@ -24,6 +24,7 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <asl.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <notify.h>
 
 #include "PMAssertions.h"
@@ -45,6 +46,8 @@ extern assertionType_t              gAssertionTypes[];
 extern CFMutableDictionaryRef       gProcessDict;
 extern uint32_t                     gDebugFlags;
 extern uint32_t                     gActivityAggCnt;
+extern exitedProcStats_t            *gExitedProcStats;
+extern int                          gExitedProcCount;
 
 
 typedef struct {
@@ -52,9 +55,39 @@ typedef struct {
     CFMutableArrayRef       types;         
 } assertionAggregate_t;
 
+/* Creator backtrace frames kept per activity log entry */
+#define AA_MAX_BT_FRAMES            16
+
+/*
+ * One entry of the assertion activity log. Entries are kept in a fixed ring
+ * and are only turned into CF dictionaries when a client reads the log.
+ * Strings, including each backtrace frame, are held as interned string IDs
+ * and no CF objects are kept, so an entry pins nothing but string table
+ * references and logging an already seen string doesn't allocate.
+ */
 typedef struct {
-    uint32_t                idx;
-    CFMutableArrayRef       log;
+    CFAbsoluteTime          time;
+    uint64_t                uniqueAID;
+    PMStringID              typeID;
+    PMStringID              nameID;
+    PMStringID              onBehalfReasonID;
+    PMStringID              backtrace[AA_MAX_BT_FRAMES];
+    pid_t                   pid;
+    int                     onBehalfPid;
+    uint32_t                retainCnt;
+    uint8_t                 action;         // assertLogAction
+    uint8_t                 flags;
+    uint8_t                 frameCnt;
+} assertionActivityEntry_t;
+
+/* Flag bits for assertionActivityEntry_t */
+#define kAAEntryHasAID              0x01
+#define kAAEntryHasOnBehalfPid      0x02
+
+typedef struct {
+    uint32_t                idx;        // Number of entries logged since powerd start
+    assertionActivityEntry_t log[AA_MAX_ENTRIES];
+    bool                    started;
     uint32_t                unreadCnt;  // Number of entries logged since last read by
                                         // entitled reader. There should be only one entitled
                                         // reader in the system.
@@ -71,132 +104,194 @@ static  uint32_t        gActivityLogCnt = 0;  // Has to be explicity enabled on
 
 __private_extern__ bool isDisplayAsleep( );
 
-static void logAssertionActivity(assertLogAction  action,
-                                 assertion_t     *assertion)
+static CFStringRef activityActionString(assertLogAction action)
 {
+    switch(action) {
+    case kACreateLog:
+        return CFSTR(kPMASLAssertionActionCreate);
+    case kACreateRetain:
+        return CFSTR(kPMASLAssertionActionRetain);
+    case kATurnOnLog:
+        return CFSTR(kPMASLAssertionActionTurnOn);
+    case kAReleaseLog:
+        return CFSTR(kPMASLAssertionActionRelease);
+    case kAClientDeathLog:
+        return CFSTR(kPMASLAssertionActionClientDeath);
+    case kATimeoutLog:
+        return CFSTR(kPMASLAssertionActionTimeOut);
+    case kATurnOffLog:
+        return CFSTR(kPMASLAssertionActionTurnOff);
+    default:
+        return NULL;
+    }
+}
 
-    bool            logBT = false;
-    CFDateRef       time = NULL;
-    CFStringRef     actionStr = NULL;
-    CFNumberRef     pid_cf = NULL, retain_cf = NULL, uniqueAID = NULL;
-    CFTypeRef       type = NULL, name = NULL, btSymbols = NULL;
-    CFTypeRef       onBehalfPid = NULL, onBehalfPidStr = NULL;
+static inline void setEntryString(PMStringID *slot, CFTypeRef value)
+{
+    PMStringID      sid = PMStringIntern(value);
 
-    CFMutableDictionaryRef  entry = NULL;
-    CFDictionaryRef         props = assertion->props;
+    PMStringRelease(*slot);
+    *slot = sid;
+}
 
-    switch(action) {
+static void setEntryBacktrace(assertionActivityEntry_t *entry, CFArrayRef frames)
+{
+    PMStringID      ids[AA_MAX_BT_FRAMES];
+    CFIndex         cnt = 0;
+    int             i;
 
-    case kACreateLog:
-        logBT = true;
-        actionStr = CFSTR(kPMASLAssertionActionCreate);
-        break;
+    // Intern the new frames before dropping the old, so frames shared by
+    // both aren't freed and interned again
+    if (isA_CFArray(frames)) {
+        cnt = CFArrayGetCount(frames);
+        if (cnt > AA_MAX_BT_FRAMES)
+            cnt = AA_MAX_BT_FRAMES;
+        for (i = 0; i < cnt; i++)
+            ids[i] = PMStringIntern(CFArrayGetValueAtIndex(frames, i));
+    }
 
-    case kACreateRetain:
-        logBT = true;
-        actionStr = CFSTR(kPMASLAssertionActionRetain);
-        break;
+    for (i = 0; i < entry->frameCnt; i++)
+        PMStringRelease(entry->backtrace[i]);
+
+    memcpy(entry->backtrace, ids, cnt * sizeof(PMStringID));
+    entry->frameCnt = (uint8_t)cnt;
+}
+
+static void logAssertionActivity(assertLogAction  action,
+                                 assertion_t     *assertion)
+{
+    bool                        logBT = false;
+    CFNumberRef                 num = NULL;
+    CFDictionaryRef             props = assertion->props;
+    assertionActivityEntry_t    *entry;
 
+    switch(action) {
+    case kACreateLog:
+    case kACreateRetain:
     case kATurnOnLog:
         logBT = true;
-        actionStr = CFSTR(kPMASLAssertionActionTurnOn);
         break;
 
     case kAReleaseLog:
-        actionStr = CFSTR(kPMASLAssertionActionRelease);
-        break;
-
     case kAClientDeathLog:
-        actionStr = CFSTR(kPMASLAssertionActionClientDeath);
-        break;
-
     case kATimeoutLog:
-        actionStr = CFSTR(kPMASLAssertionActionTimeOut);
-        break;
-
     case kATurnOffLog:
-        actionStr = CFSTR(kPMASLAssertionActionTurnOff);
         break;
 
     default:
         return;
     }
 
-    if (!activity.log) {
-        activity.log = CFArrayCreateMutable(NULL, AA_MAX_ENTRIES, &kCFTypeArrayCallBacks);
-
-        if (!activity.log) return;
-
+    if (!activity.started) {
+        activity.started = true;
+        PMMemoryCharge(kPMMemAssertionLog, sizeof(activity));
         activity.unreadCnt = UINT_MAX;
         // Send a high water mark notification to force a read by powerlog after powerd's crash
         notify_post(kIOPMAssertionsLogBufferHighWM);
     }
 
-    entry = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, 
-                                      &kCFTypeDictionaryValueCallBacks);
-    if (!entry) return;
+    entry = &activity.log[activity.idx % AA_MAX_ENTRIES];
 
-    // Current time of this activity
-    time = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-    if (time) {
-        CFDictionarySetValue(entry, kIOPMAssertionActivityTime, time);
-        CFRelease(time);
-    }
-    else {
-        // Not much to log, if we can't even get the time of activity
-        CFRelease(entry);
-        return;
-    }
+    entry->time = CFAbsoluteTimeGetCurrent();
+    entry->action = action;
+    entry->pid = assertion->pinfo->pid;
+    entry->retainCnt = assertion->retainCnt;
+    entry->flags = 0;
 
-    // Assertion type
-    if ((type = CFDictionaryGetValue(props, kIOPMAssertionTypeKey)) != NULL)
-        CFDictionarySetValue(entry, kIOPMAssertionTypeKey, type);
+    setEntryString(&entry->typeID, CFDictionaryGetValue(props, kIOPMAssertionTypeKey));
+    PMStringRetain(assertion->nameID);
+    PMStringRelease(entry->nameID);
+    entry->nameID = assertion->nameID;
+    setEntryString(&entry->onBehalfReasonID, CFDictionaryGetValue(props, kIOPMAssertionOnBehalfOfPIDReason));
+    setEntryBacktrace(entry, logBT ? CFDictionaryGetValue(props, kIOPMAssertionCreatorBacktrace) : NULL);
 
-    // Assertion name
-    if ((name = CFDictionaryGetValue(props, kIOPMAssertionNameKey)) != NULL)
-        CFDictionarySetValue(entry, kIOPMAssertionNameKey, name);
+    num = CFDictionaryGetValue(props, kIOPMAssertionGlobalUniqueIDKey);
+    if (isA_CFNumber(num) && CFNumberGetValue(num, kCFNumberSInt64Type, &entry->uniqueAID))
+        entry->flags |= kAAEntryHasAID;
 
-    // Type of assertion action
-    CFDictionarySetValue(entry, kIOPMAssertionActivityAction, actionStr);
+    num = CFDictionaryGetValue(props, kIOPMAssertionOnBehalfOfPID);
+    if (isA_CFNumber(num) && CFNumberGetValue(num, kCFNumberIntType, &entry->onBehalfPid))
+        entry->flags |= kAAEntryHasOnBehalfPid;
 
-    // PID owning this assertion
-    if ((pid_cf = CFNumberCreate(NULL, kCFNumberIntType, &assertion->pinfo->pid)) != NULL) {
-        CFDictionarySetValue(entry, kIOPMAssertionPIDKey, pid_cf);
-        CFRelease(pid_cf);
+    activity.idx++;
+
+    if ((activity.unreadCnt != UINT_MAX) && (++activity.unreadCnt >= 0.9*AA_MAX_ENTRIES))  {
+        notify_post(kIOPMAssertionsLogBufferHighWM);
+        activity.unreadCnt = UINT_MAX;
     }
-      
-    // Retain count
-    if ((retain_cf = CFNumberCreate(NULL, kCFNumberIntType, &assertion->retainCnt)) != NULL) {
-        CFDictionarySetValue(entry, kIOPMAssertionRetainCountKey, retain_cf);
-        CFRelease(retain_cf);
+}
+
+/* Builds the dictionary handed to activity log readers for one entry */
+static CFDictionaryRef copyActivityEntryDictionary(assertionActivityEntry_t *entry)
+{
+    CFMutableDictionaryRef  dict = NULL;
+    CFDateRef               time = NULL;
+    CFNumberRef             num = NULL;
+    CFStringRef             actionStr = NULL;
+    CFStringRef             str = NULL;
+    CFMutableArrayRef       frames = NULL;
+    int                     i;
+
+    if ( !(actionStr = activityActionString(entry->action)) )
+        return NULL;
+
+    dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, 
+                                     &kCFTypeDictionaryValueCallBacks);
+    if (!dict) return NULL;
+
+    time = CFDateCreate(0, entry->time);
+    if (!time) {
+        // Not much to log, if we can't even get the time of activity
+        CFRelease(dict);
+        return NULL;
     }
+    CFDictionarySetValue(dict, kIOPMAssertionActivityTime, time);
+    CFRelease(time);
 
-    // Assertion ID
-    if ((uniqueAID = CFDictionaryGetValue(props, kIOPMAssertionGlobalUniqueIDKey)) != NULL) 
-        CFDictionarySetValue(entry, kIOPMAssertionGlobalUniqueIDKey, uniqueAID);
+    if ((str = PMStringGet(entry->typeID)))
+        CFDictionarySetValue(dict, kIOPMAssertionTypeKey, str);
 
-    // Assertion on behalf of PID
-    if ((onBehalfPid = CFDictionaryGetValue(props, kIOPMAssertionOnBehalfOfPID)) != NULL) 
-        CFDictionarySetValue(entry, kIOPMAssertionOnBehalfOfPID, onBehalfPid);
+    if ((str = PMStringGet(entry->nameID)))
+        CFDictionarySetValue(dict, kIOPMAssertionNameKey, str);
 
-    if ((onBehalfPidStr = CFDictionaryGetValue(props, kIOPMAssertionOnBehalfOfPIDReason)) != NULL) 
-        CFDictionarySetValue(entry, kIOPMAssertionOnBehalfOfPIDReason, onBehalfPidStr);
+    CFDictionarySetValue(dict, kIOPMAssertionActivityAction, actionStr);
 
-    if (logBT) {
-        // Backtrace of assertion creation
-        if ((btSymbols = CFDictionaryGetValue(props, kIOPMAssertionCreatorBacktrace)) != NULL)
-            CFDictionarySetValue(entry, kIOPMAssertionCreatorBacktrace, btSymbols);
+    if ((num = CFNumberCreate(NULL, kCFNumberIntType, &entry->pid)) != NULL) {
+        CFDictionarySetValue(dict, kIOPMAssertionPIDKey, num);
+        CFRelease(num);
     }
 
-    CFArraySetValueAtIndex(activity.log, (activity.idx % AA_MAX_ENTRIES), entry);
-    activity.idx++;
+    if ((num = CFNumberCreate(NULL, kCFNumberIntType, &entry->retainCnt)) != NULL) {
+        CFDictionarySetValue(dict, kIOPMAssertionRetainCountKey, num);
+        CFRelease(num);
+    }
 
-    CFRelease(entry);
+    if ((entry->flags & kAAEntryHasAID) &&
+        (num = CFNumberCreate(NULL, kCFNumberSInt64Type, &entry->uniqueAID)) != NULL) {
+        CFDictionarySetValue(dict, kIOPMAssertionGlobalUniqueIDKey, num);
+        CFRelease(num);
+    }
 
-    if ((activity.unreadCnt != UINT_MAX) && (++activity.unreadCnt >= 0.9*AA_MAX_ENTRIES))  {
-        notify_post(kIOPMAssertionsLogBufferHighWM);
-        activity.unreadCnt = UINT_MAX;
+    if ((entry->flags & kAAEntryHasOnBehalfPid) &&
+        (num = CFNumberCreate(NULL, kCFNumberIntType, &entry->onBehalfPid)) != NULL) {
+        CFDictionarySetValue(dict, kIOPMAssertionOnBehalfOfPID, num);
+        CFRelease(num);
+    }
+
+    if ((str = PMStringGet(entry->onBehalfReasonID)))
+        CFDictionarySetValue(dict, kIOPMAssertionOnBehalfOfPIDReason, str);
+
+    if (entry->frameCnt &&
+        (frames = CFArrayCreateMutable(NULL, entry->frameCnt, &kCFTypeArrayCallBacks)) != NULL) {
+        for (i = 0; i < entry->frameCnt; i++) {
+            if ((str = PMStringGet(entry->backtrace[i])))
+                CFArrayAppendValue(frames, str);
+        }
+        CFDictionarySetValue(dict, kIOPMAssertionCreatorBacktrace, frames);
+        CFRelease(frames);
     }
+
+    return dict;
 }
 
 #if !TARGET_OS_EMBEDDED
@@ -273,15 +368,13 @@ static void logAssertionToASL(assertLogAction  action,
 {
     const int       kLongStringLen          = 200;
     const int       kShortStringLen         = 10;
-    aslmsg          m;
+    pmlogmsg        m;
     CFStringRef     foundAssertionType      = NULL;
-    CFStringRef     foundAssertionName      = NULL;
+    const char      *foundAssertionName     = NULL;
     CFDateRef       foundDate               = NULL;
-    CFStringRef     procName                = NULL;
-    char            proc_name_buf[kProcNameBufLen];
+    const char      *procName               = NULL;
     char            pid_buf[kShortStringLen];
     char            assertionTypeCString[kLongStringLen];
-    char            assertionNameCString[kLongStringLen];
     char            ageString[kShortStringLen];
     char            aslMessageString[kLongStringLen];
     char            assertionsBuf[kLongStringLen];
@@ -370,14 +463,10 @@ static void logAssertionToASL(assertLogAction  action,
         if (foundAssertionType) {
             CFStringGetCString(foundAssertionType, assertionTypeCString, 
                                sizeof(assertionTypeCString), kCFStringEncodingUTF8);
-            asl_set(m, kPMASLAssertionNameKey, assertionTypeCString);
+            pmlog_set(m, kPMASLAssertionNameKey, assertionTypeCString);
         }
 
-        foundAssertionName = CFDictionaryGetValue(assertionDictionary, kIOPMAssertionNameKey);
-        if (foundAssertionName) {
-            CFStringGetCString(foundAssertionName, assertionNameCString, 
-                               sizeof(assertionNameCString), kCFStringEncodingUTF8);            
-        }
+        foundAssertionName = PMStringGetCString(assertion->nameID);
 
         /*
          * Assertion's age
@@ -400,45 +489,41 @@ static void logAssertionToASL(assertLogAction  action,
         {
             char    retainCountBuf[kShortStringLen];
             snprintf(retainCountBuf, sizeof(retainCountBuf), "%d", retainCount);
-            asl_set(m, "RetainCount", retainCountBuf);
+            pmlog_set(m, "RetainCount", retainCountBuf);
         }
     }
 
-    if ((procName = assertion->pinfo->name))
-    {
-        CFStringGetCString(procName, proc_name_buf, sizeof(proc_name_buf), kCFStringEncodingUTF8);
-    }
+    procName = PMStringGetCString(assertion->pinfo->nameID);
 
     printAggregateAssertionsToBuf(assertionsBuf, sizeof(assertionsBuf), getKerAssertionBits());
 
     pid_buf[0] = 0;
     if (0 < snprintf(pid_buf, kShortStringLen, "%d", assertion->pinfo->pid)) {
-        asl_set(m, kPMASLPIDKey, pid_buf);
+        pmlog_set(m, kPMASLPIDKey, pid_buf);
     }
 
     snprintf(aslMessageString, sizeof(aslMessageString), "PID %s(%s) %s %s %s%s%s %s id:0x%llx %s",
              pid_buf,
-             procName ? proc_name_buf:"?",
+             procName ? procName:"?",
              assertionAction,
              foundAssertionType ? assertionTypeCString:"",
-             foundAssertionName?"\"":"", foundAssertionName ? assertionNameCString:"", 
+             foundAssertionName?"\"":"", foundAssertionName ? foundAssertionName:"", 
              foundAssertionName?"\"":"",
              foundDate?ageString:"",
              (((uint64_t)assertion->kassert) << 32) | (assertion->assertionId),
              assertionsBuf);
 
-    asl_set(m, ASL_KEY_MSG, aslMessageString);
-    asl_set(m, kPMASLActionKey, assertionAction);
-    asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-    asl_send(NULL, m);
-    asl_free(m);
+    pmlog_set(m, ASL_KEY_MSG, aslMessageString);
+    pmlog_set(m, kPMASLActionKey, assertionAction);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
+    pmlog_send(m);
 
 }
 
 
 void logASLAssertionsAggregate( )
 {
-    aslmsg m;
+    pmlogmsg m;
     char            aslMessageString[100];
     char            assertionsBuf[100];
     static int      prevPwrSrc = -1;
@@ -459,10 +544,9 @@ void logASLAssertionsAggregate( )
              ( pwrSrc == kBatteryPowered) ? "Batt" : "AC");
 
     m = new_msg_pmset_log();
-    asl_set(m, ASL_KEY_MSG, aslMessageString);
-    asl_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
-    asl_send(NULL, m);
-    asl_free(m);
+    pmlog_set(m, ASL_KEY_MSG, aslMessageString);
+    pmlog_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
+    pmlog_send(m);
     //
     //    for (int i=0; i<kIOPMNumAssertionTypes; i++) {
     //        logASLAssertionTypeSummary(gAssertionTypes[i].kassert);
@@ -512,13 +596,12 @@ kern_return_t _io_pm_assertion_activity_log (
                                              uint32_t                 *overflow,
                                              int                      *rc)
 {
-    CFRange             range;
-    CFIndex             startIdx, endIdx;
     CFDataRef           serializedLog = NULL;
+    CFDictionaryRef     entryDict = NULL;
     uint32_t            readFromIdx;
     uint32_t            writeToIdx;
+    uint32_t            i;
     CFMutableArrayRef   updates = NULL;
-    CFIndex             arrCnt;
     static bool         firstcall = true;
 
     if ((log == NULL) || (overflow == NULL))
@@ -545,82 +628,38 @@ kern_return_t _io_pm_assertion_activity_log (
         }
     }
 
-    if (!activity.log) {
-        activity.log = CFArrayCreateMutable(NULL, AA_MAX_ENTRIES, &kCFTypeArrayCallBacks);
-
-        if (!activity.log) {
-            *rc = kIOReturnNoMemory;
-            goto exit;
-        }
-    }
-    arrCnt = CFArrayGetCount(activity.log);
-
-    if ((readFromIdx == writeToIdx) || (arrCnt == 0)) {
+    if ((readFromIdx == writeToIdx) || (writeToIdx == 0)) {
         goto exit;
     }
-    if ((readFromIdx % AA_MAX_ENTRIES) >= arrCnt) {
-        // can happen in case of powerd crash and client provides old refCnt
-        *overflow = true;
-        asl_log(0,0,ASL_LEVEL_ERR, "Unexpected readFromIdx %d. arrCnt=%ld\n", readFromIdx, arrCnt);
-        *refCnt = readFromIdx = UINT_MAX;
-    }
 
+    /*
+     * refCnt is the caller's cursor into the log. UINT_MAX asks for
+     * everything still held. A cursor that is ahead of the log (powerd
+     * restarted) or that has fallen more than a ring's worth behind gets
+     * whatever is still held, flagged as an overflow.
+     */
     if ((readFromIdx == UINT_MAX) && (writeToIdx <= AA_MAX_ENTRIES)) {
-        startIdx = endIdx = 0;
-        if (isA_CFArray(activity.log))  {
-            endIdx = arrCnt;
-        }
-        if (endIdx == 0) {
-            goto exit; // No entries
-        }
-        endIdx -= 1;
+        readFromIdx = 0;
     }
     else if ((writeToIdx > readFromIdx + AA_MAX_ENTRIES) || (writeToIdx < readFromIdx)) {
-        startIdx = writeToIdx % AA_MAX_ENTRIES;
-        endIdx = (writeToIdx -1) % AA_MAX_ENTRIES;
+        readFromIdx = (writeToIdx > AA_MAX_ENTRIES) ? (writeToIdx - AA_MAX_ENTRIES) : 0;
         *overflow = true;
-        if (startIdx >= arrCnt) {
-            // can happen in case of powerd crash and client provides old refCnt
-            startIdx = 0;
-        }
-    }
-    else {
-        startIdx = readFromIdx % AA_MAX_ENTRIES;
-        endIdx = (writeToIdx -1) % AA_MAX_ENTRIES;
     }
 
-    updates = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    updates = CFArrayCreateMutable(NULL, writeToIdx - readFromIdx, &kCFTypeArrayCallBacks);
     if (updates == NULL) {
         goto exit;
     }
 
     // Copy log entries in sequential order 
-    if (startIdx > endIdx) {
-        if (arrCnt == AA_MAX_ENTRIES) {
-            range = CFRangeMake(startIdx, AA_MAX_ENTRIES-startIdx);
-            CFArrayAppendArray(updates, activity.log, range);
-        }
-        else {
-            asl_log(0,0,ASL_LEVEL_ERR, "arrCnt is %ld. expected %d\n", arrCnt, AA_MAX_ENTRIES);
-            asl_log(0,0,ASL_LEVEL_ERR, "startIdx: %ld endIdx: %ld refCnt: 0x%x readFromIdx: 0x%x writeToIdx: 0x%x\n",
-                    startIdx, endIdx, *refCnt, readFromIdx, writeToIdx);
-            *overflow = true;
+    for (i = readFromIdx; i != writeToIdx; i++) {
+        entryDict = copyActivityEntryDictionary(&activity.log[i % AA_MAX_ENTRIES]);
+        if (entryDict) {
+            CFArrayAppendValue(updates, entryDict);
+            CFRelease(entryDict);
         }
-        startIdx = 0;
     }
 
-    if (arrCnt >= endIdx+1) {
-        range = CFRangeMake(startIdx, endIdx-startIdx+1);
-        CFArrayAppendArray(updates, activity.log, range);
-    }
-    else {
-        asl_log(0,0,ASL_LEVEL_ERR, "final: arrCnt is %ld. expected >= %ld\n", arrCnt, endIdx+1);
-        *overflow = true;
-        *refCnt = activity.idx;
-        goto exit;
-    }
-
-
     serializedLog = CFPropertyListCreateData(0, updates,
                                              kCFPropertyListBinaryFormat_v1_0, 0, NULL);            
 
@@ -635,7 +674,7 @@ kern_return_t _io_pm_assertion_activity_log (
     memcpy((void *)*log, CFDataGetBytePtr(serializedLog), *logSize);
     *rc = kIOReturnSuccess;
     
-    *refCnt = activity.idx; // Number of entries saved since last reset
+    *refCnt = writeToIdx; // Number of entries saved since last reset
 
 exit:
     if (serializedLog)
@@ -664,21 +703,17 @@ struct aggregateStats {
 #define kIOPMStatsGroup CFSTR("I/O Kit Power Management")
 #define kIOPMAssertionsSub CFSTR("Power Assertions")
                                                                                                                                  
-void updateProcAssertionStats(ProcessInfo *pinfo, struct aggregateStats *aggStats)
+/* Adds the channel for one process's stats buffer to aggStats */
+static void addProcStatsChannel(pid_t pid, void *reportBuf, struct aggregateStats *aggStats)
 {
     void        *ptr2cpy = NULL;
     uint32_t    size2cpy = 0;
-    uint64_t    duration = 0;
     uint64_t    chType = 0;
     IOReturn    ret;
 
-
-    effectStats_t           *stats = NULL;
     static CFStringRef      providerName = NULL;
     static CFMutableDictionaryRef  unitInfo = NULL;
 
-    if (pinfo->reportBuf == NULL) return;
-
     if (aggStats->reportBufs == NULL) {
         aggStats->reportBufs = CFDataCreateMutable(NULL, 0);
         if (!aggStats->reportBufs) return;
@@ -709,13 +744,23 @@ void updateProcAssertionStats(ProcessInfo *pinfo, struct aggregateStats *aggStat
 
     chType = IOREPORT_MAKECHTYPE(kIOReportFormatSimpleArray, kIOReportCategoryPower, kMaxEffectStats);
     ret = IOReportAddChannelDescription(aggStats->legend, getpid(), 
-                                        providerName, pinfo->pid,
+                                        providerName, pid,
                                         chType, CFSTR("Assertion duration by process"),
                                         kIOPMStatsGroup, kIOPMAssertionsSub,
                                         unitInfo, NULL);
     if (ret != kIOReturnSuccess) 
         return;
 
+    SIMPLEARRAY_UPDATEPREP(reportBuf, ptr2cpy, size2cpy);
+    CFDataAppendBytes(aggStats->reportBufs, ptr2cpy, size2cpy);
+}
+
+void updateProcAssertionStats(ProcessInfo *pinfo, struct aggregateStats *aggStats)
+{
+    uint64_t        duration = 0;
+    effectStats_t   *stats = NULL;
+
+    if (pinfo->reportBuf == NULL) return;
 
     for (kerAssertionEffect i = kNoEffect; i < kMaxEffectStats; i++) {
         stats = &pinfo->stats[i];
@@ -726,8 +771,106 @@ void updateProcAssertionStats(ProcessInfo *pinfo, struct aggregateStats *aggStat
         stats->startTime = aggStats->curTime;
     }
 
-    SIMPLEARRAY_UPDATEPREP(pinfo->reportBuf, ptr2cpy, size2cpy);
-    CFDataAppendBytes(aggStats->reportBufs, ptr2cpy, size2cpy);
+    addProcStatsChannel(pinfo->pid, pinfo->reportBuf, aggStats);
+}
+
+static void                 *gPerfBufs[kAssertionPerfNumOps];
+static mach_timebase_info_data_t gPerfTimebase;
+
+static const CFStringRef    gPerfOpNames[kAssertionPerfNumOps] = {
+    CFSTR("Create"),
+    CFSTR("Release"),
+    CFSTR("SetProperties"),
+    CFSTR("Evaluate"),
+    CFSTR("KernelUpdate")
+};
+
+static bool allocPerfBuf(assertionPerfOp op)
+{
+    size_t nbytes = SIMPLEARRAY_BUFSIZE(kAssertionPerfBuckets);
+    int i;
+
+    gPerfBufs[op] = malloc(nbytes);
+    if (!gPerfBufs[op])
+        return false;
+
+    SIMPLEARRAY_INIT(kAssertionPerfBuckets, gPerfBufs[op], nbytes, getpid(),
+                     op, /* Channel ID */
+                     kIOReportCategoryPower);
+    for (i=0; i < kAssertionPerfBuckets; i++) {
+        SIMPLEARRAY_SETVALUE(gPerfBufs[op], i, 0);
+    }
+    return true;
+}
+
+/*
+ * Adds the time elapsed since 'startTime', a mach_absolute_time() value,
+ * to the latency histogram of 'op'.
+ */
+__private_extern__ void recordAssertionLatency(assertionPerfOp op, uint64_t startTime)
+{
+    uint64_t    usecs;
+    int         bucket = 0;
+
+    if (op >= kAssertionPerfNumOps)
+        return;
+    if (!gPerfBufs[op] && !allocPerfBuf(op))
+        return;
+
+    if (gPerfTimebase.denom == 0)
+        mach_timebase_info(&gPerfTimebase);
+
+    usecs = (mach_absolute_time() - startTime) * gPerfTimebase.numer / gPerfTimebase.denom / NSEC_PER_USEC;
+    while (usecs && (bucket < kAssertionPerfBuckets - 1)) {
+        usecs >>= 1;
+        bucket++;
+    }
+
+    SIMPLEARRAY_INCREMENTVALUE(gPerfBufs[op], bucket, 1);
+}
+
+__private_extern__ CFDictionaryRef copyAssertionPerfSamples(void)
+{
+    CFMutableDictionaryRef  legend = NULL;
+    CFMutableDataRef        bufs = NULL;
+    CFDictionaryRef         samples = NULL;
+    static CFStringRef      providerName = NULL;
+    void                    *ptr2cpy = NULL;
+    uint32_t                size2cpy = 0;
+    uint64_t                chType;
+    assertionPerfOp         op;
+
+    if (providerName == NULL) {
+        providerName = IOReportCopyCurrentProcessName();
+        if (providerName == NULL) goto exit;
+    }
+
+    legend = IOReportCreateAggregate(0);
+    bufs = CFDataCreateMutable(NULL, 0);
+    if (!legend || !bufs)
+        goto exit;
+
+    chType = IOREPORT_MAKECHTYPE(kIOReportFormatSimpleArray, kIOReportCategoryPower, kAssertionPerfBuckets);
+    for (op = 0; op < kAssertionPerfNumOps; op++) {
+        if (!gPerfBufs[op] && !allocPerfBuf(op))
+            goto exit;
+
+        if (IOReportAddChannelDescription(legend, getpid(), providerName, op,
+                                          chType, gPerfOpNames[op],
+                                          kIOPMStatsGroup, CFSTR("Assertion Latency"),
+                                          NULL, NULL) != kIOReturnSuccess)
+            goto exit;
+
+        SIMPLEARRAY_UPDATEPREP(gPerfBufs[op], ptr2cpy, size2cpy);
+        CFDataAppendBytes(bufs, ptr2cpy, size2cpy);
+    }
+
+    samples = IOReportCreateSamplesRaw(legend, bufs, NULL);
+
+exit:
+    if (legend) CFRelease(legend);
+    if (bufs) CFRelease(bufs);
+    return samples;
 }
 
 int qcompare(const void *p1, const void*p2)
@@ -754,34 +897,29 @@ int qcompare(const void *p1, const void*p2)
  *    [2]: kPrevDemandSlpEffect
  *    [3]: kPrevDisplaySlpEffect
  */
-kern_return_t _io_pm_assertion_activity_aggregate (
-                                             mach_port_t         server __unused,
-                                             audit_token_t       token,
-                                             vm_offset_t         *statsData,
-                                             mach_msg_type_number_t   *statsSize,
-                                             int                      *rc)
+/*
+ * Brings every process's assertion stats up to date and returns them as
+ * IOReport samples. Main queue only.
+ */
+static CFMutableDictionaryRef copyActivityAggregateSamples(struct aggregateStats *aggStats, int *rc)
 {
     CFIndex                 j, cnt;
-    CFDataRef               serializedArray = NULL;
+    int                     k = 0;
     ProcessInfo             **procs = NULL;
+    exitedProcStats_t       *exited = NULL;
     CFMutableDictionaryRef  samples = NULL;
-    struct aggregateStats   aggStats;
-
-    *statsSize = 0;
-    *rc = kIOReturnError;
 
     if (gActivityAggCnt == 0) {
         *rc = kIOReturnNotOpen;
-        goto exit;
+        return NULL;
     }
-    memset(&aggStats, 0, sizeof(aggStats));
-    aggStats.curTime = getMonotonicTime();
+    aggStats->curTime = getMonotonicTime();
 
     cnt = CFDictionaryGetCount(gProcessDict);
     procs = malloc(cnt*(sizeof(procs)));
     if (!procs)  {
         *rc = kIOReturnNoMemory;
-        goto exit;
+        return NULL;
     }
 
     memset(procs, 0, cnt*(sizeof(procs)));
@@ -791,14 +929,47 @@ kern_return_t _io_pm_assertion_activity_aggregate (
     // This is to overcome the limitation in IOReporting(see 16270424)
     qsort(procs, cnt, sizeof(procs), qcompare);
 
+    // Exited processes' stats are merged in, in the same order
     for (j = 0; (j < cnt) && (procs[j]); j++) {
-        updateProcAssertionStats(procs[j], &aggStats);
+        for (; (k < gExitedProcCount) && (gExitedProcStats[k].create_seq < procs[j]->create_seq); k++) {
+            exited = &gExitedProcStats[k];
+            addProcStatsChannel(exited->pid, exited->reportBuf, aggStats);
+        }
+        updateProcAssertionStats(procs[j], aggStats);
+    }
+    for (; k < gExitedProcCount; k++) {
+        exited = &gExitedProcStats[k];
+        addProcStatsChannel(exited->pid, exited->reportBuf, aggStats);
     }
 
-    samples = IOReportCreateSamplesRaw(aggStats.legend, aggStats.reportBufs, NULL);
+    samples = IOReportCreateSamplesRaw(aggStats->legend, aggStats->reportBufs, NULL);
     free(procs);
 
     *rc = kIOReturnSuccess;
+    return samples;
+}
+
+kern_return_t _io_pm_assertion_activity_aggregate (
+                                             mach_port_t         server __unused,
+                                             audit_token_t       token,
+                                             vm_offset_t         *statsData,
+                                             mach_msg_type_number_t   *statsSize,
+                                             int                      *rc)
+{
+    CFDataRef                       serializedArray = NULL;
+    __block CFMutableDictionaryRef  samples = NULL;
+    __block struct aggregateStats   aggStats;
+
+    *statsSize = 0;
+    *rc = kIOReturnError;
+
+    memset(&aggStats, 0, sizeof(aggStats));
+
+    // Served off the main queue; the stats are gathered on the main queue
+    // and serialized here.
+    PMRunOnMainQueue(^{ samples = copyActivityAggregateSamples(&aggStats, rc); });
+    if (*rc != kIOReturnSuccess)
+        goto exit;
 
     if (samples == 0) {
         /* No data collected */
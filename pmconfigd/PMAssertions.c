@@ -28,6 +28,7 @@
 #include <asl.h>
 #include <mach/mach.h>
 #include <mach/mach_host.h>
+#include <mach/mach_time.h>
 #include <mach/mach_error.h>
 #include <servers/bootstrap.h>
 #include <dispatch/dispatch.h>
@@ -90,6 +91,28 @@ enum {
 
 uint32_t gSAAssertionBehaviorFlags = kIOPMSystemActivityAssertionEnabled;
 
+/*
+ * While gBatchDepth is non-zero, type handlers are not called for each
+ * raise/release. The ops are recorded per type in gBatchPendingOps and
+ * replayed once when the outermost batch ends.
+ */
+static int      gBatchDepth = 0;
+static uint8_t  gBatchPendingOps[kIOPMNumAssertionTypes];
+
+// Pending kernel updates; see flushKernelAssertionUpdates()
+#define kMaxKernelUpdateDelayMS     100
+
+static bool     gKernelUpdateScheduled = false;
+static bool     gKernelUpdateUrgent = false;
+static bool     gKernelBitsDirty = false;
+static uint32_t gPendingKernelBits = 0;
+static uint32_t gSentKernelBits = 0;
+static bool     gClamshellStateDirty = false;
+static int      gPendingClamshellState = 0;
+static uint32_t gKernelUpdateDelayMS = 0;
+static uint32_t gKernelUpdatesSent = 0;
+static uint32_t gKernelUpdatesSuppressed = 0;
+
 CFArrayRef copyScheduledPowerEvents(void);
 CFDictionaryRef copyRepeatPowerEvents(void);
 
@@ -118,6 +141,10 @@ static IOReturn                     doSetProperties(pid_t pid,
 
 static CFArrayRef                   copyPIDAssertionDictionaryFlattened(void);
 static CFDictionaryRef              copyAggregateValuesDictionary(void);
+static CFDataRef                    copySerializedAggregates(void);
+static CFDataRef                    copySerializedAssertions(void);
+static CFDictionaryRef              copyPMSnapshot(void);
+static inline void                  assertionsChanged(void);
 
 static IOReturn                     doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
                                              IOPMAssertionID *assertion_id, ProcessInfo **pinfo);
@@ -136,6 +163,11 @@ static void                         handleAssertionTimeout(assertionType_t *asse
 static void                         resetGlobalTimer(assertionType_t *assertType, uint64_t timer);
 static IOReturn                     raiseAssertion(assertion_t *assertion);
 static void                         allocStatsBuf(ProcessInfo *pinfo);
+static void                         retireStatsBuf(ProcessInfo *pinfo);
+static void                         releaseExitedProcStats(void);
+static void                         callAssertionHandler(assertionType_t *assertType, assertionOps op);
+static void                         beginAssertionBatch(void);
+static void                         endAssertionBatch(void);
 
 __private_extern__ bool             isDisplayAsleep( );
 __private_extern__ void             logASLMessageSleepServiceTerminated(int forcedTimeoutCnt);
@@ -145,7 +177,39 @@ static uint32_t                     kerAssertionBits = 0;
 static int                          aggregate_assertions;
 static CFStringRef                  assertion_types_arr[kIOPMNumAssertionTypes];
 
-static CFMutableDictionaryRef       gAssertionsArray = NULL;
+/*
+ * Serialized replies for the kIOPMAssertionMIGCopyStatus and
+ * kIOPMAssertionMIGCopyAll queries. Each is tagged with a generation that
+ * is bumped whenever its contents could change; the cached data is dropped
+ * at that point and rebuilt on the next request. Both are reply snapshots
+ * (PMReplySnapshotSet), so io_pm_assertion_copy_details can serve them
+ * straight from the concurrent MIG queue.
+ */
+static uint32_t                     gAggregatesGen = 1;
+static CFDataRef                    gAggregatesData = NULL;
+static uint32_t                     gAssertionsGen = 1;
+static CFDataRef                    gAssertionsData = NULL;
+
+// Shared page with kerAssertionBits and aggregate_assertions; see PMAssertionSharedState.
+static PMAssertionSharedState       *gSharedState = NULL;
+
+/*
+ * Fixed capacity slab holding every assertion_t. Free slots are chained
+ * through 'nextFree', so allocation and release are O(1) and lookups by ID
+ * index straight into the slab.
+ */
+typedef struct {
+    assertion_t         assertion;
+    uint32_t            gen;            // Generation, bumped on every release of this slot
+    uint32_t            nextFree;       // Next free slot index; valid only while slot is free
+    bool                inUse;
+} assertionSlot_t;
+
+#define kAssertionSlotNone          UINT32_MAX
+
+static assertionSlot_t             *gAssertionSlab = NULL;
+static uint32_t                     gFreeSlotHead = kAssertionSlotNone;
+static uint32_t                     gFreeSlotTail = kAssertionSlotNone;
 static CFMutableDictionaryRef       gUserAssertionTypesDict = NULL;
 CFMutableDictionaryRef              gProcessDict = NULL;
 assertionType_t                     gAssertionTypes[kIOPMNumAssertionTypes];
@@ -165,6 +229,11 @@ static  uint32_t                    gTimeoutChange = 0;
 
 uint32_t                            gActivityAggCnt = 0; // Number of requests received to enable activity aggregation
 
+/* Stats of exited processes, in create_seq order */
+exitedProcStats_t                   *gExitedProcStats = NULL;
+int                                 gExitedProcCount = 0;
+static int                          gExitedProcCapacity = 0;
+
 #pragma mark -
 #pragma mark MIG
 
@@ -206,6 +275,7 @@ kern_return_t _io_pm_assertion_create (
     uid_t               callerUID = -1;
     gid_t               callerGID = -1;
     ProcessInfo         *pinfo = NULL;
+    uint64_t            startTime = mach_absolute_time();
 
     audit_token_to_au32(token, NULL, NULL, NULL, &callerUID, &callerGID, &callerPID, NULL, NULL);    
 
@@ -253,6 +323,7 @@ exit:
     }
 
     vm_deallocate(mach_task_self(), props, propsCnt);
+    recordAssertionLatency(kAssertionPerfCreate, startTime);
 
     return KERN_SUCCESS;
 }
@@ -273,6 +344,7 @@ kern_return_t _io_pm_assertion_set_properties (
     CFDictionaryRef     setProperties = NULL;
     CFDataRef           unfolder = NULL;
     pid_t               callerPID = -1;
+    uint64_t            startTime = mach_absolute_time();
 
     audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
@@ -300,6 +372,7 @@ kern_return_t _io_pm_assertion_set_properties (
 
 exit:
     vm_deallocate(mach_task_self(), props, propsCnt);
+    recordAssertionLatency(kAssertionPerfSetProperties, startTime);
 
     return KERN_SUCCESS;
 
@@ -316,6 +389,7 @@ kern_return_t _io_pm_assertion_retain_release (
                                                int                 *return_code) 
 {
     pid_t               callerPID = -1;
+    uint64_t            startTime = mach_absolute_time();
 
     audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
@@ -331,6 +405,8 @@ kern_return_t _io_pm_assertion_retain_release (
         updateAppSleepStates(processInfoGet(callerPID), disableAppSleep, enableAppSleep);
     }
 #endif
+    if (kIOPMAssertionMIGDoRetain != action)
+        recordAssertionLatency(kAssertionPerfRelease, startTime);
     return KERN_SUCCESS;
 }
 
@@ -344,36 +420,69 @@ kern_return_t _io_pm_assertion_copy_details (
                                              mach_msg_type_number_t  *assertionsCnt,
                                              int                 *return_val) 
 {
-    CFTypeRef           theCollection = NULL;
-    CFDataRef           serializedDetails = NULL;
-    pid_t               callerPID = -1;
+    __block CFTypeRef   theCollection = NULL;
+    __block CFDataRef   serializedDetails = NULL;
 
 
     *return_val = kIOReturnNotFound;
 
-    if (kIOPMAssertionMIGCopyAll == whichData)
-    {
-        theCollection = copyPIDAssertionDictionaryFlattened();
+    // This is a read-only routine served off the main queue. Cached replies
+    // are used as they are; anything else is gathered on the main queue and
+    // serialized here.
+    if (kIOPMAssertionMIGCopyAll == whichData) {
+        serializedDetails = PMReplySnapshotCopy(&gAssertionsData);
+    } else if (kIOPMAssertionMIGCopyStatus == whichData) {
+        serializedDetails = PMReplySnapshotCopy(&gAggregatesData);
+    } else if (kPMMIGCopyQueueStats == whichData) {
+        theCollection = copyMIGQueueStats();
+    }
 
-    } else if (kIOPMAssertionMIGCopyOneAssertionProperties == whichData) 
-    {
-        audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
+    if (!serializedDetails && !theCollection) PMRunOnMainQueue(^{
+        pid_t           callerPID = -1;
 
-        *return_val = copyAssertionForID(callerPID, assertion_id,  
-                                         (CFMutableDictionaryRef *)&theCollection);
+        if (kIOPMAssertionMIGCopyAll == whichData)
+        {
+            serializedDetails = copySerializedAssertions();
 
-    } else if (kIOPMAssertionMIGCopyStatus == whichData)
-    {
-        theCollection = copyAggregateValuesDictionary();
+        } else if (kIOPMAssertionMIGCopyOneAssertionProperties == whichData) 
+        {
+            audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
-    } else if (kIOPMPowerEventsMIGCopyScheduledEvents == whichData)
-    {
-        theCollection = copyScheduledPowerEvents();
-    }
-    else if (kIOPMPowerEventsMIGCopyRepeatEvents == whichData)
-    {
-        theCollection = copyRepeatPowerEvents();
-    }
+            *return_val = copyAssertionForID(callerPID, assertion_id,  
+                                             (CFMutableDictionaryRef *)&theCollection);
+
+        } else if (kIOPMAssertionMIGCopyStatus == whichData)
+        {
+            serializedDetails = copySerializedAggregates();
+
+        } else if (kPMAssertionMIGCopyPerf == whichData)
+        {
+            theCollection = copyAssertionPerfSamples();
+
+        } else if (kPMTransitionMIGCopyProfile == whichData)
+        {
+            theCollection = copyTransitionProfile();
+
+        } else if (kPMSnapshotMIGCopyAll == whichData)
+        {
+            theCollection = copyPMSnapshot();
+
+        } else if (kPMMemoryMIGCopyStats == whichData)
+        {
+            theCollection = copyMemoryAccounting();
+
+        } else if (kIOPMPowerEventsMIGCopyScheduledEvents == whichData)
+        {
+            theCollection = copyScheduledPowerEvents();
+        }
+        else if (kIOPMPowerEventsMIGCopyRepeatEvents == whichData)
+        {
+            theCollection = copyRepeatPowerEvents();
+        }
+    });
+
+    if (serializedDetails)
+        goto reply;
 
     if (!theCollection) {
         *assertionsCnt = 0;
@@ -388,6 +497,7 @@ kern_return_t _io_pm_assertion_copy_details (
 
     CFRelease(theCollection);        
 
+reply:
     if (serializedDetails) 
     {
         *assertionsCnt = (mach_msg_type_number_t)CFDataGetLength(serializedDetails);
@@ -451,25 +561,114 @@ exit:
 
 }
 
+/*
+ * Kernel assertion levels and clamshell sleep state are not sent to
+ * IOPMrootDomain as soon as they change. They are marked dirty and flushed
+ * together at the end of the current main queue turn, or after
+ * gKernelUpdateDelayMS if that is set, so a burst of raise/release only
+ * costs one call per value.
+ *
+ * Only releases and level churn wait, though. Raising a bit that keeps the
+ * system or display awake is flushed before the caller returns (or when
+ * the enclosing assertion batch ends), and everything pending is flushed
+ * before powerd acks a sleep or capability change; see
+ * PMAssertions_FlushKernelUpdates().
+ */
+#define kSleepPreventingKernelBits  (kIOPMDriverAssertionCPUBit | kIOPMDriverAssertionPreventDisplaySleepBit)
+
+static void flushKernelAssertionUpdates(void)
+{
+    io_connect_t        connect = IO_OBJECT_NULL;
+    uint64_t            in;
+    uint64_t            startTime;
+
+    gKernelUpdateScheduled = false;
+    gKernelUpdateUrgent = false;
+
+    if ( (connect = getRootDomainConnect()) == IO_OBJECT_NULL) {
+        gKernelBitsDirty = gClamshellStateDirty = false;
+        return;
+    }
+
+    if (gKernelBitsDirty) {
+        gKernelBitsDirty = false;
+        in = (uint64_t)gPendingKernelBits;
+        gSentKernelBits = gPendingKernelBits;
+        startTime = mach_absolute_time();
+        IOConnectCallMethod(connect, kPMSetUserAssertionLevels, 
+                            &in, 1, 
+                            NULL, 0, NULL, 
+                            NULL, NULL, NULL);
+        recordAssertionLatency(kAssertionPerfKernelUpdate, startTime);
+        gKernelUpdatesSent++;
+    }
+
+    if (gClamshellStateDirty) {
+        gClamshellStateDirty = false;
+        in = (uint64_t)gPendingClamshellState;
+        IOConnectCallMethod(connect, kPMSetClamshellSleepState, 
+                            &in, 1, 
+                            NULL, 0, NULL, 
+                            NULL, NULL, NULL);
+        gKernelUpdatesSent++;
+    }
+}
+
+static void scheduleKernelAssertionUpdates(void)
+{
+    if (gKernelUpdateScheduled)
+        return;
+    gKernelUpdateScheduled = true;
+
+    if (gKernelUpdateDelayMS) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, gKernelUpdateDelayMS * NSEC_PER_MSEC),
+                       dispatch_get_main_queue(), ^{ flushKernelAssertionUpdates(); });
+    }
+    else {
+        dispatch_async(dispatch_get_main_queue(), ^{ flushKernelAssertionUpdates(); });
+    }
+}
+
+__private_extern__ void PMAssertions_FlushKernelUpdates(void)
+{
+    if (gKernelBitsDirty || gClamshellStateDirty)
+        flushKernelAssertionUpdates();
+}
+
+__private_extern__ uint32_t getKernelAssertionUpdateCount(bool suppressed)
+{
+    return suppressed ? gKernelUpdatesSuppressed : gKernelUpdatesSent;
+}
+
+__private_extern__ uint32_t getKernelAssertionCoalesceDelay(void)
+{
+    return gKernelUpdateDelayMS;
+}
+
+__private_extern__ IOReturn setKernelAssertionCoalesceDelay(uint32_t delayMS)
+{
+    if (delayMS > kMaxKernelUpdateDelayMS)
+        return kIOReturnBadArgument;
+
+    gKernelUpdateDelayMS = delayMS;
+    return kIOReturnSuccess;
+}
+
 // Changes clamshell sleep state
 // 1 - disabled, 0 - enabled
 static void setClamshellSleepState(int clamshellSleepState)
 {
-    io_connect_t        connect = IO_OBJECT_NULL;
-    const uint64_t      in = (uint64_t)clamshellSleepState;
     static int          prevState = -1;
 
     if ( prevState == clamshellSleepState) return;
     prevState = clamshellSleepState;
 
-    if ( (connect = getRootDomainConnect()) == IO_OBJECT_NULL)
-        return;
-
+    if (gClamshellStateDirty)
+        gKernelUpdatesSuppressed++;
 
-    IOConnectCallMethod(connect, kPMSetClamshellSleepState, 
-                        &in, 1, 
-                        NULL, 0, NULL, 
-                        NULL, NULL, NULL);
+    gPendingClamshellState = clamshellSleepState;
+    gClamshellStateDirty = true;
+    scheduleKernelAssertionUpdates();
     return;
 }
 
@@ -495,16 +694,21 @@ static void sendActivityTickle ()
 }
 static void sendUserAssertionsToKernel(uint32_t user_assertions)
 {
-    io_connect_t                connect = IO_OBJECT_NULL;
-    const uint64_t              in = (uint64_t)user_assertions;
+    if (gKernelBitsDirty)
+        gKernelUpdatesSuppressed++;
 
-    if ( (connect = getRootDomainConnect()) == IO_OBJECT_NULL)
-        return;
+    gPendingKernelBits = user_assertions;
+    gKernelBitsDirty = true;
 
-    IOConnectCallMethod(connect, kPMSetUserAssertionLevels, 
-                        &in, 1, 
-                        NULL, 0, NULL, 
-                        NULL, NULL, NULL);
+    if (user_assertions & ~gSentKernelBits & kSleepPreventingKernelBits) {
+        // The system may be on its way to sleep; don't let this raise wait
+        if (gBatchDepth)
+            gKernelUpdateUrgent = true;
+        else
+            flushKernelAssertionUpdates();
+        return;
+    }
+    scheduleKernelAssertionUpdates();
 
     return;
 }
@@ -759,6 +963,167 @@ static CFDictionaryRef copyAggregateValuesDictionary(void)
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+static void initSharedAssertionState(void)
+{
+    gSharedState = PMSharedStateMap(kPMAssertionStateShmName, sizeof(PMAssertionSharedState));
+    if (!gSharedState)
+        return;
+
+    // Leave seq alone so readers of a previous powerd's page notice the reset.
+    PMSharedStateBeginWrite(&gSharedState->seq);
+    gSharedState->version = kPMAssertionStateShmVersion;
+    gSharedState->kernelBits = 0;
+    gSharedState->aggregates = 0;
+    PMSharedStateEndWrite(&gSharedState->seq);
+}
+
+static void publishAssertionState(void)
+{
+    if (!gSharedState)
+        return;
+
+    PMSharedStateBeginWrite(&gSharedState->seq);
+    gSharedState->kernelBits = kerAssertionBits;
+    gSharedState->aggregates = (uint32_t)aggregate_assertions;
+    PMSharedStateEndWrite(&gSharedState->seq);
+}
+
+static inline void assertionsChanged(void)
+{
+    gAssertionsGen++;
+    if (gAssertionsData)
+        PMReplySnapshotSet(&gAssertionsData, NULL);
+}
+
+/*
+ * Returns the binary plist of copyAggregateValuesDictionary(), rebuilding it
+ * only if an aggregate level changed since the last request.
+ */
+static CFDataRef copySerializedAggregates(void)
+{
+    CFDictionaryRef     aggregates = NULL;
+    CFDataRef           data = NULL;
+
+    if ((data = PMReplySnapshotCopy(&gAggregatesData)))
+        return data;
+
+    aggregates = copyAggregateValuesDictionary();
+    if (!aggregates)
+        return NULL;
+
+    data = CFPropertyListCreateData(0, aggregates,
+                                    kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    CFRelease(aggregates);
+
+    if (data)
+        PMReplySnapshotSet(&gAggregatesData, data);
+
+    return data;
+}
+
+static void snapshotSetValue(CFMutableDictionaryRef snapshot, CFStringRef key, CFTypeRef value)
+{
+    if (value) {
+        CFDictionarySetValue(snapshot, key, value);
+        CFRelease(value);
+    }
+}
+
+/*
+ * Everything pmset -g reports, gathered in one pass for kPMSnapshotMIGCopyAll.
+ */
+static CFDictionaryRef copyPMSnapshot(void)
+{
+    CFMutableDictionaryRef  snapshot = NULL;
+    CFAbsoluteTime          now = CFAbsoluteTimeGetCurrent();
+    uint32_t                thermalLevel = 0;
+    CFDictionaryRef         cpuStatus = NULL;
+
+    snapshot = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                         &kCFTypeDictionaryValueCallBacks);
+    if (!snapshot)
+        return NULL;
+
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotTimestampKey),
+                     CFDateCreate(0, now));
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotSettingsKey),
+                     PMSettings_CopyActivePMSettings());
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotAssertionsKey),
+                     copyPIDAssertionDictionaryFlattened());
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotAssertionStatusKey),
+                     copyAggregateValuesDictionary());
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotPowerSourcesKey),
+                     copyPowerSourceDescriptions());
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotScheduledEventsKey),
+                     copyScheduledPowerEvents());
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotRepeatEventsKey),
+                     copyRepeatPowerEvents());
+#if !TARGET_OS_EMBEDDED
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotUPSThresholdsKey),
+                     IOPMCopyUPSShutdownLevels(CFSTR(kIOPMDefaultUPSThresholds)));
+#endif
+    snapshotSetValue(snapshot, CFSTR(kPMSnapshotSystemLoadKey),
+                     copySystemLoadDetailed());
+
+    if (kIOReturnSuccess == IOPMGetThermalWarningLevel(&thermalLevel)) {
+        snapshotSetValue(snapshot, CFSTR(kPMSnapshotThermalWarningKey),
+                         CFNumberCreate(0, kCFNumberSInt32Type, &thermalLevel));
+    }
+    if (kIOReturnSuccess == IOPMCopyCPUPowerStatus(&cpuStatus)) {
+        snapshotSetValue(snapshot, CFSTR(kPMSnapshotCPUPowerKey), cpuStatus);
+    }
+
+    return snapshot;
+}
+
+/*
+ * Returns the binary plist of copyPIDAssertionDictionaryFlattened(). While
+ * any timed assertion exists the TimeLeft values change on every call, so
+ * the result is only cached when no assertion has a pending timeout.
+ */
+static CFDataRef copySerializedAssertions(void)
+{
+    CFArrayRef          assertions = NULL;
+    CFDataRef           data = NULL;
+    bool                cacheable = true;
+    int                 i;
+
+    if ((data = PMReplySnapshotCopy(&gAssertionsData)))
+        return data;
+
+    for (i = 0; i < kIOPMNumAssertionTypes; i++) {
+        if (gAssertionTypes[i].timedHeapCnt) {
+            cacheable = false;
+            break;
+        }
+    }
+
+    assertions = copyPIDAssertionDictionaryFlattened();
+    if (!assertions)
+        return NULL;
+
+    data = CFPropertyListCreateData(0, assertions,
+                                    kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    CFRelease(assertions);
+
+    if (data && cacheable)
+        PMReplySnapshotSet(&gAssertionsData, data);
+
+    return data;
+}
+
+__private_extern__ uint32_t getAssertionAggregatesGeneration(void)
+{
+    return gAggregatesGen;
+}
+
+__private_extern__ uint32_t getAssertionsGeneration(void)
+{
+    return gAssertionsGen;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 __private_extern__ void _PMAssertionsDriverAssertionsHaveChanged(uint32_t changedDriverAssertions)
 {
     if (gAggChange)
@@ -1190,8 +1555,13 @@ __private_extern__ void _ProxyAssertions(const struct IOPMSystemCapabilityChange
     if ( IOPMIsADarkWake(capArgs->toCapabilities) &&
          IOPMIsASleep(capArgs->fromCapabilities) )
     {
+#if !TARGET_OS_EMBEDDED
+        // Resolved once for this wake by _updateWakeReason()
+        getPlatformWakeReason(&wakeReason, &wakeType);
+#else
         wakeType = _copyRootDomainProperty(CFSTR(kIOPMRootDomainWakeTypeKey));
         wakeReason = _copyRootDomainProperty(CFSTR(kIOPMRootDomainWakeReasonKey));
+#endif
 
         if (isA_CFString(wakeReason) && CFEqual(wakeReason, kIORootDomainWakeReasonDarkPME))
         {
@@ -1232,11 +1602,13 @@ __private_extern__ void _ProxyAssertions(const struct IOPMSystemCapabilityChange
             _AssertForDeviceEnumeration( );
         }
 
+#if TARGET_OS_EMBEDDED
         if (wakeType) {
             CFRelease(wakeType);
         }
         if (wakeReason)
             CFRelease(wakeReason);
+#endif
     }
 
 }
@@ -1358,10 +1730,12 @@ static ProcessInfo* processInfoCreate(pid_t p)
     dispatch_resume(proc->disp_src);
 
     proc_name(p, name, sizeof(name));
-    proc->name = CFStringCreateWithCString(0, name, kCFStringEncodingUTF8);
+    proc->nameID = PMStringInternCString(name);
+    proc->name = PMStringGet(proc->nameID);
     proc->pid = p;
     proc->retain_cnt++;
     proc->create_seq = create_seq++;
+    LIST_INIT(&proc->assertions);
 
     CFDictionarySetValue(gProcessDict, (uintptr_t)p, (const void *)proc);
 
@@ -1423,7 +1797,7 @@ static void processInfoRelease(pid_t p)
     if (proc->retain_cnt == 1) {
 
         dispatch_release(proc->disp_src);
-        if (proc->name) CFRelease(proc->name);
+        PMStringRelease(proc->nameID);
         CFDictionaryRemoveValue(gProcessDict, (uintptr_t)p);
         free(proc);
     }
@@ -1599,16 +1973,104 @@ void updateAppStats(assertion_t *assertion, assertionOps op)
 
 }
 
+/*
+ * Slab allocator for assertion_t.
+ *
+ * Released slots are appended to the tail of the free list, so a slot index is
+ * re-used only after every other free slot has been handed out. Together with
+ * the generation count this keeps IDs unique for as long as possible.
+ */
+static void initAssertionSlab(void)
+{
+    uint32_t i;
+
+    gAssertionSlab = calloc(kMaxAssertions, sizeof(assertionSlot_t));
+    if (!gAssertionSlab) {
+        return;
+    }
+
+    for (i = 0; i < kMaxAssertions; i++) {
+        gAssertionSlab[i].gen = 1;
+        gAssertionSlab[i].nextFree = (i+1 < kMaxAssertions) ? (i+1) : kAssertionSlotNone;
+    }
+    gFreeSlotHead = 0;
+    gFreeSlotTail = kMaxAssertions - 1;
+}
+
+static assertion_t *allocAssertionSlot(void)
+{
+    assertionSlot_t *slot;
+    uint32_t        idx;
+
+    if (!gAssertionSlab || (gFreeSlotHead == kAssertionSlotNone)) {
+        return NULL;
+    }
+
+    idx = gFreeSlotHead;
+    slot = &gAssertionSlab[idx];
+
+    gFreeSlotHead = slot->nextFree;
+    if (gFreeSlotHead == kAssertionSlotNone) {
+        gFreeSlotTail = kAssertionSlotNone;
+    }
+
+    slot->nextFree = kAssertionSlotNone;
+    slot->inUse = true;
+    memset(&slot->assertion, 0, sizeof(slot->assertion));
+    slot->assertion.assertionId = ID_FROM_INDEX(idx, slot->gen);
+
+    return &slot->assertion;
+}
+
+static void freeAssertionSlot(assertion_t *assertion)
+{
+    int             idx = INDEX_FROM_ID(assertion->assertionId);
+    assertionSlot_t *slot;
+
+    if ((idx < 0) || (idx >= kMaxAssertions)) {
+        return;
+    }
+
+    slot = &gAssertionSlab[idx];
+    slot->inUse = false;
+    if (++slot->gen > kAssertionIDGenMask) {
+        slot->gen = 1;
+    }
+
+    slot->nextFree = kAssertionSlotNone;
+    if (gFreeSlotTail == kAssertionSlotNone) {
+        gFreeSlotHead = idx;
+    }
+    else {
+        gAssertionSlab[gFreeSlotTail].nextFree = idx;
+    }
+    gFreeSlotTail = idx;
+}
+
+/*
+ * Returns the assertion for 'id' if the ID refers to a live slot of the same
+ * generation. Doesn't check on the owning process.
+ */
+static assertion_t *assertionForID(IOPMAssertionID id)
+{
+    int             idx = INDEX_FROM_ID(id);
+    assertionSlot_t *slot;
+
+    if (!gAssertionSlab || (idx < 0) || (idx >= kMaxAssertions))
+        return NULL;
+
+    slot = &gAssertionSlab[idx];
+    if (!slot->inUse || (slot->gen != GEN_FROM_ID(id)))
+        return NULL;
+
+    return &slot->assertion;
+}
+
 static IOReturn lookupAssertion(pid_t pid, IOPMAssertionID id, assertion_t **assertion)
 {
-    unsigned int idx = INDEX_FROM_ID(id);
     assertion_t  *tmp_a = NULL;
 
-    if (idx >= kMaxAssertions)
-        return kIOReturnBadArgument;
-
-    if( CFDictionaryGetValueIfPresent(gAssertionsArray, 
-                                      (uintptr_t)idx, (const void **)&tmp_a) == false)
+    if ((tmp_a = assertionForID(id)) == NULL)
         return kIOReturnBadArgument;
 
     if (tmp_a->pinfo->pid != pid)
@@ -1996,8 +2458,80 @@ static void releaseStatsBuf(ProcessInfo *pinfo)
     memset(pinfo->stats, 0, sizeof(pinfo->stats));
     free(pinfo->reportBuf);
     pinfo->reportBuf = NULL;
+    PMMemoryCharge(kPMMemProcessStats, -(ssize_t)SIMPLEARRAY_BUFSIZE(kMaxEffectStats));
+    processInfoRelease(pinfo->pid);
+
+}
+
+static void removeExitedProcStats(int idx, bool freeBuf)
+{
+    if (freeBuf)
+        free(gExitedProcStats[idx].reportBuf);
+
+    memmove(&gExitedProcStats[idx], &gExitedProcStats[idx + 1],
+            (gExitedProcCount - idx - 1) * sizeof(exitedProcStats_t));
+    gExitedProcCount--;
+    PMMemoryCharge(kPMMemExitedProcessStats,
+                   -(ssize_t)(sizeof(exitedProcStats_t) + SIMPLEARRAY_BUFSIZE(kMaxEffectStats)));
+}
+
+static void releaseExitedProcStats(void)
+{
+    while (gExitedProcCount)
+        removeExitedProcStats(gExitedProcCount - 1, true);
+
+    free(gExitedProcStats);
+    gExitedProcStats = NULL;
+    gExitedProcCapacity = 0;
+}
+
+/*
+ * Moves the stats of an exited process into gExitedProcStats, so that its
+ * ProcessInfo and dispatch source can go. The process holds no assertions
+ * by now, so its stats are complete. Processes created longest ago are
+ * evicted to stay under the kPMMemExitedProcessStats cap.
+ */
+static void retireStatsBuf(ProcessInfo *pinfo)
+{
+    exitedProcStats_t   *grown;
+    size_t              recordBytes = sizeof(exitedProcStats_t) + SIMPLEARRAY_BUFSIZE(kMaxEffectStats);
+    int                 i;
+
+    while (gExitedProcCount && PMMemoryWouldExceedCap(kPMMemExitedProcessStats, recordBytes)) {
+        removeExitedProcStats(0, true);
+        PMMemoryNoteEviction(kPMMemExitedProcessStats);
+    }
+    if (PMMemoryWouldExceedCap(kPMMemExitedProcessStats, recordBytes)) {
+        PMMemoryNoteEviction(kPMMemExitedProcessStats);
+        goto exit;
+    }
+
+    if (gExitedProcCount == gExitedProcCapacity) {
+        grown = realloc(gExitedProcStats, (gExitedProcCapacity + 16) * sizeof(exitedProcStats_t));
+        if (!grown)
+            goto exit;
+        gExitedProcStats = grown;
+        gExitedProcCapacity += 16;
+    }
+
+    for (i = gExitedProcCount; (i > 0) && (gExitedProcStats[i-1].create_seq > pinfo->create_seq); i--)
+        gExitedProcStats[i] = gExitedProcStats[i-1];
+
+    gExitedProcStats[i].reportBuf = pinfo->reportBuf;
+    gExitedProcStats[i].pid = pinfo->pid;
+    gExitedProcStats[i].create_seq = pinfo->create_seq;
+    gExitedProcCount++;
+    PMMemoryCharge(kPMMemExitedProcessStats, recordBytes);
+
+    // The buffer now belongs to gExitedProcStats
+    pinfo->reportBuf = NULL;
+    memset(pinfo->stats, 0, sizeof(pinfo->stats));
+    PMMemoryCharge(kPMMemProcessStats, -(ssize_t)SIMPLEARRAY_BUFSIZE(kMaxEffectStats));
     processInfoRelease(pinfo->pid);
+    return;
 
+exit:
+    releaseStatsBuf(pinfo);
 }
 
 
@@ -2009,6 +2543,20 @@ static void allocStatsBuf(ProcessInfo *pinfo)
     if (pinfo->reportBuf) return;
 
     size_t nbytes = SIMPLEARRAY_BUFSIZE(kMaxEffectStats);
+
+    // A reused pid picks up the stats its exited process left, as it
+    // would have when the exited process's ProcessInfo was kept around
+    for (int j = 0; j < gExitedProcCount; j++) {
+        if (gExitedProcStats[j].pid == pinfo->pid) {
+            pinfo->reportBuf = gExitedProcStats[j].reportBuf;
+            removeExitedProcStats(j, false);
+            memset(pinfo->stats, 0, sizeof(pinfo->stats));
+            PMMemoryCharge(kPMMemProcessStats, nbytes);
+            processInfoRetain(pinfo->pid);
+            return;
+        }
+    }
+
     pinfo->reportBuf = malloc(nbytes);
 
     if (pinfo->reportBuf) {
@@ -2019,6 +2567,7 @@ static void allocStatsBuf(ProcessInfo *pinfo)
             SIMPLEARRAY_SETVALUE(pinfo->reportBuf, i, 0);
         }
         memset(pinfo->stats, 0, sizeof(pinfo->stats));
+        PMMemoryCharge(kPMMemProcessStats, nbytes);
         processInfoRetain(pinfo->pid);
     }
 }
@@ -2068,6 +2617,7 @@ void setAssertionActivityAggregate(int value)
             releaseStatsBuf(procs[j]);
         }
         free(procs);
+        releaseExitedProcStats();
 
         for (i=0; i < kIOPMNumAssertionTypes; i++)
         {
@@ -2124,10 +2674,19 @@ uint8_t getAssertionLevel(kerAssertionType idx)
 
 void setAggregateLevel(kerAssertionType idx, uint8_t val)
 {
+    int prev = aggregate_assertions;
+
     if (val)
         aggregate_assertions |= (1 << idx);
     else
         aggregate_assertions &= ~(1<<idx);
+
+    if (aggregate_assertions != prev) {
+        publishAssertionState();
+        gAggregatesGen++;
+        if (gAggregatesData)
+            PMReplySnapshotSet(&gAggregatesData, NULL);
+    }
 }
 
 uint32_t getKerAssertionBits( )
@@ -2138,6 +2697,7 @@ uint32_t getKerAssertionBits( )
 void insertInactiveAssertion(assertion_t *assertion, assertionType_t *assertType) 
 {
     LIST_INSERT_HEAD(&assertType->inactive, assertion, link);
+    assertionsChanged();
     assertion->state &= ~kAssertionStateTimed;
     assertion->state |= kAssertionStateInactive;
 }
@@ -2146,12 +2706,14 @@ void removeInactiveAssertion(assertion_t *assertion, assertionType_t *assertType
 {
     LIST_REMOVE(assertion, link);
     assertion->state &= ~kAssertionStateInactive;
+    assertionsChanged();
 }
 
 void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 {
     LIST_INSERT_HEAD(&assertType->active, assertion, link);
     assertion->state &= ~(kAssertionStateTimed|kAssertionStateInactive);
+    assertionsChanged();
 
     if ( (assertType->flags & kAssertionTypeNotValidOnBatt) &&
          (assertion->state & kAssertionStateValidOnBatt) )
@@ -2167,6 +2729,7 @@ void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 void removeActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 {
     LIST_REMOVE(assertion, link);
+    assertionsChanged();
 
     if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
         assertType->validOnBattCount--;
@@ -2179,17 +2742,122 @@ void removeActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 }
 
 
-void resetAssertionTimer(assertionType_t *assertType)
+/*
+ * Timed assertions of each type are kept on the 'activeTimed' list for
+ * iteration and in a binary min-heap ordered by timeout. Only the heap root
+ * matters for arming the per-type timer, so inserts and removals are
+ * O(log n) instead of walking a sorted list.
+ */
+#define kTimedHeapGrowBy            16
+
+static inline assertion_t *timedHeapFirst(assertionType_t *assertType)
 {
-    uint64_t currTime ;
-    assertion_t *nextAssertion = NULL;
+    return (assertType->timedHeapCnt) ? assertType->timedHeap[0] : NULL;
+}
 
-    nextAssertion = LIST_FIRST(&assertType->activeTimed);
-    if (!nextAssertion) return;
+static inline void timedHeapSet(assertionType_t *assertType, uint32_t idx, assertion_t *assertion)
+{
+    assertType->timedHeap[idx] = assertion;
+    assertion->heapIdx = idx;
+}
 
-    currTime = getMonotonicTime();
+static void timedHeapSiftUp(assertionType_t *assertType, uint32_t idx)
+{
+    assertion_t *assertion = assertType->timedHeap[idx];
+    uint32_t    parent;
 
-    if (nextAssertion->timeout <= currTime) {
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (assertType->timedHeap[parent]->timeout <= assertion->timeout)
+            break;
+        timedHeapSet(assertType, idx, assertType->timedHeap[parent]);
+        idx = parent;
+    }
+    timedHeapSet(assertType, idx, assertion);
+}
+
+static void timedHeapSiftDown(assertionType_t *assertType, uint32_t idx)
+{
+    assertion_t *assertion = assertType->timedHeap[idx];
+    uint32_t    child;
+
+    while ((child = 2*idx + 1) < assertType->timedHeapCnt) {
+        if ((child + 1 < assertType->timedHeapCnt) &&
+            (assertType->timedHeap[child+1]->timeout < assertType->timedHeap[child]->timeout))
+            child++;
+        if (assertion->timeout <= assertType->timedHeap[child]->timeout)
+            break;
+        timedHeapSet(assertType, idx, assertType->timedHeap[child]);
+        idx = child;
+    }
+    timedHeapSet(assertType, idx, assertion);
+}
+
+/* Makes room for one more entry. Must succeed before the assertion is linked anywhere. */
+static bool timedHeapReserve(assertionType_t *assertType)
+{
+    assertion_t **newHeap;
+
+    if (assertType->timedHeapCnt < assertType->timedHeapSize)
+        return true;
+
+    newHeap = realloc(assertType->timedHeap,
+                      (assertType->timedHeapSize + kTimedHeapGrowBy) * sizeof(assertion_t *));
+    if (!newHeap) {
+        asl_log(0, 0, ASL_LEVEL_ERR, "Failed to grow timeout heap for assertion type %d\n", assertType->kassert);
+        return false;
+    }
+    assertType->timedHeap = newHeap;
+    assertType->timedHeapSize += kTimedHeapGrowBy;
+    return true;
+}
+
+/* Caller has already called timedHeapReserve() */
+static void timedHeapInsert(assertionType_t *assertType, assertion_t *assertion)
+{
+    timedHeapSet(assertType, assertType->timedHeapCnt++, assertion);
+    timedHeapSiftUp(assertType, assertion->heapIdx);
+}
+
+static void timedHeapRemove(assertionType_t *assertType, assertion_t *assertion)
+{
+    uint32_t    idx = assertion->heapIdx;
+    assertion_t *last;
+
+    if ((idx >= assertType->timedHeapCnt) || (assertType->timedHeap[idx] != assertion))
+        return;
+
+    last = assertType->timedHeap[--assertType->timedHeapCnt];
+    if (last == assertion)
+        return;
+
+    timedHeapSet(assertType, idx, last);
+    if ((idx > 0) && (assertType->timedHeap[(idx - 1) / 2]->timeout > last->timeout))
+        timedHeapSiftUp(assertType, idx);
+    else
+        timedHeapSiftDown(assertType, idx);
+}
+
+/* Re-orders the heap after timeouts of several assertions are changed in place */
+static void timedHeapRebuild(assertionType_t *assertType)
+{
+    uint32_t i;
+
+    for (i = assertType->timedHeapCnt / 2; i-- > 0; )
+        timedHeapSiftDown(assertType, i);
+}
+
+void resetAssertionTimer(assertionType_t *assertType)
+{
+    uint64_t currTime ;
+    assertion_t *nextAssertion = NULL;
+
+    nextAssertion = timedHeapFirst(assertType);
+    if (!nextAssertion) return;
+
+    currTime = getMonotonicTime();
+
+    if (nextAssertion->timeout <= currTime) {
         CFRunLoopPerformBlock(_getPMRunLoop(), kCFRunLoopDefaultMode, ^{ handleAssertionTimeout(assertType); });
         CFRunLoopWakeUp(_getPMRunLoop());
     }
@@ -2207,12 +2875,7 @@ void resetAssertionTimer(assertionType_t *assertType)
 
 static void releaseAssertionMemory(assertion_t *assertion, assertLogAction logAction)
 {
-    int idx = INDEX_FROM_ID(assertion->assertionId);
-    assertion_t *tmp_a = NULL;
-
-    if ( (idx < 0) || (idx >= kMaxAssertions) || 
-         (CFDictionaryGetValueIfPresent(gAssertionsArray, 
-                                        (uintptr_t)idx, (const void **)&tmp_a) == false) || (tmp_a != assertion) ) {
+    if (assertionForID(assertion->assertionId) != assertion) {
 #ifdef DEBUG
         abort();
 #endif
@@ -2221,12 +2884,12 @@ static void releaseAssertionMemory(assertion_t *assertion, assertLogAction logAc
 
     assertion->retainCnt = 0;
     logAssertionEvent(logAction, assertion);
-    CFDictionaryRemoveValue(gAssertionsArray, (uintptr_t)idx);
     if (assertion->props) CFRelease(assertion->props);
 
-
+    PMStringRelease(assertion->nameID);
+    LIST_REMOVE(assertion, pidLink);
     processInfoRelease(assertion->pinfo->pid);
-    free(assertion);
+    freeAssertionSlot(assertion);
 }
 
 void handleAssertionTimeout(assertionType_t *assertType)
@@ -2238,7 +2901,7 @@ void handleAssertionTimeout(assertionType_t *assertType)
     CFStringRef     timeoutAction = NULL;
     bool            displayProxy = false;
 
-    while( (assertion = LIST_FIRST(&assertType->activeTimed)) )
+    while( (assertion = timedHeapFirst(assertType)) )
     {
         if (assertion->timeout > currtime) {
             assertion = NULL;
@@ -2246,6 +2909,7 @@ void handleAssertionTimeout(assertionType_t *assertType)
         }
         timedoutCnt++;
 
+        timedHeapRemove(assertType, assertion);
         LIST_REMOVE(assertion, link);
         assertion->state &= ~kAssertionStateTimed;
 
@@ -2261,6 +2925,7 @@ void handleAssertionTimeout(assertionType_t *assertType)
         if ((dateNow = CFDateCreate(0, CFAbsoluteTimeGetCurrent()))) {
             CFDictionarySetValue(assertion->props, kIOPMAssertionTimedOutDateKey, dateNow);            
             CFRelease(dateNow);
+            assertionsChanged();
         }
 
 
@@ -2308,11 +2973,13 @@ void removeTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
     bool isTheFirstOne = false;
 
     CFDictionaryRemoveValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey);
-    if (LIST_FIRST(&assertType->activeTimed) == assertion) {
+    if (timedHeapFirst(assertType) == assertion) {
         isTheFirstOne = true;
     }
+    timedHeapRemove(assertType, assertion);
     LIST_REMOVE(assertion, link);
     assertion->state &= ~kAssertionStateTimed;
+    assertionsChanged();
 
     if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
         assertType->validOnBattCount--;
@@ -2332,7 +2999,7 @@ void updateAssertionTimer(assertionType_t *assertType)
     uint64_t    currTime;
     assertion_t *assertion = NULL;
 
-    if ((assertion = LIST_FIRST(&assertType->activeTimed)) == NULL) return;
+    if ((assertion = timedHeapFirst(assertType)) == NULL) return;
 
     /* Update/create the dispatch timer.  */
     if (assertType->timer == NULL) {
@@ -2369,54 +3036,25 @@ void updateAssertionTimer(assertionType_t *assertType)
 
 }
 
-/* Inserts assertion into activeTimed list, sorted by timeout */
-static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
+/*
+ * Inserts assertion into activeTimed list and the timeout heap.
+ * Returns false, with the assertion left unlinked, if the heap can't grow.
+ */
+static bool insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
 {
-    assertion_t *a, *prev;
-    CFNumberRef         timeLeftCF = NULL;
-    uint64_t            currTime, timeLeft;
-    CFDateRef           updateDate = NULL;
-
-    currTime = getMonotonicTime();
-    if (assertion->timeout > currTime) {
-        /* Update timeout time left property */
-        timeLeft = (assertion->timeout-currTime);
-        int timeLeft32 = (int)timeLeft;
-        timeLeftCF = CFNumberCreate(0, kCFNumberIntType, &timeLeft32);
-
-        if (timeLeftCF) {
-            CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey, timeLeftCF);
-            CFRelease(timeLeftCF);
-        }
-
-        updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-        if (updateDate) {
-            CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
-            CFRelease(updateDate);
-        }
-    }
-
-    if (LIST_EMPTY(&assertType->activeTimed) ) {
-        LIST_INSERT_HEAD(&assertType->activeTimed, assertion, link);
-    }
-    else {
-        LIST_FOREACH(a, &assertType->activeTimed, link) 
-        {
-            prev = a;
-            if (a->timeout > assertion->timeout)
-                break;
-        }
-        if (a)
-            LIST_INSERT_BEFORE(a, assertion, link);
-        else
-            LIST_INSERT_AFTER(prev, assertion, link);
-    }
+    if (!timedHeapReserve(assertType))
+        return false;
 
+    LIST_INSERT_HEAD(&assertType->activeTimed, assertion, link);
+    timedHeapInsert(assertType, assertion);
+    assertionsChanged();
+    return true;
 }
 
-void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, bool updateTimer)
+IOReturn insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, bool updateTimer)
 {
-    insertByTimeout(assertion, assertType);
+    if (!insertByTimeout(assertion, assertType))
+        return kIOReturnNoMemory;
 
     assertion->state |= kAssertionStateTimed;
     if ( (assertType->flags & kAssertionTypeNotValidOnBatt) &&
@@ -2432,12 +3070,12 @@ void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
      * If this assertion is not the one with earliest timeout,
      * there is nothing to do.
      */
-    if (LIST_FIRST(&assertType->activeTimed) != assertion)
-        return;
+    if (timedHeapFirst(assertType) != assertion)
+        return kIOReturnSuccess;
 
     if (updateTimer) updateAssertionTimer(assertType);
 
-    return;
+    return kIOReturnSuccess;
 }
 
 
@@ -2459,10 +3097,199 @@ static void releaseAssertion(assertion_t *assertion, bool callHandler)
 
     if (!callHandler) return;
 
-    if (assertType->handler)
-        (*assertType->handler)(assertType, kAssertionOpRelease);
+    callAssertionHandler(assertType, kAssertionOpRelease);
+}
+
+static void callAssertionHandler(assertionType_t *assertType, assertionOps op)
+{
+    if (!assertType->handler)
+        return;
+
+    if (gBatchDepth) {
+        gBatchPendingOps[assertType->kassert] |= (1 << op);
+        return;
+    }
 
+    (*assertType->handler)(assertType, op);
+}
+
+static void beginAssertionBatch(void)
+{
+    gBatchDepth++;
+}
+
+static void endAssertionBatch(void)
+{
+    assertionType_t     *assertType;
+    uint8_t             ops;
+    bool                replayed;
+    int                 i;
+
+    if (gBatchDepth > 1) {
+        gBatchDepth--;
+        return;
+    }
+
+    /*
+     * Replay recorded ops with the batch still open. Kernel updates made by
+     * the handlers are coalesced into a single flush. A raise is replayed
+     * before a release; each handler looks at the final state of its lists, so this
+     * leaves the type raised only if it still has active assertions.
+     * Handlers may create or release assertions of their own, so repeat
+     * until nothing is pending.
+     */
+    do {
+        replayed = false;
+        for (i = 0; i < kIOPMNumAssertionTypes; i++) {
+            if ((ops = gBatchPendingOps[i]) == 0)
+                continue;
+            gBatchPendingOps[i] = 0;
+            replayed = true;
+
+            assertType = &gAssertionTypes[i];
+            if (ops & (1 << kAssertionOpRaise))
+                (*assertType->handler)(assertType, kAssertionOpRaise);
+            if (ops & (1 << kAssertionOpRelease))
+                (*assertType->handler)(assertType, kAssertionOpRelease);
+        }
+    } while (replayed);
+
+    gBatchDepth = 0;
+
+    if (gKernelUpdateUrgent)
+        flushKernelAssertionUpdates();
+}
+
+__private_extern__ void PMAssertions_HandleBatchRequest(
+                                xpc_connection_t    peer,
+                                xpc_object_t        request,
+                                audit_token_t       token)
+{
+    xpc_object_t            ops = NULL;
+    xpc_object_t            results = NULL;
+    xpc_object_t            noMemory = NULL;
+    xpc_object_t            reply = NULL;
+    pid_t                   callerPID = -1;
+    uid_t                   callerUID = -1;
+    gid_t                   callerGID = -1;
+    int                     disableAppSleep = 0;
+    int                     enableAppSleep = 0;
+    size_t                  opCnt, i;
+
+    audit_token_to_au32(token, NULL, NULL, NULL, &callerUID, &callerGID, &callerPID, NULL, NULL);
+
+    ops = xpc_dictionary_get_value(request, kAssertionBatchKey);
+    if (!ops || (xpc_get_type(ops) != XPC_TYPE_ARRAY))
+        return;
+
+    if ( !(reply = xpc_dictionary_create_reply(request)) )
+        return;
+
+    opCnt = xpc_array_get_count(ops);
+    if (opCnt > kAssertionBatchMaxOps) {
+        // Refuse the whole batch rather than act on only part of it
+        xpc_dictionary_set_int64(reply, kAssertionBatchReturnKey, kIOReturnBadArgument);
+        goto exit;
+    }
+
+    results = xpc_array_create(NULL, 0);
+    noMemory = xpc_dictionary_create(NULL, NULL, 0);
+    if (!results || !noMemory) {
+        xpc_dictionary_set_int64(reply, kAssertionBatchReturnKey, kIOReturnNoMemory);
+        goto exit;
+    }
+
+    // Stands in for an op whose own result can't be allocated, so that
+    // results[i] always answers ops[i]. Such an op is not performed.
+    xpc_dictionary_set_int64(noMemory, kAssertionBatchIDKey, kIOPMNullAssertionID);
+    xpc_dictionary_set_int64(noMemory, kAssertionBatchReturnKey, kIOReturnNoMemory);
+
+    beginAssertionBatch();
+    for (i = 0; i < opCnt; i++) {
+        xpc_object_t            op = xpc_array_get_value(ops, i);
+        xpc_object_t            result = xpc_dictionary_create(NULL, NULL, 0);
+        CFMutableDictionaryRef  props = NULL;
+        CFDataRef               unfolder = NULL;
+        IOPMAssertionID         assertion_id = kIOPMNullAssertionID;
+        IOReturn                ret = kIOReturnBadArgument;
+        const void              *bytes;
+        size_t                  len;
+
+        if (!result) {
+            xpc_array_append_value(results, noMemory);
+            continue;
+        }
+
+        if (xpc_get_type(op) != XPC_TYPE_DICTIONARY) {
+            goto next_op;
+        }
 
+        switch (xpc_dictionary_get_int64(op, kAssertionBatchOpKey)) {
+        case kAssertionBatchOpCreate:
+            bytes = xpc_dictionary_get_data(op, kAssertionBatchPropsKey, &len);
+            if (bytes) {
+                unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)bytes, len, kCFAllocatorNull);
+            }
+            if (unfolder) {
+                props = (CFMutableDictionaryRef)
+                            CFPropertyListCreateWithData(0, unfolder,
+                                                         kCFPropertyListMutableContainersAndLeaves,
+                                                         NULL, NULL);
+                CFRelease(unfolder);
+            }
+            if (!isA_CFDictionary(props)) {
+                ret = kIOReturnBadArgument;
+            }
+            else if (!callerIsEntitledToAssertion(token, props)) {
+                ret = kIOReturnNotPrivileged;
+            }
+            else if (propertiesDictRequiresRoot(props)
+                     && ( !(callerIsRoot(callerUID) || callerIsAdmin(callerUID, callerGID)))) {
+                ret = kIOReturnNotPrivileged;
+            }
+            else {
+                ret = doCreate(callerPID, props, &assertion_id, NULL);
+            }
+            if (props) {
+                CFRelease(props);
+            }
+            break;
+
+        case kAssertionBatchOpRelease:
+            assertion_id = (IOPMAssertionID)xpc_dictionary_get_int64(op, kAssertionBatchIDKey);
+            ret = doRelease(callerPID, assertion_id);
+            break;
+
+        default:
+            break;
+        }
+
+next_op:
+        xpc_dictionary_set_int64(result, kAssertionBatchIDKey, assertion_id);
+        xpc_dictionary_set_int64(result, kAssertionBatchReturnKey, ret);
+        xpc_array_append_value(results, result);
+        xpc_release(result);
+    }
+    endAssertionBatch();
+
+#if !TARGET_OS_EMBEDDED
+    updateAppSleepStates(processInfoGet(callerPID), &disableAppSleep, &enableAppSleep);
+#endif
+
+    xpc_dictionary_set_int64(reply, kAssertionBatchReturnKey, kIOReturnSuccess);
+    xpc_dictionary_set_value(reply, kAssertionBatchResultsKey, results);
+    xpc_dictionary_set_int64(reply, kAssertionBatchDisableAppSleepKey, disableAppSleep);
+    xpc_dictionary_set_int64(reply, kAssertionBatchEnableAppSleepKey, enableAppSleep);
+
+exit:
+    xpc_connection_send_message(peer, reply);
+    xpc_release(reply);
+    if (results) {
+        xpc_release(results);
+    }
+    if (noMemory) {
+        xpc_release(noMemory);
+    }
 }
 
 static IOReturn doRelease(pid_t pid, IOPMAssertionID id)
@@ -2529,58 +3356,63 @@ __private_extern__ void HandleProcessExit(pid_t deadPID)
     int i;
     assertionType_t *assertType = NULL;
     assertion_t     *assertion = NULL;
-    __block LIST_HEAD(, assertion) list  = LIST_HEAD_INITIALIZER(list);     /* list of assertions released */
+    ProcessInfo     *pinfo = NULL;
+    uint32_t        releasedTypes = 0;
 
     do_assertion_notify(deadPID, kIOPMAssertionsAnyChangedNotifyString, kIOPMNotifyDeRegister);
     do_assertion_notify(deadPID, kIOPMAssertionTimedOutNotifyString, kIOPMNotifyDeRegister);
     do_assertion_notify(deadPID, kIOPMAssertionsChangedNotifyString, kIOPMNotifyDeRegister);
 
-    /* Go thru each assertion type and release all assertion from its lists */
-    for (i=0; i < kIOPMNumAssertionTypes; i++)
-    {
-        assertType = &gAssertionTypes[i]; 
+    /* Hold the ProcessInfo until all of its assertions are released */
+    if ( !(pinfo = processInfoRetain(deadPID)) )
+        return;
 
-        applyToAllAssertionsSync(assertType, true, ^(assertion_t *assertion)
-                                 {
-                                 if (assertion->pinfo->pid == deadPID) {
-                                     releaseAssertion(assertion, false);
-                                     LIST_INSERT_HEAD(&list, assertion, link);
-                                 }
-                                 });
+    /* Take each of the process's assertions off its type's lists */
+    LIST_FOREACH(assertion, &pinfo->assertions, pidLink)
+    {
+        releaseAssertion(assertion, false);
+        releasedTypes |= (1 << assertion->kassert);
+    }
 
-        if (assertType->handler)
-            (*assertType->handler)(assertType, kAssertionOpRelease);
+    for (i=0; i < kIOPMNumAssertionTypes; i++)
+    {
+        if (!(releasedTypes & (1 << i)))
+            continue;
 
-        /* Release memory after calling the handler to get proper aggregate_assertions value into log */
-        while( (assertion = LIST_FIRST(&list)) )
-        {
-            LIST_REMOVE(assertion, link);
-            releaseAssertionMemory(assertion, kAClientDeathLog);
-        }
+        assertType = &gAssertionTypes[i]; 
+        callAssertionHandler(assertType, kAssertionOpRelease);
+    }
 
+    /* Release memory after calling the handlers to get proper aggregate_assertions value into log */
+    while( (assertion = LIST_FIRST(&pinfo->assertions)) )
+    {
+        releaseAssertionMemory(assertion, kAClientDeathLog);
     }
-    if (gAnyChange) notify_post( kIOPMAssertionsAnyChangedNotifyString );
 
+    /* If only the stats buffer still holds the ProcessInfo, keep just the stats */
+    if (pinfo->reportBuf && (pinfo->retain_cnt == 2))
+        retireStatsBuf(pinfo);
+
+    processInfoRelease(deadPID);
 
+    if (releasedTypes && gAnyChange) notify_post( kIOPMAssertionsAnyChangedNotifyString );
 }
 
 
 static int getAssertionTypeIndex(CFStringRef type)
 {
-    int idx = -1;
-    CFNumberRef numRef = NULL;
+    const void *value = NULL;
+    uintptr_t   idx;
 
-    if (!isA_CFString(type))
+    if (!isA_CFString(type)
+        || !CFDictionaryGetValueIfPresent(gUserAssertionTypesDict, type, &value))
         return -1;
 
-    numRef = CFDictionaryGetValue(gUserAssertionTypesDict, type);
-    if (isA_CFNumber(numRef))
-        CFNumberGetValue(numRef, kCFNumberIntType, &idx);
-
-    if (idx < 0 || idx >= kIOPMNumAssertionTypes)
+    idx = (uintptr_t)value;
+    if (idx >= kIOPMNumAssertionTypes)
         return -1;
 
-    return idx;
+    return (int)idx;
 }
 static void forwardPropertiesToAssertion(const void *key, const void *value, void *context)
 {
@@ -2668,9 +3500,13 @@ static void forwardPropertiesToAssertion(const void *key, const void *value, voi
         /* Assertion type can't be modified */
         return;
     }
+    else if (CFEqual(key, kIOPMAssertionNameKey)) {
+        PMStringRelease(assertion->nameID);
+        assertion->nameID = PMStringIntern(value);
+    }
 
     CFDictionarySetValue(assertion->props, key, value);
-
+    assertionsChanged();
 
 }
 
@@ -2727,7 +3563,10 @@ static IOReturn doSetProperties(pid_t pid,
             /* An inactive assertion is made active now */
             removeInactiveAssertion(assertion, assertType);
             CFDictionaryRemoveValue(assertion->props, kIOPMAssertionTimedOutDateKey);            
-            raiseAssertion(assertion);
+            if ((ret = raiseAssertion(assertion)) != kIOReturnSuccess) {
+                insertInactiveAssertion(assertion, assertType);
+                return ret;
+            }
             logAssertionEvent(kATurnOnLog, assertion);
         }
         if (gAnyChange) notify_post( kIOPMAssertionsAnyChangedNotifyString );
@@ -2749,7 +3588,13 @@ static IOReturn doSetProperties(pid_t pid,
         assertion->createTime = getMonotonicTime();
 
         if (assertion->timeout != 0) {
-            insertTimedAssertion(assertion, assertType, true);
+            if (insertTimedAssertion(assertion, assertType, true) != kIOReturnSuccess) {
+                // Without a timer it would never time out; park it instead
+                insertInactiveAssertion(assertion, assertType);
+                if (assertType->handler)
+                    (*assertType->handler)(assertType, kAssertionOpEval);
+                return kIOReturnNoMemory;
+            }
         }
         else {
             insertActiveAssertion(assertion, assertType);
@@ -3175,6 +4020,7 @@ void setKernelAssertions(assertionType_t *assertType, assertionOps op)
         kerAssertionBits &= ~assertBit;
         sendUserAssertionsToKernel(kerAssertionBits);
     }
+    publishAssertionState();
     if (gAggChange) notify_post( kIOPMAssertionsChangedNotifyString );
 }
 
@@ -3310,6 +4156,7 @@ void enforceAssertionTypeTimeCap(assertionType_t *assertType)
     /* Timeout all timed assertions */
     while( (assertion = LIST_FIRST(&assertType->activeTimed)) )
     {
+        timedHeapRemove(assertType, assertion);
         LIST_REMOVE(assertion, link);
         assertion->state &= ~kAssertionStateTimed;
 
@@ -3462,7 +4309,8 @@ static IOReturn raiseAssertion(assertion_t *assertion)
     }
     if (timeout) {
         assertion->timeout = (uint64_t)timeout+currTime; // Absolute time at which assertion expires
-        insertTimedAssertion(assertion, assertType, true);
+        if (insertTimedAssertion(assertion, assertType, true) != kIOReturnSuccess)
+            return kIOReturnNoMemory;
     }
     else {
         /* Insert into active assertion list */
@@ -3470,8 +4318,7 @@ static IOReturn raiseAssertion(assertion_t *assertion)
     }
 
 
-    if (assertType->handler)
-        (*assertType->handler)(assertType, kAssertionOpRaise);
+    callAssertionHandler(assertType, kAssertionOpRaise);
 
     mt2RecordAssertionEvent(kAssertionOpRaise, assertion);
 
@@ -3488,13 +4335,10 @@ IOReturn doCreate(
                   ProcessInfo             **procInfo
                  ) 
 {
-    int                     i;
     assertion_t             *assertion = NULL;
-    assertion_t             *tmp_a = NULL;
     IOReturn                result = kIOReturnSuccess;
     ProcessInfo             *pinfo = NULL;
     assertionType_t         *assertType = NULL;
-    static uint32_t         gNextAssertionIdx = 0;
 
     // assertion_id will be set to kIOPMNullAssertionID on failure.
     *assertion_id = kIOPMNullAssertionID;
@@ -3507,18 +4351,8 @@ IOReturn doCreate(
         if (procInfo) *procInfo = pinfo;
     }
 
-    // Generate an id
-    for (i=gNextAssertionIdx; CFDictionaryGetValueIfPresent(gAssertionsArray, 
-                                                            (uintptr_t)i, (const void **)&tmp_a) == true; ) {
-        i = (i+1) % kMaxAssertions;
-        if (i == gNextAssertionIdx) break;
-    }
-    if (CFDictionaryGetValueIfPresent(gAssertionsArray, (uintptr_t)i, (const void **)&tmp_a) == true) {
-        processInfoRelease(pid);
-        return kIOReturnNoMemory;
-    }
-
-    assertion = calloc(1, sizeof(assertion_t));
+    // Grab a free slot. This also generates the id
+    assertion = allocAssertionSlot();
     if (assertion == NULL) {
         processInfoRelease(pid);
         return kIOReturnNoMemory;
@@ -3527,21 +4361,20 @@ IOReturn doCreate(
     CFRetain(newProperties);
     assertion->retainCnt = 1;
     assertion->pinfo = pinfo;
-
-    assertion->assertionId = ID_FROM_INDEX(i);
-    CFDictionarySetValue(gAssertionsArray, (uintptr_t)i, (const void *)assertion);
-    gNextAssertionIdx = (i+1) % kMaxAssertions;
+    assertion->nameID = PMStringIntern(CFDictionaryGetValue(newProperties, kIOPMAssertionNameKey));
 
     result = raiseAssertion(assertion);
     if (result != kIOReturnSuccess) {
         processInfoRelease(pid);
-        CFDictionaryRemoveValue(gAssertionsArray, (uintptr_t)i);
+        PMStringRelease(assertion->nameID);
         CFRelease(assertion->props);
-        free(assertion);
+        freeAssertionSlot(assertion);
 
         return result;
     }
 
+    LIST_INSERT_HEAD(&pinfo->assertions, assertion, pidLink);
+
     assertType = &gAssertionTypes[assertion->kassert];
     if (!(assertion->state & kAssertionStateInactive))
         logAssertionEvent(kACreateLog, assertion);
@@ -3552,38 +4385,41 @@ IOReturn doCreate(
     return result;
 }
 
-static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef assertionsDict)
+/*
+ * Refreshes the TimeLeft and UpdateTime properties of a timed assertion.
+ * These are computed only when a client asks for the assertion's properties.
+ */
+static void updateTimeoutProps(assertion_t *assertion)
 {
-    bool                    created = false;
-    CFNumberRef             pidCF = NULL;
-    CFMutableDictionaryRef  processDict = NULL;
-    CFMutableArrayRef       pidAssertionsArr = NULL;
-    CFStringRef             processName = NULL;
-
-    pidCF = CFNumberCreate(0, kCFNumberIntType, &assertion->pinfo->pid);
-
-    processDict = (CFMutableDictionaryRef)CFDictionaryGetValue(assertionsDict, pidCF);
-    if (processDict == NULL) 
-    {
-        pidAssertionsArr = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    CFNumberRef         timeLeftCF = NULL;
+    CFDateRef           updateDate = NULL;
+    uint64_t            currTime;
+    int                 timeLeft32;
 
-        processDict = CFDictionaryCreateMutable( kCFAllocatorDefault, 2,
-                                                 &kCFTypeDictionaryKeyCallBacks,
-                                                 &kCFTypeDictionaryValueCallBacks);
-        CFDictionarySetValue(processDict,
-                             CFSTR("PerTaskAssertions"),
-                             pidAssertionsArr);
-        CFDictionarySetValue(processDict,
-                             kIOPMAssertionPIDKey,
-                             pidCF);
+    if (!(assertion->state & kAssertionStateTimed))
+        return;
 
+    currTime = getMonotonicTime();
+    if (assertion->timeout <= currTime)
+        return;
 
-        CFDictionarySetValue(assertionsDict, pidCF, processDict);
-        created = true;
+    timeLeft32 = (int)(assertion->timeout - currTime);
+    timeLeftCF = CFNumberCreate(0, kCFNumberIntType, &timeLeft32);
+    if (timeLeftCF) {
+        CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey, timeLeftCF);
+        CFRelease(timeLeftCF);
     }
-    else {
-        pidAssertionsArr = (CFMutableArrayRef)CFDictionaryGetValue(processDict, CFSTR("PerTaskAssertions"));
+
+    updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    if (updateDate) {
+        CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
+        CFRelease(updateDate);
     }
+}
+
+static void copyAssertion(assertion_t *assertion, CFMutableArrayRef pidAssertionsArr)
+{
+    CFStringRef             processName = NULL;
 
     processName = assertion->pinfo->name;
     if (processName) {
@@ -3592,56 +4428,76 @@ static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef asserti
     if (assertion->kassert < kIOPMNumAssertionTypes) {
         CFDictionarySetValue(assertion->props, kIOPMAssertionTrueTypeKey, assertion_types_arr[assertion->kassert]);
     }
+    updateTimeoutProps(assertion);
 
     CFArrayAppendValue(pidAssertionsArr, assertion->props);
-    CFRelease(pidCF);
-
-    if (created) {
-        CFRelease(pidAssertionsArr);
-        CFRelease(processDict);
-    }
 }
 
-
 static CFArrayRef copyPIDAssertionDictionaryFlattened(void)
 {
-    CFMutableDictionaryRef  assertionsDict = NULL;
     CFMutableArrayRef       returnArray = NULL;
-    CFDictionaryRef         *assertionsDictArr;
-    assertionType_t         *assertType = NULL;
+    CFMutableDictionaryRef  processDict = NULL;
+    CFMutableArrayRef       pidAssertionsArr = NULL;
+    CFNumberRef             pidCF = NULL;
+    ProcessInfo             **procs = NULL;
+    assertion_t             *assertion = NULL;
     CFIndex                 i, count;
 
 
     returnArray = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if (!returnArray)
+        return NULL;
 
-    assertionsDict = CFDictionaryCreateMutable(
-                                               kCFAllocatorDefault, 0, 
-                                               &kCFTypeDictionaryKeyCallBacks,
-                                               &kCFTypeDictionaryValueCallBacks);
+    count = CFDictionaryGetCount(gProcessDict);
+    if (count == 0)
+        return returnArray;
 
-    /* Go thru each assertion type and copy assertion props */
-    for (i=0; i < kIOPMNumAssertionTypes; i++)
+    procs = (ProcessInfo **)malloc(sizeof(ProcessInfo *)*count);
+    if (!procs)
+        return returnArray;
+    CFDictionaryGetKeysAndValues(gProcessDict, NULL, (const void **)procs);
+
+    /* Walk each process's own assertions and copy the active ones */
+    for (i=0; i < count; i++)
     {
-        if (i == kEnableIdleType) continue;
-        assertType = &gAssertionTypes[i]; 
-        applyToAllAssertionsSync(assertType, false, ^(assertion_t *assertion)
-                                 {
-                                 copyAssertion(assertion, assertionsDict);                    
-                                 });
+        pidAssertionsArr = NULL;
 
-    }
+        LIST_FOREACH(assertion, &procs[i]->assertions, pidLink)
+        {
+            if ((assertion->kassert == kEnableIdleType)
+                || (assertion->state & kAssertionStateInactive))
+                continue;
 
-    count = CFDictionaryGetCount(assertionsDict);
-    assertionsDictArr = (CFDictionaryRef *)malloc(sizeof(CFDictionaryRef)*count); 
-    CFDictionaryGetKeysAndValues(assertionsDict,
-                                 NULL, (const void **)assertionsDictArr);
+            if (!pidAssertionsArr) {
+                pidAssertionsArr = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+                if (!pidAssertionsArr)
+                    break;
+            }
+            copyAssertion(assertion, pidAssertionsArr);
+        }
+        if (!pidAssertionsArr)
+            continue;
 
-    for (i=0; i < count; i++) {
-        CFArrayAppendValue(returnArray, assertionsDictArr[i]);
+        processDict = CFDictionaryCreateMutable( kCFAllocatorDefault, 2,
+                                                 &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+        pidCF = CFNumberCreate(0, kCFNumberIntType, &procs[i]->pid);
+        if (processDict && pidCF) {
+            CFDictionarySetValue(processDict,
+                                 CFSTR("PerTaskAssertions"),
+                                 pidAssertionsArr);
+            CFDictionarySetValue(processDict,
+                                 kIOPMAssertionPIDKey,
+                                 pidCF);
+            CFArrayAppendValue(returnArray, processDict);
+        }
+
+        if (pidCF) CFRelease(pidCF);
+        if (processDict) CFRelease(processDict);
+        CFRelease(pidAssertionsArr);
     }
 
-    free(assertionsDictArr);
-    CFRelease(assertionsDict);
+    free(procs);
 
     return returnArray;
 }
@@ -3664,6 +4520,7 @@ static IOReturn copyAssertionForID(
         goto exit;
     }
 
+    updateTimeoutProps(assertion);
     CFRetain(assertion->props);
     *outAssertion = assertion->props;
 
@@ -3722,6 +4579,7 @@ __private_extern__ void evalAllUserActivityAssertions(unsigned int dispSlpTimer)
         }
 
         if (gDisplaySleepTimer) {
+            timedHeapRemove(assertType, assertion);
             LIST_REMOVE(assertion, link); // Remove from timed list
 
             if (assertion->timeout + changeInSecs < currTime)
@@ -3743,6 +4601,7 @@ __private_extern__ void evalAllUserActivityAssertions(unsigned int dispSlpTimer)
     while( (assertion = LIST_FIRST(&list)) )
     {
         LIST_REMOVE(assertion, link);
+        // Can't fail: each of these was just removed from the heap
         insertByTimeout(assertion, assertType);
     }
 
@@ -3755,8 +4614,12 @@ __private_extern__ void evalAllUserActivityAssertions(unsigned int dispSlpTimer)
             continue;
         }
 
+        if (!timedHeapReserve(assertType)) {
+            // Leave it untimed rather than half-inserted
+            assertion = nextAssertion;
+            continue;
+        }
         assertion->timeout = currTime + (gDisplaySleepTimer * 60); 
-
         removeActiveAssertion(assertion, assertType);
         insertTimedAssertion(assertion, assertType, false);
         assertion = nextAssertion;
@@ -3806,6 +4669,7 @@ __private_extern__ void evalAllNetworkAccessAssertions()
         }
 
         if (gIdleSleepTimer) {
+            timedHeapRemove(assertType, assertion);
             LIST_REMOVE(assertion, link); // Remove from timed list
 
             if (assertion->timeout + changeInSecs < currTime)
@@ -3827,6 +4691,7 @@ __private_extern__ void evalAllNetworkAccessAssertions()
     while( (assertion = LIST_FIRST(&list)) )
     {
         LIST_REMOVE(assertion, link);
+        // Can't fail: each of these was just removed from the heap
         insertByTimeout(assertion, assertType);
     }
 
@@ -3839,8 +4704,12 @@ __private_extern__ void evalAllNetworkAccessAssertions()
             continue;
         }
 
+        if (!timedHeapReserve(assertType)) {
+            // Leave it untimed rather than half-inserted
+            assertion = nextAssertion;
+            continue;
+        }
         assertion->timeout = currTime + (gIdleSleepTimer * 60); 
-
         removeActiveAssertion(assertion, assertType);
         insertTimedAssertion(assertion, assertType, false);
         assertion = nextAssertion;
@@ -3864,26 +4733,12 @@ __private_extern__ void evalAllInteractivePushAssertions()
 
     applyToAllAssertionsSync(assertType, false, ^(assertion_t *assertion)
                              {
-                                 CFNumberRef  timeLeftCF = NULL;
-                                 CFDateRef    updateDate = NULL;
-
                                  if (assertion->timeout > newTimeout) {
                                      assertion->timeout = newTimeout;
-
-                                     timeLeftCF = CFNumberCreate(0, kCFNumberIntType, &assertType->autoTimeout);
-                                     if (timeLeftCF) {
-                                         CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey, timeLeftCF);
-                                         CFRelease(timeLeftCF);
-                                     }
-
-                                     updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-                                     if (updateDate) {
-                                         CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
-                                         CFRelease(updateDate);
-                                     }
                                  }
                              });
 
+    timedHeapRebuild(assertType);
     updateAssertionTimer(assertType);
 
     if (gTimeoutChange) notify_post( kIOPMAssertionTimedOutNotifyString );
@@ -3897,12 +4752,14 @@ static void   evaluateAssertions(void)
     int         i, pwrSrc;
     static int  prevPwrSrc = -1;
     assertionType_t    *assertType;
+    uint64_t    startTime;
 
     pwrSrc = _getPowerSource();
     if (pwrSrc == prevPwrSrc)
         return; // If power source hasn't changed, there is nothing to do
 
     prevPwrSrc = pwrSrc;
+    startTime = mach_absolute_time();
 
     for (i=0; i < kIOPMNumAssertionTypes; i++)
     {
@@ -3937,6 +4794,7 @@ static void   evaluateAssertions(void)
         }
     }
     logASLAssertionsAggregate();
+    recordAssertionLatency(kAssertionPerfEvaluate, startTime);
 
 }
 
@@ -3959,6 +4817,100 @@ __private_extern__ void setSleepServicesTimeCap(uint32_t  timeoutInMS)
 }
 
 
+/*
+ * Static description of each assertion type, indexed by kerAssertionType.
+ * 'name' is the type's canonical name (the kIOPMAssertionTrueTypeKey value
+ * and the key in aggregate reports); 'alias' is a second name that maps to
+ * the same type. Types marked 'dynamic' have a name mapping, handler or
+ * effect that depends on system state, and configAssertionType() sets those
+ * up itself; for all others the table is used as-is.
+ */
+typedef struct {
+    CFStringRef         name;
+    CFStringRef         alias;
+    uint32_t            flags;
+    assertionHandler_f  handler;
+    kerAssertionEffect  effect;
+    CFStringRef         entitlement;
+    bool                dynamic;
+} assertionTypeDesc_t;
+
+static const assertionTypeDesc_t gAssertionTypeDescs[kIOPMNumAssertionTypes] = {
+    [kHighPerfType]                 = { kIOPMAssertionTypeNeedsCPU, NULL,
+                                        0,
+                                        modifySettings, kHighPerfEffect },
+    [kPreventIdleType]              = { kIOPMAssertionTypePreventUserIdleSystemSleep, kIOPMAssertionTypeNoIdleSleep,
+                                        kAssertionTypePreventAppSleep,
+                                        modifySettings, kPrevIdleSlpEffect },
+    [kDisableInflowType]            = { kIOPMAssertionTypeDisableInflow, NULL,
+                                        0,
+                                        handleBatteryAssertions, kDisableInflowEffect },
+    [kInhibitChargeType]            = { kIOPMAssertionTypeInhibitCharging, NULL,
+                                        0,
+                                        handleBatteryAssertions, kInhibitChargeEffect },
+    [kDisableWarningsType]          = { kIOPMAssertionTypeDisableLowBatteryWarnings, NULL,
+                                        0,
+                                        handleBatteryAssertions, kDisableWarningsEffect },
+    [kPreventDisplaySleepType]      = { kIOPMAssertionTypePreventUserIdleDisplaySleep, kIOPMAssertionTypeNoDisplaySleep,
+                                        kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        setKernelAssertions, kPrevDisplaySlpEffect },
+    [kEnableIdleType]               = { kIOPMAssertionTypeEnableIdleSleep, NULL,
+                                        0,
+                                        enableIdleHandler, kEnableIdleEffect },
+    [kPreventSleepType]             = { kIOPMAssertionTypePreventSystemSleep, kIOPMAssertionTypeDenySystemSleep,
+                                        kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        setKernelAssertions, kPrevDemandSlpEffect },
+    [kSRPreventSleepType]           = { kIOPMAssertInternalPreventSleep, kIOPMAssertMaintenanceActivity,
+                                        kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        setKernelAssertions, kPrevDemandSlpEffect },
+    [kPreventDiskSleepType]         = { kIOPMAssertPreventDiskIdle, NULL,
+                                        0,
+                                        modifySettings, kPreventDiskSleepEffect },
+    [kExternalMediaType]            = { _kIOPMAssertionTypeExternalMedia, NULL,
+                                        0,
+                                        setKernelAssertions, kExternalMediaEffect },
+    [kDeclareUserActivityType]      = { kIOPMAssertionUserIsActive, NULL,
+                                        kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        setKernelAssertions, kPrevDisplaySlpEffect },
+    [kDeclareSystemActivityType]    = { kIOPMAssertionTypeSystemIsActive, NULL,
+                                        kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        modifySettings, kPrevIdleSlpEffect },
+    [kPushServiceTaskType]          = { kIOPMAssertionTypeApplePushServiceTask, NULL,
+                                        kAssertionTypeGloballyTimed | kAssertionTypePreventAppSleep,
+                                        setKernelAssertions, kNoEffect, NULL, true },
+    [kBackgroundTaskType]           = { kIOPMAssertionTypeBackgroundTask, NULL,
+                                        kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep,
+                                        NULL, kNoEffect, NULL, true },
+#if TCPKEEPALIVE
+    [kTicklessDisplayWakeType]      = { kIOPMAssertDisplayWake, NULL,
+                                        kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        displayWakeHandler, kTicklessDisplayWakeEffect, kIOPMDarkWakeControlEntitlement },
+#else
+    // TicklessDisplayWake is not a valid assertion type; its name is left unmapped.
+    [kTicklessDisplayWakeType]      = { kIOPMAssertDisplayWake, NULL,
+                                        0,
+                                        NULL, kNoEffect, NULL, true },
+#endif
+    [kIntPreventDisplaySleepType]   = { kIOPMAssertInternalPreventDisplaySleep, kIOPMAssertRequiresDisplayAudio,
+                                        kAssertionTypeLogOnCreate,
+                                        setKernelAssertions, kPrevDisplaySlpEffect },
+    [kNetworkAccessType]            = { kIOPMAssertNetworkClientActive, NULL,
+                                        kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate,
+                                        NULL, kNoEffect, NULL, true },
+    [kInteractivePushServiceType]   = { kIOPMAssertInteractivePushServiceTask, NULL,
+                                        0,
+                                        NULL, kNoEffect, kIOPMInteractivePushEntitlement, true },
+    [kReservePwrPreventIdleType]    = { kIOPMAssertAwakeReservePower, NULL,
+                                        kAssertionTypePreventAppSleep,
+                                        modifySettings, kPrevIdleSlpEffect, kIOPMReservePwrCtrlEntitlement, true },
+};
+
+/* Name lookups store the type index itself as the dictionary value */
+static void mapAssertionTypeName(CFStringRef name, kerAssertionType idx)
+{
+    CFDictionarySetValue(gUserAssertionTypesDict, name, (const void *)(uintptr_t)idx);
+}
+
 static void configAssertionEffect(kerAssertionEffect idx)
 {
     gAssertionEffects[idx].effectIdx = idx;
@@ -3969,17 +4921,17 @@ static void configAssertionEffect(kerAssertionEffect idx)
 __private_extern__ void configAssertionType(kerAssertionType idx, bool initialConfig)
 {
     assertionHandler_f   oldHandler = NULL;
-    CFNumberRef idxRef = NULL;
     uint32_t    oldFlags, flags;
     static bool prevBTdisable = false;
-    kerAssertionType  altIdx;
+    const assertionTypeDesc_t *desc;
     assertionType_t *assertType;
     kerAssertionEffect  prevEffect, newEffect;
 
     // This can get called before gUserAssertionTypesDict is initialized
-    if ( !gUserAssertionTypesDict )
+    if ( !gUserAssertionTypesDict || (idx >= kIOPMNumAssertionTypes) )
         return;
 
+    desc = &gAssertionTypeDescs[idx];
     assertType = &gAssertionTypes[idx];
     if (!initialConfig) {
         oldHandler = assertType->handler;
@@ -3988,141 +4940,35 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
     }
 
     assertType->kassert = idx;
-    switch(idx) 
-    {
-    case kHighPerfType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNeedsCPU, idxRef);
-        assertType->handler = modifySettings;
-        newEffect = kHighPerfEffect;
-        break;
-
-    case kPreventIdleType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventUserIdleSystemSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNoIdleSleep, idxRef);
-        assertType->handler = modifySettings;
-
-        newEffect = kPrevIdleSlpEffect;
-        assertType->flags |= kAssertionTypePreventAppSleep;
-        break;
-
-    case kDisableInflowType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDisableInflow, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kDisableInflowEffect;
-        break;
-
-
-    case kInhibitChargeType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeInhibitCharging, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kInhibitChargeEffect;
-        break;
-
-    case kDisableWarningsType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDisableLowBatteryWarnings, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kDisableWarningsEffect;
-        break;
-
-    case kPreventDisplaySleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventUserIdleDisplaySleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNoDisplaySleep, idxRef);
-        assertType->handler = setKernelAssertions;
-
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
-    case kEnableIdleType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeEnableIdleSleep, idxRef);
-        assertType->handler = enableIdleHandler;
-        newEffect = kEnableIdleEffect;
-        break;
-
-    case kPreventSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventSystemSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDenySystemSleep, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep 
-            | kAssertionTypeLogOnCreate;
-        assertType->handler = setKernelAssertions;
-
-        newEffect = kPrevDemandSlpEffect;
-        break;
-
-    case kSRPreventSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInternalPreventSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertMaintenanceActivity, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        assertType->handler = setKernelAssertions;
-
-        newEffect = kPrevDemandSlpEffect;
-
-        break;
-
-    case kPreventDiskSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertPreventDiskIdle, idxRef);
-        assertType->handler = modifySettings;
-        newEffect = kPreventDiskSleepEffect;
-        break;
-
-    case kExternalMediaType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, _kIOPMAssertionTypeExternalMedia, idxRef);
-        assertType->handler = setKernelAssertions;
-        newEffect = kExternalMediaEffect;
-        break;
-
-    case kDeclareUserActivityType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionUserIsActive, idxRef);
-        assertType->handler = setKernelAssertions;
-
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
-    case kDeclareSystemActivityType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeSystemIsActive, idxRef);
-        assertType->handler = modifySettings;
+    assertType->flags |= desc->flags;
+    if (desc->entitlement)
+        assertType->entitlement = desc->entitlement;
+    if (desc->handler)
+        assertType->handler = desc->handler;
+    newEffect = desc->effect;
 
-        newEffect = kPrevIdleSlpEffect;
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        break;
+    if (!desc->dynamic) {
+        mapAssertionTypeName(desc->name, idx);
+        if (desc->alias)
+            mapAssertionTypeName(desc->alias, idx);
+    }
 
+    switch(idx) 
+    {
     case kPushServiceTaskType:
         if ( isA_SleepSrvcWake() && _SS_allowed() ) {
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-            CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeApplePushServiceTask, idxRef);
+            mapAssertionTypeName(kIOPMAssertionTypeApplePushServiceTask, idx);
             newEffect = kPrevDemandSlpEffect;
         }
         else {
             /* Set this as an alias to BackgroundTask assertion for non-sleep srvc wakes */
-            altIdx = kBackgroundTaskType;
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-            CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeApplePushServiceTask, idxRef);
+            mapAssertionTypeName(kIOPMAssertionTypeApplePushServiceTask, kBackgroundTaskType);
             newEffect = kNoEffect;
         }
-        assertType->flags |= kAssertionTypeGloballyTimed | kAssertionTypePreventAppSleep;
-        assertType->handler = setKernelAssertions;
-
-
         break;
 
     case kBackgroundTaskType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeBackgroundTask, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep;
+        mapAssertionTypeName(kIOPMAssertionTypeBackgroundTask, idx);
         if (_DWBT_enabled()) {
             assertType->handler = setKernelAssertions;
 
@@ -4151,37 +4997,8 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
 
         break;
 
-    case kTicklessDisplayWakeType:
-#if TCPKEEPALIVE
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertDisplayWake, idxRef);
-        assertType->handler = displayWakeHandler;
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kTicklessDisplayWakeEffect;
-        assertType->entitlement = kIOPMDarkWakeControlEntitlement;
-#else
-        // TicklessDisplayWake is not a valid assertion type.
-        // We are intentionally disabling it.
-        altIdx = kPreventDisplaySleepType;
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-        newEffect = kNoEffect;
-#endif
-        break;
-
-    case kIntPreventDisplaySleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInternalPreventDisplaySleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertRequiresDisplayAudio, idxRef);
-        assertType->handler = setKernelAssertions;
-        assertType->flags |= kAssertionTypeLogOnCreate;
-
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
     case kNetworkAccessType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertNetworkClientActive, idxRef);
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
+        mapAssertionTypeName(kIOPMAssertNetworkClientActive, idx);
 
         if (kACPowered == _getPowerSource()) {
             assertType->handler = setKernelAssertions;
@@ -4194,11 +5011,10 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         break;
 
     case kInteractivePushServiceType:
-        newEffect = kNoEffect;
 #if TCPKEEPALIVE
         if (getTCPKeepAliveState(NULL, 0) == kActive) {
             /* If keep alives are allowed */
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
+            mapAssertionTypeName(kIOPMAssertInteractivePushServiceTask, idx);
 
             assertType->handler = setKernelAssertions;
             assertType->flags = kAssertionTypePreventAppSleep | kAssertionTypeAutoTimed;
@@ -4208,14 +5024,11 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         }
         else if ( isA_SleepSrvcWake() && _SS_allowed() ) {
             /* else if in a sleep service window, set this as an alias to ApplePushServiceTask  */
-
-            altIdx = kPushServiceTaskType;
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-
+            mapAssertionTypeName(kIOPMAssertInteractivePushServiceTask, kPushServiceTaskType);
         }
         else {
             /* else make this behave same as BackgroundTask assertion when PowerNap is disabled */
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
+            mapAssertionTypeName(kIOPMAssertInteractivePushServiceTask, idx);
             assertType->flags = kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep;
             assertType->flags |= kAssertionTypeAutoTimed;
             assertType->autoTimeout = getCurrentSleepServiceCapTimeout()/1000;
@@ -4226,40 +5039,25 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         }
 #else
         if ( isA_SleepSrvcWake() && _SS_allowed() ) {
-            altIdx = kPushServiceTaskType;
+            mapAssertionTypeName(kIOPMAssertInteractivePushServiceTask, kPushServiceTaskType);
         }
         else {
-            altIdx = kBackgroundTaskType;
+            mapAssertionTypeName(kIOPMAssertInteractivePushServiceTask, kBackgroundTaskType);
         }
-
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
 #endif
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInteractivePushServiceTask, idxRef);
-        assertType->entitlement = kIOPMInteractivePushEntitlement;
-
         break;
 
     case kReservePwrPreventIdleType:
 #if TARGET_OS_EMBEDDED
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
+        mapAssertionTypeName(kIOPMAssertAwakeReservePower, idx);
 #else
-        altIdx = kPreventIdleType;
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
+        mapAssertionTypeName(kIOPMAssertAwakeReservePower, kPreventIdleType);
 #endif
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertAwakeReservePower, idxRef);
-        assertType->flags |= kAssertionTypePreventAppSleep ;
-        assertType->handler = modifySettings;
-        newEffect = kPrevIdleSlpEffect;
-        assertType->entitlement = kIOPMReservePwrCtrlEntitlement;
-
         break;
 
-
     default:
-        return;
+        break;
     }
-    if (idxRef)
-        CFRelease(idxRef);
 
 
     if (assertType->disableCnt) {
@@ -4314,32 +5112,15 @@ __private_extern__ void PMAssertions_prime(void)
     kerAssertionEffect  effctIdx = 0;
     int token;
 
-    gAssertionsArray = CFDictionaryCreateMutable(NULL, kMaxAssertions, NULL, NULL); 
+    initAssertionSlab();
+    initSharedAssertionState();
     gProcessDict = CFDictionaryCreateMutable(0, 0, NULL, NULL);
 
-    gUserAssertionTypesDict = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-
-
-    assertion_types_arr[kHighPerfType]             = kIOPMAssertionTypeNeedsCPU; 
-    assertion_types_arr[kPreventIdleType]          = kIOPMAssertionTypePreventUserIdleSystemSleep;
-    assertion_types_arr[kPreventSleepType]         = kIOPMAssertionTypePreventSystemSleep;
-    assertion_types_arr[kDisableInflowType]        = kIOPMAssertionTypeDisableInflow; 
-    assertion_types_arr[kInhibitChargeType]        = kIOPMAssertionTypeInhibitCharging;
-    assertion_types_arr[kDisableWarningsType]      = kIOPMAssertionTypeDisableLowBatteryWarnings;
-    assertion_types_arr[kPreventDisplaySleepType]  = kIOPMAssertionTypePreventUserIdleDisplaySleep;
-    assertion_types_arr[kEnableIdleType]           = kIOPMAssertionTypeEnableIdleSleep;
-    assertion_types_arr[kExternalMediaType]             = _kIOPMAssertionTypeExternalMedia;
-    assertion_types_arr[kDeclareUserActivityType]       = kIOPMAssertionUserIsActive;
-    assertion_types_arr[kPushServiceTaskType]      = kIOPMAssertionTypeApplePushServiceTask;
-    assertion_types_arr[kBackgroundTaskType]       = kIOPMAssertionTypeBackgroundTask;
-    assertion_types_arr[kDeclareSystemActivityType]     = kIOPMAssertionTypeSystemIsActive;
-    assertion_types_arr[kSRPreventSleepType]       = kIOPMAssertInternalPreventSleep;
-    assertion_types_arr[kTicklessDisplayWakeType]       = kIOPMAssertDisplayWake;
-    assertion_types_arr[kPreventDiskSleepType]     = kIOPMAssertPreventDiskIdle;
-    assertion_types_arr[kNetworkAccessType]        = kIOPMAssertNetworkClientActive;
-    assertion_types_arr[kIntPreventDisplaySleepType] = kIOPMAssertInternalPreventDisplaySleep;
-    assertion_types_arr[kInteractivePushServiceType] = kIOPMAssertInteractivePushServiceTask;
-    assertion_types_arr[kReservePwrPreventIdleType]  = kIOPMAssertAwakeReservePower;
+    gUserAssertionTypesDict = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+
+
+    for (idx = 0; idx < kIOPMNumAssertionTypes; idx++)
+        assertion_types_arr[idx] = gAssertionTypeDescs[idx].name;
 
     for (effctIdx = 0; effctIdx < kMaxAssertionEffects; effctIdx++)
         configAssertionEffect(effctIdx);
@@ -35,6 +35,7 @@
 #include <IOKit/pwr_mgt/IOPMLibPrivate.h>
 
 #include <sys/queue.h>
+#include <xpc/xpc.h>
 
 #define IOREPORT_ABORT(str...) \
 do {    \
@@ -46,6 +47,10 @@ do {    \
 #include <IOKit/IOReportMacros.h>
 #include <IOKit/IOReportTypes.h>
 
+/* ID of a string interned with PMStringIntern(); see PrivateLib.h */
+typedef uint32_t                        PMStringID;
+#define kPMStringIDNone                 0
+
 /* ExternalMedia assertion
  * This assertion is only defined here in PM configd. 
  * It can only be asserted by PM configd; not by other user processes.
@@ -54,6 +59,69 @@ do {    \
 #define _kIOPMAssertionTypeExternalMedia        CFSTR(_kIOPMAssertionTypeExternalMediaCStr)
 
 
+/* Batched assertion create/release, sent on the powerd XPC service.
+ *
+ * The request carries an array under kAssertionBatchKey. Each element is a
+ * dictionary with an op code; creates carry the serialized assertion
+ * properties, releases carry the assertion id. All ops are applied before
+ * the affected assertion types are evaluated, so the batch results in at
+ * most one kernel update. The reply carries an array of results in the
+ * same order as the ops, one for every op, and a kAssertionBatchReturnKey
+ * for the batch as a whole. A batch of more than kAssertionBatchMaxOps ops
+ * is refused with kIOReturnBadArgument and none of its ops are applied.
+ */
+#define kAssertionBatchKey                      "assertionBatch"
+#define kAssertionBatchOpKey                    "op"
+#define kAssertionBatchPropsKey                 "props"
+#define kAssertionBatchIDKey                    "id"
+#define kAssertionBatchReturnKey                "return"
+#define kAssertionBatchResultsKey               "assertionBatchResults"
+#define kAssertionBatchDisableAppSleepKey       "disableAppSleep"
+#define kAssertionBatchEnableAppSleepKey        "enableAppSleep"
+
+enum {
+    kAssertionBatchOpCreate                     = 1,
+    kAssertionBatchOpRelease                    = 2
+};
+
+#define kAssertionBatchMaxOps                   256
+
+/*
+ * Assertion state published by powerd in a read-only POSIX shared memory
+ * object, so clients can read it without a round-trip to powerd.
+ *
+ * 'seq' is odd while powerd is updating the page. Readers copy the fields
+ * between two reads of 'seq' and retry if the values differ or are odd.
+ * kIOPMAssertionsChangedNotifyString is still posted when the contents
+ * change, for clients that want to be woken up.
+ */
+#define kPMAssertionStateShmName                "com.apple.powerd.assertions"
+#define kPMAssertionStateShmVersion             1
+
+typedef struct {
+    uint32_t            version;        // kPMAssertionStateShmVersion
+    volatile uint32_t   seq;            // Odd while an update is in progress
+    uint32_t            kernelBits;     // Assertion levels sent to the kernel
+    uint32_t            aggregates;     // Aggregate level, one bit per kerAssertionType
+} PMAssertionSharedState;
+
+/*
+ * Latency histograms of powerd's own assertion paths, published as IOReport
+ * simple arrays with one channel per operation. Element 0 counts operations
+ * that took less than 1us, element i those that took [2^(i-1), 2^i) us and
+ * the last element everything slower.
+ */
+typedef enum {
+    kAssertionPerfCreate = 0,
+    kAssertionPerfRelease,
+    kAssertionPerfSetProperties,
+    kAssertionPerfEvaluate,
+    kAssertionPerfKernelUpdate,
+    kAssertionPerfNumOps
+} assertionPerfOp;
+
+#define kAssertionPerfBuckets                   kPMPerfHistogramBuckets
+
 #ifndef     kIOPMRootDomainWakeTypeNetwork
 #define     kIOPMRootDomainWakeTypeNetwork          CFSTR("Network")
 #endif
@@ -90,8 +158,21 @@ do {    \
 #define kIOPMRootDomainWakeTypeNotification CFSTR("Notification")
 #endif
 
-#define ID_FROM_INDEX(idx)          (idx + 300)
-#define INDEX_FROM_ID(id)           (id - 300)
+/*
+ * Assertion IDs handed out to clients carry the slab index in the low 16 bits
+ * and the slot's generation count in the next 15 bits. The generation is bumped
+ * every time a slot is released, so a stale ID that refers to a re-used slot
+ * fails lookup instead of silently operating on someone else's assertion.
+ * Bit 31 is kept clear, as MIG passes the ID around as a signed int.
+ */
+#define kAssertionIDIndexMask       0xffff
+#define kAssertionIDGenShift        16
+#define kAssertionIDGenMask         0x7fff
+
+#define ID_FROM_INDEX(idx, gen)     \
+    ((((gen) & kAssertionIDGenMask) << kAssertionIDGenShift) | (((idx) + 300) & kAssertionIDIndexMask))
+#define INDEX_FROM_ID(id)           ((int)((id) & kAssertionIDIndexMask) - 300)
+#define GEN_FROM_ID(id)             (((id) >> kAssertionIDGenShift) & kAssertionIDGenMask)
 
 #define MAKE_UNIQAID(time, type, idx) \
     ((((uint64_t)time) & 0xffffffff) << 32) | ((type) & 0xffff) << 16 | ((idx) & 0xffff)
@@ -193,7 +274,8 @@ typedef struct {
     void                *reportBuf;                  // Stats buffer for IOReporter
                                   
     uint32_t            retain_cnt;     // Retain cnt of this structure
-    CFStringRef         name;           // Process name
+    CFStringRef         name;           // Process name, owned by the intern table
+    PMStringID          nameID;         // Interned process name
     dispatch_source_t   disp_src;       // Dispatch src to handle process exit
     pid_t               pid;            // PID 
     uint32_t            create_seq;
@@ -202,10 +284,23 @@ typedef struct {
     uint32_t            timeoutchange:1;    // Interested in assertion timeout notification
     uint32_t            disableAS_pend:1;   // Disable AppSleep notification need to be sent
     uint32_t            enableAS_pend:1;    // Enable AppSleep notification need to be sent
+    LIST_HEAD(, assertion) assertions;      // Assertions created by this process
 } ProcessInfo;
 
+/*
+ * Activity aggregate stats of a process that has exited. They replace the
+ * process's ProcessInfo until aggregation is turned off, the pid is reused
+ * or they're evicted to keep under the kPMMemExitedProcessStats cap.
+ */
+typedef struct {
+    void                *reportBuf;     // Stats buffer for IOReporter, from the ProcessInfo
+    pid_t               pid;
+    uint32_t            create_seq;     // of the ProcessInfo, to keep IOReport channel order
+} exitedProcStats_t;
+
 typedef struct assertion {
     LIST_ENTRY(assertion) link;
+    LIST_ENTRY(assertion) pidLink;      // Entry in pinfo->assertions
     CFMutableDictionaryRef props;       // client provided properties
     uint32_t        state;              // assertion state bits
     uint64_t        createTime;         // Time at which assertion is created
@@ -220,8 +315,12 @@ typedef struct assertion {
 
     ProcessInfo     *pinfo;             // Pointer to ProcessInfo structure
 
+    PMStringID      nameID;             // Interned assertion name
+
     pid_t           causingPid;         // PID for process on whose behalf this assertion is raised
     ProcessInfo     *causingPinfo;      // Corresponding ProcessInfo struct 
+
+    uint32_t        heapIdx;            // Index into assertType->timedHeap, valid while timed
 } assertion_t;
 
 /* State bits for assertion_t structure */
@@ -261,10 +360,14 @@ typedef struct {
 struct assertionType {
     uint32_t        flags;              /* Specific to this assertion type */
 
-    LIST_HEAD(, assertion) activeTimed;  /* Active assertions with timeout */
+    LIST_HEAD(, assertion) activeTimed;  /* Active assertions with timeout, unordered */
     LIST_HEAD(, assertion) active;       /* Active assertions without timeout */
     LIST_HEAD(, assertion) inactive;     /* timed out assertions/Level 0 assertions etc */
 
+    assertion_t     **timedHeap;        /* Min-heap of 'activeTimed' assertions, keyed by timeout */
+    uint32_t        timedHeapCnt;       /* Number of assertions in timedHeap */
+    uint32_t        timedHeapSize;      /* Allocated capacity of timedHeap */
+
     kerAssertionType    kassert;
     dispatch_source_t   timer;          /* dispatch source for Per assertion timer */  
     dispatch_source_t   globalTimer;    /* dispatch source for all assertions of this type */
@@ -343,6 +446,10 @@ __private_extern__ void InternalReleaseAssertion(
 
 __private_extern__ void InternalEvaluateAssertions(void);
 
+__private_extern__ void PMAssertions_HandleBatchRequest(xpc_connection_t peer,
+                                xpc_object_t request,
+                                audit_token_t token);
+
 __private_extern__ void evalAllUserActivityAssertions(unsigned int dispSlpTimer);
 __private_extern__ void evalAllNetworkAccessAssertions();
 
@@ -370,6 +477,14 @@ __private_extern__ void logAssertionEvent(assertLogAction assertionAction, asser
 __private_extern__ uint8_t getAssertionLevel(kerAssertionType idx);
 __private_extern__ void setAggregateLevel(kerAssertionType idx, uint8_t val);
 __private_extern__ uint32_t getKerAssertionBits( );
+__private_extern__ void PMAssertions_FlushKernelUpdates(void);
+__private_extern__ uint32_t getKernelAssertionUpdateCount(bool suppressed);
+__private_extern__ uint32_t getKernelAssertionCoalesceDelay(void);
+__private_extern__ IOReturn setKernelAssertionCoalesceDelay(uint32_t delayMS);
+__private_extern__ uint32_t getAssertionAggregatesGeneration(void);
+__private_extern__ uint32_t getAssertionsGeneration(void);
+__private_extern__ void recordAssertionLatency(assertionPerfOp op, uint64_t startTime);
+__private_extern__ CFDictionaryRef copyAssertionPerfSamples(void);
 __private_extern__ void setAssertionActivityLog(int value);
 __private_extern__ void setAssertionActivityAggregate(int value);
 __private_extern__ kern_return_t setReservePwrMode(int enable);
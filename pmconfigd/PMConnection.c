@@ -38,11 +38,13 @@
 #include <bsm/libbsm.h>
 #include <IOKit/pwr_mgt/IOPM.h>
 #include <libproc.h>
+#include <uuid/uuid.h>
 #include <sys/syscall.h>
 #include <Kernel/kern/debug.h>
 
 #include "PrivateLib.h"
 #include "PMConnection.h"
+#include "WakeCoalesce.h"
 #include "AutoWakeScheduler.h"
 #include "RepeatingAutoWake.h"
 #include "PMAssertions.h"
@@ -86,15 +88,6 @@ enum {
     _kOnStateBits = 0xFFFF
 };
 
-/* Array indices & for PMChooseScheduledEvent */
-typedef enum {
-    kChooseFullWake         = 0,
-    kChooseMaintenance      = 1,
-    kChooseSleepServiceWake = 2,
-    kChooseTimerPlugin      = 3,
-    kChooseWakeTypeCount    = 4
-} wakeType_e;
-
 enum {
     kSilentRunningOff = 0,
     kSilentRunningOn  = 1
@@ -107,6 +100,9 @@ CFAbsoluteTime              ts_apo = 0; // Time at which system should go for au
 static int const kMaxConnectionIDCount = 1000*1000*1000;
 static int const kConnectionOffset = 1000;
 static double const  kPMConnectionNotifyTimeoutDefault = 28.0;
+// Deadline for a client that timed out on its previous notification.
+// A chronically tardy client shouldn't hold every transition for the full 28s.
+static double const  kPMConnectionNotifyTimeoutTardy = 5.0;
 #if !TARGET_OS_EMBEDDED
 static int kPMSleepDurationForBT = (30*60); // Defaults to 30 mins
 static int kPMDarkWakeLingerDuration = 15; // Defaults to 15 secs
@@ -149,12 +145,16 @@ typedef struct {
     long                    kernelAcknowledgementID;
     int                     notificationType;
     int                     awaitingResponsesCount;
+    int                     outstandingResponsesCount;  // not yet replied or timed out
     int                     awaitResponsesTimeoutSeconds;
     int                     completedStatus;    // status after timed out or, all acked
     bool                    completed;
     bool                    nextIsValid;
     long                    nextKernelAcknowledgementID;
     int                     nextInterestBits;
+    pid_t                   simulatedGroup;     // process group of a simulated change; 0 if real
+    uint32_t                transitionID;       // TransitionRecord id when fired; 0 if none
+    CFAbsoluteTime          firedTime;
 } PMResponseWrangler;
 
 
@@ -164,7 +164,7 @@ typedef struct {
  * responseHandler - Should be NULL unless this connection has outstanding
  *      notifications to reply to.
  */
-typedef struct {
+typedef struct PMConnection {
     mach_port_t             notifyPort;
     PMResponseWrangler      *responseHandler;
     CFStringRef             callerName;
@@ -172,9 +172,38 @@ typedef struct {
     int                     callerPID;
     IOPMCapabilityBits      interestsBits;
     bool                    notifyEnable;
-    int                     timeoutCnt;
+    int                     timeoutCnt;     // consecutive notifications this client failed to ack
+    struct PMConnection     *hashNext;      // next PMConnection in gConnectionHash chain
+    uint32_t                fanoutStamp;    // last fan-out that collected this connection
 } PMConnection;
 
+/* PMConnectionBucket - the connections interested in one capability bit.
+ * gInterestBuckets[n] holds every connection with (1 << n) set in interestsBits.
+ */
+typedef struct {
+    PMConnection            **connections;
+    int                     count;
+    int                     capacity;
+} PMConnectionBucket;
+
+
+/* TransitionRecord
+ * Timeline of one sleep, darkwake or full wake, for "pmset -g transitionprofile".
+ * phaseUS[] are offsets from the kernel's capability change notification;
+ * -1 for phases the transition didn't go through.
+ * id tells a transition apart from the one before it in the same slot.
+ */
+typedef struct {
+    uuid_string_t           uuid;
+    uint32_t                id;
+    int                     kind;
+    CFAbsoluteTime          begin;
+    int32_t                 phaseUS[kPMTransitionPhaseCount];
+} TransitionRecord;
+
+#define kTransitionProfileCount         32
+
+
 
 /* PMResponse 
  * represents one outstanding notification acknowledgement
@@ -185,10 +214,12 @@ typedef struct {
     IOPMConnectionMessageToken  token;
     CFAbsoluteTime          repliedWhen;
     CFAbsoluteTime          notifiedWhen;
+    CFAbsoluteTime          deadline;
     CFAbsoluteTime          maintenanceRequested;
     CFAbsoluteTime          timerPluginRequested;
     CFAbsoluteTime          sleepServiceRequested;
     CFStringRef             clientInfoString;
+    CFTimeInterval          wakeLeeway;     // 0 unless the client declared kPMAckWakeLeewayKey
     int                     sleepServiceCapTimeoutMS;
     int                     notificationType;
     bool                    replied;
@@ -216,13 +247,25 @@ static IOReturn createConnectionWithID(
 static PMConnection *connectionForID(
                     uint32_t findMe);
 
-static CFArrayRef createArrayOfConnectionsWithInterest(
+static int collectConnectionsWithInterest(
                     int interestBitsNotify);
 
+static void connectionSetInterests(
+                    PMConnection *connection,
+                    IOPMCapabilityBits interests);
+
 static PMResponseWrangler *connectionFireNotification(
                     int notificationType,
                     long kernelAcknowledgementID);
 
+static PMResponseWrangler *connectionFireNotificationToGroup(
+                    int notificationType,
+                    int affectedBits,
+                    long kernelAcknowledgementID,
+                    pid_t onlyGroup);
+
+static void simulatedChangeFinish(PMResponseWrangler *wrangler, bool preempted);
+
 static void _sendMachMessage(
                     mach_port_t port, 
                     mach_msg_id_t msg_id,
@@ -235,12 +278,22 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
 
 static void responsesTimedOut(CFRunLoopTimerRef timer, void * info);
 
+static void scheduleResponsesTimeout(PMResponseWrangler *wrangler, CFAbsoluteTime fireDate);
+
 static void cleanupConnection(PMConnection *reap);
 
 static void cleanupResponseWrangler(PMResponseWrangler *reap);
 
 static void setSystemSleepStateTracking(IOPMCapabilityBits);
 
+static void transitionProfileBegin(int kind);
+
+static void transitionProfileMark(int phase, bool onlyFirst);
+
+static void transitionProfileEnd(void);
+
+static bool transitionProfileIsCurrent(uint32_t transitionID);
+
 #if !TARGET_OS_EMBEDDED
 static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms);
 #endif
@@ -270,6 +323,7 @@ __private_extern__ void ClockSleepWakeNotification(IOPMCapabilityBits b,
 
 void setAutoPowerOffTimer(bool initialCall, CFAbsoluteTime postpone);
 static void sendNoRespNotification( int interestBitsNotify );
+static void allowPowerChange(long notificationID);
 void cancelAutoPowerOffTimer();
 
 /************************************************************************************/
@@ -299,10 +353,50 @@ static CFMutableArrayRef        gConnections = NULL;
 
 static uint32_t                 globalConnectionIDTally = 0;
 
+/* gConnectionHash - connections chained by uniqueID for connectionForID().
+ * IDs are handed out sequentially, so (uniqueID % kConnectionHashSize) spreads
+ * them evenly without a real hash function.
+ */
+#define kConnectionHashSize             128
+static PMConnection             *gConnectionHash[kConnectionHashSize];
+
+/* gInterestBuckets - one bucket per IOPMCapabilityBits bit.
+ * gFanout is scratch space for collectConnectionsWithInterest(); it only
+ * grows, so steady-state notification fan-out doesn't allocate.
+ */
+#define kConnectionInterestBitCount     ((int)(8 * sizeof(IOPMCapabilityBits)))
+static PMConnectionBucket       gInterestBuckets[kConnectionInterestBitCount];
+static PMConnection             **gFanout = NULL;
+static int                      gFanoutCapacity = 0;
+static uint32_t                 gFanoutStamp = 0;
+
+/* gTransitionProfile - ring of the last kTransitionProfileCount transitions.
+ * gTransition points into it while a transition is in flight.
+ */
+static TransitionRecord         gTransitionProfile[kTransitionProfileCount];
+static int                      gTransitionProfileNext = 0;
+static int                      gTransitionProfileCount = 0;
+static TransitionRecord         *gTransition = NULL;
+static uint32_t                 gTransitionLastID = 0;
+static uuid_string_t            gTransitionUUID;
+
 static io_connect_t             gRootDomainConnect = IO_OBJECT_NULL;
 
 static PMResponseWrangler *     gLastResponseWrangler = NULL;
 
+/* Outcome of the last kPMSetSimulatedCapabilityChange.
+ * Duration is -1 while one is in flight and -2 if a real transition preempted it.
+ */
+static int                      gSimulatedChangeDurationUS = 0;
+static int                      gSimulatedChangeTimeouts = 0;
+
+/* Capabilities the last simulated change moved to, so that consecutive
+ * simulated changes notify the bits that differ between them. Invalid again
+ * once a real transition fires.
+ */
+static IOPMCapabilityBits       gSimulatedCapabilityBits = 0;
+static bool                     gSimulatedCapabilityBitsValid = false;
+
 SleepServiceStruct              gSleepService;
 
 uint32_t                        gDebugFlags = 0;
@@ -397,7 +491,7 @@ void PMConnection_prime()
 
 error:
     // ASL_LOG: KEEP
-    asl_log(NULL, NULL, ASL_LEVEL_ERR,
+    pmlog_log(ASL_LEVEL_ERR,
                     "PowerManagement: unable to register with kernel power management. %s %s",
                     errorString ? "Reason = : ":"", errorString ? errorString:"unknown");
     return;
@@ -454,7 +548,7 @@ kern_return_t _io_pm_connection_create
         newConnection->callerName = CFStringCreateWithCString(0, name, kCFStringEncodingUTF8);
     }
 
-    newConnection->interestsBits = interests;
+    connectionSetInterests(newConnection, interests);
     *connection_id = newConnection->uniqueID;
     *return_code = kIOReturnSuccess;
 
@@ -618,6 +712,20 @@ static CFDictionaryRef _io_pm_connection_acknowledge_event_unpack_payload(
 }
 #endif
 
+/* Approximate heap cost of one response stats dictionary, for memory accounting */
+#define kResponseStatsEntryBytes        384
+
+static void releaseResponseStats(PMResponseWrangler *wrangler)
+{
+    if (!wrangler->responseStats)
+        return;
+
+    PMMemoryCharge(kPMMemResponseStats,
+                   -(ssize_t)(CFArrayGetCount(wrangler->responseStats) * kResponseStatsEntryBytes));
+    CFRelease(wrangler->responseStats);
+    wrangler->responseStats = NULL;
+}
+
 static void cacheResponseStats(PMResponse *resp)
 {
     PMResponseWrangler *respWrangler = resp->myResponseWrangler;
@@ -670,7 +778,16 @@ static void cacheResponseStats(PMResponse *resp)
         CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("Wake"));
     }
 
+    // Over the cap, the oldest stats of this transition make room
+    while (CFArrayGetCount(respWrangler->responseStats)
+           && PMMemoryWouldExceedCap(kPMMemResponseStats, kResponseStatsEntryBytes))
+    {
+        CFArrayRemoveValueAtIndex(respWrangler->responseStats, 0);
+        PMMemoryCharge(kPMMemResponseStats, -kResponseStatsEntryBytes);
+        PMMemoryNoteEviction(kPMMemResponseStats);
+    }
     CFArrayAppendValue(respWrangler->responseStats, stats);
+    PMMemoryCharge(kPMMemResponseStats, kResponseStatsEntryBytes);
 
     CFRelease(stats);
 }
@@ -711,10 +828,24 @@ kern_return_t _io_pm_connection_acknowledge_event
     }
     
     *return_code = kIOReturnSuccess;
-    foundResponse->repliedWhen = CFAbsoluteTimeGetCurrent();
-    foundResponse->replied = true;
-    
-    cacheResponseStats(foundResponse);
+
+    // A client acking after its deadline has already been recorded as timed out;
+    // still honor its wake requests below, but don't count it twice.
+    if (!foundResponse->replied)
+    {
+        foundResponse->repliedWhen = CFAbsoluteTimeGetCurrent();
+        foundResponse->replied = true;
+        foundResponse->myResponseWrangler->outstandingResponsesCount--;
+        connection->timeoutCnt = 0;
+
+        if (!foundResponse->myResponseWrangler->simulatedGroup
+            && transitionProfileIsCurrent(foundResponse->myResponseWrangler->transitionID)) {
+            transitionProfileMark(kPMTransitionPhaseFirstAck, true);
+            transitionProfileMark(kPMTransitionPhaseLastAck, false);
+        }
+
+        cacheResponseStats(foundResponse);
+    }
     
     // Unpack the passed-in options data structure
     if ((ackOptionsDict = _io_pm_connection_acknowledge_event_unpack_payload(options_ptr, options_len)))
@@ -732,6 +863,15 @@ kern_return_t _io_pm_connection_acknowledge_event
          * kIOPMAckNetworkMaintenanceWakeDate
          * kIOPMAckSUWakeDate
          */
+        CFNumberRef leewayNum = isA_CFNumber(CFDictionaryGetValue(ackOptionsDict, kPMAckWakeLeewayKey));
+        if (leewayNum) {
+            CFNumberGetValue(leewayNum, kCFNumberDoubleType, &foundResponse->wakeLeeway);
+            if (foundResponse->wakeLeeway < 0.0)
+                foundResponse->wakeLeeway = 0.0;
+            if (foundResponse->wakeLeeway > kPMWakeLeewayMax)
+                foundResponse->wakeLeeway = kPMWakeLeewayMax;
+        }
+
         requestDate = isA_CFDate(CFDictionaryGetValue(ackOptionsDict, kIOPMAckWakeDate));
         if (!requestDate) {
             requestDate = isA_CFDate(CFDictionaryGetValue(ackOptionsDict, kIOPMAckNetworkMaintenanceWakeDate));
@@ -954,6 +1094,7 @@ static void cleanupConnection(PMConnection *reap)
     CFIndex                 index;
     CFRange                 connectionsRange =
                                 CFRangeMake(0, CFArrayGetCount(gConnections));
+    PMConnection            **link = NULL;
 
     if (MACH_PORT_NULL != reap->notifyPort) 
     {
@@ -980,6 +1121,9 @@ static void cleanupConnection(PMConnection *reap)
                                     responseWrangler->awaitingResponses, i);
 
             if (openResponse && (openResponse->connection == reap)) {
+                if (!openResponse->replied) {
+                    responseWrangler->outstandingResponsesCount--;
+                }
                 openResponse->connection    = NULL;
                 openResponse->replied       = true;
                 openResponse->timedout      = true;
@@ -998,6 +1142,17 @@ static void cleanupConnection(PMConnection *reap)
     if (kCFNotFound != index) {
         CFArrayRemoveValueAtIndex(gConnections, index);
     }
+
+    // Remove our struct from the interest buckets and the ID hash
+    connectionSetInterests(reap, 0);
+
+    link = &gConnectionHash[reap->uniqueID % kConnectionHashSize];
+    while (*link && (*link != reap)) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) {
+        *link = reap->hashNext;
+    }
     
     free(reap);
 
@@ -1062,6 +1217,7 @@ static void cleanupResponseWrangler(PMResponseWrangler *reap)
         
         reap->awaitingResponses = NULL;
     }
+    releaseResponseStats(reap);
 
     // Invalidate the pointer to the in-flight response wrangler.
     if (gLastResponseWrangler == reap) {
@@ -1080,7 +1236,7 @@ static void cleanupResponseWrangler(PMResponseWrangler *reap)
         if (!resp)
         {
             if (nextAcknowledgementID)
-                IOAllowPowerChange(gRootDomainConnect, nextAcknowledgementID);
+                allowPowerChange(nextAcknowledgementID);
         }
     }
 }
@@ -1142,6 +1298,10 @@ static void setSystemSleepStateTracking(IOPMCapabilityBits capables)
     if (capablesNum) {
         PMStoreSetValue(key, capablesNum);     
         CFRelease(capablesNum);
+
+        // Sleep/wake clients read this right after they're notified;
+        // don't leave it for the end of the run loop turn.
+        PMStoreFlush();
     }
 
     CFRelease(key);
@@ -1305,17 +1465,17 @@ static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms)
 
 static void logASLMessageSleepServiceBegins(long withCapTime)
 {
-    aslmsg      m;
+    pmlogmsg    m;
     char        strbuf[125];
     
     m = new_msg_pmset_log();
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceStarted);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceStarted);
     
     /* com.apple.message.uuid = <SleepWake UUID>
      */
     if (_getUUIDString(strbuf, sizeof(strbuf))) {
-        asl_set(m, kPMASLUUIDKey, strbuf);
+        pmlog_set(m, kPMASLUUIDKey, strbuf);
     }
     
     /* com.apple.message.uuid2 = <SleepServices UUID>
@@ -1323,17 +1483,16 @@ static void logASLMessageSleepServiceBegins(long withCapTime)
     if (gSleepService.uuid
         && CFStringGetCString(gSleepService.uuid, strbuf, sizeof(strbuf), kCFStringEncodingUTF8))
     {
-        asl_set(m, kPMASLUUID2Key, strbuf);
+        pmlog_set(m, kPMASLUUID2Key, strbuf);
     }
     
     snprintf(strbuf, sizeof(strbuf), "%ld", withCapTime);
-    asl_set(m, kPMASLValueKey, strbuf);
+    pmlog_set(m, kPMASLValueKey, strbuf);
     
     snprintf(strbuf, sizeof(strbuf), "SleepService: window begins with cap time=%ld secs", withCapTime/1000);
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 #endif
 
@@ -1343,7 +1502,7 @@ static void logASLMessageSleepServiceBegins(long withCapTime)
 
 __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt)
 {
-    aslmsg      m;
+    pmlogmsg    m;
     char        strUUID[100];
     char        strUUID2[100];
     char        valStr[30];
@@ -1357,12 +1516,12 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
 
     m = new_msg_pmset_log();
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceTerminated);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceTerminated);
     
     /* com.apple.message.uuid = <SleepWake UUID>
      */
     if (_getUUIDString(strUUID, sizeof(strUUID))) {
-        asl_set(m, kPMASLUUIDKey, strUUID);
+        pmlog_set(m, kPMASLUUIDKey, strUUID);
     }
     
     /* com.apple.message.uuid2 = <SleepServices UUID>
@@ -1370,28 +1529,27 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
     if (gSleepService.uuid
         && CFStringGetCString(gSleepService.uuid, strUUID2, sizeof(strUUID2), kCFStringEncodingUTF8))
     {
-        asl_set(m, kPMASLUUID2Key, strUUID2);
+        pmlog_set(m, kPMASLUUID2Key, strUUID2);
     }
     
     /* value = # of clients whose assertions had to be timed out.
      */
     snprintf(valStr, sizeof(valStr), "%d", forcedTimeoutCnt);
-    asl_set(m, kPMASLValueKey, valStr);
+    pmlog_set(m, kPMASLValueKey, valStr);
         
 
-    asl_set(m, ASL_KEY_MSG, "SleepService: window has terminated.");
+    pmlog_set(m, ASL_KEY_MSG, "SleepService: window has terminated.");
 
     /* Signature for how many clients timed out
      */    
     if (forcedTimeoutCnt == 0)
     {
-        asl_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceExitClean);
+        pmlog_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceExitClean);
     } else {
-        asl_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceTimedOut);
+        pmlog_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceTimedOut);
     }
     
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
     
     /* Messages describes the next state - S3, S0Dark, S0
      */
@@ -1401,16 +1559,16 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
     minSystemPower = getAssertionsMinimumSystemPowerLevel();
 
     if (kS0Dark == minSystemPower) {
-        asl_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Elevated to DarkWake.");
+        pmlog_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Elevated to DarkWake.");
     } else 
     if (kS0Full == minSystemPower) {
-        asl_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Elevated to FullWake.");    
+        pmlog_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Elevated to FullWake.");    
     } else
     if (kS3 == minSystemPower) {
-        asl_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Returning to S3/S4.");    
+        pmlog_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. Returning to S3/S4.");    
     } else {
         
-        asl_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. AssertionsMinimumSystemPowerLevel = Unknown.");
+        pmlog_set(endMsg, ASL_KEY_MSG, "SleepService window terminated. AssertionsMinimumSystemPowerLevel = Unknown.");
     }
 */
 }
@@ -1553,14 +1711,14 @@ static void startAutoPowerOffSleep( )
     if ( (sleepType != kIOPMSleepTypePowerOff) || (nextAutoWake != 0) ) {
 
         if (gDebugFlags & kIOPMDebugLogCallbacks)
-            asl_log(0,0,ASL_LEVEL_ERR, "Resetting APO timer. sleepType:%d nextAutoWake:%f\n",
+            pmlog_log(ASL_LEVEL_ERR, "Resetting APO timer. sleepType:%d nextAutoWake:%f\n",
                     sleepType, nextAutoWake);
         setAutoPowerOffTimer(false, 0);
         return;
     }
 
     if (gDebugFlags & kIOPMDebugLogCallbacks)
-       asl_log(0,0,ASL_LEVEL_ERR,  "Cancelling assertions for AutoPower Off\n");
+       pmlog_log(ASL_LEVEL_ERR,  "Cancelling assertions for AutoPower Off\n");
     cancelAutoPowerOffTimer( );
     /*
      * We will be here only if the system is  in dark wake. In that
@@ -1599,14 +1757,14 @@ void setAutoPowerOffTimer(bool initialCall, CFAbsoluteTime  postponeAfter)
     if ( (GetPMSettingNumber(CFSTR(kIOPMAutoPowerOffEnabledKey), &apo_enable) != kIOReturnSuccess) ||
             (apo_enable != 1) ) {
         if (gDebugFlags & kIOPMDebugLogCallbacks)
-           asl_log(0,0,ASL_LEVEL_ERR, "Failed to get APO enabled key\n");
+           pmlog_log(ASL_LEVEL_ERR, "Failed to get APO enabled key\n");
         ts_apo = 0;
         return;
     }
 
     if ( (GetPMSettingNumber(CFSTR(kIOPMAutoPowerOffDelayKey), &apo_delay) != kIOReturnSuccess) ) {
         if (gDebugFlags & kIOPMDebugLogCallbacks)
-           asl_log(0,0,ASL_LEVEL_ERR, "Failed to get APO delay timer \n");
+           pmlog_log(ASL_LEVEL_ERR, "Failed to get APO delay timer \n");
         ts_apo = 0;
         return;
     }
@@ -1661,7 +1819,7 @@ void setAutoPowerOffTimer(bool initialCall, CFAbsoluteTime  postponeAfter)
     }
 
     if (gDebugFlags & kIOPMDebugLogCallbacks)
-        asl_log(0,0,ASL_LEVEL_ERR,
+        pmlog_log(ASL_LEVEL_ERR,
                 "Set auto power off timer to fire in %lld secs\n", timer_fire);
     dispatch_source_set_timer(gApoDispatch, 
             dispatch_walltime(NULL, timer_fire * NSEC_PER_SEC), DISPATCH_TIME_FOREVER, 0);
@@ -1729,7 +1887,7 @@ static void handleLastCallMsg(void *messageData)
     }
     else
     {
-        IOAllowPowerChange(gRootDomainConnect, (long)messageData);
+        allowPowerChange((long)messageData);
         gMachineStateRevertible = false;
     }
 
@@ -1745,7 +1903,7 @@ static void handleCanSleepMsg(void *messageData, CFStringRef sleepReason)
 #endif        
 
     if (allow_sleep) {
-        IOAllowPowerChange(gRootDomainConnect, (long)messageData);                
+        allowPowerChange((long)messageData);                
         if (CFStringCompare(sleepReason, CFSTR(kIOPMIdleSleepKey), 0) != kCFCompareEqualTo) {
             gMachineStateRevertible = false;
         }
@@ -1856,6 +2014,7 @@ static void PMConnectionPowerCallBack(
         if(smcSilentRunningSupport() )
            gCurrentSilentRunningState = kSilentRunningOn;
 
+        transitionProfileBegin(kPMTransitionSleep);
         responseController = connectionFireNotification(_kSleepStateBits, (long)capArgs->notifyRef);
 
 
@@ -1865,7 +2024,9 @@ static void PMConnectionPowerCallBack(
             // We have zero clients. Acknowledge immediately.            
 
             PMScheduleWakeEventChooseBest(getEarliestRequestAutoWake(), kChooseFullWake);
-            IOAllowPowerChange(gRootDomainConnect, (long)capArgs->notifyRef);                
+            transitionProfileMark(kPMTransitionPhaseScheduleWake, false);
+            allowPowerChange((long)capArgs->notifyRef);                
+            transitionProfileEnd();
         }
 
         return;
@@ -1952,8 +2113,11 @@ static void PMConnectionPowerCallBack(
 #endif
     } else if (SYSTEM_DID_WAKE(capArgs))
     {
+        transitionProfileBegin(IS_CAP_GAIN(capArgs, kIOPMSystemCapabilityGraphics) ?
+                                kPMTransitionFullWake : kPMTransitionDarkWake);
 #if !TARGET_OS_EMBEDDED
-        _updateWakeReason(NULL, &wakeType);
+        _updateWakeReason(NULL, &wakeType, IS_CAP_GAIN(capArgs, kIOPMSystemCapabilityGraphics));
+        transitionProfileMark(kPMTransitionPhaseWakeReason, false);
         // On a SilentRunningMachine, the assumption is that every wake is
         // Silent until powerd unclamps SilentRunning or unforeseen thermal
         // constraints arise
@@ -2133,7 +2297,8 @@ static void PMConnectionPowerCallBack(
          */
         if (!responseController) {
             // We have zero clients. Acknowledge immediately.            
-            IOAllowPowerChange(gRootDomainConnect, (long)capArgs->notifyRef);                
+            allowPowerChange((long)capArgs->notifyRef);                
+            transitionProfileEnd();
         }
 #if !TARGET_OS_EMBEDDED
         SystemLoadSystemPowerStateHasChanged( );
@@ -2170,8 +2335,145 @@ static void PMConnectionPowerCallBack(
     }
 
     if (capArgs->notifyRef)
-        IOAllowPowerChange(gRootDomainConnect, capArgs->notifyRef);
+        allowPowerChange(capArgs->notifyRef);
+
+}
+
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+/************************************************************************************/
+
+#pragma mark -
+#pragma mark TransitionProfile
+
+static void transitionProfileBegin(int kind)
+{
+    TransitionRecord    *record = &gTransitionProfile[gTransitionProfileNext];
+    int                 i;
+
+    gTransitionProfileNext = (gTransitionProfileNext + 1) % kTransitionProfileCount;
+    if (gTransitionProfileCount < kTransitionProfileCount)
+        gTransitionProfileCount++;
+
+    strlcpy(record->uuid, gTransitionUUID, sizeof(record->uuid));
+    if (++gTransitionLastID == 0)
+        gTransitionLastID = 1;
+    record->id = gTransitionLastID;
+    record->kind = kind;
+    record->begin = CFAbsoluteTimeGetCurrent();
+    for (i=0; i<kPMTransitionPhaseCount; i++) {
+        record->phaseUS[i] = -1;
+    }
+
+    gTransition = record;
+}
+
+static void transitionProfileMark(int phase, bool onlyFirst)
+{
+    CFAbsoluteTime      elapsed;
 
+    if (!gTransition || (onlyFirst && (gTransition->phaseUS[phase] >= 0)))
+        return;
+
+    elapsed = CFAbsoluteTimeGetCurrent() - gTransition->begin;
+    if (elapsed < 0.0)
+        elapsed = 0.0;
+    gTransition->phaseUS[phase] = (elapsed < (INT32_MAX / 1000000.0)) ?
+                                    (int32_t)(elapsed * 1000000.0) : INT32_MAX;
+}
+
+static void transitionProfileEnd(void)
+{
+    transitionProfileMark(kPMTransitionPhaseKernelAck, false);
+    gTransition = NULL;
+}
+
+/*
+ * Whether responses to a wrangler fired during transition 'transitionID'
+ * belong in the transition being profiled now. An ack that arrives after
+ * its transition has ended, or another transition has begun, doesn't.
+ */
+static bool transitionProfileIsCurrent(uint32_t transitionID)
+{
+    return (gTransition && transitionID && (gTransition->id == transitionID));
+}
+
+__private_extern__ void PMConnectionSleepWakeUUIDChanged(CFStringRef uuid)
+{
+    // Holds on to the last published UUID; the kernel clears its copy
+    // before we see the full wake that ends the session.
+    if (!isA_CFString(uuid)
+        || !CFStringGetCString(uuid, gTransitionUUID, sizeof(gTransitionUUID), kCFStringEncodingUTF8))
+    {
+        gTransitionUUID[0] = 0;
+    }
+
+    if (gTransition && !gTransition->uuid[0]) {
+        strlcpy(gTransition->uuid, gTransitionUUID, sizeof(gTransition->uuid));
+    }
+}
+
+__private_extern__ CFArrayRef copyTransitionProfile(void)
+{
+    CFMutableArrayRef       profile = NULL;
+    CFMutableDictionaryRef  one = NULL;
+    CFMutableArrayRef       phases = NULL;
+    CFNumberRef             num = NULL;
+    CFStringRef             uuid = NULL;
+    TransitionRecord        *record;
+    int                     i, j;
+
+    if (0 == gTransitionProfileCount)
+        return NULL;
+
+    profile = CFArrayCreateMutable(0, gTransitionProfileCount, &kCFTypeArrayCallBacks);
+    if (!profile)
+        return NULL;
+
+    // Oldest first
+    for (i=0; i<gTransitionProfileCount; i++)
+    {
+        record = &gTransitionProfile[(gTransitionProfileNext - gTransitionProfileCount + i
+                                        + kTransitionProfileCount) % kTransitionProfileCount];
+
+        one = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        phases = CFArrayCreateMutable(0, kPMTransitionPhaseCount, &kCFTypeArrayCallBacks);
+        if (!one || !phases)
+            goto next;
+
+        if (record->uuid[0]
+            && (uuid = CFStringCreateWithCString(0, record->uuid, kCFStringEncodingUTF8)))
+        {
+            CFDictionarySetValue(one, CFSTR(kPMTransitionUUIDKey), uuid);
+            CFRelease(uuid);
+        }
+
+        if ((num = CFNumberCreate(0, kCFNumberIntType, &record->kind))) {
+            CFDictionarySetValue(one, CFSTR(kPMTransitionKindKey), num);
+            CFRelease(num);
+        }
+
+        for (j=0; j<kPMTransitionPhaseCount; j++) {
+            if ((num = CFNumberCreate(0, kCFNumberSInt32Type, &record->phaseUS[j]))) {
+                CFArrayAppendValue(phases, num);
+                CFRelease(num);
+            }
+        }
+        CFDictionarySetValue(one, CFSTR(kPMTransitionPhasesKey), phases);
+
+        CFArrayAppendValue(profile, one);
+next:
+        if (one)
+            CFRelease(one);
+        if (phases)
+            CFRelease(phases);
+        one = NULL;
+        phases = NULL;
+    }
+
+    return profile;
 }
 
 /************************************************************************************/
@@ -2188,14 +2490,11 @@ static PMResponseWrangler *connectionFireNotification(
     long kernelAcknowledgementID)
 {
     int                     affectedBits = 0;
-    CFArrayRef              interested = NULL;
-    PMConnection            *connection = NULL;
-    int                     interestedCount = 0;
-    uint32_t                messageToken = 0;
-    int                     calloutCount = 0;
-    
-    PMResponseWrangler      *responseWrangler = NULL;
-    PMResponse              *awaitThis = NULL;
+
+    // A real transition never waits behind a simulated one.
+    if (gLastResponseWrangler && gLastResponseWrangler->simulatedGroup) {
+        simulatedChangeFinish(gLastResponseWrangler, true);
+    }
 
     /*
      * If a response wrangler is active, store the new notification on the
@@ -2221,12 +2520,36 @@ static PMResponseWrangler *connectionFireNotification(
     affectedBits = interestBitsNotify ^ gCurrentCapabilityBits;
 
     gCurrentCapabilityBits = interestBitsNotify;
+    gSimulatedCapabilityBitsValid = false;
 
-    interested = createArrayOfConnectionsWithInterest(affectedBits);
-    if (!interested) {
-        goto exit;
-    }
-    interestedCount = (int)CFArrayGetCount(interested);
+    return connectionFireNotificationToGroup(interestBitsNotify, affectedBits,
+                                             kernelAcknowledgementID, 0);
+}
+
+/* connectionFireNotificationToGroup
+ *
+ * Sends interestBitsNotify to every connection interested in affectedBits
+ * and returns the wrangler tracking their responses. A non-zero onlyGroup
+ * makes this a simulated change: only connections owned by that process
+ * group are notified, and completion neither acks the kernel nor schedules
+ * wakes.
+ */
+static PMResponseWrangler *connectionFireNotificationToGroup(
+    int interestBitsNotify,
+    int affectedBits,
+    long kernelAcknowledgementID,
+    pid_t onlyGroup)
+{
+    PMConnection            *connection = NULL;
+    int                     interestedCount = 0;
+    uint32_t                messageToken = 0;
+    int                     calloutCount = 0;
+    CFAbsoluteTime          earliestDeadline = kCFAbsoluteTimeIntervalSince1904;
+
+    PMResponseWrangler      *responseWrangler = NULL;
+    PMResponse              *awaitThis = NULL;
+
+    interestedCount = collectConnectionsWithInterest(affectedBits);
     if (0 == interestedCount) {
         goto exit;
     }
@@ -2243,6 +2566,9 @@ static PMResponseWrangler *connectionFireNotification(
     responseWrangler->notificationType = interestBitsNotify;
     responseWrangler->awaitResponsesTimeoutSeconds = (int)kPMConnectionNotifyTimeoutDefault;
     responseWrangler->kernelAcknowledgementID = kernelAcknowledgementID;
+    responseWrangler->simulatedGroup = onlyGroup;
+    responseWrangler->transitionID = gTransition ? gTransition->id : 0;
+    responseWrangler->firedTime = CFAbsoluteTimeGetCurrent();
 
     
     /*
@@ -2254,16 +2580,23 @@ static PMResponseWrangler *connectionFireNotification(
                     CFArrayCreateMutable(kCFAllocatorDefault, interestedCount, &_CFArrayVanillaCallBacks);
     responseWrangler->awaitingResponsesCount = interestedCount;
 
-    responseWrangler->responseStats =
+    // Simulated changes stay out of the app response stats
+    if (!onlyGroup) {
+        responseWrangler->responseStats =
                     CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+    }
     for (calloutCount=0; calloutCount<interestedCount; calloutCount++) 
     {
-        connection = (PMConnection *)CFArrayGetValueAtIndex(interested, calloutCount);
+        connection = gFanout[calloutCount];
     
         if ((MACH_PORT_NULL == connection->notifyPort) ||
             (false == connection->notifyEnable)) {
             continue;
         }
+
+        if (onlyGroup && (getpgid(connection->callerPID) != onlyGroup)) {
+            continue;
+        }
         
         /* We generate a messagetoken here, which the notifiee must pass 
          * back into us when the client acknowledges. 
@@ -2295,35 +2628,33 @@ static PMResponseWrangler *connectionFireNotification(
         awaitThis->notificationType = interestBitsNotify;
         awaitThis->myResponseWrangler = responseWrangler;
         awaitThis->notifiedWhen = CFAbsoluteTimeGetCurrent();
+        awaitThis->wakeLeeway = 0.0;
+        awaitThis->deadline = awaitThis->notifiedWhen +
+                    (connection->timeoutCnt ? kPMConnectionNotifyTimeoutTardy
+                                            : responseWrangler->awaitResponsesTimeoutSeconds);
+        if (awaitThis->deadline < earliestDeadline) {
+            earliestDeadline = awaitThis->deadline;
+        }
 
         CFArrayAppendValue(responseWrangler->awaitingResponses, awaitThis);
+        responseWrangler->outstandingResponsesCount++;
 
         if (gDebugFlags & kIOPMDebugLogCallbacks)
            logASLPMConnectionNotify(awaitThis->connection->callerName, interestBitsNotify );
          
     }
 
-    // TODO: Set off a timer to fire in xx30xx seconds 
-    CFRunLoopTimerContext   responseTimerContext = 
-        { 0, (void *)responseWrangler, NULL, NULL, NULL };
-    responseWrangler->awaitingResponsesTimeout = 
-            CFRunLoopTimerCreate(0, 
-                    CFAbsoluteTimeGetCurrent() + responseWrangler->awaitResponsesTimeoutSeconds, 
-                    0.0, 0, 0, responsesTimedOut, &responseTimerContext);
+    if (!onlyGroup) {
+        transitionProfileMark(kPMTransitionPhaseFanout, false);
+    }
 
-    if (responseWrangler->awaitingResponsesTimeout)
-    {
-        CFRunLoopAddTimer(CFRunLoopGetCurrent(), 
-                            responseWrangler->awaitingResponsesTimeout, 
-                            kCFRunLoopDefaultMode);
-                            
-        CFRelease(responseWrangler->awaitingResponsesTimeout);
+    // Fire at the earliest client deadline; responsesTimedOut re-arms for the next one.
+    if (0 == responseWrangler->outstandingResponsesCount) {
+        earliestDeadline = CFAbsoluteTimeGetCurrent() + responseWrangler->awaitResponsesTimeoutSeconds;
     }
+    scheduleResponsesTimeout(responseWrangler, earliestDeadline);
 
 exit:
-    if (interested) 
-        CFRelease(interested);
-
     // Record the active wrangler in a global, then clear when reaped.
     if (responseWrangler)
         gLastResponseWrangler = responseWrangler;
@@ -2332,6 +2663,17 @@ exit:
 }
 
 /*****************************************************************************/
+/*
+ * Acks a sleep or capability change to the kernel. Assertion updates that
+ * powerd is still holding back are sent first, so the kernel decides on
+ * the change with the current assertion levels.
+ */
+static void allowPowerChange(long notificationID)
+{
+    PMAssertions_FlushKernelUpdates();
+    IOAllowPowerChange(gRootDomainConnect, notificationID);
+}
+
 static void sendNoRespNotification( int interestBitsNotify )
 {
 
@@ -2340,14 +2682,11 @@ static void sendNoRespNotification( int interestBitsNotify )
     PMConnection            *connection = NULL;
 
 
-    count = CFArrayGetCount(gConnections);
+    count = collectConnectionsWithInterest(interestBitsNotify);
 
     for (i=0; i<count; i++)
     {
-        connection = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
-
-        if ((connection->interestsBits & interestBitsNotify) == 0) 
-           continue;
+        connection = gFanout[i];
 
         if ((MACH_PORT_NULL == connection->notifyPort) ||
             (false == connection->notifyEnable)) {
@@ -2375,10 +2714,34 @@ static void sendNoRespNotification( int interestBitsNotify )
 /*****************************************************************************/
 /*****************************************************************************/
 
+static void scheduleResponsesTimeout(PMResponseWrangler *wrangler, CFAbsoluteTime fireDate)
+{
+    CFRunLoopTimerContext   responseTimerContext = 
+        { 0, (void *)wrangler, NULL, NULL, NULL };
+
+    wrangler->awaitingResponsesTimeout = 
+            CFRunLoopTimerCreate(0, fireDate, 0.0, 0, 0, 
+                    responsesTimedOut, &responseTimerContext);
+
+    if (wrangler->awaitingResponsesTimeout)
+    {
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), 
+                            wrangler->awaitingResponsesTimeout, 
+                            kCFRunLoopDefaultMode);
+                            
+        CFRelease(wrangler->awaitingResponsesTimeout);
+    }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
 static void responsesTimedOut(CFRunLoopTimerRef timer, void * info)
 {
     PMResponseWrangler  *responseWrangler = (PMResponseWrangler *)info;
     PMResponse          *one_response = NULL;
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime      nextDeadline = kCFAbsoluteTimeIntervalSince1904;
 
     CFIndex         i, responsesCount = 0;
 #if !TARGET_OS_EMBEDDED
@@ -2394,8 +2757,8 @@ static void responsesTimedOut(CFRunLoopTimerRef timer, void * info)
     // Mark the timer as NULL since it's just fired and autoreleased.
     responseWrangler->awaitingResponsesTimeout = NULL;
 
-    // Iterate list of awaiting responses, and tattle on anyone who hasn't 
-    // acknowledged yet.
+    // Iterate list of awaiting responses, and tattle on anyone who's past
+    // their deadline and hasn't acknowledged yet.
     // Artificially mark them as "replied", with their reason being "timed out"
     responsesCount = CFArrayGetCount(responseWrangler->awaitingResponses);
     for (i=0; i<responsesCount; i++)
@@ -2407,10 +2770,20 @@ static void responsesTimedOut(CFRunLoopTimerRef timer, void * info)
         if (one_response->replied)
             continue;
 
+        // Still within this client's deadline; wait for it.
+        // Allow some slop for timer coalescing.
+        if (one_response->deadline > now + 0.1) {
+            if (one_response->deadline < nextDeadline)
+                nextDeadline = one_response->deadline;
+            continue;
+        }
+
         // Caught a tardy reply
         one_response->replied = true;
         one_response->timedout = true;
-        one_response->repliedWhen = CFAbsoluteTimeGetCurrent();
+        one_response->repliedWhen = now;
+        one_response->connection->timeoutCnt++;
+        responseWrangler->outstandingResponsesCount--;
         
         cacheResponseStats(one_response);
 
@@ -2423,6 +2796,10 @@ static void responsesTimedOut(CFRunLoopTimerRef timer, void * info)
 #endif
     }
 
+    if (responseWrangler->outstandingResponsesCount > 0) {
+        scheduleResponsesTimeout(responseWrangler, nextDeadline);
+    }
+
     checkResponses(responseWrangler);
 }
 
@@ -2480,8 +2857,8 @@ static void _sendMachMessage(
     return;
 }
 
-static aslmsg describeWakeRequest(
-    aslmsg                  m,
+static pmlogmsg describeWakeRequest(
+    pmlogmsg              m,
     pid_t                   pid,
     char                    *describeType,
     CFAbsoluteTime          requestedTime,
@@ -2493,26 +2870,26 @@ static aslmsg describeWakeRequest(
 
     if (m == NULL) {
         m = new_msg_pmset_log();
-        asl_set(m, kPMASLDomainKey, kPMASLDomainClientWakeRequests);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainClientWakeRequests);
         cnt = 0;
     }
 
     key[0] = value[0] = 0;
     proc_name(pid, value, sizeof(value));
     snprintf(key, sizeof(key), "%s%d", KPMASLWakeReqAppNamePrefix, cnt);
-    asl_set(m, key, value);
+    pmlog_set(m, key, value);
 
     snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTypePrefix, cnt);
-    asl_set(m, key, describeType);
+    pmlog_set(m, key, describeType);
 
     snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTimeDeltaPrefix, cnt);
     snprintf(value, sizeof(value), "%.0f", requestedTime - CFAbsoluteTimeGetCurrent());
-    asl_set(m, key, value);
+    pmlog_set(m, key, value);
 
     if (isA_CFString(clientInfoString) && 
         (CFStringGetCString(clientInfoString, value, sizeof(value), kCFStringEncodingUTF8))) {
         snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqClientInfoPrefix, cnt);
-        asl_set(m, key, value);
+        pmlog_set(m, key, value);
     }
     cnt++;
 
@@ -2528,10 +2905,13 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     CFIndex                 responsesCount          = 0;
     bool                    complete                = true;
     PMResponse              *oneResponse            = NULL;
-    aslmsg                  m = NULL;
+    pmlogmsg              m = NULL;
     int                     chosenReq = -1;
     CFAbsoluteTime          userWake = 0.0; 
+    CFTimeInterval          userWakeLeeway = 0.0;
     CFAbsoluteTime          earliestWake = kCFAbsoluteTimeIntervalSince1904; // Invalid value
+    WakeCandidateHeap       heap = { NULL, 0, 0 };
+    int                     coalescedCount = 0;
     wakeType_e              type = kChooseWakeTypeCount; // Invalid value
     CFBooleanRef            scheduleEvent = kCFBooleanFalse;
     bool                    userWakeReq = false, ssWakeReq = false;
@@ -2548,6 +2928,14 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     }
 #endif
     responsesCount = CFArrayGetCount(wrangler->awaitingResponses);    
+
+    // Up to three wake requests per client, plus the user's scheduled wake
+    if (!BIT_IS_SET(wrangler->notificationType, kIOPMSystemCapabilityCPU)) {
+        heap.capacity = (int)(3 * responsesCount + 1);
+        heap.candidates = calloc(heap.capacity, sizeof(WakeCandidate));
+        if (!heap.candidates)
+            heap.capacity = 0;
+    }
     
     for (i=0; i<responsesCount; i++)
     {
@@ -2574,12 +2962,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     "Maintenance",
                                     oneResponse->maintenanceRequested,
                                     oneResponse->clientInfoString);
-            if (oneResponse->maintenanceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->maintenanceRequested;
-                type = kChooseMaintenance;
-                chosenReq = reqCnt;
-            }
+            wakeHeapPush(&heap, oneResponse->maintenanceRequested,
+                         oneResponse->wakeLeeway, kChooseMaintenance, reqCnt);
             reqCnt++;
         }
 
@@ -2590,12 +2974,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     oneResponse->sleepServiceRequested,
                                     oneResponse->clientInfoString);
 
-            if (oneResponse->sleepServiceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->sleepServiceRequested;
-                type = kChooseSleepServiceWake;
-                chosenReq = reqCnt;
-            }
+            wakeHeapPush(&heap, oneResponse->sleepServiceRequested,
+                         oneResponse->wakeLeeway, kChooseSleepServiceWake, reqCnt);
             ssWakeReq = true;
             reqCnt++;
         }
@@ -2607,12 +2987,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     oneResponse->timerPluginRequested,
                                     oneResponse->clientInfoString);
 
-            if (oneResponse->timerPluginRequested < earliestWake)
-            {
-                earliestWake = oneResponse->timerPluginRequested;
-                type = kChooseTimerPlugin;
-                chosenReq = reqCnt;
-            }
+            wakeHeapPush(&heap, oneResponse->timerPluginRequested,
+                         oneResponse->wakeLeeway, kChooseTimerPlugin, reqCnt);
             reqCnt++;
         }
     }
@@ -2624,26 +3000,19 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         goto exit;
     }
 
-    if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-        // Make sure that wake request is at least 1 min from now
-        earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-    }
-    userWake = getEarliestRequestAutoWake();
+    userWake = getEarliestRequestAutoWakeWithLeeway(&userWakeLeeway);
     if (VALID_DATE(userWake)) {
         m = describeWakeRequest(m, getpid(), "UserWake", userWake, NULL);
-        if (userWake <= earliestWake) {
-            earliestWake = userWake;
-            type = kChooseFullWake;
-            chosenReq = reqCnt;
-            if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-                // Make sure that wake request is at least 1 min from now
-                earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-            }
-        }
+        wakeHeapPush(&heap, userWake, userWakeLeeway, kChooseFullWake, reqCnt);
         userWakeReq = true;
         reqCnt++;
     }
 
+    earliestWake = wakeHeapCoalesce(&heap, &type, &chosenReq, &coalescedCount);
+    if (coalescedCount > 1) {
+        mt2RecordDarkWakesCoalesced(coalescedCount - 1);
+    }
+
     if (ts_apo != 0) {
         // Report existence of user wake request or SS request to IOPPF(thru rootDomain)
         // This is used in figuring out if Auto Power Off should be scheduled
@@ -2656,8 +3025,13 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     if (m != NULL) {
         char chosenStr[5];
         snprintf(chosenStr, sizeof(chosenStr), "%d", chosenReq);
-        asl_set(m, kPMASLWakeReqChosenIdx, chosenStr);
-        asl_send(NULL, m);
+        pmlog_set(m, kPMASLWakeReqChosenIdx, chosenStr);
+        if (coalescedCount > 1) {
+            snprintf(chosenStr, sizeof(chosenStr), "%d", coalescedCount);
+            pmlog_set(m, kPMASLWakeReqCoalescedCount, chosenStr);
+        }
+        pmlog_send(m);
+        m = NULL;
     }
 
     PMScheduleWakeEventChooseBest(earliestWake, type);
@@ -2665,24 +3039,40 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
 exit:
 
     if (m != NULL) {
-        asl_release(m);
+        pmlog_release(m);
+    }
+    if (heap.candidates) {
+        free(heap.candidates);
     }
     return complete;
 }
 
 static void checkResponses(PMResponseWrangler *wrangler)
 {
+    // Acks are processed as they arrive; there's nothing to evaluate
+    // until the last outstanding client has replied or timed out.
+    if (wrangler->outstandingResponsesCount > 0) {
+        return;
+    }
 
+    if (wrangler->simulatedGroup) {
+        simulatedChangeFinish(wrangler, false);
+        return;
+    }
 
     if (!checkResponses_ScheduleWakeEvents(wrangler)) {
         // Not all clients acknowledged.
         return;
     }
 
+    if (!BIT_IS_SET(wrangler->notificationType, kIOPMSystemCapabilityCPU)
+        && transitionProfileIsCurrent(wrangler->transitionID)) {
+        transitionProfileMark(kPMTransitionPhaseScheduleWake, false);
+    }
+
     if (wrangler->responseStats) {
         logASLMessageAppStats(wrangler->responseStats, kPMASLDomainPMClientStats);
-        CFRelease(wrangler->responseStats);
-        wrangler->responseStats = NULL;
+        releaseResponseStats(wrangler);
     }
 
     // Completion: all clients have acknowledged.
@@ -2694,13 +3084,121 @@ static void checkResponses(PMResponseWrangler *wrangler)
     // Handle PowerManagement acknowledgements
     if (wrangler->kernelAcknowledgementID) 
     {
-        IOAllowPowerChange(gRootDomainConnect, wrangler->kernelAcknowledgementID);
+        allowPowerChange(wrangler->kernelAcknowledgementID);
+        if (transitionProfileIsCurrent(wrangler->transitionID))
+            transitionProfileEnd();
     }
     
     cleanupResponseWrangler(wrangler);
     
     return;
 }
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+#pragma mark -
+#pragma mark SimulatedChange
+
+/* simulatedChangeFinish
+ *
+ * Records how long the simulated change in 'wrangler' took to be acknowledged,
+ * or that a real transition preempted it, then reaps it.
+ */
+static void simulatedChangeFinish(PMResponseWrangler *wrangler, bool preempted)
+{
+    PMResponse          *one_response = NULL;
+    CFIndex             i, responsesCount = 0;
+    CFTimeInterval      elapsed = 0.0;
+
+    if (wrangler->awaitingResponsesTimeout) {
+        CFRunLoopTimerInvalidate(wrangler->awaitingResponsesTimeout);
+        wrangler->awaitingResponsesTimeout = NULL;
+    }
+
+    gSimulatedChangeTimeouts = 0;
+    if (wrangler->awaitingResponses) {
+        responsesCount = CFArrayGetCount(wrangler->awaitingResponses);
+    }
+    for (i=0; i<responsesCount; i++) {
+        one_response = (PMResponse *)CFArrayGetValueAtIndex(wrangler->awaitingResponses, i);
+        if (one_response && one_response->timedout)
+            gSimulatedChangeTimeouts++;
+    }
+
+    if (preempted) {
+        gSimulatedChangeDurationUS = -2;
+    } else {
+        elapsed = CFAbsoluteTimeGetCurrent() - wrangler->firedTime;
+        if (elapsed < 0.0)
+            elapsed = 0.0;
+        gSimulatedChangeDurationUS = (elapsed < (INT32_MAX / 1000000.0)) ?
+                                        (int)(elapsed * 1000000.0) : INT32_MAX;
+    }
+
+    cleanupResponseWrangler(wrangler);
+
+    notify_post(kPMSimulatedChangeDoneNotifyString);
+}
+
+/* PMConnectionSimulateCapabilityChange
+ *
+ * Fans 'capabilities' out to the PMConnections owned by the caller's process
+ * group, exactly as a kernel capability change would, without touching the
+ * system's capability state, the kernel or the wake schedule. The changed
+ * bits are taken against the previous simulated change, or against the real
+ * capabilities for the first one. Lets a
+ * benchmark measure notification and acknowledgement latency with synthetic
+ * clients. Completion is announced on kPMSimulatedChangeDoneNotifyString.
+ */
+__private_extern__ IOReturn PMConnectionSimulateCapabilityChange(
+    pid_t callerPID,
+    IOPMCapabilityBits capabilities)
+{
+    PMResponseWrangler  *wrangler = NULL;
+    IOPMCapabilityBits  affectedBits;
+    pid_t               group;
+
+    if (gLastResponseWrangler) {
+        return kIOReturnBusy;
+    }
+
+    group = getpgid(callerPID);
+    if (group <= 0) {
+        return kIOReturnBadArgument;
+    }
+
+    if (!gSimulatedCapabilityBitsValid) {
+        gSimulatedCapabilityBits = gCurrentCapabilityBits;
+        gSimulatedCapabilityBitsValid = true;
+    }
+    affectedBits = capabilities ^ gSimulatedCapabilityBits;
+    gSimulatedCapabilityBits = capabilities;
+
+    gSimulatedChangeDurationUS = -1;
+    gSimulatedChangeTimeouts = 0;
+
+    wrangler = connectionFireNotificationToGroup(capabilities, affectedBits, 0, group);
+    if (!wrangler) {
+        // Nobody is interested in the changing bits
+        gSimulatedChangeDurationUS = 0;
+        notify_post(kPMSimulatedChangeDoneNotifyString);
+    } else if (0 == wrangler->outstandingResponsesCount) {
+        checkResponses(wrangler);
+    }
+
+    return kIOReturnSuccess;
+}
+
+__private_extern__ int PMConnectionSimulatedChangeDuration(void)
+{
+    return gSimulatedChangeDurationUS;
+}
+
+__private_extern__ int PMConnectionSimulatedChangeTimeouts(void)
+{
+    return gSimulatedChangeTimeouts;
+}
             
             
 static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_e type)
@@ -2748,13 +3246,13 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
              // Auto Power off timer is the earliest one and system is capable of
              // entering ErpLot6. Don't schedule any other wakes.
              if (gDebugFlags & kIOPMDebugLogCallbacks)
-                asl_log(0,0,ASL_LEVEL_ERR, 
+                pmlog_log(ASL_LEVEL_ERR, 
                      "Not scheduling other wakes to allow AutoPower off. APO timer:%lld\n", 
                      secs_to_apo);
              return;
        }
        if (gDebugFlags & kIOPMDebugLogCallbacks)
-             asl_log(0,0,ASL_LEVEL_ERR, "sleepType:%d APO timer:%lld secs\n", 
+             pmlog_log(ASL_LEVEL_ERR, "sleepType:%d APO timer:%lld secs\n", 
                      sleepType, secs_to_apo);
     }
 
@@ -2796,36 +3294,112 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
 /*****************************************************************************/
 /*****************************************************************************/
 
-static CFArrayRef createArrayOfConnectionsWithInterest(
+/* collectConnectionsWithInterest
+ *
+ * Fills gFanout with every connection interested in any of interestBits,
+ * by walking only the buckets for those bits. A connection that sits in
+ * several of those buckets is collected once. Returns the count; gFanout
+ * is valid until the next call.
+ */
+static int collectConnectionsWithInterest(
     int interestBits)
 {
-    CFMutableArrayRef       arrayFoundInterests = NULL;
+    PMConnectionBucket      *bucket;
     PMConnection            *lookee;
-    CFIndex                 connectionsCount;
-    CFIndex                 i;
-    
-    
+    int                     needed = 0;
+    int                     found = 0;
+    int                     bit;
+    int                     i;
+
     if (0 == interestBits)
-        return NULL;
+        return 0;
 
-    // *********        
-    
-    arrayFoundInterests = CFArrayCreateMutable(kCFAllocatorDefault, 0, &_CFArrayConnectionCallBacks);
+    for (bit=0; bit<kConnectionInterestBitCount; bit++) {
+        if (interestBits & (1U << bit))
+            needed += gInterestBuckets[bit].count;
+    }
+    if (needed > gFanoutCapacity) {
+        PMConnection **grown = realloc(gFanout, needed * sizeof(PMConnection *));
+        if (!grown)
+            return 0;
+        gFanout = grown;
+        gFanoutCapacity = needed;
+    }
 
-    connectionsCount = CFArrayGetCount(gConnections);
+    // A stamp of 0 is reserved for "never collected"
+    if (0 == ++gFanoutStamp)
+        gFanoutStamp = 1;
 
-    for (i=0; i<connectionsCount; i++)
+    for (bit=0; bit<kConnectionInterestBitCount; bit++)
     {
-        lookee = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
+        if (!(interestBits & (1U << bit)))
+            continue;
 
-        // Matching interest in this connection
-        if (interestBits & lookee->interestsBits) {
-            CFArrayAppendValue(arrayFoundInterests, lookee);
+        bucket = &gInterestBuckets[bit];
+        for (i=0; i<bucket->count; i++)
+        {
+            lookee = bucket->connections[i];
+            if (lookee->fanoutStamp != gFanoutStamp) {
+                lookee->fanoutStamp = gFanoutStamp;
+                gFanout[found++] = lookee;
+            }
         }
     }
-    
-    return arrayFoundInterests;
-    
+
+    return found;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+/* connectionSetInterests
+ *
+ * The only place interestsBits should change; keeps gInterestBuckets in sync.
+ * Passing 0 removes the connection from every bucket.
+ */
+static void connectionSetInterests(
+    PMConnection *connection,
+    IOPMCapabilityBits interests)
+{
+    PMConnectionBucket      *bucket;
+    IOPMCapabilityBits      removed = connection->interestsBits & ~interests;
+    IOPMCapabilityBits      added = interests & ~connection->interestsBits;
+    int                     bit;
+    int                     i;
+
+    for (bit=0; bit<kConnectionInterestBitCount; bit++)
+    {
+        bucket = &gInterestBuckets[bit];
+
+        if (removed & (1U << bit))
+        {
+            for (i=0; i<bucket->count; i++) {
+                if (bucket->connections[i] == connection) {
+                    bucket->connections[i] = bucket->connections[--bucket->count];
+                    break;
+                }
+            }
+        }
+
+        if (added & (1U << bit))
+        {
+            if (bucket->count == bucket->capacity) {
+                int newCapacity = bucket->capacity ? 2 * bucket->capacity : 16;
+                PMConnection **grown = realloc(bucket->connections,
+                                               newCapacity * sizeof(PMConnection *));
+                if (!grown) {
+                    // Not notifiable for this bit; don't claim the interest either
+                    interests &= ~(1U << bit);
+                    continue;
+                }
+                bucket->connections = grown;
+                bucket->capacity = newCapacity;
+            }
+            bucket->connections[bucket->count++] = connection;
+        }
+    }
+
+    connection->interestsBits = interests;
 }
 
 /*****************************************************************************/
@@ -2851,8 +3425,11 @@ static IOReturn createConnectionWithID(PMConnection **out)
     
     ((PMConnection *)*out)->uniqueID = kConnectionOffset + globalConnectionIDTally++;
 
-    // Add new connection to the global tracking array
+    // Add new connection to the global tracking array and the ID hash
     CFArrayAppendValue(gConnections, *out);
+
+    (*out)->hashNext = gConnectionHash[(*out)->uniqueID % kConnectionHashSize];
+    gConnectionHash[(*out)->uniqueID % kConnectionHashSize] = *out;
     
     return kIOReturnSuccess;
 }
@@ -2862,22 +3439,13 @@ static IOReturn createConnectionWithID(PMConnection **out)
 
 static PMConnection *connectionForID(uint32_t findMe)
 {
-    CFIndex     where = 0;
-    CFRange     theRange = CFRangeMake(0, CFArrayGetCount(gConnections));
-    PMConnection     dummy;
-    
-    // Our gConnections CFArray equality callback only checks the "uniqueID" field
-    // of the passed in PMConnection type. Searching for the value "dummy"
-    // will return the first instance with connection ID "findMe".
+    PMConnection     *lookee = gConnectionHash[findMe % kConnectionHashSize];
 
-    dummy.uniqueID = findMe;
-    where = CFArrayGetFirstIndexOfValue(gConnections, theRange, &dummy);
-
-    if (kCFNotFound == where) {
-        return NULL;
-    } else {
-        return (PMConnection *)CFArrayGetValueAtIndex(gConnections, where);
+    while (lookee && (lookee->uniqueID != findMe)) {
+        lookee = lookee->hashNext;
     }
+
+    return lookee;
 }
 
 // Unclamps machine from SilentRunning if the machine is currently clamped.
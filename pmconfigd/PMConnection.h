@@ -65,6 +65,17 @@ __private_extern__ void cancel_NotificationDisplayWake();
 
 __private_extern__ void InternalEvalConnections(void);
 
+// pmconfigd.c calls into this when kernel PM publishes a new sleep/wake UUID
+__private_extern__ void PMConnectionSleepWakeUUIDChanged(CFStringRef uuid);
+
+// Sleep/wake transition profiles for kPMTransitionMIGCopyProfile
+__private_extern__ CFArrayRef copyTransitionProfile(void);
+
+// Synthetic capability change fan-out, for kPMSetSimulatedCapabilityChange
+__private_extern__ IOReturn PMConnectionSimulateCapabilityChange(pid_t callerPID, IOPMCapabilityBits capabilities);
+__private_extern__ int PMConnectionSimulatedChangeDuration(void);
+__private_extern__ int PMConnectionSimulatedChangeTimeouts(void);
+
 #if !TARGET_OS_EMBEDDED
 __private_extern__ int getCurrentSleepServiceCapTimeout();
 #endif
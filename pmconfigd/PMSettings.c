@@ -227,7 +227,7 @@ activateSettingOverrides(void)
 
             if (!gIOPMConnection) gIOPMConnection = IOPMFindPowerManagement(0);
             if (!gIOPMConnection) break;
-            kr = IOPMSetAggressiveness(gIOPMConnection, kPMMinutesToSleep, 
+            kr = setAggressivenessSetting(gIOPMConnection, kPMMinutesToSleep, 
                         (kPMPreventIdleSleep & g_overrides) ? 0 : gSleepSetting);
             if (kIOReturnSuccess != kr)
             {
@@ -379,7 +379,6 @@ static IOReturn
 activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
 {
     CFDictionaryRef                     energy_settings;
-    CFDictionaryRef                     activePMPrefs = NULL;
     CFMutableDictionaryRef              profiles_activated;
     IOReturn                            ret;
     CFNumberRef                         n1, n0;
@@ -454,20 +453,10 @@ activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
         ret = ActivatePMSettings(energy_settings, removeUnsupported);
     }
         
-    activePMPrefs = SCDynamicStoreCopyValue(_getSharedPMDynamicStore(), 
-                                            CFSTR(kIOPMDynamicStoreSettingsKey));
-    
-    // If there isn't currently a value for kIOPMDynamicStoreSettingsKey,
-    //   or the current value is different than the new value,
     // Put the new settings in the SCDynamicStore for interested apps.
-    
-    if( !isA_CFDictionary(activePMPrefs) || !CFEqual(activePMPrefs, energy_settings) )
-    {
-        PMStoreSetValue(CFSTR(kIOPMDynamicStoreSettingsKey), energy_settings);
-    }
-
-    if (activePMPrefs)
-        CFRelease(activePMPrefs);
+    // PMStore only writes through to configd if they differ from the
+    // value it last set.
+    PMStoreSetValue(CFSTR(kIOPMDynamicStoreSettingsKey), energy_settings);
 
     return ret;
 }
@@ -535,6 +524,10 @@ PMSettingsPrefsHaveChanged(void)
     // re-blast system-wide settings
     IOPMActivateSystemPowerSettings();
 
+    // Power source switches and overrides only send the settings that
+    // changed; new preferences go out to the kernel in full.
+    resetSentEnergySettings();
+
     // re-read preferences into memory
     if(energySettings) CFRelease(energySettings);
 
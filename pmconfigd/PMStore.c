@@ -11,6 +11,7 @@
 #include <SystemConfiguration/SCValidation.h>
 #include <SystemConfiguration/SCDynamicStorePrivate.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <notify.h>
 #include "PMStore.h"
 
 
@@ -22,7 +23,19 @@ __private_extern__ void PMStoreRequestCallBack(void *param, (PMStoreKeysChangedC
 static CFMutableDictionaryRef   gPMStore = NULL;
 SCDynamicStoreRef               gSCDynamicStore = NULL;
 
+/* Writes are staged here and sent to configd in one SCDynamicStoreSetMultiple()
+ * when the run loop is about to wait, so that several sets during one event
+ * cost one IPC and wake watchers once.
+ * gPendingNotifications holds notify(3) names that must not go out before
+ * the staged values do; see PMStoreNotifyPost().
+ */
+static CFMutableDictionaryRef   gPendingSets = NULL;
+static CFMutableSetRef          gPendingRemovals = NULL;
+static CFMutableArrayRef        gPendingNotifications = NULL;
+static CFRunLoopObserverRef     gFlushObserver = NULL;
+
 static void PMDynamicStoreDisconnectCallBack(SCDynamicStoreRef store, void *info __unused);
+static void flushObserverCallBack(CFRunLoopObserverRef observer, CFRunLoopActivity activity, void *info);
 
 /* dynamicStoreNotifyCallBack
  * defined in pmconfigd.c
@@ -38,6 +51,9 @@ void PMStoreLoad()
     CFRunLoopSourceRef      _storeRLS = NULL;
 
     gPMStore = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingSets = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingRemovals = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
+    gPendingNotifications = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
 
     gSCDynamicStore = SCDynamicStoreCreate(0, CFSTR("powerd"), dynamicStoreNotifyCallBack, NULL);
 
@@ -51,9 +67,21 @@ void PMStoreLoad()
     }
     
     SCDynamicStoreSetDisconnectCallBack(gSCDynamicStore, PMDynamicStoreDisconnectCallBack);
+
+    gFlushObserver = CFRunLoopObserverCreate(0, kCFRunLoopBeforeWaiting | kCFRunLoopExit,
+                                             true, 0, flushObserverCallBack, NULL);
+    if (gFlushObserver) {
+        CFRunLoopAddObserver(CFRunLoopGetCurrent(), gFlushObserver, kCFRunLoopCommonModes);
+    }
 }
                 
 
+static bool hasPendingWrites(void)
+{
+    return (gPendingSets && CFDictionaryGetCount(gPendingSets))
+        || (gPendingRemovals && CFSetGetCount(gPendingRemovals));
+}
+
 bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
 {
     CFTypeRef lastValue = NULL;
@@ -68,17 +96,121 @@ bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
     }
     
     CFDictionarySetValue(gPMStore, key, value);
-    return SCDynamicStoreSetValue(gSCDynamicStore, key, value);
+
+    if (!gPendingSets || !gFlushObserver) {
+        return SCDynamicStoreSetValue(gSCDynamicStore, key, value);
+    }
+
+    CFSetRemoveValue(gPendingRemovals, key);
+    CFDictionarySetValue(gPendingSets, key, value);
+    return true;
 }
 
 bool PMStoreRemoveValue(CFStringRef key)
 {
-    if (key) {
-        CFDictionaryRemoveValue(gPMStore, key);
+    if (!key)
+        return false;
+
+    CFDictionaryRemoveValue(gPMStore, key);
+
+    if (!gPendingSets || !gFlushObserver) {
         return SCDynamicStoreRemoveValue(gSCDynamicStore, key);
     }
-    
-    return false;
+
+    CFDictionaryRemoveValue(gPendingSets, key);
+    CFSetAddValue(gPendingRemovals, key);
+    return true;
+}
+
+CFTypeRef PMStoreCopyValue(CFStringRef key)
+{
+    CFTypeRef value;
+
+    if (!key)
+        return NULL;
+
+    if (gPMStore && (value = CFDictionaryGetValue(gPMStore, key))) {
+        return CFRetain(value);
+    }
+    if (gPendingRemovals && CFSetContainsValue(gPendingRemovals, key)) {
+        return NULL;
+    }
+
+    return SCDynamicStoreCopyValue(gSCDynamicStore, key);
+}
+
+void PMStoreNotifyPost(const char *name)
+{
+    CFStringRef     nameString;
+
+    if (!name)
+        return;
+
+    if (!hasPendingWrites()
+        || !(nameString = CFStringCreateWithCString(0, name, kCFStringEncodingUTF8)))
+    {
+        notify_post(name);
+        return;
+    }
+
+    if (!CFArrayContainsValue(gPendingNotifications,
+                              CFRangeMake(0, CFArrayGetCount(gPendingNotifications)),
+                              nameString))
+    {
+        CFArrayAppendValue(gPendingNotifications, nameString);
+    }
+    CFRelease(nameString);
+}
+
+void PMStoreFlush(void)
+{
+    CFArrayRef      removals = NULL;
+    CFIndex         count;
+    CFIndex         i;
+    char            name[256];
+
+    if (hasPendingWrites())
+    {
+        count = CFSetGetCount(gPendingRemovals);
+        if (count) {
+            const void  **keys = malloc(count * sizeof(void *));
+            if (keys) {
+                CFSetGetValues(gPendingRemovals, keys);
+                removals = CFArrayCreate(0, keys, count, &kCFTypeArrayCallBacks);
+                free(keys);
+            }
+        }
+
+        SCDynamicStoreSetMultiple(gSCDynamicStore,
+                                  CFDictionaryGetCount(gPendingSets) ? gPendingSets : NULL,
+                                  removals, NULL);
+
+        CFDictionaryRemoveAllValues(gPendingSets);
+        CFSetRemoveAllValues(gPendingRemovals);
+        if (removals) {
+            CFRelease(removals);
+        }
+    }
+
+    count = gPendingNotifications ? CFArrayGetCount(gPendingNotifications) : 0;
+    for (i = 0; i < count; i++) {
+        if (CFStringGetCString(CFArrayGetValueAtIndex(gPendingNotifications, i),
+                               name, sizeof(name), kCFStringEncodingUTF8))
+        {
+            notify_post(name);
+        }
+    }
+    if (count) {
+        CFArrayRemoveAllValues(gPendingNotifications);
+    }
+}
+
+static void flushObserverCallBack(
+    CFRunLoopObserverRef        observer __unused,
+    CFRunLoopActivity           activity __unused,
+    void                        *info __unused)
+{
+    PMStoreFlush();
 }
 
 static void PMDynamicStoreDisconnectCallBack(
@@ -87,5 +219,11 @@ static void PMDynamicStoreDisconnectCallBack(
 {
     assert (store == gSCDynamicStore);
     
+    // gPMStore already holds every staged set, and not the staged removals
+    if (gPendingSets) {
+        CFDictionaryRemoveAllValues(gPendingSets);
+        CFSetRemoveAllValues(gPendingRemovals);
+    }
     SCDynamicStoreSetMultiple(gSCDynamicStore, gPMStore, NULL, NULL);
+    PMStoreFlush();
 }
@@ -13,3 +13,17 @@ __private_extern__ bool PMStoreSetValue(CFStringRef key, CFTypeRef value);
 
 __private_extern__ bool PMStoreRemoveValue(CFStringRef key);
 
+/* PMStoreSetValue() and PMStoreRemoveValue() stage their change; staged
+ * changes go to configd in one batch before the run loop next waits.
+ *
+ * PMStoreCopyValue() sees staged changes to keys powerd owns.
+ * PMStoreNotifyPost() posts a notify(3) name after the staged changes are
+ * written, for notifications whose listeners read the store. PMStoreFlush()
+ * writes staged changes (and queued notifications) right away.
+ */
+__private_extern__ CFTypeRef PMStoreCopyValue(CFStringRef key);
+
+__private_extern__ void PMStoreNotifyPost(const char *name);
+
+__private_extern__ void PMStoreFlush(void);
+
@@ -45,8 +45,12 @@
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <malloc/malloc.h>
 #include <dispatch/dispatch.h>
 #include <notify.h>
 
@@ -135,6 +139,8 @@ typedef struct {
     CFArrayRef      claimedWakeEventsArray;
     CFStringRef     claimedWake;
     CFStringRef     interpretedWake;
+    CFStringRef     wakeUUID;       // sleep/wake UUID the wake fields were resolved for
+    bool            wakeFull;       // ... and whether that was for a full wake
 } PowerEventReasons;
 
 static PowerEventReasons     reasons = {
@@ -143,6 +149,7 @@ static PowerEventReasons     reasons = {
         CFSTR(""),
         NULL,
         NULL,
+        NULL,
         NULL
         };
 
@@ -397,7 +404,10 @@ __private_extern__ void _resetWakeReason( )
     if (reasons.platformWakeType)           CFRelease(reasons.platformWakeType);
     if (reasons.claimedWake)        CFRelease(reasons.claimedWake);
     if (isA_CFArray(reasons.claimedWakeEventsArray))   CFRelease(reasons.claimedWakeEventsArray);
+    if (reasons.wakeUUID)           CFRelease(reasons.wakeUUID);
 
+    reasons.wakeUUID                = NULL;
+    reasons.wakeFull                = false;
     reasons.interpretedWake         = NULL;
     reasons.claimedWake             = NULL;
     reasons.claimedWakeEventsArray  = NULL;
@@ -447,22 +457,64 @@ static CFStringRef claimedReasonFromEventsArray(CFArrayRef wakeEvents)
 }
 
 
+static CFTypeRef copyWakeProperty(CFDictionaryRef props, CFStringRef key)
+{
+    CFTypeRef   value = props ? CFDictionaryGetValue(props, key) : NULL;
+
+    return value ? CFRetain(value) : NULL;
+}
+
+/*
+ * Resolves the wake reason once per wake. All of rootDomain's wake
+ * properties are fetched with a single registry read, and the result is
+ * kept alongside the sleep/wake UUID and destination it belongs to; a
+ * repeat call for the same wake is served from 'reasons' without going back
+ * to the kernel. A DarkWake promoted to FullWake keeps its UUID but the
+ * kernel rewrites Wake Type, so 'fullWake' is part of the key.
+ * _resetWakeReason() on sleep drops the cached wake.
+ */
 __private_extern__ void _updateWakeReason
-    (CFStringRef *wakeReason, CFStringRef *wakeType)
+    (CFStringRef *wakeReason, CFStringRef *wakeType, bool fullWake)
 {
+    CFMutableDictionaryRef  props = NULL;
+    CFStringRef             uuid = NULL;
+
+    uuid = IOPMSleepWakeCopyUUID();
+    if (uuid && reasons.wakeUUID && CFEqual(uuid, reasons.wakeUUID)
+        && (reasons.wakeFull == fullWake)) {
+        CFRelease(uuid);
+        goto exit;
+    }
+
     _resetWakeReason();
+    reasons.wakeUUID = uuid;
+    reasons.wakeFull = fullWake;
+
+    if (KERN_SUCCESS != IORegistryEntryCreateCFProperties(getRootDomain(),
+                                    &props, kCFAllocatorDefault, 0)) {
+        props = NULL;
+    }
 
     // This property may not exist on all platforms.
-    reasons.platformWakeReason = _copyRootDomainProperty(CFSTR(kIOPMRootDomainWakeReasonKey));
-    if (!isA_CFString(reasons.platformWakeReason))
+    reasons.platformWakeReason = copyWakeProperty(props, CFSTR(kIOPMRootDomainWakeReasonKey));
+    if (!isA_CFString(reasons.platformWakeReason)) {
+        if (reasons.platformWakeReason) CFRelease(reasons.platformWakeReason);
         reasons.platformWakeReason = CFSTR("");
+    }
 
-    reasons.platformWakeType = _copyRootDomainProperty(CFSTR(kIOPMRootDomainWakeTypeKey));
-    if (!isA_CFString(reasons.platformWakeType))
+    reasons.platformWakeType = copyWakeProperty(props, CFSTR(kIOPMRootDomainWakeTypeKey));
+    if (!isA_CFString(reasons.platformWakeType)) {
+        if (reasons.platformWakeType) CFRelease(reasons.platformWakeType);
         reasons.platformWakeType = CFSTR("");
+    }
+
+    reasons.claimedWakeEventsArray = copyWakeProperty(props, CFSTR(kIOPMDriverWakeEventsKey));
+    if (reasons.claimedWakeEventsArray && !isA_CFArray(reasons.claimedWakeEventsArray)) {
+        CFRelease(reasons.claimedWakeEventsArray);
+        reasons.claimedWakeEventsArray = NULL;
+    }
+    if (props) CFRelease(props);
 
-    reasons.claimedWakeEventsArray = _copyRootDomainProperty(CFSTR(kIOPMDriverWakeEventsKey));
-    
     reasons.claimedWake = claimedReasonFromEventsArray(reasons.claimedWakeEventsArray);
     if (reasons.claimedWake) {
         reasons.interpretedWake = reasons.claimedWake;
@@ -472,6 +524,7 @@ __private_extern__ void _updateWakeReason
         mt2PublishWakeReason(reasons.platformWakeType, reasons.platformWakeType);
     }
 
+exit:
     getPlatformWakeReason(wakeReason, wakeType);
     return ;
 }
@@ -734,6 +787,165 @@ static bool                     _platformSleepServiceSupport = false;
 #endif
 
 
+/* Last values sendEnergySettingsToKernel() pushed to the kernel.
+ *
+ * Settings get re-activated on every power source switch and profile
+ * override, usually with most values unchanged. powerd only sends the
+ * keys whose value differs from what it last sent, and only re-runs
+ * ProcessHibernateSettings() when one of its inputs changed.
+ * resetSentEnergySettings() forgets everything, so that the next
+ * activation sends every key again.
+ * pmset doesn't keep a cache; it always sends everything.
+ */
+#ifndef __I_AM_PMSET__
+static CFMutableDictionaryRef   gSentRootDomainSettings = NULL;
+static CFDictionaryRef          gSentHibernateInputs = NULL;
+static bool                     gSentHibernateStandby = false;
+static bool                     gSentHibernateDesktop = false;
+
+static struct {
+    unsigned long   type;
+    unsigned long   value;
+    bool            sent;
+} gSentAggressiveness[] = {
+    { kPMMinutesToSleep,                0, false },
+    { kPMMinutesToSpinDown,             0, false },
+    { kPMMinutesToDim,                  0, false },
+    { kPMEthernetWakeOnLANSettings,     0, false }
+};
+
+__private_extern__ void resetSentEnergySettings(void)
+{
+    int i;
+
+    if (gSentRootDomainSettings) {
+        CFDictionaryRemoveAllValues(gSentRootDomainSettings);
+    }
+    if (gSentHibernateInputs) {
+        CFRelease(gSentHibernateInputs);
+        gSentHibernateInputs = NULL;
+    }
+    for (i = 0; i < (int)(sizeof(gSentAggressiveness)/sizeof(gSentAggressiveness[0])); i++) {
+        gSentAggressiveness[i].sent = false;
+    }
+}
+#endif
+
+static void setRootDomainSetting(
+                                 io_registry_entry_t rootDomain,
+                                 CFStringRef         key,
+                                 CFTypeRef           value)
+{
+#ifndef __I_AM_PMSET__
+    CFTypeRef   sent;
+
+    if (!gSentRootDomainSettings) {
+        gSentRootDomainSettings = CFDictionaryCreateMutable(0, 0,
+                                        &kCFTypeDictionaryKeyCallBacks,
+                                        &kCFTypeDictionaryValueCallBacks);
+    }
+    if (gSentRootDomainSettings
+        && (sent = CFDictionaryGetValue(gSentRootDomainSettings, key))
+        && CFEqual(sent, value))
+    {
+        return;
+    }
+
+    if ((KERN_SUCCESS == IORegistryEntrySetCFProperty(rootDomain, key, value))
+        && gSentRootDomainSettings)
+    {
+        CFDictionarySetValue(gSentRootDomainSettings, key, value);
+    }
+#else
+    IORegistryEntrySetCFProperty(rootDomain, key, value);
+#endif
+}
+
+__private_extern__ IOReturn setAggressivenessSetting(
+                                     io_connect_t        connection,
+                                     unsigned long       type,
+                                     unsigned long       value)
+{
+#ifndef __I_AM_PMSET__
+    IOReturn ret;
+    int     i;
+
+    for (i = 0; i < (int)(sizeof(gSentAggressiveness)/sizeof(gSentAggressiveness[0])); i++)
+    {
+        if (gSentAggressiveness[i].type != type)
+            continue;
+
+        if (gSentAggressiveness[i].sent && (gSentAggressiveness[i].value == value))
+            return kIOReturnSuccess;
+
+        ret = IOPMSetAggressiveness(connection, type, value);
+        if (kIOReturnSuccess == ret) {
+            gSentAggressiveness[i].value = value;
+            gSentAggressiveness[i].sent = true;
+        }
+        return ret;
+    }
+#endif
+    return IOPMSetAggressiveness(connection, type, value);
+}
+
+/* Returns true if ProcessHibernateSettings() needs to run for these
+ * settings: the keys it reads, the standby flag or the desktop flag differ
+ * from the last run.
+ */
+static bool hibernateSettingsChanged(
+                                     CFDictionaryRef     useSettings,
+                                     bool                standby,
+                                     bool                isDesktop)
+{
+#ifndef __I_AM_PMSET__
+    CFMutableDictionaryRef      inputs;
+    CFStringRef                 hibernateKeys[] = {
+                                    CFSTR(kIOHibernateModeKey),
+                                    CFSTR(kIOHibernateFileKey),
+                                    CFSTR(kIOHibernateFreeRatioKey),
+                                    CFSTR(kIOHibernateFreeTimeKey),
+                                    CFSTR(kIOPMAutoPowerOffEnabledKey) };
+    CFTypeRef                   obj;
+    bool                        changed = true;
+    int                         i;
+
+    inputs = CFDictionaryCreateMutable(0, 0,
+                                       &kCFTypeDictionaryKeyCallBacks,
+                                       &kCFTypeDictionaryValueCallBacks);
+    if (!inputs)
+        return true;
+
+    for (i = 0; i < (int)(sizeof(hibernateKeys)/sizeof(hibernateKeys[0])); i++) {
+        if ((obj = CFDictionaryGetValue(useSettings, hibernateKeys[i]))) {
+            CFDictionarySetValue(inputs, hibernateKeys[i], obj);
+        }
+    }
+
+    if (gSentHibernateInputs
+        && (gSentHibernateStandby == standby)
+        && (gSentHibernateDesktop == isDesktop)
+        && CFEqual(gSentHibernateInputs, inputs))
+    {
+        changed = false;
+    }
+
+    if (changed) {
+        if (gSentHibernateInputs)
+            CFRelease(gSentHibernateInputs);
+        gSentHibernateInputs = inputs;
+        gSentHibernateStandby = standby;
+        gSentHibernateDesktop = isDesktop;
+    } else {
+        CFRelease(inputs);
+    }
+
+    return changed;
+#else
+    return true;
+#endif
+}
+
 static void sendEnergySettingsToKernel(
                                        CFDictionaryRef                 useSettings,
                                        bool                            removeUnsupportedSettings,
@@ -792,56 +1004,56 @@ static void sendEnergySettingsToKernel(
     // Grab a copy of RootDomain's supported energy saver settings
     _supportedCached = IORegistryEntryCreateCFProperty(PMRootDomain, CFSTR("Supported Features"), kCFAllocatorDefault, kNilOptions);
 
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToSleep, p->fMinutesToSleep);
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToSpinDown, p->fMinutesToSpin);
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToDim, p->fMinutesToDim);
+    setAggressivenessSetting(PM_connection, kPMMinutesToSleep, p->fMinutesToSleep);
+    setAggressivenessSetting(PM_connection, kPMMinutesToSpinDown, p->fMinutesToSpin);
+    setAggressivenessSetting(PM_connection, kPMMinutesToDim, p->fMinutesToDim);
 
 
     // Wake on LAN
     if(true == IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnLANKey), providing_power, _supportedCached))
     {
-        IOPMSetAggressiveness(PM_connection, kPMEthernetWakeOnLANSettings, p->fWakeOnLAN);
+        setAggressivenessSetting(PM_connection, kPMEthernetWakeOnLANSettings, p->fWakeOnLAN);
     } else {
         // Even if WakeOnLAN is reported as not supported, broadcast 0 as
         // value. We may be on a supported machine, just on battery power.
         // Wake on LAN is not supported on battery power on PPC hardware.
-        IOPMSetAggressiveness(PM_connection, kPMEthernetWakeOnLANSettings, 0);
+        setAggressivenessSetting(PM_connection, kPMEthernetWakeOnLANSettings, 0);
     }
 
     // Display Sleep Uses Dim
     if ( !removeUnsupportedSettings
         || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMDisplaySleepUsesDimKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingDisplaySleepUsesDimKey),
-                                     (p->fDisplaySleepUsesDimming?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingDisplaySleepUsesDimKey),
+                             (p->fDisplaySleepUsesDimming?number1:number0));
     }
 
     // Wake On Ring
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnRingKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnRingKey),
-                                     (p->fWakeOnRing?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingWakeOnRingKey),
+                             (p->fWakeOnRing?number1:number0));
     }
 
     // Automatic Restart On Power Loss, aka FileServer mode
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMRestartOnPowerLossKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingRestartOnPowerLossKey),
-                                     (p->fAutomaticRestart?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingRestartOnPowerLossKey),
+                             (p->fAutomaticRestart?number1:number0));
     }
 
     // Wake on change of AC state -- battery to AC or vice versa
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnACChangeKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnACChangeKey),
-                                     (p->fWakeOnACChange?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingWakeOnACChangeKey),
+                             (p->fWakeOnACChange?number1:number0));
     }
 
     // Disable power button sleep on PowerMacs, Cubes, and iMacs
@@ -849,9 +1061,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMSleepOnPowerButtonKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingSleepOnPowerButtonKey),
-                                     (p->fSleepOnPowerButton?kCFBooleanFalse:kCFBooleanTrue));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingSleepOnPowerButtonKey),
+                             (p->fSleepOnPowerButton?kCFBooleanFalse:kCFBooleanTrue));
     }
 
     // Wakeup on clamshell open
@@ -859,9 +1071,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnClamshellKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnClamshellKey),
-                                     (p->fWakeOnClamshell?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingWakeOnClamshellKey),
+                             (p->fWakeOnClamshell?number1:number0));
     }
 
     // Mobile Motion Module
@@ -869,9 +1081,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMMobileMotionModuleKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingMobileMotionModuleKey),
-                                     (p->fMobileMotionModule?number1:number0));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMSettingMobileMotionModuleKey),
+                             (p->fMobileMotionModule?number1:number0));
     }
 
     /*
@@ -882,9 +1094,9 @@ static void sendEnergySettingsToKernel(
     {
         num = CFNumberCreate(0, kCFNumberIntType, &p->fGPU);
         if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMGPUSwitchKey),
-                                         num);
+            setRootDomainSetting(PMRootDomain,
+                                 CFSTR(kIOPMGPUSwitchKey),
+                                 num);
             CFRelease(num);
         }
     }
@@ -894,9 +1106,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMDeepSleepEnabledKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMDeepSleepEnabledKey),
-                                     (p->fDeepSleepEnable?kCFBooleanTrue:kCFBooleanFalse));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMDeepSleepEnabledKey),
+                             (p->fDeepSleepEnable?kCFBooleanTrue:kCFBooleanFalse));
     }
 
     // DeepSleepDelay
@@ -906,9 +1118,9 @@ static void sendEnergySettingsToKernel(
     {
         num = CFNumberCreate(0, kCFNumberIntType, &p->fDeepSleepDelay);
         if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMDeepSleepDelayKey),
-                                         num);
+            setRootDomainSetting(PMRootDomain,
+                                 CFSTR(kIOPMDeepSleepDelayKey),
+                                 num);
             CFRelease(num);
         }
     }
@@ -918,9 +1130,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMAutoPowerOffEnabledKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMAutoPowerOffEnabledKey),
-                                     (p->fAutoPowerOffEnable?kCFBooleanTrue:kCFBooleanFalse));
+        setRootDomainSetting(PMRootDomain,
+                             CFSTR(kIOPMAutoPowerOffEnabledKey),
+                             (p->fAutoPowerOffEnable?kCFBooleanTrue:kCFBooleanFalse));
     }
 
     // AutoPowerOffDelay
@@ -930,9 +1142,9 @@ static void sendEnergySettingsToKernel(
     {
         num = CFNumberCreate(0, kCFNumberIntType, &p->fAutoPowerOffDelay);
         if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMAutoPowerOffDelayKey),
-                                         num);
+            setRootDomainSetting(PMRootDomain,
+                                 CFSTR(kIOPMAutoPowerOffDelayKey),
+                                 num);
             CFRelease(num);
         }
     }
@@ -973,7 +1185,9 @@ static void sendEnergySettingsToKernel(
     if (useSettings)
     {
         bool isDesktop = (0 == _batteryCount());
-        ProcessHibernateSettings(useSettings, p->fDeepSleepEnable, isDesktop, PMRootDomain);
+        if (hibernateSettingsChanged(useSettings, p->fDeepSleepEnable, isDesktop)) {
+            ProcessHibernateSettings(useSettings, p->fDeepSleepEnable, isDesktop, PMRootDomain);
+        }
     }
 
 exit:
@@ -1347,10 +1561,113 @@ static void _unpackBatteryState(IOPMBattery *b, CFDictionaryRef prop)
     } else {
         b->pfStatus = 0;
     }
+    n = CFDictionaryGetValue(prop, CFSTR(kBootPathKey));
+    if (n) {
+        CFNumberGetValue(n, kCFNumberIntType, &b->bootPathUpdated);
+    }
+    n = CFDictionaryGetValue(prop, CFSTR(kFullPathKey));
+    if (n) {
+        CFNumberGetValue(n, kCFNumberIntType, &b->fullPathUpdated);
+    }
+    n = CFDictionaryGetValue(prop, CFSTR(kUserVisPathKey));
+    if (n) {
+        CFNumberGetValue(n, kCFNumberIntType, &b->userVisPathUpdated);
+    }
 
     return;
 }
 
+#if HAVE_SMART_BATTERY
+static io_connect_t     sbSnapshotConnect = MACH_PORT_NULL;
+static bool             sbSnapshotUnsupported = false;
+
+/*
+ * _copyBatterySnapshot
+ *
+ * Reads AppleSmartBattery's state in one user client call, in place of
+ * serializing its registry properties. Returns false if the kext doesn't
+ * support snapshots, and the caller falls back to the properties.
+ */
+static bool _copyBatterySnapshot(SmartBatterySnapshot *snap)
+{
+    io_service_t    sbmanager = MACH_PORT_NULL;
+    size_t          outSize = sizeof(SmartBatterySnapshot);
+    kern_return_t   kr;
+
+    if (sbSnapshotUnsupported) {
+        return false;
+    }
+
+    if (MACH_PORT_NULL == sbSnapshotConnect)
+    {
+        sbmanager = IOServiceGetMatchingService(MACH_PORT_NULL,
+                                IOServiceMatching("AppleSmartBatteryManager"));
+        if (MACH_PORT_NULL == sbmanager) {
+            return false;
+        }
+
+        kr = IOServiceOpen(sbmanager, mach_task_self(), 0, &sbSnapshotConnect);
+        IOObjectRelease(sbmanager);
+        if (kIOReturnSuccess != kr) {
+            sbSnapshotConnect = MACH_PORT_NULL;
+            return false;
+        }
+    }
+
+    kr = IOConnectCallStructMethod(sbSnapshotConnect, kSBUCCopySnapshot,
+                                   NULL, 0, snap, &outSize);
+    if (kIOReturnSuccess != kr)
+    {
+        if (kIOReturnBadArgument == kr) {
+            // This AppleSmartBatteryManager predates kSBUCCopySnapshot
+            sbSnapshotUnsupported = true;
+        }
+        IOServiceClose(sbSnapshotConnect);
+        sbSnapshotConnect = MACH_PORT_NULL;
+        return false;
+    }
+
+    if ((outSize < sizeof(SmartBatterySnapshot))
+        || (kSBSnapshotVersion != snap->version))
+    {
+        sbSnapshotUnsupported = true;
+        return false;
+    }
+
+    return true;
+}
+
+static void _unpackBatterySnapshot(IOPMBattery *b, SmartBatterySnapshot *snap)
+{
+    b->externalConnected        = (snap->flags & kSBSnapshotExternalConnected) ? 1 : 0;
+    b->externalChargeCapable    = (snap->flags & kSBSnapshotExternalChargeCapable) ? 1 : 0;
+    b->isPresent                = (snap->flags & kSBSnapshotBatteryInstalled) ? 1 : 0;
+    b->isCharging               = (snap->flags & kSBSnapshotIsCharging) ? 1 : 0;
+
+    b->voltage                  = snap->voltage;
+    b->currentCap               = snap->currentCapacity;
+    b->maxCap                   = snap->maxCapacity;
+    b->designCap                = snap->designCapacity;
+    b->hwAverageTR              = snap->timeRemaining;
+    b->instantAmperage          = snap->instantAmperage;
+    b->avgAmperage              = snap->amperage;
+    b->maxerr                   = snap->maxErr;
+    b->cycleCount               = snap->cycleCount;
+    b->location                 = snap->location;
+    b->pfStatus                 = snap->pfStatus;
+
+    if (snap->flags & kSBSnapshotHasInvalidWakeSecs) {
+        b->invalidWakeSecs      = snap->invalidWakeSecs;
+    } else {
+        b->invalidWakeSecs      = kInvalidWakeSecsDefault;
+    }
+
+    b->bootPathUpdated          = snap->bootPathUpdated;
+    b->fullPathUpdated          = snap->fullPathUpdated;
+    b->userVisPathUpdated       = snap->userVisPathUpdated;
+}
+#endif /* HAVE_SMART_BATTERY */
+
 /*
  * _batteries
  */
@@ -1374,6 +1691,9 @@ __private_extern__ IOPMBattery *_newBatteryFound(io_registry_entry_t where)
     // Populate new battery in array
     new_battery = calloc(1, sizeof(IOPMBattery));
     new_battery->me = where;
+#if HAVE_SMART_BATTERY
+    new_battery->hasSnapshot = IOObjectConformsTo(where, "AppleSmartBattery") ? 1 : 0;
+#endif
     new_battery->name = CFStringCreateWithFormat(
                             kCFAllocatorDefault,
                             NULL,
@@ -1407,12 +1727,36 @@ __private_extern__ IOPMBattery *_newBatteryFound(io_registry_entry_t where)
 __private_extern__ void _batteryChanged(IOPMBattery *changed_battery)
 {
     kern_return_t       kr;
+#if HAVE_SMART_BATTERY
+    SmartBatterySnapshot    snap;
+    bool                    acChanged;
+#endif
 
     if(!changed_battery) {
         // This is unexpected; we're not tracking this battery
         return;
     }
 
+#if HAVE_SMART_BATTERY
+    /* The snapshot carries every number and flag we track. Only re-read the
+     * registry properties, for the strings and adapter details, when the
+     * battery says they changed or AC was attached or removed.
+     */
+    if (changed_battery->hasSnapshot && _copyBatterySnapshot(&snap))
+    {
+        acChanged = (((snap.flags & kSBSnapshotExternalConnected) ? 1 : 0)
+                     != changed_battery->externalConnected);
+
+        if (changed_battery->properties && !acChanged
+            && (snap.propertiesGeneration == changed_battery->propertiesGeneration))
+        {
+            _unpackBatterySnapshot(changed_battery, &snap);
+            goto exit;
+        }
+        changed_battery->propertiesGeneration = snap.propertiesGeneration;
+    }
+#endif
+
     // Free the last set of properties
     if(changed_battery->properties) {
         CFRelease(changed_battery->properties);
@@ -1477,7 +1821,7 @@ __private_extern__ CFUserNotificationRef _copyUPSWarning(void)
     note_ref = CFUserNotificationCreate(kCFAllocatorDefault, 0, 0, &error, alert_dict);
     CFRelease(alert_dict);
 
-    asl_log(0, 0, ASL_LEVEL_ERR, "PowerManagement: UPS low power warning\n");
+    pmlog_log(ASL_LEVEL_ERR, "PowerManagement: UPS low power warning\n");
 
     return note_ref;
 }
@@ -1533,12 +1877,289 @@ static void printCapabilitiesToBuf(char *buf, int buf_size, IOPMCapabilityBits i
 }
 
 
-__private_extern__ aslmsg new_msg_pmset_log(void)
+/*
+ * Deferred ASL messages.
+ *
+ * Building an aslmsg and sending it costs allocations and a trip to syslogd,
+ * and most of powerd's messages are logged on the main queue in the middle of
+ * a sleep/wake transition or an assertion call. Callers fill in a pmlogmsg
+ * instead: a record from a fixed pool holding copies of its key/value
+ * strings. pmlog_send() queues it, and a background queue turns each batch of
+ * queued records into aslmsgs and sends them.
+ *
+ * Each record carries the time it was created, so the background queue
+ * running late doesn't restamp or reorder entries around a transition.
+ *
+ * When every pool record is queued, pmlog_new() allocates one instead, and
+ * that one is sent synchronously from pmlog_send(); only a failed allocation
+ * drops a message, and the next batch reports how many were lost. The pool
+ * and queue are shared by all threads, under gPMLogLock.
+ */
+#define kPMLogRecordCount           64
+#define kPMLogRecordPairs           32
+#define kPMLogRecordBytes           2048
+
+struct pmlog_record {
+    struct pmlog_record     *next;
+    int                     level;          // -1 for asl_send(); else asl_log() level
+    bool                    overflow;       // malloc'd, not from gPMLogRecords
+    struct timeval          time;
+    uint16_t                pairCount;
+    uint16_t                used;           // bytes of buf in use
+    uint16_t                key[kPMLogRecordPairs];     // offsets into buf
+    uint16_t                value[kPMLogRecordPairs];
+    char                    buf[kPMLogRecordBytes];
+};
+
+static struct pmlog_record  gPMLogRecords[kPMLogRecordCount];
+static struct pmlog_record  *gPMLogFree = NULL;
+static struct pmlog_record  *gPMLogQueueHead = NULL;
+static struct pmlog_record  *gPMLogQueueTail = NULL;
+static uint32_t             gPMLogDropped = 0;
+static pthread_mutex_t      gPMLogLock = PTHREAD_MUTEX_INITIALIZER;
+static dispatch_source_t    gPMLogDrain = NULL;
+
+static void pmlogSendRecord(struct pmlog_record *r)
+{
+    aslmsg                  m;
+    char                    buf[32];
+    int                     i;
+
+    if (!(m = asl_new(ASL_TYPE_MSG)))
+        return;
+
+    for (i = 0; i < r->pairCount; i++) {
+        asl_set(m, &r->buf[r->key[i]], &r->buf[r->value[i]]);
+    }
+    snprintf(buf, sizeof(buf), "%ld", (long)r->time.tv_sec);
+    asl_set(m, ASL_KEY_TIME, buf);
+    snprintf(buf, sizeof(buf), "%ld", (long)r->time.tv_usec * 1000);
+    asl_set(m, ASL_KEY_TIME_NSEC, buf);
+
+    if (r->level < 0) {
+        asl_send(NULL, m);
+    } else {
+        asl_log(NULL, m, r->level, "%s", asl_get(m, ASL_KEY_MSG) ? : "");
+    }
+    asl_release(m);
+}
+
+static void pmlogDrain(void)
+{
+    struct pmlog_record     *batch, *r;
+    uint32_t                dropped;
+
+    pthread_mutex_lock(&gPMLogLock);
+    batch = gPMLogQueueHead;
+    gPMLogQueueHead = gPMLogQueueTail = NULL;
+    dropped = gPMLogDropped;
+    gPMLogDropped = 0;
+    pthread_mutex_unlock(&gPMLogLock);
+
+    for (r = batch; r; r = r->next) {
+        pmlogSendRecord(r);
+    }
+
+    if (dropped) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PowerManagement: dropped %u log messages\n", dropped);
+    }
+
+    if (batch) {
+        for (r = batch; r->next; r = r->next) { }
+
+        pthread_mutex_lock(&gPMLogLock);
+        r->next = gPMLogFree;
+        gPMLogFree = batch;
+        pthread_mutex_unlock(&gPMLogLock);
+    }
+}
+
+static void pmlogSetup(void)
+{
+    dispatch_queue_t    q;
+    int                 i;
+
+    for (i = 0; i < kPMLogRecordCount; i++) {
+        gPMLogRecords[i].next = gPMLogFree;
+        gPMLogFree = &gPMLogRecords[i];
+    }
+
+    q = dispatch_queue_create("com.apple.powermanagement.asl", NULL);
+    if (!q)
+        return;
+    dispatch_set_target_queue(q, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+
+    gPMLogDrain = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, q);
+    dispatch_release(q);
+    if (!gPMLogDrain)
+        return;
+    dispatch_source_set_event_handler(gPMLogDrain, ^{ pmlogDrain(); });
+    dispatch_resume(gPMLogDrain);
+
+    PMMemoryCharge(kPMMemLogRecords, sizeof(gPMLogRecords));
+}
+
+/* Returns an empty record, or NULL if the pool is empty and malloc fails */
+__private_extern__ pmlogmsg pmlog_new(void)
+{
+    static dispatch_once_t  once;
+    struct pmlog_record     *r;
+    bool                    overflow = false;
+
+    dispatch_once(&once, ^{ pmlogSetup(); });
+
+    pthread_mutex_lock(&gPMLogLock);
+    if ((r = gPMLogFree)) {
+        gPMLogFree = r->next;
+    }
+    pthread_mutex_unlock(&gPMLogLock);
+
+    if (!r) {
+        if (!(r = malloc(sizeof(*r)))) {
+            pthread_mutex_lock(&gPMLogLock);
+            gPMLogDropped++;
+            pthread_mutex_unlock(&gPMLogLock);
+            return NULL;
+        }
+        overflow = true;
+    }
+
+    r->next = NULL;
+    r->level = -1;
+    r->overflow = overflow;
+    r->pairCount = 0;
+    r->used = 0;
+    gettimeofday(&r->time, NULL);
+    return r;
+}
+
+static bool pmlogCopyString(pmlogmsg m, const char *str, uint16_t *offset)
+{
+    size_t  len;
+
+    if (m->used >= kPMLogRecordBytes)
+        return false;
+
+    len = strlcpy(&m->buf[m->used], str, kPMLogRecordBytes - m->used);
+    *offset = m->used;
+    if (len >= (size_t)(kPMLogRecordBytes - m->used)) {
+        // Truncated to what was left
+        m->used = kPMLogRecordBytes;
+    } else {
+        m->used += len + 1;
+    }
+    return true;
+}
+
+/* Like asl_set(). Setting a key again replaces its value. */
+__private_extern__ void pmlog_set(pmlogmsg m, const char *key, const char *value)
+{
+    uint16_t    keyOffset, valueOffset;
+    int         i;
+
+    if (!m || !key || !value)
+        return;
+
+    for (i = 0; i < m->pairCount; i++) {
+        if (!strcmp(&m->buf[m->key[i]], key))
+            break;
+    }
+    if (i == kPMLogRecordPairs)
+        return;
+
+    if (i < m->pairCount) {
+        keyOffset = m->key[i];
+    } else if (!pmlogCopyString(m, key, &keyOffset)) {
+        return;
+    }
+    if (!pmlogCopyString(m, value, &valueOffset))
+        return;
+
+    m->key[i] = keyOffset;
+    m->value[i] = valueOffset;
+    if (i == m->pairCount)
+        m->pairCount++;
+}
+
+static void pmlogEnqueue(pmlogmsg m)
+{
+    if (m->overflow || !gPMLogDrain) {
+        // Pool is exhausted (or the queue never came up): don't drop it
+        pmlogSendRecord(m);
+        pmlog_release(m);
+        return;
+    }
+
+    pthread_mutex_lock(&gPMLogLock);
+    if (gPMLogQueueTail) {
+        gPMLogQueueTail->next = m;
+    } else {
+        gPMLogQueueHead = m;
+    }
+    gPMLogQueueTail = m;
+    pthread_mutex_unlock(&gPMLogLock);
+
+    dispatch_source_merge_data(gPMLogDrain, 1);
+}
+
+/* Like asl_send() followed by asl_release(): the record is consumed */
+__private_extern__ void pmlog_send(pmlogmsg m)
+{
+    if (m)
+        pmlogEnqueue(m);
+}
+
+/* Like asl_log(NULL, m, level, "") followed by asl_release() */
+__private_extern__ void pmlog_send_level(pmlogmsg m, int level)
+{
+    if (!m)
+        return;
+
+    m->level = level;
+    pmlogEnqueue(m);
+}
+
+/* Like asl_log(NULL, NULL, level, format, ...). Formatting happens here. */
+__private_extern__ void pmlog_log(int level, const char *format, ...)
+{
+    pmlogmsg    m;
+    char        buf[512];
+    va_list     ap;
+
+    if (!(m = pmlog_new()))
+        return;
+
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send_level(m, level);
+}
+
+/* Hands back a record without sending it */
+__private_extern__ void pmlog_release(pmlogmsg m)
+{
+    if (!m)
+        return;
+
+    if (m->overflow) {
+        free(m);
+        return;
+    }
+
+    pthread_mutex_lock(&gPMLogLock);
+    m->next = gPMLogFree;
+    gPMLogFree = m;
+    pthread_mutex_unlock(&gPMLogLock);
+}
+
+__private_extern__ pmlogmsg new_msg_pmset_log(void)
 {
-    aslmsg m = asl_new(ASL_TYPE_MSG);
+    pmlogmsg m = pmlog_new();
 
-    asl_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
-    asl_set(m, ASL_KEY_FACILITY, kPMFacility);
+    pmlog_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
+    pmlog_set(m, ASL_KEY_FACILITY, kPMFacility);
 
     return m;
 }
@@ -1546,25 +2167,24 @@ __private_extern__ aslmsg new_msg_pmset_log(void)
 
 __private_extern__ void logASLMessagePMStart(void)
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    uuidString[150];
 
     m = new_msg_pmset_log();
 
     if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
+        pmlog_set(m, kPMASLUUIDKey, uuidString);
     }
-    asl_set(m, kPMASLDomainKey, kPMASLDomainPMStart);
-    asl_set(m, ASL_KEY_MSG, "powerd process is started\n");
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMStart);
+    pmlog_set(m, ASL_KEY_MSG, "powerd process is started\n");
+    pmlog_send(m);
 }
 
 #if TCPKEEPALIVE
 #ifndef __I_AM_PMSET__
 
 static void attachTCPKeepAliveKeys(
-                                   aslmsg m,
+                                   pmlogmsg m,
                                    char *tcpString,
                                    unsigned int tcpStringLen)
 
@@ -1575,11 +2195,11 @@ static void attachTCPKeepAliveKeys(
     IOPlatformCopyFeatureDefault(kIOPlatformTCPKeepAliveDuringSleep, &platformSupport);
     if (kCFBooleanTrue == platformSupport)
     {
-        asl_set(m, kPMASLTCPKeepAlive, "supported");
+        pmlog_set(m, kPMASLTCPKeepAlive, "supported");
         
         getTCPKeepAliveState(keepAliveString, sizeof(keepAliveString));
 
-        asl_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
+        pmlog_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
         snprintf(tcpString, tcpStringLen, "TCPKeepAlive=%s", keepAliveString);
     }
 
@@ -1591,7 +2211,7 @@ static void attachTCPKeepAliveKeys(
 #else
 
 static void attachTCPKeepAliveKeys(
-                                   aslmsg m __unused,
+                                   pmlogmsg m __unused,
                                    char *tcpString __unused,
                                    unsigned int tcpStringLen __unused)
 {
@@ -1609,7 +2229,7 @@ __private_extern__ void logASLMessageSleep(
 )
 {
     static int              sleepCyclesCount = 0;
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    uuidString[150];
     char                    powerLevelBuf[50];
     char                    numbuf[15];
@@ -1651,29 +2271,28 @@ __private_extern__ void logASLMessageSleep(
         // Note: unknown on the failure case, so we won't publish the sleep count
         // unless sig == success
         snprintf(numbuf, 10, "%d", ++sleepCyclesCount);
-        asl_set(m, kPMASLValueKey, numbuf);
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
+        pmlog_set(m, kPMASLValueKey, numbuf);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
         powerString(powerLevelBuf, sizeof(powerLevelBuf));
     }
     else {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
     }
 
     // UUID
     if (uuidStr) {
-        asl_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
+        pmlog_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
     } else if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
+        pmlog_set(m, kPMASLUUIDKey, uuidString);
     }
     
 
     snprintf(messageString, sizeof(messageString), "%s: %s %s",
             messageString,  powerLevelBuf, tcpKeepAliveString);
 
-    asl_set(m, kPMASLSignatureKey, sig);
-    asl_set(m, ASL_KEY_MSG, messageString);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, kPMASLSignatureKey, sig);
+    pmlog_set(m, ASL_KEY_MSG, messageString);
+    pmlog_send(m);
 }
 
 /*****************************************************************************/
@@ -1687,7 +2306,7 @@ __private_extern__ void logASLMessageWake(
     WakeTypeEnum dark_wake
 )
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     int                     i = 0;
     CFStringRef             tmpStr = NULL;
     char                    buf[200];
@@ -1704,9 +2323,9 @@ __private_extern__ void logASLMessageWake(
 
     m = new_msg_pmset_log();
 
-    asl_set(m, kPMASLSignatureKey, sig);
+    pmlog_set(m, kPMASLSignatureKey, sig);
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
         if (strncmp(buf, prev_uuid, sizeof(prev_uuid))) {
               // New sleep/wake cycle.
               snprintf(prev_uuid, sizeof(prev_uuid), "%s", buf);
@@ -1779,7 +2398,7 @@ __private_extern__ void logASLMessageWake(
             
             snprintf(key, sizeof(key), "%s-%d", kPMASLClaimedEventKey, keyIndex);
             
-            asl_set(m, key, claimed);
+            pmlog_set(m, key, claimed);
             keyIndex++;
         }
     
@@ -1788,15 +2407,15 @@ __private_extern__ void logASLMessageWake(
 
     if (!success)
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
     }
     else if (dark_wake == kIsDarkWake)
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
         snprintf(buf, sizeof(buf), "%s", "DarkWake");
         darkWakeCnt++;
         snprintf(numbuf, sizeof(numbuf), "%d", darkWakeCnt);
-        asl_set(m, kPMASLValueKey, numbuf);
+        pmlog_set(m, kPMASLValueKey, numbuf);
     }
     else if (dark_wake == kIsDarkToFullWake)
     {
@@ -1807,12 +2426,12 @@ __private_extern__ void logASLMessageWake(
         if (wakeType) {
             CFRelease(wakeType);
         }
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
         snprintf(buf, sizeof(buf), "%s", "DarkWake to FullWake");
     }
     else
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
         snprintf(buf, sizeof(buf), "%s", "Wake");
     }
 
@@ -1832,9 +2451,8 @@ __private_extern__ void logASLMessageWake(
           detailString ? detailString : "",
           powerLevelBuf);
 
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send(m);
 
     logASLMessageHibernateStatistics( );
 }
@@ -1846,19 +2464,18 @@ __private_extern__ void logASLAppWakeReason(
 {
 #define kPMASLDomainAppWakeReason   "AppWakeReason"
 
-    aslmsg m = new_msg_pmset_log();
+    pmlogmsg m = new_msg_pmset_log();
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainAppWakeReason);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppWakeReason);
     if (ident) {
-        asl_set(m, kPMASLSignatureKey, ident);
+        pmlog_set(m, kPMASLSignatureKey, ident);
     }
 
     char msg[255];
     snprintf(msg, sizeof(msg), "AppWoke:%s Reason:%s", ident?ident:"--none--", reason?reason:"--none--");
-    asl_set(m, ASL_KEY_MSG, msg);
+    pmlog_set(m, ASL_KEY_MSG, msg);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 
 
@@ -1866,7 +2483,7 @@ __private_extern__ void logASLAppWakeReason(
 
 __private_extern__ void logASLMessageHibernateStatistics(void)
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     CFDataRef               statsData = NULL;
     PMStatsStruct           *stats = NULL;
     uint64_t                readHIBImageMS = 0;
@@ -1907,16 +2524,16 @@ __private_extern__ void logASLMessageHibernateStatistics(void)
 
     m = new_msg_pmset_log();
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainHibernateStatistics);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainHibernateStatistics);
 
-    asl_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
+    pmlog_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
 
     if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
+        pmlog_set(m, kPMASLUUIDKey, uuidString);
     }
 
     snprintf(valuestring, sizeof(valuestring), "hibernatemode=%d", hibernateMode);
-    asl_set(m, kPMASLSignatureKey, valuestring);
+    pmlog_set(m, kPMASLSignatureKey, valuestring);
     // If readHibImageMS == zero, that means we woke from the contents of memory
     // and did not read the hibernate image.
     if (writeHIBImageMS)
@@ -1924,13 +2541,12 @@ __private_extern__ void logASLMessageHibernateStatistics(void)
 
     if (readHIBImageMS)
         snprintf(buf, sizeof(buf), "rd=%qd ms", readHIBImageMS);
-    asl_set(m, kPMASLDelayKey, buf);
+    pmlog_set(m, kPMASLDelayKey, buf);
 
     snprintf(buf, sizeof(buf), "hibmode=%d standbydelay=%d", hibernateMode, hibernateDelay);
 
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send(m);
 exit:
     if(statsData)
         CFRelease(statsData);
@@ -1945,32 +2561,31 @@ __private_extern__ void logASLPMConnectionNotify(
     )
 {
 
-    aslmsg m;
+    pmlogmsg m;
     char buf[128];
     char appName[100];
 
 
     m = new_msg_pmset_log();
-    asl_set(m, kPMASLDomainKey, kPMASLDomainAppNotify);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppNotify);
 
 
     if (!CFStringGetCString(appNameString, appName, sizeof(appName), kCFStringEncodingUTF8))
        snprintf(appName, sizeof(appName), "Unknown app");
 
 
-    asl_set(m, kPMASLSignatureKey, appName);
+    pmlog_set(m, kPMASLSignatureKey, appName);
 
     // UUID
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
    snprintf(buf, sizeof(buf), "Notification sent to %s (powercaps:0x%x)",
          appName,notificationBits );
 
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send(m);
 }
 
 #ifndef __I_AM_PMSET__
@@ -1978,25 +2593,24 @@ __private_extern__ void logASLDisplayStateChange()
 {
 
 #if !TARGET_OS_EMBEDDED
-    aslmsg m;
+    pmlogmsg m;
     char buf[128];
     bool displayState = isDisplayAsleep();
 
 
     m = new_msg_pmset_log();
-    asl_set(m, kPMASLDomainKey, kPMASLDomainAppNotify);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppNotify);
 
     // UUID
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
    snprintf(buf, sizeof(buf), "Display is turned %s",
         displayState ? "off" : "on");
 
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, ASL_KEY_MSG, buf);
+    pmlog_send(m);
 
     if (displayState) {
         /* Log all assertions when display goes off */
@@ -2015,7 +2629,7 @@ __private_extern__ void logASLMessagePMConnectionResponse(
     int             notificationBits
 )
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    appName[128];
     char                    *appNamePtr = NULL;
     int                     time = 0;
@@ -2031,31 +2645,31 @@ __private_extern__ void logASLMessagePMConnectionResponse(
 
     if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseTimedOut)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseTimedOut);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseTimedOut);
         snprintf(qualifier, sizeof(qualifier), "timed out");
         timeout = true;
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseCancel)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseCancel);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseCancel);
         snprintf(qualifier, sizeof(qualifier), "is to cancel state change");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseSlow)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseSlow);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseSlow);
         snprintf(qualifier, sizeof(qualifier), "is slow");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kPMASLDomainSleepServiceCapApp)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceCapApp);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepServiceCapApp);
         snprintf(qualifier, sizeof(qualifier), "exceeded SleepService cap");
     } else
         if (responseTypeString && CFEqual(responseTypeString, CFSTR(kPMASLDomainAppResponse)))
     {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainAppResponseReceived);
+        pmlog_set(m, kPMASLDomainKey, kPMASLDomainAppResponseReceived);
         snprintf(qualifier, sizeof(qualifier), "received");
     } else {
-        asl_release(m);
+        pmlog_release(m);
         return;
     }
 
@@ -2071,18 +2685,18 @@ __private_extern__ void logASLMessagePMConnectionResponse(
         appNamePtr = "AppNameUnknown";
     }
 
-    asl_set(m, kPMASLSignatureKey, appNamePtr);
+    pmlog_set(m, kPMASLSignatureKey, appNamePtr);
 
     // UUID
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
     // Value == Time
     if (responseTime) {
         if (CFNumberGetValue(responseTime, kCFNumberIntType, &time)) {
             snprintf(buf, sizeof(buf), "%d", time);
-            asl_set(m, kPMASLValueKey, buf);
+            pmlog_set(m, kPMASLValueKey, buf);
         }
     }
 
@@ -2097,15 +2711,14 @@ __private_extern__ void logASLMessagePMConnectionResponse(
     if (notificationBits != -1)
        snprintf(buf, sizeof(buf), "%s (powercaps:0x%x)", buf, notificationBits);
 
-    asl_set(m, ASL_KEY_MSG, buf);
+    pmlog_set(m, ASL_KEY_MSG, buf);
 
     if (time != 0) {
        snprintf(buf, sizeof(buf), "%d ms", time);
-       asl_set(m, kPMASLDelayKey, buf);
+       pmlog_set(m, kPMASLDelayKey, buf);
     }
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 
 #ifndef __I_AM_PMSET__
     if (timeout) {
@@ -2131,7 +2744,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
     long                    numElems = 0;
     int                     appCnt = 0;
     int                     i = 0;
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    appName[128];
     char                    responseType[32];
     int                     num = 0;
@@ -2147,7 +2760,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
         return;
 
     m = new_msg_pmset_log();
-    asl_set(m, kPMASLDomainKey, domain);
+    pmlog_set(m, kPMASLDomainKey, domain);
 
     for (i = 0; i < numElems; i++)
     {
@@ -2178,7 +2791,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
 
         if (!_getUUIDString(key, sizeof(key)))
             continue;
-        asl_set(m, kPMASLUUIDKey, key);
+        pmlog_set(m, kPMASLUUIDKey, key);
 
         if (transString == NULL) {
             // Transition should be same for all apps listed in appFailuresArray.
@@ -2186,29 +2799,29 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
             transString = CFDictionaryGetValue(appFailures, CFSTR(kIOPMStatsSystemTransitionKey));
             if (isA_CFString(transString)  && 
                 (CFStringGetCString(transString, key, sizeof(key), kCFStringEncodingUTF8))) {
-                    asl_set(m, kPMASLResponseSystemTransition, key);
+                    pmlog_set(m, kPMASLResponseSystemTransition, key);
             }
         }
 
         snprintf(key, sizeof(key), "%s%d",kPMASLResponseAppNamePrefix, appCnt);
-        asl_set(m, key, appName);
+        pmlog_set(m, key, appName);
 
         snprintf(key, sizeof(key), "%s%d", kPMASLResponseRespTypePrefix, appCnt);
-        asl_set(m, key, responseType);
+        pmlog_set(m, key, responseType);
 
         snprintf(key, sizeof(key), "%s%d", kPMASLResponseDelayPrefix, appCnt);
-        asl_set(m, key, numStr);
+        pmlog_set(m, key, numStr);
 
         numRef = CFDictionaryGetValue(appFailures, CFSTR(kIOPMStatsMessageTypeKey));
         if (isA_CFNumber(numRef) && (CFNumberGetValue(numRef, kCFNumberIntType, &num))) {
 
             snprintf(key, sizeof(key), "%s%d", kPMASLResponseMessagePrefix, appCnt);
             if (num == kDriverCallSetPowerState)
-                asl_set(m, key, "SetState");
+                pmlog_set(m, key, "SetState");
             else if (num == kDriverCallInformPreChange)
-                asl_set(m, key, "WillChangeState");
+                pmlog_set(m, key, "WillChangeState");
             else 
-                asl_set(m, key, "DidChangeState");
+                pmlog_set(m, key, "DidChangeState");
         }
 
         numRef = CFDictionaryGetValue(appFailures, CFSTR(kIOPMStatsPowerCapabilityKey));
@@ -2217,7 +2830,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
             snprintf(numStr, sizeof(numStr), "%d", num);
 
             snprintf(key, sizeof(key), "%s%d", kPMASLResponsePSCapsPrefix, appCnt);
-            asl_set(m, key, numStr);
+            pmlog_set(m, key, numStr);
         }
 
         appCnt++;
@@ -2228,15 +2841,14 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
         }
 #endif
     }
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 
 }
 
 
 __private_extern__ void logASLMessagePMConnectionScheduledWakeEvents(CFStringRef requestedMaintenancesString)
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    buf[100];
     char                    requestors[500];
     CFMutableStringRef      messageString = NULL;
@@ -2248,7 +2860,7 @@ __private_extern__ void logASLMessagePMConnectionScheduledWakeEvents(CFStringRef
     m = new_msg_pmset_log();
 
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
     CFStringAppendCString(messageString, "Clients requested wake events: ", kCFStringEncodingUTF8);
@@ -2260,17 +2872,16 @@ __private_extern__ void logASLMessagePMConnectionScheduledWakeEvents(CFStringRef
 
     CFStringGetCString(messageString, requestors, sizeof(requestors), kCFStringEncodingUTF8);
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
-    asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
+    pmlog_set(m, ASL_KEY_MSG, requestors);
+    pmlog_send(m);
     CFRelease(messageString);
 
 }
 
 __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMaintenancesString)
 {
-    aslmsg                  m;
+    pmlogmsg                m;
     char                    buf[100];
     char                    requestors[500];
     CFMutableStringRef      messageString = CFStringCreateMutable(0, 0);
@@ -2281,7 +2892,7 @@ __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMa
     m = new_msg_pmset_log();
 
     if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
+        pmlog_set(m, kPMASLUUIDKey, buf);
     }
 
     CFStringAppendCString(messageString, "PM scheduled RTC wake event: ", kCFStringEncodingUTF8);
@@ -2289,17 +2900,16 @@ __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMa
 
     CFStringGetCString(messageString, requestors, sizeof(requestors), kCFStringEncodingUTF8);
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
-    asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
+    pmlog_set(m, ASL_KEY_MSG, requestors);
+    pmlog_send(m);
     CFRelease(messageString);
 }
 
 #if !TARGET_OS_EMBEDDED
 __private_extern__ void logASLMessageIgnoredDWTEmergency(void)
 {
-    aslmsg      m;
+    pmlogmsg    m;
     char        strbuf[125];
     char        tcpKeepAliveString[50];
 
@@ -2311,22 +2921,21 @@ __private_extern__ void logASLMessageIgnoredDWTEmergency(void)
     attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
 #endif
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainDWTEmergency);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainDWTEmergency);
 
     snprintf(
         strbuf,
         sizeof(strbuf),
         "Ignored DarkWake thermal emergency signal %s", tcpKeepAliveString);
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 #endif
 
 __private_extern__ void logASLMessageSleepCanceledAtLastCall(void)
 {
-    aslmsg      m;
+    pmlogmsg    m;
     char        strbuf[125];
     char        tcpKeepAliveString[50];
 
@@ -2339,30 +2948,29 @@ __private_extern__ void logASLMessageSleepCanceledAtLastCall(void)
     attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
 #endif
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainSleepRevert);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainSleepRevert);
 
     snprintf(
         strbuf,
         sizeof(strbuf),
         "Sleep in process aborted due to power assertion %s", tcpKeepAliveString);
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 
 __private_extern__ void logASLBatteryHealthChanged(const char *health,
                                                    const char *oldhealth,
                                                    const char *reason)
 {
-    aslmsg      m;
+    pmlogmsg    m;
     char        strbuf[125];
     
     bzero(strbuf, sizeof(strbuf));
     
     m = new_msg_pmset_log();
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainBattery);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainBattery);
     
     if (!strncmp(oldhealth, "", 5)) {
         snprintf(
@@ -2380,31 +2988,29 @@ __private_extern__ void logASLBatteryHealthChanged(const char *health,
                  sizeof(strbuf),
                  "Battery health: %s; was: %s; reason %s", health, oldhealth, reason);
     }
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 }
 
 __private_extern__ void logASLLowBatteryWarning(IOPSLowBatteryWarningLevel level,
                                                    int time, int ccap)
 {
 #if !TARGET_OS_EMBEDDED
-    aslmsg      m;
+    pmlogmsg    m;
     char        strbuf[125];
     
     bzero(strbuf, sizeof(strbuf));
     
     m = new_msg_pmset_log();
     
-    asl_set(m, kPMASLDomainKey, kPMASLDomainBattery);
+    pmlog_set(m, kPMASLDomainKey, kPMASLDomainBattery);
     
     snprintf(strbuf, sizeof(strbuf), "Warning level: %d time: %d cap: %d\n",
              level, time, ccap);
-    asl_set(m, ASL_KEY_MSG, strbuf);
+    pmlog_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
-    asl_release(m);
+    pmlog_send(m);
 #endif
 }
 /*****************************************************************************/
@@ -2419,6 +3025,409 @@ __private_extern__ CFCalendarRef        _gregorian(void)
     return g;
 }
 
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+#pragma mark Memory accounting
+
+/*
+ * Bytes held by powerd's long-lived buffers, by subsystem. Caps are only
+ * enforced by the subsystems that can drop data, which check
+ * PMMemoryWouldExceedCap() before they grow. Main queue only.
+ */
+typedef struct {
+    const char      *name;
+    bool            capped;
+    size_t          bytes;
+    size_t          peak;
+    size_t          cap;            // 0 == no cap
+    uint64_t        evictions;
+} PMMemorySubsystem;
+
+static PMMemorySubsystem gPMMemory[kPMMemSubsystemCount] = {
+    [kPMMemAssertionLog]        = { "AssertionLog",         false },
+    [kPMMemBatteryLogs]         = { "BatteryLogs",          false },
+    [kPMMemHIDHistory]          = { "HIDHistory",           false },
+    [kPMMemResponseStats]       = { "ResponseStats",        true,   0, 0, 64*1024 },
+    [kPMMemMT2]                 = { "MessageTracer",        true,   0, 0, 64*1024 },
+    [kPMMemProcessStats]        = { "ProcessStats",         false },
+    [kPMMemExitedProcessStats]  = { "ExitedProcessStats",   true,   0, 0, 32*1024 },
+    [kPMMemStrings]             = { "Strings",              false },
+    [kPMMemLogRecords]          = { "LogRecords",           false }
+};
+
+__private_extern__ void PMMemoryCharge(int subsystem, ssize_t bytes)
+{
+    PMMemorySubsystem   *mem;
+
+    if ((subsystem < 0) || (subsystem >= kPMMemSubsystemCount))
+        return;
+
+    mem = &gPMMemory[subsystem];
+    if ((bytes < 0) && ((size_t)-bytes > mem->bytes)) {
+        mem->bytes = 0;
+    } else {
+        mem->bytes += bytes;
+    }
+    if (mem->bytes > mem->peak)
+        mem->peak = mem->bytes;
+}
+
+/* True if charging 'bytes' more would take a capped subsystem over its cap */
+__private_extern__ bool PMMemoryWouldExceedCap(int subsystem, size_t bytes)
+{
+    PMMemorySubsystem   *mem;
+
+    if ((subsystem < 0) || (subsystem >= kPMMemSubsystemCount))
+        return false;
+
+    mem = &gPMMemory[subsystem];
+    return (mem->capped && mem->cap && ((mem->bytes + bytes) > mem->cap));
+}
+
+/* Called by a capped subsystem each time it drops data to stay under its cap */
+__private_extern__ void PMMemoryNoteEviction(int subsystem)
+{
+    if ((subsystem < 0) || (subsystem >= kPMMemSubsystemCount))
+        return;
+
+    gPMMemory[subsystem].evictions++;
+}
+
+/*
+ * Takes a kPMMemoryCapValue(). The new cap applies the next time the
+ * subsystem grows; data already held isn't dropped until then.
+ */
+__private_extern__ IOReturn PMMemorySetCap(int value)
+{
+    int         subsystem = (value >> 24) & 0xff;
+
+    if ((subsystem >= kPMMemSubsystemCount) || !gPMMemory[subsystem].capped)
+        return kIOReturnBadArgument;
+
+    gPMMemory[subsystem].cap = (size_t)(value & kPMMemoryCapMaxKB) * 1024;
+    return kIOReturnSuccess;
+}
+
+static void setDictionaryUInt64(CFMutableDictionaryRef dict, const char *key, uint64_t value)
+{
+    CFNumberRef     num = CFNumberCreate(0, kCFNumberSInt64Type, &value);
+    CFStringRef     keyStr = CFStringCreateWithCString(0, key, kCFStringEncodingUTF8);
+
+    if (num && keyStr)
+        CFDictionarySetValue(dict, keyStr, num);
+    if (num) CFRelease(num);
+    if (keyStr) CFRelease(keyStr);
+}
+
+__private_extern__ CFArrayRef copyMemoryAccounting(void)
+{
+    CFMutableArrayRef       subsystems = NULL;
+    CFMutableDictionaryRef  dict = NULL;
+    CFStringRef             name = NULL;
+    PMMemorySubsystem       *mem;
+    int                     i;
+
+    subsystems = CFArrayCreateMutable(0, kPMMemSubsystemCount, &kCFTypeArrayCallBacks);
+    if (!subsystems)
+        return NULL;
+
+    for (i = 0; i < kPMMemSubsystemCount; i++)
+    {
+        mem = &gPMMemory[i];
+        dict = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!dict)
+            continue;
+
+        if ((name = CFStringCreateWithCString(0, mem->name, kCFStringEncodingUTF8))) {
+            CFDictionarySetValue(dict, CFSTR(kPMMemoryNameKey), name);
+            CFRelease(name);
+        }
+        setDictionaryUInt64(dict, kPMMemoryBytesKey, mem->bytes);
+        setDictionaryUInt64(dict, kPMMemoryPeakKey, mem->peak);
+        if (mem->capped) {
+            setDictionaryUInt64(dict, kPMMemoryCapKey, mem->cap);
+            setDictionaryUInt64(dict, kPMMemoryEvictionsKey, mem->evictions);
+        }
+
+        CFArrayAppendValue(subsystems, dict);
+        CFRelease(dict);
+    }
+
+    return subsystems;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+#pragma mark String interning
+
+/*
+ * Process names, assertion names and app names are interned once and
+ * handed out as small integer IDs. Equal strings get the same ID while
+ * any holder keeps a reference, so hot paths can compare and hash IDs and
+ * log from the cached C string instead of converting CFStrings.
+ */
+typedef struct {
+    CFStringRef     str;
+    char            *cstr;
+    uint32_t        refCnt;
+    PMStringID      nextFree;
+} PMStringEntry;
+
+#define kPMStringTableGrowBy    64
+
+static PMStringEntry            *gStringTable = NULL;
+static uint32_t                 gStringTableSize = 0;
+static PMStringID               gStringFreeHead = kPMStringIDNone;
+static CFMutableDictionaryRef   gStringIDs = NULL;      // CFString -> PMStringID
+
+static PMStringID allocStringEntry(void)
+{
+    PMStringEntry   *newTable;
+    PMStringID      sid;
+    uint32_t        i, first;
+
+    if (gStringFreeHead == kPMStringIDNone) {
+        newTable = realloc(gStringTable, (gStringTableSize + kPMStringTableGrowBy) * sizeof(PMStringEntry));
+        if (!newTable)
+            return kPMStringIDNone;
+        gStringTable = newTable;
+        PMMemoryCharge(kPMMemStrings, kPMStringTableGrowBy * sizeof(PMStringEntry));
+
+        // Entry 0 is never handed out; it stands for kPMStringIDNone
+        first = (gStringTableSize == 0) ? 1 : gStringTableSize;
+        bzero(&gStringTable[gStringTableSize], kPMStringTableGrowBy * sizeof(PMStringEntry));
+        gStringTableSize += kPMStringTableGrowBy;
+        for (i = first; i < gStringTableSize; i++) {
+            gStringTable[i].nextFree = (i + 1 < gStringTableSize) ? (i + 1) : kPMStringIDNone;
+        }
+        gStringFreeHead = first;
+    }
+
+    sid = gStringFreeHead;
+    gStringFreeHead = gStringTable[sid].nextFree;
+    gStringTable[sid].nextFree = kPMStringIDNone;
+
+    return sid;
+}
+
+__private_extern__ PMStringID PMStringIntern(CFStringRef str)
+{
+    PMStringEntry   *entry;
+    PMStringID      sid;
+    CFIndex         len;
+
+    if (!isA_CFString(str))
+        return kPMStringIDNone;
+
+    if (!gStringIDs) {
+        gStringIDs = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        if (!gStringIDs)
+            return kPMStringIDNone;
+    }
+
+    if ((sid = (PMStringID)(uintptr_t)CFDictionaryGetValue(gStringIDs, str)) != kPMStringIDNone) {
+        gStringTable[sid].refCnt++;
+        return sid;
+    }
+
+    if ((sid = allocStringEntry()) == kPMStringIDNone)
+        return kPMStringIDNone;
+
+    entry = &gStringTable[sid];
+    entry->str = CFStringCreateCopy(0, str);
+    len = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+    entry->cstr = malloc(len);
+    if (!entry->str || !entry->cstr
+        || !CFStringGetCString(str, entry->cstr, len, kCFStringEncodingUTF8))
+    {
+        if (entry->str) CFRelease(entry->str);
+        if (entry->cstr) free(entry->cstr);
+        bzero(entry, sizeof(PMStringEntry));
+        entry->nextFree = gStringFreeHead;
+        gStringFreeHead = sid;
+        return kPMStringIDNone;
+    }
+    entry->refCnt = 1;
+    PMMemoryCharge(kPMMemStrings, malloc_size(entry->cstr));
+
+    CFDictionarySetValue(gStringIDs, entry->str, (const void *)(uintptr_t)sid);
+
+    return sid;
+}
+
+__private_extern__ PMStringID PMStringInternCString(const char *cstr)
+{
+    CFStringRef     str;
+    PMStringID      sid;
+
+    if (!cstr)
+        return kPMStringIDNone;
+
+    str = CFStringCreateWithCStringNoCopy(0, cstr, kCFStringEncodingUTF8, kCFAllocatorNull);
+    if (!str)
+        return kPMStringIDNone;
+
+    sid = PMStringIntern(str);
+    CFRelease(str);
+
+    return sid;
+}
+
+__private_extern__ void PMStringRetain(PMStringID sid)
+{
+    if ((sid == kPMStringIDNone) || (sid >= gStringTableSize) || !gStringTable[sid].refCnt)
+        return;
+
+    gStringTable[sid].refCnt++;
+}
+
+__private_extern__ void PMStringRelease(PMStringID sid)
+{
+    PMStringEntry   *entry;
+
+    if ((sid == kPMStringIDNone) || (sid >= gStringTableSize) || !gStringTable[sid].refCnt)
+        return;
+
+    entry = &gStringTable[sid];
+    if (--entry->refCnt)
+        return;
+
+    CFDictionaryRemoveValue(gStringIDs, entry->str);
+    CFRelease(entry->str);
+    PMMemoryCharge(kPMMemStrings, -(ssize_t)malloc_size(entry->cstr));
+    free(entry->cstr);
+    bzero(entry, sizeof(PMStringEntry));
+
+    entry->nextFree = gStringFreeHead;
+    gStringFreeHead = sid;
+}
+
+__private_extern__ CFStringRef PMStringGet(PMStringID sid)
+{
+    if ((sid == kPMStringIDNone) || (sid >= gStringTableSize))
+        return NULL;
+
+    return gStringTable[sid].str;
+}
+
+__private_extern__ const char *PMStringGetCString(PMStringID sid)
+{
+    if ((sid == kPMStringIDNone) || (sid >= gStringTableSize))
+        return NULL;
+
+    return gStringTable[sid].cstr;
+}
+
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+/***************************************************************************/
+#pragma mark Reply snapshots
+#ifndef __I_AM_PMSET__
+
+/*
+ * Read-only MIG routines run on a concurrent queue (see pmconfigd.c), and
+ * may hand out a serialized reply cached by the main queue without touching
+ * any other powerd state. The main queue is the only writer of a slot; the
+ * lock only covers swapping the reference in and out, so a reader holding a
+ * copy keeps an immutable snapshot however the slot changes after it.
+ */
+static pthread_mutex_t          gReplySnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+__private_extern__ void PMReplySnapshotSet(CFDataRef *slot, CFDataRef data)
+{
+    CFDataRef   old;
+
+    if (data)
+        CFRetain(data);
+
+    pthread_mutex_lock(&gReplySnapshotLock);
+    old = *slot;
+    *slot = data;
+    pthread_mutex_unlock(&gReplySnapshotLock);
+
+    if (old)
+        CFRelease(old);
+}
+
+__private_extern__ CFDataRef PMReplySnapshotCopy(CFDataRef *slot)
+{
+    CFDataRef   data;
+
+    pthread_mutex_lock(&gReplySnapshotLock);
+    data = *slot;
+    if (data)
+        CFRetain(data);
+    pthread_mutex_unlock(&gReplySnapshotLock);
+
+    return data;
+}
+
+/*
+ * Runs 'block' on powerd's main queue and waits for it. Read-only routines
+ * call this to build whatever they can't serve from a snapshot; the caller
+ * is a concurrent queue worker, so only that worker waits.
+ */
+__private_extern__ void PMRunOnMainQueue(dispatch_block_t block)
+{
+    if (pthread_main_np()) {
+        block();
+    } else {
+        dispatch_sync(dispatch_get_main_queue(), block);
+    }
+}
+
+/*
+ * Shared memory objects outlive powerd, and one can only be sized once. An
+ * existing object is reused, so readers that have it mapped see powerd
+ * restart through 'seq', unless its size differs from this build's layout
+ * or someone else owns it; then the name is unlinked and made afresh.
+ */
+__private_extern__ void *PMSharedStateMap(const char *name, size_t len)
+{
+    struct stat     st;
+    void            *addr = NULL;
+    int             fd;
+
+    len = round_page(len);
+
+    fd = shm_open(name, O_RDWR);
+    if (fd != -1) {
+        if ((fstat(fd, &st) == -1) || (st.st_size != (off_t)len) || (st.st_uid != geteuid())) {
+            close(fd);
+            fd = -1;
+            shm_unlink(name);
+        }
+    }
+    if (fd == -1) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            asl_log(0, 0, ASL_LEVEL_ERR, "Failed to create shm %s: %d\n", name, errno);
+            return NULL;
+        }
+        if (ftruncate(fd, len) == -1) {
+            asl_log(0, 0, ASL_LEVEL_ERR, "Failed to size shm %s: %d\n", name, errno);
+            shm_unlink(name);
+            goto exit;
+        }
+    }
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        asl_log(0, 0, ASL_LEVEL_ERR, "Failed to map shm %s: %d\n", name, errno);
+        addr = NULL;
+    }
+
+exit:
+    close(fd);
+    return addr;
+}
+#endif
+
 /***************************************************************************/
 /***************************************************************************/
 /***************************************************************************/
@@ -2433,6 +3442,7 @@ void mt2DarkWakeEnded(void) {};
 void mt2EvaluateSystemSupport(void) {};
 void mt2RecordWakeEvent(uint32_t description) {};
 void mt2RecordThermalEvent(uint32_t description) {};
+void mt2RecordDarkWakesCoalesced(uint32_t saved) {};
 void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion) {};
 void mt2PublishReports(void) {};
 void mt2PublishSleepFailure(const char *failType, const char *pci_string) {};
@@ -2445,6 +3455,30 @@ static void mt2PublishWakeReason(CFStringRef wakeTypeStr, CFStringRef claimedWak
  * MessageTracer2 DarkWake Keys
  */
 
+/*
+ * Counters reported per process, each to its own domain. The background
+ * and push counters count a process at most once per dark wake.
+ */
+enum {
+    kMT2ProcBackground = 0,     /* com.apple.darkwake.backgroundtasks */
+    kMT2ProcPush,               /* com.apple.darkwake.pushservicetasks */
+    kMT2ProcPushTimeout,        /* com.apple.darkwake.pushservicetimeouts */
+    kMT2ProcIdleSleepAckTo,     /* com.apple.ackto.idlesleep */
+    kMT2ProcDemandSleepAckTo,   /* com.apple.ackto.demandsleep */
+    kMT2ProcDarkWakeSleepAckTo,
+    kMT2ProcCounterCount
+};
+
+/*
+ * One process's counters, keyed by its interned name. The entry holds a
+ * reference on the name until the aggregator is recycled.
+ */
+typedef struct {
+    PMStringID                  procID;
+    uint32_t                    recordedThisWake;   /* bit per counter */
+    uint32_t                    counts[kMT2ProcCounterCount];
+} MT2ProcCounts;
+
 typedef struct {
     CFAbsoluteTime              startedPeriod;
     dispatch_source_t           nextFireSource;
@@ -2458,18 +3492,16 @@ typedef struct {
     uint16_t                    wakeEvents[kWakeStateCount];
     /* for domain com.apple.darkwake.thermal */
     uint16_t                    thermalEvents[kThermalStateCount];
-    /* for domain com.apple.darkwake.backgroundtasks */
-    CFMutableSetRef             alreadyRecordedBackground;
-    CFMutableDictionaryRef      tookBackground;
-    /* for domain com.apple.darkwake.pushservicetasks */
-    CFMutableSetRef             alreadyRecordedPush;
-    CFMutableDictionaryRef      tookPush;
-    /* for domain com.apple.darkwake.pushservicetasktimeout */
-    CFMutableSetRef             alreadyRecordedPushTimeouts;
-    CFMutableDictionaryRef      timeoutPush;
-    CFMutableDictionaryRef      idleSleepAppTimeouts;
-    CFMutableDictionaryRef      demandSleepAppTimeouts;
-    CFMutableDictionaryRef      darkwakeSleepAppTimeouts;
+    /* for domain com.apple.darkwake.coalesced */
+    uint32_t                    darkWakesSaved;
+    uint32_t                    coalescedSleeps;
+    /* Per process counters, for the process domains below */
+    MT2ProcCounts               *procs;
+    int                         procCount;
+    int                         procCapacity;
+    /* procSlot[PMStringID] is 1 + the process's index in procs, or 0 */
+    uint16_t                    *procSlot;
+    uint32_t                    procSlotCount;
 } MT2Aggregator;
 
 static const uint64_t   kMT2CheckIntervalTimer = 4ULL*60ULL*60ULL*NSEC_PER_SEC;     /* Check every 4 hours */
@@ -2478,6 +3510,93 @@ static const uint64_t   kBigLeeway = (30Ull * NSEC_PER_SEC);
 
 static MT2Aggregator    *mt2 = NULL;
 
+/*
+ * Returns procID's counters, adding them the first time the process shows
+ * up. Only a new process allocates; counting is plain integer updates.
+ * Once the table is at its memory cap, processes not already in it aren't
+ * counted until the next report.
+ */
+static MT2ProcCounts *mt2ProcCounts(PMStringID procID)
+{
+    MT2ProcCounts   *entry;
+    void            *grown;
+    uint32_t        slots;
+    int             capacity;
+    size_t          growBy;
+
+    if (procID == kPMStringIDNone) {
+        return NULL;
+    }
+    if ((procID < mt2->procSlotCount) && mt2->procSlot[procID]) {
+        return &mt2->procs[mt2->procSlot[procID] - 1];
+    }
+
+    slots = mt2->procSlotCount;
+    if (procID >= slots) {
+        slots = slots ? slots : 64;
+        while (slots <= procID) slots *= 2;
+    }
+    capacity = mt2->procCapacity;
+    if (mt2->procCount == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+    }
+    if (capacity > UINT16_MAX) {
+        return NULL;
+    }
+    growBy = (slots - mt2->procSlotCount) * sizeof(uint16_t)
+           + (capacity - mt2->procCapacity) * sizeof(MT2ProcCounts);
+    if (growBy && PMMemoryWouldExceedCap(kPMMemMT2, growBy)) {
+        PMMemoryNoteEviction(kPMMemMT2);
+        return NULL;
+    }
+
+    if (slots != mt2->procSlotCount) {
+        if (!(grown = realloc(mt2->procSlot, slots * sizeof(uint16_t)))) {
+            return NULL;
+        }
+        PMMemoryCharge(kPMMemMT2, (slots - mt2->procSlotCount) * sizeof(uint16_t));
+        mt2->procSlot = grown;
+        bzero(&mt2->procSlot[mt2->procSlotCount], (slots - mt2->procSlotCount) * sizeof(uint16_t));
+        mt2->procSlotCount = slots;
+    }
+    if (capacity != mt2->procCapacity) {
+        if (!(grown = realloc(mt2->procs, capacity * sizeof(MT2ProcCounts)))) {
+            return NULL;
+        }
+        PMMemoryCharge(kPMMemMT2, (capacity - mt2->procCapacity) * sizeof(MT2ProcCounts));
+        mt2->procs = grown;
+        mt2->procCapacity = capacity;
+    }
+
+    entry = &mt2->procs[mt2->procCount++];
+    bzero(entry, sizeof(MT2ProcCounts));
+    entry->procID = procID;
+    PMStringRetain(procID);
+    mt2->procSlot[procID] = mt2->procCount;
+
+    return entry;
+}
+
+static void mt2CountProcess(PMStringID procID, int counter)
+{
+    MT2ProcCounts   *entry = mt2ProcCounts(procID);
+
+    if (entry) {
+        entry->counts[counter]++;
+    }
+}
+
+/* Counts a process at most once until mt2DarkWakeEnded() */
+static void mt2CountProcessOnce(PMStringID procID, int counter)
+{
+    MT2ProcCounts   *entry = mt2ProcCounts(procID);
+
+    if (entry && !(entry->recordedThisWake & (1 << counter))) {
+        entry->recordedThisWake |= (1 << counter);
+        entry->counts[counter]++;
+    }
+}
+
 void initializeMT2Aggregator(void)
 {
     if (mt2)
@@ -2486,15 +3605,13 @@ void initializeMT2Aggregator(void)
         if (mt2->nextFireSource) {
             dispatch_release(mt2->nextFireSource);
         }
-        CFRelease(mt2->alreadyRecordedBackground);
-        CFRelease(mt2->tookBackground);
-        CFRelease(mt2->alreadyRecordedPush);
-        CFRelease(mt2->tookPush);
-        CFRelease(mt2->alreadyRecordedPushTimeouts);
-        CFRelease(mt2->timeoutPush);
-        CFRelease(mt2->idleSleepAppTimeouts);
-        CFRelease(mt2->demandSleepAppTimeouts);
-        CFRelease(mt2->darkwakeSleepAppTimeouts);
+        for (int i = 0; i < mt2->procCount; i++) {
+            PMStringRelease(mt2->procs[i].procID);
+        }
+        free(mt2->procs);
+        free(mt2->procSlot);
+        PMMemoryCharge(kPMMemMT2, -(ssize_t)(mt2->procCapacity * sizeof(MT2ProcCounts)
+                                             + mt2->procSlotCount * sizeof(uint16_t)));
 
         bzero(mt2, sizeof(MT2Aggregator));
     } else {
@@ -2502,15 +3619,6 @@ void initializeMT2Aggregator(void)
         mt2 = calloc(1, sizeof(MT2Aggregator));
     }
     mt2->startedPeriod                      = CFAbsoluteTimeGetCurrent();
-    mt2->alreadyRecordedBackground          = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPush                = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPushTimeouts        = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->tookBackground                     = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->tookPush                           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->timeoutPush                        = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->idleSleepAppTimeouts               = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->demandSleepAppTimeouts             = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->darkwakeSleepAppTimeouts           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
 
     mt2->nextFireSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
     if (mt2->nextFireSource) {
@@ -2542,30 +3650,29 @@ static int mt2PublishDomainCapable(void)
         return 0;
     }
 
-    aslmsg m = asl_new(ASL_TYPE_MSG);
-    asl_set(m, "com.apple.message.domain", kMT2DomainDarkWakeCapable );
+    pmlogmsg m = pmlog_new();
+    pmlog_set(m, "com.apple.message.domain", kMT2DomainDarkWakeCapable );
     if (mt2->SMCSupport && mt2->PlatformSupport) {
-        asl_set(m, kMT2KeySupport, kMT2ValFullDWSupport);
+        pmlog_set(m, kMT2KeySupport, kMT2ValFullDWSupport);
     } else if (mt2->PlatformSupport) {
-        asl_set(m, kMT2KeySupport, kMT2ValPlatformSupport);
+        pmlog_set(m, kMT2KeySupport, kMT2ValPlatformSupport);
     } else if (mt2->SMCSupport) {
-        asl_set(m, kMT2KeySupport, kMT2ValSMCSupport);
+        pmlog_set(m, kMT2KeySupport, kMT2ValSMCSupport);
     } else {
-        asl_set(m, kMT2KeySupport, kMT2ValNoSupport);
+        pmlog_set(m, kMT2KeySupport, kMT2ValNoSupport);
     }
 
     if (mt2->checkedforAC && mt2->checkedforBatt) {
-        asl_set(m, kMT2KeySettings, kMT2ValSettingsACPlusBatt);
+        pmlog_set(m, kMT2KeySettings, kMT2ValSettingsACPlusBatt);
     } else if (mt2->checkedforAC) {
-        asl_set(m, kMT2KeySettings, kMT2ValSettingsAC);
+        pmlog_set(m, kMT2KeySettings, kMT2ValSettingsAC);
     } else if (mt2->checkedforBatt) {
-        asl_set(m, kMT2KeySettings, kMT2ValSettingsBatt);
+        pmlog_set(m, kMT2KeySettings, kMT2ValSettingsBatt);
     } else {
-        asl_set(m, kMT2KeySettings, kMT2ValSettingsNone);
+        pmlog_set(m, kMT2KeySettings, kMT2ValSettingsNone);
     }
 
-    asl_log(NULL, m, ASL_LEVEL_ERR, "");
-    asl_release(m);
+    pmlog_send_level(m, ASL_LEVEL_ERR);
 
     return 1;
 }
@@ -2596,28 +3703,27 @@ static int mt2PublishDomainWakes(void)
         if (0 == mt2->wakeEvents[i]) {
             continue;
         }
-        aslmsg m = asl_new(ASL_TYPE_MSG);
-        asl_set(m, "com.apple.message.domain", kMT2DomainWakes);
+        pmlogmsg m = pmlog_new();
+        pmlog_set(m, "com.apple.message.domain", kMT2DomainWakes);
         if (i & kWakeStateDark) {
-            asl_set(m, kMT2KeyWakeType, kMT2ValWakeDark);
+            pmlog_set(m, kMT2KeyWakeType, kMT2ValWakeDark);
         } else {
-            asl_set(m, kMT2KeyWakeType, kMT2ValWakeFull);
+            pmlog_set(m, kMT2KeyWakeType, kMT2ValWakeFull);
         }
         if (i & kWakeStateBattery) {
-            asl_set(m, kMT2KeyPowerSource, kMT2ValPowerBatt);
+            pmlog_set(m, kMT2KeyPowerSource, kMT2ValPowerBatt);
         } else {
-            asl_set(m, kMT2KeyPowerSource, kMT2ValPowerAC);
+            pmlog_set(m, kMT2KeyPowerSource, kMT2ValPowerAC);
         }
         if (i & kWakeStateLidClosed) {
-            asl_set(m, kMT2KeyLid, kMT2ValLidClosed);
+            pmlog_set(m, kMT2KeyLid, kMT2ValLidClosed);
         } else {
-            asl_set(m, kMT2KeyLid, kMT2ValLidOpen);
+            pmlog_set(m, kMT2KeyLid, kMT2ValLidOpen);
         }
 
         snprintf(buf, sizeof(buf), "%d", mt2->wakeEvents[i]);
-        asl_set(m, "com.apple.message.count", buf);
-        asl_log(NULL, m, ASL_LEVEL_ERR, "");
-        asl_release(m);
+        pmlog_set(m, "com.apple.message.count", buf);
+        pmlog_send_level(m, ASL_LEVEL_ERR);
         sentCount++;
     }
     return sentCount;
@@ -2644,74 +3750,90 @@ static int mt2PublishDomainThermals(void)
         if (0 == mt2->thermalEvents[i]) {
             continue;
         }
-        aslmsg m = asl_new(ASL_TYPE_MSG);
-        asl_set(m, "com.apple.message.domain", kMT2DomainThermal );
+        pmlogmsg m = pmlog_new();
+        pmlog_set(m, "com.apple.message.domain", kMT2DomainThermal );
         if (i & kThermalStateSleepRequest) {
-            asl_set(m, kMT2KeySleepRequest, kMT2ValTrue);
+            pmlog_set(m, kMT2KeySleepRequest, kMT2ValTrue);
         } else {
-            asl_set(m, kMT2KeySleepRequest, kMT2ValFalse);
+            pmlog_set(m, kMT2KeySleepRequest, kMT2ValFalse);
         }
         if (i & kThermalStateFansOn) {
-            asl_set(m, kMT2KeyFansSpin, kMT2ValTrue);
+            pmlog_set(m, kMT2KeyFansSpin, kMT2ValTrue);
         } else {
-            asl_set(m, kMT2KeyFansSpin, kMT2ValFalse);
+            pmlog_set(m, kMT2KeyFansSpin, kMT2ValFalse);
         }
 
         snprintf(buf, sizeof(buf), "%d", mt2->thermalEvents[i]);
-        asl_set(m, "com.apple.message.count", buf);
-        asl_log(NULL, m, ASL_LEVEL_ERR, "");
-        asl_release(m);
+        pmlog_set(m, "com.apple.message.count", buf);
+        pmlog_send_level(m, ASL_LEVEL_ERR);
         sentCount++;
     }
     return sentCount;
 }
 
-static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
+static int mt2PublishDomainCoalesced(void)
+{
+#define kMT2DomainCoalesced             "com.apple.darkwake.coalesced"
+#define kMT2KeySleeps                   "com.apple.message.sleeps"
+
+    char    buf[kIntegerStringLen];
+
+    if (!mt2 || (0 == mt2->darkWakesSaved)) {
+        return 0;
+    }
+
+    pmlogmsg m = pmlog_new();
+    pmlog_set(m, "com.apple.message.domain", kMT2DomainCoalesced);
+
+    snprintf(buf, sizeof(buf), "%u", mt2->coalescedSleeps);
+    pmlog_set(m, kMT2KeySleeps, buf);
+
+    snprintf(buf, sizeof(buf), "%u", mt2->darkWakesSaved);
+    pmlog_set(m, "com.apple.message.count", buf);
+    pmlog_send_level(m, ASL_LEVEL_ERR);
+    return 1;
+}
+
+static int mt2PublishDomainProcess(const char *appdomain, int counter)
 {
 #define kMT2KeyApp                      "com.apple.message.process"
 
-    CFStringRef         *keys;
-    uintptr_t           *counts;
+    MT2ProcCounts       *entry;
+    const char          *procName;
     char                buf[2*kProcNameBufLen];
     int                 sendCount = 0;
-    int                 appcount = 0;
     int                 i = 0;
 
-    if (!mt2 || !apps || (0 == (appcount = CFDictionaryGetCount(apps))))
+    if (!mt2)
     {
         return 0;
     }
 
-    keys = (CFStringRef *)calloc(sizeof(CFStringRef), appcount);
-    counts = (uintptr_t *)calloc(sizeof(uintptr_t), appcount);
-
-    CFDictionaryGetKeysAndValues(apps, (const void **)keys, (const void **)counts);
-
-    for (i=0; i<appcount; i++)
+    for (i=0; i<mt2->procCount; i++)
     {
-        if (0 == counts[i]) {
+        entry = &mt2->procs[i];
+        if (0 == entry->counts[counter]) {
             continue;
         }
-        aslmsg m = asl_new(ASL_TYPE_MSG);
-        asl_set(m, "com.apple.message.domain", appdomain);
+        pmlogmsg m = pmlog_new();
+        pmlog_set(m, "com.apple.message.domain", appdomain);
 
-        if (!CFStringGetCString(keys[i], buf, sizeof(buf), kCFStringEncodingUTF8)) {
+        if ((procName = PMStringGetCString(entry->procID))) {
+            pmlog_set(m, kMT2KeyApp, procName);
+        }
+        else {
             snprintf(buf, sizeof(buf), "com.apple.message.%s", "Unknown");
+            pmlog_set(m, kMT2KeyApp, buf);
         }
-        asl_set(m, kMT2KeyApp, buf);
 
-        snprintf(buf, sizeof(buf), "%d", (int)counts[i]);
-        asl_set(m, "com.apple.message.count", buf);
+        snprintf(buf, sizeof(buf), "%d", (int)entry->counts[counter]);
+        pmlog_set(m, "com.apple.message.count", buf);
 
-        asl_log(NULL, m, ASL_LEVEL_ERR,"");
-        asl_release(m);
+        pmlog_send_level(m, ASL_LEVEL_ERR);
         sendCount++;
 
     }
 
-    free(keys);
-    free(counts);
-
     return sendCount;
 }
 
@@ -2744,12 +3866,13 @@ void mt2PublishReports(void)
     {
         mt2PublishDomainWakes();
         mt2PublishDomainThermals();
-        mt2PublishDomainProcess(kMT2DomainPushTasks, mt2->tookPush);
-        mt2PublishDomainProcess(kMT2DomainPushTimeouts, mt2->timeoutPush);
-        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, mt2->tookBackground);
-        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, mt2->idleSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, mt2->demandSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, mt2->darkwakeSleepAppTimeouts);
+        mt2PublishDomainCoalesced();
+        mt2PublishDomainProcess(kMT2DomainPushTasks, kMT2ProcPush);
+        mt2PublishDomainProcess(kMT2DomainPushTimeouts, kMT2ProcPushTimeout);
+        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, kMT2ProcBackground);
+        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, kMT2ProcIdleSleepAckTo);
+        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, kMT2ProcDemandSleepAckTo);
+        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, kMT2ProcDarkWakeSleepAckTo);
 
         // Recyle the data structure for the next reporting.
         initializeMT2Aggregator();
@@ -2767,9 +3890,9 @@ void mt2DarkWakeEnded(void)
     if (!mt2) {
         return;
     }
-    CFSetRemoveAllValues(mt2->alreadyRecordedBackground);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPush);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPushTimeouts);
+    for (int i = 0; i < mt2->procCount; i++) {
+        mt2->procs[i].recordedThisWake = 0;
+    }
 }
 
 void mt2EvaluateSystemSupport(void)
@@ -2856,13 +3979,23 @@ void mt2RecordThermalEvent(uint32_t description)
     return;
 }
 
+void mt2RecordDarkWakesCoalesced(uint32_t saved)
+{
+    if (!mt2 || (0 == saved)) {
+        return;
+    }
+    mt2->darkWakesSaved += saved;
+    mt2->coalescedSleeps++;
+    return;
+}
+
 /* PMConnection.c */
 bool isA_DarkWakeState();
 
 void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
 {
-    CFStringRef         processName;
-    CFStringRef         assertionType;
+    static PMStringID   unknownID = kPMStringIDNone;
+    PMStringID          procID;
 
     if (!mt2) {
         return;
@@ -2872,45 +4005,29 @@ void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
         return;
     }
 
-    if (!(processName = processInfoGetName(theAssertion->pinfo->pid))) {
-        processName = CFSTR("Unknown");
+    if ((procID = theAssertion->pinfo->nameID) == kPMStringIDNone) {
+        if (unknownID == kPMStringIDNone) {
+            unknownID = PMStringIntern(CFSTR("Unknown"));
+        }
+        procID = unknownID;
     }
-
-    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))
-        || (!CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask)
-         && !CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask)))
-    {
+    if (procID == kPMStringIDNone) {
         return;
     }
 
-    if (CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask))
+    if (kBackgroundTaskType == theAssertion->kassert)
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedBackground, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookBackground, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookBackground, processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedBackground, processName);
-            }
+            mt2CountProcessOnce(procID, kMT2ProcBackground);
         }
     }
-    else if (CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask))
+    else if (kPushServiceTaskType == theAssertion->kassert)
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPush, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookPush, processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPush, processName);
-            }
+            mt2CountProcessOnce(procID, kMT2ProcPush);
         }
         else if (kAssertionOpGlobalTimeout == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPushTimeouts, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->timeoutPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->timeoutPush, (const void *)processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPushTimeouts, processName);
-            }
+            mt2CountProcessOnce(procID, kMT2ProcPushTimeout);
         }
     }
 
@@ -2919,26 +4036,27 @@ void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
 
 void mt2RecordAppTimeouts(CFStringRef sleepReason, CFStringRef procName)
 {
-    CFMutableDictionaryRef dict;
+    int                    counter;
+    PMStringID             procID;
 
     if ( !mt2 || !isA_CFString(procName)) return;
 
     if (CFStringCompare(sleepReason, CFSTR(kIOPMIdleSleepKey), 0) == kCFCompareEqualTo) {
-        dict = mt2->idleSleepAppTimeouts;
+        counter = kMT2ProcIdleSleepAckTo;
     }
     else  if ((CFStringCompare(sleepReason, CFSTR(kIOPMClamshellSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMPowerButtonSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMSoftwareSleepKey), 0) == kCFCompareEqualTo)) {
-        dict = mt2->demandSleepAppTimeouts;
+        counter = kMT2ProcDemandSleepAckTo;
     }
     else {
-        dict = mt2->darkwakeSleepAppTimeouts;
+        counter = kMT2ProcDarkWakeSleepAckTo;
     }
 
-    int x = (int)CFDictionaryGetValue(dict, procName);
-    x++;
-    CFDictionarySetValue(dict, (const void *)procName, (uintptr_t)x);
+    if ((procID = PMStringIntern(procName)) == kPMStringIDNone) return;
 
+    mt2CountProcess(procID, counter);
+    PMStringRelease(procID);
 }
 
 
@@ -2968,47 +4086,44 @@ static void mt2PublishWakeReason(CFStringRef wakeTypeStr, CFStringRef claimedWak
         return;
     }
     
-    aslmsg m = asl_new(ASL_TYPE_MSG);
-    asl_set(m, "com.apple.message.domain", kMT2DomainWakeReasons);
+    pmlogmsg m = pmlog_new();
+    pmlog_set(m, "com.apple.message.domain", kMT2DomainWakeReasons);
 
-    asl_set(m, "com.apple.message.signature", wakeType);
+    pmlog_set(m, "com.apple.message.signature", wakeType);
     if (state == kNotSupported) {
-        asl_set(m, "com.apple.message.signature2", "unsupported");
+        pmlog_set(m, "com.apple.message.signature2", "unsupported");
     }
     else if (state == kActive) {
-        asl_set(m, "com.apple.message.signature2", "active");
+        pmlog_set(m, "com.apple.message.signature2", "active");
     }
     else {
-        asl_set(m, "com.apple.message.signature2", "inactive");
+        pmlog_set(m, "com.apple.message.signature2", "inactive");
     }
-    asl_set(m, "com.apple.message.signature3", claimedWake);
+    pmlog_set(m, "com.apple.message.signature3", claimedWake);
 
-    asl_set(m, "com.apple.message.summarize", "YES");
-    asl_log(NULL, m, ASL_LEVEL_NOTICE, "");
-    asl_release(m);
+    pmlog_set(m, "com.apple.message.summarize", "YES");
+    pmlog_send_level(m, ASL_LEVEL_NOTICE);
 
 }
 
 void mt2PublishSleepFailure(const char *failType, const char *pci_string)
 {
-    aslmsg m = asl_new(ASL_TYPE_MSG);
-    asl_set(m, "com.apple.message.domain", kMT2DomainSleepFailure);
-    asl_set(m, kMT2KeyFailType, failType);
-    asl_set(m, kMT2KeyPCI, pci_string);
-    asl_set(m, "com.apple.message.summarize", "YES");
-    asl_log(NULL, m, ASL_LEVEL_NOTICE, "");
-    asl_release(m);
+    pmlogmsg m = pmlog_new();
+    pmlog_set(m, "com.apple.message.domain", kMT2DomainSleepFailure);
+    pmlog_set(m, kMT2KeyFailType, failType);
+    pmlog_set(m, kMT2KeyPCI, pci_string);
+    pmlog_set(m, "com.apple.message.summarize", "YES");
+    pmlog_send_level(m, ASL_LEVEL_NOTICE);
 }
 
 void mt2PublishWakeFailure(const char *failType, const char *pci_string)
 {
-    aslmsg m = asl_new(ASL_TYPE_MSG);
-    asl_set(m, "com.apple.message.domain", kMT2DomainWakeFailure);
-    asl_set(m, kMT2KeyFailType, failType);
-    asl_set(m, kMT2KeyPCI, pci_string);
-    asl_set(m, "com.apple.message.summarize", "YES");
-    asl_log(NULL, m, ASL_LEVEL_NOTICE, "");
-    asl_release(m);
+    pmlogmsg m = pmlog_new();
+    pmlog_set(m, "com.apple.message.domain", kMT2DomainWakeFailure);
+    pmlog_set(m, kMT2KeyFailType, failType);
+    pmlog_set(m, kMT2KeyPCI, pci_string);
+    pmlog_set(m, "com.apple.message.summarize", "YES");
+    pmlog_send_level(m, ASL_LEVEL_NOTICE);
 }
 
 #endif      /* #endif for iOS */
@@ -3426,11 +4541,85 @@ bool smcSilentRunningSupport(void)
 /************************************************************************/
 /************************************************************************/
 
+/*
+ * SMC key cache
+ *
+ * A key's size never changes, so kSMCGetKeyInfo is asked once per key, and
+ * a key the SMC doesn't have is remembered as missing.
+ */
+#define kSMCKeyCacheSize        16
+
+typedef struct {
+    uint32_t        key;
+    IOReturn        infoResult;     // kIOReturnSuccess or kIOReturnNotFound
+    uint32_t        dataSize;
+} SMCKeyCacheEntry;
+
+static SMCKeyCacheEntry     gSMCKeyCache[kSMCKeyCacheSize];
+static SMCKeyCacheEntry     gSMCKeyOverflow;
+static int                  gSMCKeyCacheCount = 0;
+static io_connect_t         gSMCConnect = IO_OBJECT_NULL;
+
 static IOReturn callSMCFunction(
     int which,
     SMCParamStruct *inputValues,
     SMCParamStruct *outputValues);
 
+static SMCKeyCacheEntry *smcKeyCacheLookup(uint32_t key)
+{
+    int     i;
+
+    for (i=0; i<gSMCKeyCacheCount; i++) {
+        if (gSMCKeyCache[i].key == key)
+            return &gSMCKeyCache[i];
+    }
+    return NULL;
+}
+
+/*
+ * Returns the key's cache entry, asking the SMC for its info if this is the
+ * first time we've seen it. Returns NULL, with *ret set, if the key info
+ * couldn't be read and the failure isn't one worth remembering.
+ */
+static SMCKeyCacheEntry *smcKeyInfo(uint32_t key, IOReturn *ret)
+{
+    SMCKeyCacheEntry    *entry = NULL;
+    SMCParamStruct      stuffMeIn;
+    SMCParamStruct      stuffMeOut;
+
+    if ((entry = smcKeyCacheLookup(key))) {
+        *ret = entry->infoResult;
+        return entry;
+    }
+
+    bzero(&stuffMeIn, sizeof(SMCParamStruct));
+    bzero(&stuffMeOut, sizeof(SMCParamStruct));
+    stuffMeIn.data8 = kSMCGetKeyInfo;
+    stuffMeIn.key = key;
+
+    *ret = callSMCFunction(kSMCHandleYPCEvent, &stuffMeIn, &stuffMeOut);
+    if (kIOReturnSuccess != *ret) {
+        return NULL;
+    }
+
+    if (stuffMeOut.result == kSMCKeyNotFound) {
+        *ret = kIOReturnNotFound;
+    } else if (stuffMeOut.result != kSMCSuccess) {
+        *ret = kIOReturnInternalError;
+        return NULL;
+    }
+
+    // With the cache full, later keys share gSMCKeyOverflow and are
+    // asked about again on every read.
+    entry = (gSMCKeyCacheCount < kSMCKeyCacheSize) ? &gSMCKeyCache[gSMCKeyCacheCount++] : &gSMCKeyOverflow;
+    bzero(entry, sizeof(SMCKeyCacheEntry));
+    entry->key = key;
+    entry->infoResult = *ret;
+    entry->dataSize = stuffMeOut.keyInfo.dataSize;
+
+    return entry;
+}
+
 /************************************************************************/
 // Methods
 static IOReturn _smcWriteKey(
@@ -3438,10 +4627,11 @@ static IOReturn _smcWriteKey(
     uint8_t *outBuf,
     uint8_t outBufMax)
 {
-    SMCParamStruct  stuffMeIn;
-    SMCParamStruct  stuffMeOut;
-    IOReturn        ret;
-    int             i;
+    SMCParamStruct      stuffMeIn;
+    SMCParamStruct      stuffMeOut;
+    SMCKeyCacheEntry    *entry = NULL;
+    IOReturn            ret;
+    int                 i;
 
     if (key == 0)
         return kIOReturnCannotWire;
@@ -3450,33 +4640,21 @@ static IOReturn _smcWriteKey(
     bzero(&stuffMeOut, sizeof(SMCParamStruct));
 
     // Determine key's data size
-    stuffMeIn.data8             = kSMCGetKeyInfo;
-    stuffMeIn.key               = key;
-
-    ret = callSMCFunction(kSMCHandleYPCEvent, &stuffMeIn, &stuffMeOut);
+    entry = smcKeyInfo(key, &ret);
     if (kIOReturnSuccess != ret) {
         goto exit;
     }
 
-    if (stuffMeOut.result == kSMCKeyNotFound) {
-        ret = kIOReturnNotFound;
-        goto exit;
-    } else if (stuffMeOut.result != kSMCSuccess) {
-        ret = kIOReturnInternalError;
-        goto exit;
-    }
-
     // Write Key
     stuffMeIn.data8             = kSMCWriteKey;
     stuffMeIn.key               = key;
-    stuffMeIn.keyInfo.dataSize  = stuffMeOut.keyInfo.dataSize;
+    stuffMeIn.keyInfo.dataSize  = entry->dataSize;
     if (outBuf) {
         if (outBufMax > 32) outBufMax = 32;
         for (i=0; i<outBufMax; i++) {
             stuffMeIn.bytes[i] = outBuf[i];
         }
     }
-    bzero(&stuffMeOut, sizeof(SMCParamStruct));
     ret = callSMCFunction(kSMCHandleYPCEvent, &stuffMeIn, &stuffMeOut);
 
     if (stuffMeOut.result != kSMCSuccess) {
@@ -3493,10 +4671,11 @@ static IOReturn _smcReadKey(
     uint8_t *outBuf,
     uint8_t *outBufMax)
 {
-    SMCParamStruct  stuffMeIn;
-    SMCParamStruct  stuffMeOut;
-    IOReturn        ret;
-    int             i;
+    SMCParamStruct      stuffMeIn;
+    SMCParamStruct      stuffMeOut;
+    SMCKeyCacheEntry    *entry = NULL;
+    IOReturn            ret;
+    int                 i;
 
     if (key == 0 || outBuf == NULL)
         return kIOReturnCannotWire;
@@ -3505,28 +4684,20 @@ static IOReturn _smcReadKey(
     bzero(outBuf, *outBufMax);
     bzero(&stuffMeIn, sizeof(SMCParamStruct));
     bzero(&stuffMeOut, sizeof(SMCParamStruct));
-    stuffMeIn.data8 = kSMCGetKeyInfo;
-    stuffMeIn.key = key;
 
-    ret = callSMCFunction(kSMCHandleYPCEvent, &stuffMeIn, &stuffMeOut);
+    entry = smcKeyInfo(key, &ret);
     if (kIOReturnSuccess != ret) {
         goto exit;
     }
 
-    if (stuffMeOut.result == kSMCKeyNotFound) {
-        ret = kIOReturnNotFound;
-        goto exit;
-    } else if (stuffMeOut.result != kSMCSuccess) {
-        ret = kIOReturnInternalError;
-        goto exit;
-    }
-
     // Get Key Value
     stuffMeIn.data8 = kSMCReadKey;
     stuffMeIn.key = key;
-    stuffMeIn.keyInfo.dataSize = stuffMeOut.keyInfo.dataSize;
-    bzero(&stuffMeOut, sizeof(SMCParamStruct));
+    stuffMeIn.keyInfo.dataSize = entry->dataSize;
     ret = callSMCFunction(kSMCHandleYPCEvent, &stuffMeIn, &stuffMeOut);
+    if (kIOReturnSuccess != ret) {
+        goto exit;
+    }
     if (stuffMeOut.result == kSMCKeyNotFound) {
         ret = kIOReturnNotFound;
         goto exit;
@@ -3556,19 +4727,19 @@ exit:
     return ret;
 }
 
-static IOReturn callSMCFunction(
-    int which,
-    SMCParamStruct *inputValues,
-    SMCParamStruct *outputValues)
+/*
+ * The SMC user client stays open for powerd's lifetime, instead of being
+ * opened and closed around every call. It's reopened once if a call finds
+ * the connection gone, e.g. after AppleSMC restarts.
+ */
+static IOReturn openSMCConnection(void)
 {
-    IOReturn result = kIOReturnError;
-
-    size_t         inStructSize = sizeof(SMCParamStruct);
-    size_t         outStructSize = sizeof(SMCParamStruct);
-
-    io_connect_t    _SMCConnect = IO_OBJECT_NULL;
+    IOReturn        result = kIOReturnError;
     io_service_t    smc = IO_OBJECT_NULL;
 
+    if (IO_OBJECT_NULL != gSMCConnect)
+        return kIOReturnSuccess;
+
     smc = IOServiceGetMatchingService(
         kIOMasterPortDefault,
         IOServiceMatching("AppleSMC"));
@@ -3576,28 +4747,60 @@ static IOReturn callSMCFunction(
         return kIOReturnNotFound;
     }
 
-    result = IOServiceOpen(smc, mach_task_self(), 1, &_SMCConnect);
+    result = IOServiceOpen(smc, mach_task_self(), 1, &gSMCConnect);
+    IOObjectRelease(smc);
     if (result != kIOReturnSuccess ||
-        IO_OBJECT_NULL == _SMCConnect) {
-        _SMCConnect = IO_OBJECT_NULL;
+        IO_OBJECT_NULL == gSMCConnect) {
+        gSMCConnect = IO_OBJECT_NULL;
         goto exit;
     }
 
-    result = IOConnectCallMethod(_SMCConnect, kSMCUserClientOpen,
+    result = IOConnectCallMethod(gSMCConnect, kSMCUserClientOpen,
                     NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
     if (result != kIOReturnSuccess) {
-        goto exit;
+        IOServiceClose(gSMCConnect);
+        gSMCConnect = IO_OBJECT_NULL;
     }
 
-    result = IOConnectCallStructMethod(_SMCConnect, which,
-                        inputValues, inStructSize,
-                        outputValues, &outStructSize);
-
 exit:
-    if (IO_OBJECT_NULL != _SMCConnect) {
-        IOConnectCallMethod(_SMCConnect, kSMCUserClientClose,
+    return result;
+}
+
+static void closeSMCConnection(void)
+{
+    if (IO_OBJECT_NULL != gSMCConnect) {
+        IOConnectCallMethod(gSMCConnect, kSMCUserClientClose,
                     NULL, 0, NULL, 0, NULL, NULL, NULL, NULL);
-        IOServiceClose(_SMCConnect);
+        IOServiceClose(gSMCConnect);
+        gSMCConnect = IO_OBJECT_NULL;
+    }
+}
+
+static IOReturn callSMCFunction(
+    int which,
+    SMCParamStruct *inputValues,
+    SMCParamStruct *outputValues)
+{
+    IOReturn result = kIOReturnError;
+    size_t   outStructSize;
+    int      attempt;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        result = openSMCConnection();
+        if (result != kIOReturnSuccess) {
+            break;
+        }
+
+        outStructSize = sizeof(SMCParamStruct);
+        result = IOConnectCallStructMethod(gSMCConnect, which,
+                            inputValues, sizeof(SMCParamStruct),
+                            outputValues, &outStructSize);
+        if ((result != MACH_SEND_INVALID_DEST) && (result != kIOReturnNotOpen)
+            && (result != kIOReturnNoDevice)) {
+            break;
+        }
+        closeSMCConnection();
     }
 
     return result;
@@ -57,6 +57,7 @@
 #include <IOKit/IOReturn.h>
 
 #include <dispatch/dispatch.h>
+#include <libkern/OSAtomic.h>
 #include "PMAssertions.h"
 
 #if !TARGET_OS_EMBEDDED
@@ -93,6 +94,173 @@ enum {
     kRStateCount
 };
 
+/*
+ * powerd private selectors for io_pm_get_value_int()/io_pm_set_value_int().
+ * Numbered well clear of the selectors defined in IOPMLibPrivate.h.
+ */
+enum {
+    kPMGetKernelAssertionUpdates            = 1000,
+    kPMGetKernelAssertionUpdatesSuppressed  = 1001,
+    kPMGetKernelAssertionCoalesceDelay      = 1002,
+    kPMSetKernelAssertionCoalesceDelay      = 1003,
+    kPMGetAssertionAggregatesGeneration     = 1004,
+    kPMGetAssertionsGeneration              = 1005,
+    kPMGetPowerSourcesGeneration            = 1006,
+    kPMGetTimeRemainingEstimator            = 1007,
+    kPMSetTimeRemainingEstimator            = 1008,
+    kPMGetTimeRemainingHorizon              = 1009,
+    kPMSetTimeRemainingHorizon              = 1010,
+    kPMSetSimulatedCapabilityChange         = 1011,
+    kPMGetSimulatedChangeDuration           = 1012,
+    kPMGetSimulatedChangeTimeouts           = 1013,
+    kPMSetMemoryCap                         = 1014
+};
+
+/*
+ * kPMSetSimulatedCapabilityChange (root only) sends its capability bits to the
+ * PMConnections in the caller's process group as if the system had changed
+ * state, and posts kPMSimulatedChangeDoneNotifyString once they have all
+ * acknowledged or timed out. kPMGetSimulatedChangeDuration then returns the
+ * microseconds from fan-out to completion (-1 while in flight, -2 if a real
+ * transition preempted it), and kPMGetSimulatedChangeTimeouts the number of
+ * clients that failed to acknowledge.
+ */
+#define kPMSimulatedChangeDoneNotifyString      "com.apple.powermanagement.simulatedchangedone"
+
+/*
+ * Wake coalescing leeway, in seconds (CFNumber).
+ * kPMPowerEventLeewayKey may be set in an IOPMSchedulePowerEvent() event
+ * dictionary, and kPMAckWakeLeewayKey in IOPMConnectionAcknowledgeEventWithOptions()
+ * options alongside a wake date. Either lets powerd fire the wake up to that
+ * much later, so it can share one RTC wake with other requests.
+ */
+#define kPMPowerEventLeewayKey                  "leeway"
+#define kPMAckWakeLeewayKey                     CFSTR("WakeLeeway")
+#define kPMWakeLeewayMax                        (60.0 * 60.0)
+
+/*
+ * powerd private 'whichData' for io_pm_assertion_copy_details().
+ * Returns IOReport samples of the assertion latency histograms.
+ */
+#define kPMAssertionMIGCopyPerf                 1000
+
+/*
+ * Latency histograms powerd publishes are IOReport simple arrays of this
+ * many elements: element 0 counts samples under 1us, element i those in
+ * [2^(i-1), 2^i) us and the last element everything slower.
+ */
+#define kPMPerfHistogramBuckets                 16
+
+/*
+ * powerd private 'whichData' for io_pm_assertion_copy_details().
+ * Returns an array of recent sleep/wake transition profiles, oldest first.
+ * Each is a dictionary of kPMTransition*Key; phase offsets are microseconds
+ * from the kernel's capability change notification, or -1 if not reached.
+ */
+#define kPMTransitionMIGCopyProfile             1001
+
+#define kPMTransitionUUIDKey                    "UUID"
+#define kPMTransitionKindKey                    "Kind"
+#define kPMTransitionPhasesKey                  "PhasesUS"
+
+enum {
+    kPMTransitionSleep = 0,
+    kPMTransitionDarkWake,
+    kPMTransitionFullWake,
+    kPMTransitionKindCount
+};
+
+enum {
+    kPMTransitionPhaseWakeReason = 0,   // wake reason resolved (wakes only)
+    kPMTransitionPhaseFanout,           // all PMConnection clients notified
+    kPMTransitionPhaseFirstAck,
+    kPMTransitionPhaseLastAck,
+    kPMTransitionPhaseScheduleWake,     // wake requests evaluated (sleeps only)
+    kPMTransitionPhaseKernelAck,        // IOAllowPowerChange
+    kPMTransitionPhaseCount
+};
+
+/*
+ * powerd private 'whichData' for io_pm_assertion_copy_details().
+ * Returns one dictionary of everything pmset -g reports, built in a single
+ * pass on powerd's main queue so the pieces are consistent with each other.
+ * Keys whose source has nothing to report are omitted.
+ */
+#define kPMSnapshotMIGCopyAll                   1002
+
+#define kPMSnapshotTimestampKey                 "Timestamp"
+#define kPMSnapshotSettingsKey                  "Settings"
+#define kPMSnapshotAssertionsKey                "Assertions"
+#define kPMSnapshotAssertionStatusKey           "AssertionStatus"
+#define kPMSnapshotPowerSourcesKey              "PowerSources"
+#define kPMSnapshotScheduledEventsKey           "ScheduledEvents"
+#define kPMSnapshotRepeatEventsKey              "RepeatEvents"
+#define kPMSnapshotUPSThresholdsKey             "UPSThresholds"
+#define kPMSnapshotSystemLoadKey                "SystemLoad"
+#define kPMSnapshotThermalWarningKey            "ThermalWarningLevel"
+#define kPMSnapshotCPUPowerKey                  "CPUPowerStatus"
+
+/*
+ * powerd private 'whichData' for io_pm_assertion_copy_details().
+ * Returns IOReport samples with two simple array channels for each MIG
+ * routine powerd has served: the time requests waited between being received
+ * and being served, and the time serving took, as kPMPerfHistogramBuckets
+ * histograms.
+ */
+#define kPMMIGCopyQueueStats                    1003
+
+// Channel IDs: MIG message ID << 2 | kPMMIGStatsChannel* bits
+#define kPMMIGStatsChannelService               0x1     // else queue delay
+#define kPMMIGStatsChannelConcurrent            0x2     // routine is read-only
+#define kPMMIGStatsChannelID(msgid, bits)       (((uint64_t)(msgid) << 2) | (bits))
+#define kPMMIGStatsChannelMsgID(chid)           ((int)((chid) >> 2))
+
+__private_extern__ CFDictionaryRef      copyMIGQueueStats(void);
+
+/*
+ * powerd memory accounting. Each long-lived buffer charges the bytes it
+ * holds to one of these subsystems. A subsystem that can drop data keeps
+ * itself under its cap by discarding its oldest; the others only report.
+ */
+enum {
+    kPMMemAssertionLog = 0,         // assertion activity log ring
+    kPMMemBatteryLogs,              // power source log rings
+    kPMMemHIDHistory,               // HID event history
+    kPMMemResponseStats,            // PM client response stats (capped)
+    kPMMemMT2,                      // MessageTracer process counters (capped)
+    kPMMemProcessStats,             // activity aggregate buffers of running processes
+    kPMMemExitedProcessStats,       // activity aggregate stats of exited processes (capped)
+    kPMMemStrings,                  // interned names
+    kPMMemLogRecords,               // deferred ASL message pool
+    kPMMemSubsystemCount
+};
+
+/*
+ * powerd private 'whichData' for io_pm_assertion_copy_details().
+ * Returns an array with a dictionary of kPMMemory*Key for each subsystem,
+ * in kPMMem* order.
+ */
+#define kPMMemoryMIGCopyStats                   1004
+
+#define kPMMemoryNameKey                        "Name"
+#define kPMMemoryBytesKey                       "Bytes"
+#define kPMMemoryPeakKey                        "Peak"
+#define kPMMemoryCapKey                         "Cap"           // absent if the subsystem can't be capped
+#define kPMMemoryEvictionsKey                   "Evictions"
+
+/*
+ * kPMSetMemoryCap (root only) takes kPMMemoryCapValue(subsystem, kbytes).
+ * A cap of 0 lets the subsystem grow without bound.
+ */
+#define kPMMemoryCapValue(subsystem, kbytes)    (((subsystem) << 24) | ((kbytes) & 0xffffff))
+#define kPMMemoryCapMaxKB                       0xffffff
+
+__private_extern__ void                 PMMemoryCharge(int subsystem, ssize_t bytes);
+__private_extern__ bool                 PMMemoryWouldExceedCap(int subsystem, size_t bytes);
+__private_extern__ void                 PMMemoryNoteEviction(int subsystem);
+__private_extern__ IOReturn             PMMemorySetCap(int value);
+__private_extern__ CFArrayRef           copyMemoryAccounting(void);
+
 // Definitions of PFStatus keys for AppleSmartBattery failures
 enum {
     kSmartBattPFExternalInput =             (1<<0),
@@ -113,6 +281,48 @@ enum {
     kSmartBattPFFuseBlown =                 (1<<15)
 };
 
+/*
+ * AppleSmartBatteryManager user client battery snapshot.
+ * Must match SmartBatterySnapshot in AppleSmartBatteryManagerUserClient.h.
+ */
+#define kSBUCCopySnapshot           5
+
+// Registry keys AppleSmartBattery updates as each polling path finishes
+#define kBootPathKey                "BootPathUpdated"
+#define kFullPathKey                "FullPathUpdated"
+#define kUserVisPathKey             "UserVisiblePathUpdated"
+#define kSBSnapshotVersion          1
+
+enum {
+    kSBSnapshotExternalConnected        = (1 << 0),
+    kSBSnapshotExternalChargeCapable    = (1 << 1),
+    kSBSnapshotBatteryInstalled         = (1 << 2),
+    kSBSnapshotIsCharging               = (1 << 3),
+    kSBSnapshotFullyCharged             = (1 << 4),
+    kSBSnapshotHasInvalidWakeSecs       = (1 << 5)
+};
+
+typedef struct {
+    uint32_t        version;
+    uint32_t        flags;
+    uint32_t        propertiesGeneration;
+    uint32_t        pfStatus;
+    int32_t         voltage;
+    int32_t         currentCapacity;
+    int32_t         maxCapacity;
+    int32_t         designCapacity;
+    int32_t         timeRemaining;
+    int32_t         instantAmperage;
+    int32_t         amperage;
+    int32_t         maxErr;
+    int32_t         cycleCount;
+    int32_t         location;
+    int32_t         invalidWakeSecs;
+    uint32_t        bootPathUpdated;
+    uint32_t        fullPathUpdated;
+    uint32_t        userVisPathUpdated;
+} SmartBatterySnapshot;
+
 typedef enum {
    kBatteryPowered = 0,
    kACPowered
@@ -138,6 +348,7 @@ struct IOPMBattery {
     uint32_t                     isTimeRemainingUnknown:1;
     uint32_t                     isCritical:1;
     uint32_t                     isRestricted:1;
+    uint32_t                     hasSnapshot:1;
     uint32_t                pfStatus;
     int                     currentCap;
     int                     maxCap;
@@ -161,6 +372,10 @@ struct IOPMBattery {
     CFStringRef             chargeStatus;
     time_t                  lowCapRatioSinceTime;
     boolean_t               hasLowCapRatio;
+    uint32_t                propertiesGeneration;
+    uint32_t                bootPathUpdated;
+    uint32_t                fullPathUpdated;
+    uint32_t                userVisPathUpdated;
 };
 typedef struct IOPMBattery IOPMBattery;
 
@@ -198,6 +413,19 @@ __private_extern__ IOReturn ActivatePMSettings(
     CFDictionaryRef                 useSettings,
     bool                            removeUnsupportedSettings);
 
+/* Forgets which energy settings powerd last sent to the kernel, so that
+ * the next ActivatePMSettings() sends every key again.
+ */
+__private_extern__ void resetSentEnergySettings(void);
+
+/* IOPMSetAggressiveness(), skipped if powerd last sent the kernel the same
+ * value. Every powerd write of a cached type must go through here, or the
+ * cache no longer matches the kernel.
+ */
+__private_extern__ IOReturn setAggressivenessSetting(io_connect_t connection,
+                                                     unsigned long type,
+                                                     unsigned long value);
+
 
 
 #define kPowerManagementBundlePathCString       "/System/Library/CoreServices/powerd.bundle"
@@ -276,6 +504,7 @@ __private_extern__ IOReturn ActivatePMSettings(
 #define kPMASLWakeReqTypePrefix             "WakeType"
 #define kPMASLWakeReqClientInfoPrefix       "WakeClientInfo"
 #define kPMASLWakeReqChosenIdx              "WakeRequestChosen"
+#define kPMASLWakeReqCoalescedCount         "WakeRequestsCoalesced"
 
 
 /*
@@ -410,6 +639,12 @@ void mt2RecordWakeEvent(uint32_t description);
  */
 void mt2RecordThermalEvent(uint32_t description);
 
+/* mt2RecordDarkWakesCoalesced
+ * powerd should call at sleep time when it folds several wake requests into one RTC wake.
+ * @arg saved is the number of requests that would otherwise have needed a wake of their own.
+ */
+void mt2RecordDarkWakesCoalesced(uint32_t saved);
+
 /* mt2RecordAsserctionEvent
  * powerd should call to indicate that a process "whichApp" has "action'd" assertion "AssertionType".
  * @arg assertionType is one of PMAssertion.h: kPushServiceTaskIndex, kBackgroundTaskIndex
@@ -533,7 +768,25 @@ __private_extern__ void                 logASLLowBatteryWarning(IOPSLowBatteryWa
 #define kPMSettingsDictionaryDateKey            "Date"
 #define kPMSettingsDictionaryUUIDKey            "UUID"
 
-__private_extern__ aslmsg               new_msg_pmset_log(void);
+/*
+ * Deferred ASL messages. A pmlogmsg is filled in like an aslmsg, and sent
+ * by a background queue after pmlog_send() or pmlog_send_level() queues it,
+ * stamped with the time pmlog_new() was called. When the pool is exhausted
+ * the message is sent synchronously instead. pmlog_new() only returns NULL
+ * if that allocation fails; the other calls accept NULL, and the dropped
+ * message is counted in the log.
+ */
+typedef struct pmlog_record             *pmlogmsg;
+
+__private_extern__ pmlogmsg             pmlog_new(void);
+__private_extern__ void                 pmlog_set(pmlogmsg m, const char *key, const char *value);
+__private_extern__ void                 pmlog_send(pmlogmsg m);
+__private_extern__ void                 pmlog_send_level(pmlogmsg m, int level);
+__private_extern__ void                 pmlog_log(int level, const char *format, ...) __printflike(2, 3);
+__private_extern__ void                 pmlog_release(pmlogmsg m);
+
+// pmlog_new() with the level and facility of pmset -g log messages
+__private_extern__ pmlogmsg             new_msg_pmset_log(void);
 
 /* PM Kernel shares times with user space in a packed 64-bit integer.
  * Seconds since 1970 in the lower 32, microseconds in the upper 32.
@@ -576,7 +829,7 @@ __private_extern__ bool                 _getUUIDString(char *buf, int buflen);
 __private_extern__ CFStringRef          _updateSleepReason(void);
 __private_extern__ CFStringRef          _getSleepReason();
 __private_extern__ void                 _resetWakeReason( );
-__private_extern__ void                 _updateWakeReason(CFStringRef *wakeReason, CFStringRef *wakeType);
+__private_extern__ void                 _updateWakeReason(CFStringRef *wakeReason, CFStringRef *wakeType, bool fullWake);
 __private_extern__ void                 getPlatformWakeReason(CFStringRef *wakeReason, CFStringRef *wakeType);
 
 __private_extern__ io_registry_entry_t  getRootDomain(void);
@@ -614,5 +867,44 @@ __private_extern__ void                 _oneOffHacksSetup(void);
 __private_extern__ IOReturn getNvramArgInt(char *key, int *value);
 
 __private_extern__ uint64_t             getMonotonicTime( );
+
+/* Interned strings (PMStringID is defined in PMAssertions.h)
+ * PMStringIntern() returns the ID for a string, taking a reference on it.
+ * Each reference is dropped with PMStringRelease(). The CFString and C
+ * string returned for an ID stay valid while a reference is held.
+ */
+__private_extern__ PMStringID           PMStringIntern(CFStringRef str);
+__private_extern__ PMStringID           PMStringInternCString(const char *cstr);
+__private_extern__ void                 PMStringRetain(PMStringID sid);
+__private_extern__ void                 PMStringRelease(PMStringID sid);
+__private_extern__ CFStringRef          PMStringGet(PMStringID sid);
+__private_extern__ const char           *PMStringGetCString(PMStringID sid);
+
+/* Serialized replies handed to read-only MIG routines off the main queue.
+ * Only the main queue calls PMReplySnapshotSet(); PMReplySnapshotCopy()
+ * may be called from any queue and returns a retained, immutable CFData.
+ */
+__private_extern__ void                 PMReplySnapshotSet(CFDataRef *slot, CFDataRef data);
+__private_extern__ CFDataRef            PMReplySnapshotCopy(CFDataRef *slot);
+__private_extern__ void                 PMRunOnMainQueue(dispatch_block_t block);
+
+/* Maps the read-only shared memory object 'name', at least 'len' bytes,
+ * for powerd to publish state in. Returns NULL on failure. Writers bracket
+ * every update with PMSharedStateBeginWrite()/PMSharedStateEndWrite() on
+ * the page's 'seq' field, which readers retry on while it is odd.
+ */
+__private_extern__ void                 *PMSharedStateMap(const char *name, size_t len);
+
+static inline void PMSharedStateBeginWrite(volatile uint32_t *seq)
+{
+    *seq |= 1;
+    OSMemoryBarrier();
+}
+
+static inline void PMSharedStateEndWrite(volatile uint32_t *seq)
+{
+    OSMemoryBarrier();
+    (*seq)++;
+}
 #endif
 
@@ -45,6 +45,15 @@ static int minOfThree(int a, int b, int c);
 const bool  kNoNotify  = false;
 const bool  kYesNotify = true;
 static void shareTheSystemLoad(bool shouldNotify);
+static bool updateUserLevel(void);
+static bool updateBatteryLevel(void);
+static bool updatePowerLevel(void);
+static void postSystemLoadNotification(void);
+
+/* Don't post kIOSystemLoadAdvisoryNotifyName more than once in this many
+ * seconds. Changes within the window are folded into one trailing post.
+ */
+#define kSystemLoadNotifyMinInterval    2
 
 
 // Globals
@@ -66,6 +75,17 @@ static bool   displaySleepEnabled       = FALSE;
 
 static int    gNotifyToken              = 0;
 
+//  Each input updates only its own component level; shareTheSystemLoad()
+//  combines them and publishes only when one of them moves.
+static int    userLevel                 = kIOSystemLoadAdvisoryLevelGreat;
+static int    batteryLevel              = kIOSystemLoadAdvisoryLevelGreat;
+static int    powerLevel                = kIOSystemLoadAdvisoryLevelGreat;
+static uint64_t lastSystemLoad          = 0;
+
+static uint64_t lastNotifiedSystemLoad  = 0;
+static uint64_t lastNotifyPostTime      = 0;
+static bool   notifyPostPending         = false;
+
 
 /*! UserActiveStruct records the many data sources that affect
  *  our concept of user-is-active; and the user's activity level.
@@ -119,14 +139,89 @@ typedef struct {
 
 static UserActiveStruct userActive;
 
+// Shared page mirroring userActive; see PMUserActivitySharedState.
+static PMUserActivitySharedState    *gUserActivityShared = NULL;
+static bool                         gUserActivityPostPending = false;
+
 /************************* ****************************** ********************/
 
 static void updateUserActivityLevels(void);
+static void initUserActivitySharedState(void);
+static void publishUserActivityState(void);
 
 static void userActive_prime(void) {
     bzero(&userActive, sizeof(UserActiveStruct));
 
     userActive.postedLevels = 0xFFFF; // bogus value
+
+    initUserActivitySharedState();
+}
+
+static void initUserActivitySharedState(void)
+{
+    gUserActivityShared = PMSharedStateMap(kPMUserActivityShmName, sizeof(PMUserActivitySharedState));
+    if (!gUserActivityShared)
+        return;
+
+    // Subscribers will find lastEventID went backwards and resync.
+    PMSharedStateBeginWrite(&gUserActivityShared->seq);
+    gUserActivityShared->version = kPMUserActivityShmVersion;
+    gUserActivityShared->levels = 0;
+    gUserActivityShared->presentActive = 0;
+    gUserActivityShared->levelsChangedTime = 0;
+    gUserActivityShared->presentChangedTime = 0;
+    gUserActivityShared->lastEventID = 0;
+    bzero(gUserActivityShared->events, sizeof(gUserActivityShared->events));
+    PMSharedStateEndWrite(&gUserActivityShared->seq);
+}
+
+/* Copies the current levels and presentActive state into the shared page,
+ * appending an event if either changed, and schedules one notification for
+ * this run loop pass.
+ */
+static void publishUserActivityState(void)
+{
+    PMUserActivitySharedState   *st = gUserActivityShared;
+    PMUserActivityEvent         *ev;
+    CFAbsoluteTime              now;
+    uint64_t                    levels = userActive.postedLevels;
+    uint32_t                    presentActive = userActive.presentActive ? 1 : 0;
+
+    if (!st)
+        return;
+    if ((st->lastEventID != 0)
+        && (st->levels == levels) && (st->presentActive == presentActive))
+    {
+        return;
+    }
+
+    now = CFAbsoluteTimeGetCurrent();
+
+    PMSharedStateBeginWrite(&st->seq);
+    if ((st->lastEventID == 0) || (st->levels != levels)) {
+        st->levelsChangedTime = now;
+    }
+    if ((st->lastEventID == 0) || (st->presentActive != presentActive)) {
+        st->presentChangedTime = now;
+    }
+    st->levels = levels;
+    st->presentActive = presentActive;
+
+    ev = &st->events[(st->lastEventID + 1) % kPMUserActivityShmEventCount];
+    ev->eventID = st->lastEventID + 1;
+    ev->timestamp = now;
+    ev->levels = levels;
+    ev->presentActive = presentActive;
+    st->lastEventID = ev->eventID;
+    PMSharedStateEndWrite(&st->seq);
+
+    if (!gUserActivityPostPending) {
+        gUserActivityPostPending = true;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            gUserActivityPostPending = false;
+            notify_post(kPMUserActivityShmNotifyName);
+        });
+    }
 }
 
 bool userActiveRootDomain(void)
@@ -193,9 +288,10 @@ void updateUserActivityLevels(void)
                               &token);
     }
     if (userActive.postedLevels != levels) {
+        userActive.postedLevels = levels;
+        publishUserActivityState();
         notify_set_state(token, levels);
         notify_post("com.apple.system.powermanagement.useractivity2");
-        userActive.postedLevels = levels;
     }
 }
 
@@ -219,6 +315,12 @@ static void updateUserPresentActive( )
     }
 
     if (presentActive != userActive.presentActive) {
+       userActive.presentActive = presentActive;
+
+       // Updates levels and the shared page before kIOUserActivityNotifyName
+       // goes out, so that clients woken by it see the new state.
+       updateUserActivityLevels();
+
        if (presentActive) {
            /* new PresentActive == true */
            notify_set_state(userActive.token, (uint64_t)kIOUserIsActive);
@@ -229,10 +331,6 @@ static void updateUserPresentActive( )
        }
 
        notify_post(kIOUserActivityNotifyName);
-
-       userActive.presentActive = presentActive;
-
-       updateUserActivityLevels();
     }
 
 #endif
@@ -248,37 +346,53 @@ CFAbsoluteTime get_SleepFromUserWakeTime(void)
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static void shareTheSystemLoad(bool shouldNotify)
-{
-    static uint64_t         lastSystemLoad  = 0;
-    uint64_t                theseSystemLoad = 0;
-    int                     userLevel       = kIOSystemLoadAdvisoryLevelGreat;
-    int                     batteryLevel    = kIOSystemLoadAdvisoryLevelGreat;
-    int                     powerLevel      = kIOSystemLoadAdvisoryLevelGreat;
-    int                     combinedLevel   = kIOSystemLoadAdvisoryLevelGreat;
-
 /******************************************
  * Power Level Computation code begins here
- * Edit this block of code to change what
+ * Edit these functions to change what
  * defines a "good time" to do work, based on system load.
+ * Each returns true if its component level changed.
  */
 /******************************************/
 
+static bool updateBatteryLevel(void)
+{
+    int level;
+
     if (onACPower) {
-        batteryLevel = kIOSystemLoadAdvisoryLevelGreat;
+        level = kIOSystemLoadAdvisoryLevelGreat;
     } else if (!batteryBelowThreshold) {
-        batteryLevel = kIOSystemLoadAdvisoryLevelOK;
+        level = kIOSystemLoadAdvisoryLevelOK;
     } else {
-        batteryLevel = kIOSystemLoadAdvisoryLevelBad;
+        level = kIOSystemLoadAdvisoryLevelBad;
     }
-    
+
+    if (level == batteryLevel)
+        return false;
+    batteryLevel = level;
+    return true;
+}
+
+static bool updatePowerLevel(void)
+{
+    int level = kIOSystemLoadAdvisoryLevelGreat;
+
     if (plimitBelowThreshold) {
-        powerLevel = kIOSystemLoadAdvisoryLevelOK;
+        level = kIOSystemLoadAdvisoryLevelOK;
     }
     if (coresConstrained || forcedIdle || thermalWarningLevel) {
-        powerLevel = kIOSystemLoadAdvisoryLevelBad;
+        level = kIOSystemLoadAdvisoryLevelBad;
     }
 
+    if (level == powerLevel)
+        return false;
+    powerLevel = level;
+    return true;
+}
+
+static bool updateUserLevel(void)
+{
+    int level = kIOSystemLoadAdvisoryLevelGreat;
+
     // TODO: Use seconds since last UI activity as an indicator of
     // userLevel. Basing this data on display dimming is a crutch,
     // and may be invalid on systems with display dimming disabled.
@@ -289,27 +403,78 @@ static void shareTheSystemLoad(bool shouldNotify)
                // System allows DWBT & user has opted in
 
                if (isA_BTMtnceWake( ) )
-                  userLevel = kIOSystemLoadAdvisoryLevelGreat;
+                  level = kIOSystemLoadAdvisoryLevelGreat;
                else
-                  userLevel = kIOSystemLoadAdvisoryLevelOK;
+                  level = kIOSystemLoadAdvisoryLevelOK;
             }
             else
-               userLevel = kIOSystemLoadAdvisoryLevelGreat;
+               level = kIOSystemLoadAdvisoryLevelGreat;
 
         } else {
-            userLevel = kIOSystemLoadAdvisoryLevelOK;
+            level = kIOSystemLoadAdvisoryLevelOK;
         }
         // TODO: If user is performing a full screen activity, or
         // is actively producing UI events, time is BAD.
     }
 
-    // The combined level is the lowest/worst level of the contributing factors
-    combinedLevel = minOfThree(userLevel, batteryLevel, powerLevel);
+    if (level == userLevel)
+        return false;
+    userLevel = level;
+    return true;
+}
 
 /******************************************/
 /* Power Level Computation code ends here */
 /******************************************/
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* Posts kIOSystemLoadAdvisoryNotifyName, at most once every
+ * kSystemLoadNotifyMinInterval seconds. A post that would land inside
+ * the window is deferred to its end, and dropped if the level has come
+ * back to what was last posted by then.
+ */
+static void postSystemLoadNotification(void)
+{
+    uint64_t    now = getMonotonicTime();
+
+    if (notifyPostPending) {
+        return;
+    }
+
+    if (lastNotifyPostTime
+        && (now - lastNotifyPostTime < kSystemLoadNotifyMinInterval))
+    {
+        notifyPostPending = true;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW,
+                        (kSystemLoadNotifyMinInterval - (now - lastNotifyPostTime)) * NSEC_PER_SEC),
+                       dispatch_get_main_queue(), ^{
+            notifyPostPending = false;
+            postSystemLoadNotification();
+        });
+        return;
+    }
+
+    if (lastSystemLoad == lastNotifiedSystemLoad) {
+        return;
+    }
+
+    lastNotifiedSystemLoad = lastSystemLoad;
+    lastNotifyPostTime = now;
+    // IOPMCheckSystemLoadDetailed() readers fetch the store on this
+    PMStoreNotifyPost(kIOSystemLoadAdvisoryNotifyName);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void shareTheSystemLoad(bool shouldNotify)
+{
+    uint64_t                theseSystemLoad = 0;
+    int                     combinedLevel   = kIOSystemLoadAdvisoryLevelGreat;
+
+    // The combined level is the lowest/worst level of the contributing factors
+    combinedLevel = minOfThree(userLevel, batteryLevel, powerLevel);
+
     theseSystemLoad = combinedLevel
                 | (userLevel << 8)
                 | (batteryLevel << 16)
@@ -383,7 +548,9 @@ static void shareTheSystemLoad(bool shouldNotify)
 
         // post notification
         if (shouldNotify) {
-            notify_post(kIOSystemLoadAdvisoryNotifyName);
+            postSystemLoadNotification();
+        } else {
+            lastNotifiedSystemLoad = lastSystemLoad;
         }
     }
 }
@@ -478,6 +645,10 @@ __private_extern__ void SystemLoad_prime(void)
     
     SystemLoadCPUPowerHasChanged(NULL);
 
+    // The inputs above only publish when a level moves off its default;
+    // make sure the initial levels are published either way.
+    shareTheSystemLoad(kYesNotify);
+
     notify_port = IONotificationPortCreate(0);
     rlser = IONotificationPortGetRunLoopSource(notify_port);
     if(rlser) 
@@ -520,12 +691,25 @@ __private_extern__ void SystemLoadDisplayPowerStateHasChanged(bool _displayIsOff
 
     displayIsOff = _displayIsOff;
     
-    shareTheSystemLoad(kYesNotify);
+    if (updateUserLevel())
+        shareTheSystemLoad(kYesNotify);
     updateUserPresentActive();
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/* @function copySystemLoadDetailed
+ * @abstract Returns the details last published under systemLoadDetailedKey.
+ */
+__private_extern__ CFDictionaryRef copySystemLoadDetailed(void)
+{
+    if (!systemLoadDetailedKey)
+        return NULL;
+    return (CFDictionaryRef)PMStoreCopyValue(systemLoadDetailedKey);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 /* @function SystemLoadPrefsHaveChanged
  * @abstract We check whether DIsplay Sleep Timer == 0
  * Populates:
@@ -533,7 +717,6 @@ __private_extern__ void SystemLoadDisplayPowerStateHasChanged(bool _displayIsOff
  */
 __private_extern__ void SystemLoadPrefsHaveChanged(void)
 {
-    SCDynamicStoreRef   _store       = _getSharedPMDynamicStore();
     CFDictionaryRef     liveSettings = NULL;
     CFNumberRef         displaySleep = NULL;
     CFTypeRef           dwbt = NULL;
@@ -542,8 +725,8 @@ __private_extern__ void SystemLoadPrefsHaveChanged(void)
     static int          lastDWBT = -1;
     bool                notify = false;
 
-    liveSettings = SCDynamicStoreCopyValue(_store, 
-                        CFSTR(kIOPMDynamicStoreSettingsKey));
+    // PMSettings may have just staged this
+    liveSettings = PMStoreCopyValue(CFSTR(kIOPMDynamicStoreSettingsKey));
     if (liveSettings) 
     {
         displaySleep = CFDictionaryGetValue(liveSettings, 
@@ -574,7 +757,7 @@ __private_extern__ void SystemLoadPrefsHaveChanged(void)
         CFRelease(liveSettings);
     }
 
-    if (notify)
+    if (notify && updateUserLevel())
         shareTheSystemLoad(kYesNotify);
     return;
 }
@@ -623,7 +806,8 @@ __private_extern__ void SystemLoadBatteriesHaveChanged(IOPMBattery **batt_stats)
     }
 
 exit:    
-    shareTheSystemLoad(kYesNotify);
+    if (updateBatteryLevel())
+        shareTheSystemLoad(kYesNotify);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -718,9 +902,10 @@ __private_extern__ void SystemLoadCPUPowerHasChanged(CFDictionaryRef newCPU)
         forcedIdle = true;
     }
 
-    shareTheSystemLoad(kYesNotify);
-
 exit:
+    if (updatePowerLevel())
+        shareTheSystemLoad(kYesNotify);
+
     if (ourAllocatedCPU)
         CFRelease(ourAllocatedCPU);
     return;
@@ -750,14 +935,16 @@ __private_extern__ void SystemLoadUserStateHasChanged(void)
         CFRelease(loggedInUserName);
     }
 
-    shareTheSystemLoad(kYesNotify);
+    if (updateUserLevel())
+        shareTheSystemLoad(kYesNotify);
 
     updateUserPresentActive( );
 }
 
 __private_extern__ void SystemLoadSystemPowerStateHasChanged(void)
 {
-    shareTheSystemLoad(kYesNotify);
+    if (updateUserLevel())
+        shareTheSystemLoad(kYesNotify);
 }
 #endif /* !TARGET_OS_EMBEDDED */
 
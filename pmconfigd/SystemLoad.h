@@ -41,6 +41,9 @@ __private_extern__ void SystemLoadSystemPowerStateHasChanged(void);
 
 __private_extern__ void SystemLoadUserActiveAssertions(bool _userActiveAssertions);
 
+/* Returns the dictionary IOCopySystemLoadAdvisoryDetailed() reads. Caller releases. */
+__private_extern__ CFDictionaryRef copySystemLoadDetailed(void);
+
 
 /* These methods support userActivity tracking
  */
@@ -52,4 +55,45 @@ __private_extern__ void userActiveHandlePowerAssertionsChanged(void);
 
 __private_extern__ CFAbsoluteTime get_SleepFromUserWakeTime(void);
 
+/*
+ * User activity state published by powerd in a read-only POSIX shared
+ * memory object, so presence clients don't have to query powerd.
+ *
+ * 'seq' is odd while powerd is updating the page. Readers copy the page
+ * between two reads of 'seq' and retry if the values differ or are odd.
+ *
+ * Every change to 'levels' or 'presentActive' is also appended to
+ * 'events', at index (eventID % kPMUserActivityShmEventCount). A
+ * subscriber registers for kPMUserActivityShmNotifyName, remembers the
+ * last eventID it consumed, and on each notification takes the events
+ * after it up to 'lastEventID' as one batch. If it fell more than
+ * kPMUserActivityShmEventCount events behind, it should resync from the
+ * top-level fields instead. The notification is posted at most once per
+ * powerd run loop pass, however many events were appended.
+ */
+#define kPMUserActivityShmName                  "com.apple.powerd.useractivity"
+#define kPMUserActivityShmNotifyName            "com.apple.system.powermanagement.useractivity.shm"
+#define kPMUserActivityShmVersion               1
+#define kPMUserActivityShmEventCount            64
+
+typedef struct {
+    uint64_t            eventID;            // 1-based, increases by one per event
+    CFAbsoluteTime      timestamp;
+    uint64_t            levels;             // kIOPMUser* activity level bits
+    uint32_t            presentActive;
+    uint32_t            reserved;
+} PMUserActivityEvent;
+
+typedef struct {
+    uint32_t            version;            // kPMUserActivityShmVersion
+    volatile uint32_t   seq;                // Odd while an update is in progress
+    uint64_t            levels;             // As returned by IOPMGetUserActivityLevel()
+    uint32_t            presentActive;      // kIOUserIsActive state
+    uint32_t            reserved;
+    CFAbsoluteTime      levelsChangedTime;
+    CFAbsoluteTime      presentChangedTime;
+    uint64_t            lastEventID;        // Newest entry in events[], 0 if none
+    PMUserActivityEvent events[kPMUserActivityShmEventCount];
+} PMUserActivitySharedState;
+
 #endif
@@ -46,9 +46,19 @@
  *
  ******************************************************************************/
 
+/*
+ * Each remote tty gets a vnode dispatch source and an idle deadline
+ * (st_atime + idle sleep time). Deadlines are kept in a min-heap so that the
+ * timer only ever has to look at the tty that's about to go idle. Vnode
+ * events are advisory: a tty's atime doesn't always generate one, so a tty is
+ * stat()ed once more when its deadline comes up before it's declared idle.
+ */
+
 #include <notify.h>
 #include <utmpx.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <err.h>
 #include <asl.h>
 #include <sys/queue.h>
@@ -70,29 +80,49 @@ typedef char dev_path_t[DEVMAXPATHSIZE];
 
 SLIST_HEAD(ttyhead, ttyentry);
 struct ttyentry {
-    dev_path_t ttydev;
+    dev_path_t          ttydev;
     SLIST_ENTRY(ttyentry) next;
+    dispatch_source_t   vnode_source;
+    time_t              atime;          // last st_atime seen
+    time_t              last_stat;      // when we last stat()ed this tty
+    time_t              deadline;       // atime + idle sleep seconds
+    int                 heap_index;     // -1 when idle (not in the heap)
+    uint32_t            generation;     // utmpx pass that last saw this tty
 };
 
 static char                     s_activetty_names[DEVMAXPATHSIZE * 4];
 
-#define kMinIdleCheckTime 10
+#define kMinIdleCheckTime       10
+#define kTTYStatCoalesceSecs    1
 static CFStringRef kTTYAssertion = CFSTR("com.apple.powermanagement.ttyassertion");
 
 // Globals protected by s_tty_queue
 static struct ttyhead           s_activettys = SLIST_HEAD_INITIALIZER(s_activettys);
+static struct ttyentry          **s_idle_heap = NULL;
+static int                      s_idle_heap_count = 0;
+static int                      s_idle_heap_capacity = 0;
+static uint32_t                 s_utmpx_generation = 0;
+static time_t                   s_timer_deadline = 0;
 static time_t                   settingIdleSleepSeconds = 0;
 static bool                     settingTTYSPreventSleep = true;
 static IOPMAssertionID          s_assertion = 0;
+static bool                     s_assertion_held = false;
 static int                      s_utmpx_notify_token = -1;
 static dispatch_source_t        s_timer_source;
 static dispatch_queue_t         s_tty_queue;
 
 // Protos
 static void freettys(void);
+static struct ttyentry *findtty(const char *ttyname);
 static void addtty(char *ttyname);
+static void removetty(struct ttyentry *tty);
 static void read_logins(void);
-static boolean_t ttys_are_active(time_t *time_to_idle_out);
+static bool refresh_tty(struct ttyentry *tty, time_t now);
+static void heap_insert(struct ttyentry *tty);
+static void heap_remove(struct ttyentry *tty);
+static void heap_fix(struct ttyentry *tty);
+static void expire_idle_ttys(time_t now);
+static void update_assertion(void);
 static void create_assertion(void);
 static void release_assertion(void);
 static void rearm_timer(time_t time_to_idle);
@@ -102,7 +132,6 @@ static void cleanup_tty_tracking(void);
 /* __private_extern__ */
 void TTYKeepAwake_prime(void)
 {
-    dispatch_queue_t    q_default;
     uint32_t            status;
     int                 result = -1;
 
@@ -111,26 +140,23 @@ void TTYKeepAwake_prime(void)
         goto finish;
     }
 
-    q_default = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-    if (!q_default) {
-        goto finish;
-    }
-
     status = notify_register_dispatch(UTMPX_CHANGE_NOTIFICATION,
-        &s_utmpx_notify_token, q_default, ^(int t){ read_logins(); });
+        &s_utmpx_notify_token, s_tty_queue, ^(int t){ read_logins(); });
     if (status != NOTIFY_STATUS_OK) {
         result = -1;
         goto finish;
     }
 
     s_timer_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
-        q_default);
+        s_tty_queue);
     if (!s_timer_source) {
         result = -1;
         goto finish;
     }
     dispatch_source_set_event_handler(s_timer_source, ^{ 
-        TTYKeepAwakeConsiderAssertion();
+        s_timer_deadline = 0;
+        expire_idle_ttys(time(NULL));
+        update_assertion();
     });
     dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
     dispatch_resume(s_timer_source);
@@ -139,7 +165,7 @@ void TTYKeepAwake_prime(void)
     TTYKeepAwakePrefsHaveChanged();
 
     // load up current user list
-    read_logins();
+    dispatch_async(s_tty_queue, ^{ read_logins(); });
 
     result = 0;    // hooray
 finish:
@@ -185,11 +211,19 @@ void TTYKeepAwakePrefsHaveChanged( void )
     CFNumberGetValue(ttysPreventNum, kCFNumberIntType, &ttysPreventSleep);
 
     dispatch_async(s_tty_queue, ^{
+        struct ttyentry *tty;
+        time_t now = time(NULL);
+
         settingIdleSleepSeconds = systemIdleMinutes * SEC_PER_MIN;
         settingTTYSPreventSleep = ttysPreventSleep;
-    });
 
-    TTYKeepAwakeConsiderAssertion();
+        // Every deadline moves with the idle time; re-key all of them.
+        SLIST_FOREACH(tty, &s_activettys, next) {
+            refresh_tty(tty, now);
+        }
+        expire_idle_ttys(now);
+        update_assertion();
+    });
 
 finish:
     if (activePMSettings) CFRelease(activePMSettings);
@@ -200,32 +234,43 @@ finish:
 /* __private_extern__ */
 bool  TTYKeepAwakeConsiderAssertion( void )
 {
-    boolean_t active;
-    bool allow_sleep = true;
-    time_t time_to_idle = 0;
+    __block bool allow_sleep = true;
 
-    active = ttys_are_active(&time_to_idle);
+    if (!s_tty_queue)
+        return true;
 
-    if (active && settingTTYSPreventSleep) 
-    {
-        time_to_idle = MAX(time_to_idle, kMinIdleCheckTime);
-        create_assertion();
-        rearm_timer(time_to_idle);
-        allow_sleep = false;
-    } else {
-        release_assertion();
-        pause_timer();
-    }
+    dispatch_sync(s_tty_queue, ^{
+        struct ttyentry *tty;
+        time_t now = time(NULL);
+
+        /* Ttys already in the heap are known to be active until their
+         * deadline. Idle ones may have been woken by input that didn't
+         * produce a vnode event, so look at those again before answering.
+         */
+        SLIST_FOREACH(tty, &s_activettys, next) {
+            if (tty->heap_index < 0) {
+                refresh_tty(tty, now);
+            }
+        }
+        expire_idle_ttys(now);
+        update_assertion();
+
+        allow_sleep = !(s_idle_heap_count && settingTTYSPreventSleep);
+    });
 
     return allow_sleep;
 }
 
+/* Runs on s_tty_queue.
+ * utmpx changes are applied as a diff: ttys that are still logged in keep
+ * their vnode source and deadline; only new and departed ones are touched.
+ */
 static void read_logins(void)
 {
     struct utmpx *ent;
-    int cnt = 0;
-
-    freettys();
+    struct ttyentry *tty;
+    struct ttyentry *tmptty;
+    uint32_t generation = ++s_utmpx_generation;
 
     setutxent();
     while((ent = getutxent())) 
@@ -235,15 +280,25 @@ static void read_logins(void)
          * (We're not interested in tracking local Terminal windows, 
          * just remote sessions.)
          */
-        if (0 < strlen(ent->ut_host))
+        if ((ent->ut_type == USER_PROCESS) && (0 < strlen(ent->ut_host)))
         {
-            addtty(ent->ut_line);            
-            cnt++;
+            if ((tty = findtty(ent->ut_line))) {
+                tty->generation = generation;
+            } else {
+                addtty(ent->ut_line);
+            }
         }
     }
     endutxent();
 
-    TTYKeepAwakeConsiderAssertion();
+    SLIST_FOREACH_SAFE(tty, &s_activettys, next, tmptty) {
+        if (tty->generation != generation) {
+            removetty(tty);
+        }
+    }
+
+    expire_idle_ttys(time(NULL));
+    update_assertion();
 }
 
 static void freettys(void)
@@ -254,19 +309,38 @@ static void freettys(void)
             struct ttyentry *tmptty;
 
             SLIST_FOREACH_SAFE(tty, &s_activettys, next, tmptty) {
-                SLIST_REMOVE(&s_activettys, tty, ttyentry, next);
-                free(tty);
+                removetty(tty);
             }
+            if (s_idle_heap) {
+                free(s_idle_heap);
+                s_idle_heap = NULL;
+            }
+            s_idle_heap_count = s_idle_heap_capacity = 0;
         });
     }
 }
 
+static struct ttyentry *findtty(const char *ttyname)
+{
+    struct ttyentry *tty;
+
+    SLIST_FOREACH(tty, &s_activettys, next) {
+        // ttydev is "/dev/" + ttyname
+        if (!strncmp(tty->ttydev + 5, ttyname, sizeof(tty->ttydev) - 5)) {
+            return tty;
+        }
+    }
+    return NULL;
+}
+
+/* Runs on s_tty_queue */
 static void addtty(char *ttyname)
 {
     struct ttyentry *tty;
     size_t len;
+    int fd = -1;
 
-    tty = malloc(sizeof(*tty));
+    tty = calloc(1, sizeof(*tty));
     if (!tty) 
         goto finish;
 
@@ -278,141 +352,285 @@ static void addtty(char *ttyname)
     if (len > sizeof(tty->ttydev)) 
         goto finish;
 
-    dispatch_async(s_tty_queue, ^{
-        SLIST_INSERT_HEAD(&s_activettys, tty, next);
-    });
+    tty->heap_index = -1;
+    tty->generation = s_utmpx_generation;
+
+    fd = open(tty->ttydev, O_EVTONLY);
+    if (fd >= 0) {
+        tty->vnode_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE,
+                                fd, DISPATCH_VNODE_ATTRIB | DISPATCH_VNODE_WRITE,
+                                s_tty_queue);
+    }
+    if (tty->vnode_source) {
+        struct ttyentry *t = tty;
+
+        dispatch_source_set_event_handler(tty->vnode_source, ^{
+            time_t now = time(NULL);
+
+            // A busy session can generate a stream of these; the deadline
+            // only has one second granularity anyway.
+            if (now - t->last_stat < kTTYStatCoalesceSecs) {
+                return;
+            }
+            if (refresh_tty(t, now)) {
+                update_assertion();
+            }
+        });
+        dispatch_source_set_cancel_handler(tty->vnode_source, ^{
+            close(fd);
+        });
+        dispatch_resume(tty->vnode_source);
+        fd = -1;
+    }
+
+    SLIST_INSERT_HEAD(&s_activettys, tty, next);
+    refresh_tty(tty, time(NULL));
     tty = NULL;
 
 finish:
+    if (fd >= 0)
+        close(fd);
     if (tty) 
         free(tty);
     return;
 }
 
-static boolean_t ttys_are_active(time_t *time_to_idle_out)
-{	
-    time_t curtime;
-    __block time_t time_to_idle;
-    __block boolean_t active = FALSE;
-
-    if (!s_tty_queue)
-        return false;
-    
-    *time_to_idle_out = time_to_idle = 0;
+/* Runs on s_tty_queue */
+static void removetty(struct ttyentry *tty)
+{
+    heap_remove(tty);
+    SLIST_REMOVE(&s_activettys, tty, ttyentry, next);
+    if (tty->vnode_source) {
+        dispatch_source_cancel(tty->vnode_source);
+        dispatch_release(tty->vnode_source);
+    }
+    free(tty);
+}
 
-    bzero(s_activetty_names, sizeof(s_activetty_names));
+/* Runs on s_tty_queue.
+ * stat()s one tty and files it in, or out of, the deadline heap.
+ * Returns true if the tty's active/idle state changed.
+ */
+static bool refresh_tty(struct ttyentry *tty, time_t now)
+{
+    struct stat sb;
+    bool was_active = (tty->heap_index >= 0);
+    bool active;
 
-    curtime = time(NULL);
-    if (curtime == (time_t)-1) {
-        goto finish;
+    tty->last_stat = now;
+    if (0 == stat(tty->ttydev, &sb)) {
+        tty->atime = sb.st_atime;
     }
-    
-    dispatch_sync(s_tty_queue, ^{
-        struct ttyentry *tty;
-        struct stat sb;
-        time_t minimum_idle_secs;
-        bool isPrintedFirst = TRUE;
+    tty->deadline = tty->atime + settingIdleSleepSeconds;
 
-        minimum_idle_secs = settingIdleSleepSeconds;
+    // Add one second so we aren't racing to check at expiration
+    active = (tty->atime && (now - tty->atime + 1 <= settingIdleSleepSeconds));
 
-        SLIST_FOREACH(tty, &s_activettys, next) {
-            time_t current_idle_secs;
-            int result;
-            
-            result = stat(tty->ttydev, &sb);
-            if (result != 0) 
-                continue;
-
-            // Add one second so we aren't racing to check at expiration
-            current_idle_secs = curtime - sb.st_atime + 1;
-            if (current_idle_secs > settingIdleSleepSeconds) {
-                continue;
-            }
-            minimum_idle_secs = MIN(current_idle_secs, minimum_idle_secs);
-            active = TRUE;
-            
-            if (isPrintedFirst) {
-                isPrintedFirst = FALSE;
-            } else { // print a pretty comma between tty names
-                strlcat(s_activetty_names, ", ", sizeof(s_activetty_names));
-            }
-            
-            // Record the active ttys' device paths in the string s_activetty_names
-            strlcat(s_activetty_names, tty->ttydev, sizeof(s_activetty_names));
-        }
+    if (active && was_active) {
+        heap_fix(tty);
+    } else if (active) {
+        heap_insert(tty);
+    } else if (was_active) {
+        heap_remove(tty);
+    }
 
-        time_to_idle = (active) ? (settingIdleSleepSeconds - minimum_idle_secs) : 0;
-    });
+    return (active != was_active);
+}
 
-    *time_to_idle_out = time_to_idle;
-finish:
-    return active;
+static void heap_swap(int a, int b)
+{
+    struct ttyentry *tmp = s_idle_heap[a];
+
+    s_idle_heap[a] = s_idle_heap[b];
+    s_idle_heap[b] = tmp;
+    s_idle_heap[a]->heap_index = a;
+    s_idle_heap[b]->heap_index = b;
 }
 
-static void create_assertion()
+static void heap_sift_up(int i)
 {
-    dispatch_async(s_tty_queue, ^{
-        CFMutableDictionaryRef      assertionProperties = NULL;
-        CFStringRef                 activeTTYList = NULL;
-        int                         i = kIOPMAssertionLevelOn;
-        CFNumberRef                 n1 = NULL;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (s_idle_heap[parent]->deadline <= s_idle_heap[i]->deadline)
+            break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
 
+static void heap_sift_down(int i)
+{
+    while (1) {
+        int l = 2*i + 1;
+        int r = l + 1;
+        int smallest = i;
+
+        if (l < s_idle_heap_count && s_idle_heap[l]->deadline < s_idle_heap[smallest]->deadline)
+            smallest = l;
+        if (r < s_idle_heap_count && s_idle_heap[r]->deadline < s_idle_heap[smallest]->deadline)
+            smallest = r;
+        if (smallest == i)
+            break;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
 
-        assertionProperties = CFDictionaryCreateMutable(0, 6, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        if (!assertionProperties)
+static void heap_insert(struct ttyentry *tty)
+{
+    if (s_idle_heap_count == s_idle_heap_capacity) {
+        int newCapacity = s_idle_heap_capacity ? 2*s_idle_heap_capacity : 8;
+        struct ttyentry **newHeap = realloc(s_idle_heap, newCapacity * sizeof(*newHeap));
+        if (!newHeap)
             return;
-        
-        CFDictionarySetValue(assertionProperties, kIOPMAssertionTypeKey, kIOPMAssertNetworkClientActive);
-        CFDictionarySetValue(assertionProperties, kIOPMAssertionNameKey, kTTYAssertion);
-        CFDictionarySetValue(assertionProperties, kIOPMAssertionHumanReadableReasonKey, kAssertionHumanReadableReasonTTY);
-        CFDictionarySetValue(assertionProperties, kIOPMAssertionLocalizationBundlePathKey, kPowerManagementBundlePathString);
-
-        n1 = CFNumberCreate(0, kCFNumberIntType, &i);
-        if (n1) {
-            CFDictionarySetValue(assertionProperties, kIOPMAssertionLevelKey, n1);
-            CFRelease(n1);
+        s_idle_heap = newHeap;
+        s_idle_heap_capacity = newCapacity;
+    }
+
+    tty->heap_index = s_idle_heap_count;
+    s_idle_heap[s_idle_heap_count++] = tty;
+    heap_sift_up(tty->heap_index);
+}
+
+static void heap_remove(struct ttyentry *tty)
+{
+    int i = tty->heap_index;
+
+    if (i < 0)
+        return;
+
+    tty->heap_index = -1;
+    if (--s_idle_heap_count == i)
+        return;
+
+    s_idle_heap[i] = s_idle_heap[s_idle_heap_count];
+    s_idle_heap[i]->heap_index = i;
+    heap_fix(s_idle_heap[i]);
+}
+
+static void heap_fix(struct ttyentry *tty)
+{
+    heap_sift_up(tty->heap_index);
+    heap_sift_down(tty->heap_index);
+}
+
+/* Runs on s_tty_queue.
+ * Only ttys whose deadline has passed get stat()ed; anything that saw
+ * input in the meantime just moves back down the heap.
+ */
+static void expire_idle_ttys(time_t now)
+{
+    while (s_idle_heap_count && (s_idle_heap[0]->deadline <= now + 1)) {
+        if (!refresh_tty(s_idle_heap[0], now)) {
+            // Still active with a later deadline
+            if (s_idle_heap[0]->deadline <= now + 1)
+                break;
         }
-        
-        activeTTYList = CFStringCreateWithFormat(0, NULL, CFSTR("%s"), s_activetty_names);        
-        if (activeTTYList) {
-            CFDictionarySetValue(assertionProperties, kIOPMAssertionDetailsKey, activeTTYList);
-            CFRelease(activeTTYList);
-        }            
-            
-        InternalCreateAssertion(assertionProperties, &s_assertion);
-
-        CFRelease(assertionProperties);
-        
-    });
+    }
 }
 
-static void release_assertion(void)
+/* Runs on s_tty_queue.
+ * Raises or drops the assertion on empty <-> non-empty transitions of the
+ * heap, and points the timer at the earliest deadline.
+ */
+static void update_assertion(void)
 {
-    if (!s_tty_queue)
+    time_t  now;
+    time_t  time_to_idle;
+
+    if (!s_idle_heap_count || !settingTTYSPreventSleep) {
+        if (s_assertion_held) {
+            release_assertion();
+            s_assertion_held = false;
+        }
+        pause_timer();
         return;
+    }
 
-    dispatch_async(s_tty_queue, ^{
+    if (!s_assertion_held) {
+        create_assertion();
+        s_assertion_held = true;
+    }
 
-        InternalReleaseAssertion(&s_assertion);
-    });
+    now = time(NULL);
+    time_to_idle = s_idle_heap[0]->deadline - now;
+    time_to_idle = MAX(time_to_idle, kMinIdleCheckTime);
+    rearm_timer(time_to_idle);
+}
+
+/* Runs on s_tty_queue */
+static void create_assertion()
+{
+    CFMutableDictionaryRef      assertionProperties = NULL;
+    CFStringRef                 activeTTYList = NULL;
+    int                         i = kIOPMAssertionLevelOn;
+    int                         idx;
+    CFNumberRef                 n1 = NULL;
+
+    // Record the active ttys' device paths in the string s_activetty_names
+    bzero(s_activetty_names, sizeof(s_activetty_names));
+    for (idx = 0; idx < s_idle_heap_count; idx++) {
+        if (idx) { // print a pretty comma between tty names
+            strlcat(s_activetty_names, ", ", sizeof(s_activetty_names));
+        }
+        strlcat(s_activetty_names, s_idle_heap[idx]->ttydev, sizeof(s_activetty_names));
+    }
+
+    assertionProperties = CFDictionaryCreateMutable(0, 6, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!assertionProperties)
+        return;
+    
+    CFDictionarySetValue(assertionProperties, kIOPMAssertionTypeKey, kIOPMAssertNetworkClientActive);
+    CFDictionarySetValue(assertionProperties, kIOPMAssertionNameKey, kTTYAssertion);
+    CFDictionarySetValue(assertionProperties, kIOPMAssertionHumanReadableReasonKey, kAssertionHumanReadableReasonTTY);
+    CFDictionarySetValue(assertionProperties, kIOPMAssertionLocalizationBundlePathKey, kPowerManagementBundlePathString);
+
+    n1 = CFNumberCreate(0, kCFNumberIntType, &i);
+    if (n1) {
+        CFDictionarySetValue(assertionProperties, kIOPMAssertionLevelKey, n1);
+        CFRelease(n1);
+    }
+    
+    activeTTYList = CFStringCreateWithFormat(0, NULL, CFSTR("%s"), s_activetty_names);        
+    if (activeTTYList) {
+        CFDictionarySetValue(assertionProperties, kIOPMAssertionDetailsKey, activeTTYList);
+        CFRelease(activeTTYList);
+    }            
+        
+    InternalCreateAssertion(assertionProperties, &s_assertion);
+
+    CFRelease(assertionProperties);
 }
 
+/* Runs on s_tty_queue */
+static void release_assertion(void)
+{
+    InternalReleaseAssertion(&s_assertion);
+}
+
+/* Runs on s_tty_queue */
 static void rearm_timer(time_t time_to_idle)
 {
-    dispatch_async(s_tty_queue, ^{
-        dispatch_source_set_timer(s_timer_source,
-            dispatch_time(DISPATCH_TIME_NOW, time_to_idle * NSEC_PER_SEC),
-            DISPATCH_TIME_FOREVER, 1 * NSEC_PER_SEC);
-    });
+    time_t deadline = time(NULL) + time_to_idle;
+
+    // Leave the timer alone if it's already due at the same second
+    if (deadline == s_timer_deadline)
+        return;
+
+    s_timer_deadline = deadline;
+    dispatch_source_set_timer(s_timer_source,
+        dispatch_time(DISPATCH_TIME_NOW, time_to_idle * NSEC_PER_SEC),
+        DISPATCH_TIME_FOREVER, 1 * NSEC_PER_SEC);
 }
 
+/* Runs on s_tty_queue */
 static void pause_timer(void)
 {
-    if (s_tty_queue) {
-        dispatch_async(s_tty_queue, ^{
-            dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
-        });
-    }
+    if (!s_timer_deadline)
+        return;
+
+    s_timer_deadline = 0;
+    dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
 }
 
 static void cleanup_tty_tracking(void)
@@ -427,6 +645,7 @@ static void cleanup_tty_tracking(void)
             }
 
             if (s_timer_source) {
+                dispatch_source_cancel(s_timer_source);
                 dispatch_release(s_timer_source);
                 s_timer_source = NULL;
             }
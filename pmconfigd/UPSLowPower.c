@@ -49,12 +49,25 @@ typedef struct  {
     int     haltpercent[2];
 } threshold_struct;
 
+// Combined runtime of every UPS that is on battery power
+typedef struct {
+    int     currentCapacity;
+    int     maxCapacity;
+    int     minutesSum;
+    int     minutesCount;
+} ups_runtime_struct;
+
+#define     kMaxTrackedUPS              8
+#define     kUPSTransientGuardSeconds   10.0
+#define     kUPSPolicyTimerParked       1.0e9
+
 // Externally defined UPS SPI
 #ifndef _IOKIT_PM_IOUPSPRIVATE_H_
 Boolean IOUPSMIGServerIsRunning(mach_port_t * bootstrap_port_ref, mach_port_t * upsd_port_ref);
 IOReturn IOUPSSendCommand(mach_port_t connect, int upsID, CFDictionaryRef command);
 IOReturn IOUPSGetEvent(mach_port_t connect, int upsID, CFDictionaryRef *event);
 IOReturn IOUPSGetCapabilities(mach_port_t connect, int upsID, CFSetRef *capabilities);
+IOReturn IOUPSGetCapabilitiesSince(mach_port_t connect, int upsID, uint64_t *generation, CFSetRef *capabilities);
 #endif
 
 // Globals
@@ -62,6 +75,14 @@ static const int                _delayedRemovePowerMinutes = 3;
 static const int                _delayBeforeStartupMinutes = 4;
 static CFAbsoluteTime           _switchedToUPSPowerTime = 0.0;
 static threshold_struct        *_thresh;
+static CFRunLoopTimerRef        _policyTimer = NULL;
+#ifndef STANDALONE
+static mach_port_t              _upsConnect = MACH_PORT_NULL;
+static struct {
+    uint64_t                    generation;
+    CFSetRef                    capabilities;
+} _upsCaps[kMaxTrackedUPS];
+#endif
 #if HAVE_CF_USER_NOTIFICATION
 static CFUserNotificationRef    _UPSAlert = NULL;
 #endif
@@ -71,13 +92,13 @@ static  int         _upsSupports(CFNumberRef whichUPS, CFStringRef  command);
 static  int         _upsCommand(CFNumberRef whichUPS, CFStringRef command, int arg);
 static  int         _threshEnabled(CFDictionaryRef dynamo);
 static  int         _threshValue(CFDictionaryRef dynamo);
-static  int         _minutesSpentOnUPSPower(void);
-static  int         _secondsSpentOnUPSPower(void);
 static  bool        _weManageUPSPower(void);
 static  void        _getUPSShutdownThresholdsFromDisk(threshold_struct *thresho);
+static  void        _addUPSRuntime(ups_runtime_struct *combined, CFDictionaryRef ups_info);
+static  CFAbsoluteTime _shutdownDeadline(ups_runtime_struct *combined, CFAbsoluteTime now);
 static  void        _itIsLaterNow(CFRunLoopTimerRef tmr, void *info);
-static  void        _reEvaluatePowerSourcesLater(int seconds);
-static  void        _doPowerEmergencyShutdown(CFNumberRef ups_id);
+static  void        _armPolicyTimer(CFAbsoluteTime when);
+static  void        _doPowerEmergencyShutdown(CFNumberRef *ups_ids, int ups_count);
 
 enum {
     _kIOUPSInternalPowerBit,
@@ -108,6 +129,9 @@ UPSLowPowerPrefsHaveChanged(void)
     if(_thresh)
     {
         _getUPSShutdownThresholdsFromDisk(_thresh);
+
+        // Thresholds moved; so did the shutdown deadline
+        UPSLowPowerPSChange();
     }
 }
 
@@ -117,144 +141,65 @@ UPSLowPowerPrefsHaveChanged(void)
  * Is the handler that gets notified when power source (battery or UPS)
  * state changes. We might respond to this by posting a user notification
  * or performing emergency shutdown.
+ *
+ * Every UPS ioupsd publishes is considered. Redundant UPS pairs feed the
+ * system through separate supplies, so the system is only running on UPS
+ * power once every present UPS has lost external power; until then any
+ * one UPS on AC keeps us up. While on UPS power we compute the time at
+ * which the earliest enabled shutdown threshold will be crossed and arm
+ * a single timer for it. Each power source change recomputes it.
  */
 __private_extern__ void
 UPSLowPowerPSChange(void)
 {
-    CFDictionaryRef     ups_info = 0;
-    int                 t1, t2;
-    CFNumberRef         n1, n2;
-    int                 minutes_remaining;
-    int                 percent_remaining;
-    CFBooleanRef        isPresent;
+    CFDictionaryRef     ups_list[kMaxTrackedUPS];
+    CFNumberRef         ups_ids[kMaxTrackedUPS];
+    int                 ups_count;
+    int                 present_count = 0;
+    int                 battery_count = 0;
+    int                 i;
+    ups_runtime_struct  combined;
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime      deadline = 0.0;
     static int          last_ups_power_source = _kIOUPSExternalPowerBit;
-    CFStringRef         power_source = 0;
-    CFNumberRef         ups_id = 0;
-    
+    int                 ups_power_source = _kIOUPSExternalPowerBit;
+
     // Exit immediately if another application
     //   is managing emergency UPS shutdown
     if(!_weManageUPSPower()) {
         goto _exit_PowerSourcesHaveChanged_;
     }
-    
-    // *** Inspect UPS power levels
-    // We assume we're only dealing with 1 UPS for simplicity.
-    // The "more than one UPS attached " case is undefined.
-    if((ups_info = getActiveUPSDictionary()))
+
+    bzero(&combined, sizeof(combined));
+
+    ups_count = getUPSDictionaries(ups_list, kMaxTrackedUPS);
+    for (i=0; i<ups_count; i++)
     {
-        ups_id = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceIDKey)));
-        if(!ups_id) goto _exit_PowerSourcesHaveChanged_;
-        
-        // Check UPS "Is Present" key
-        isPresent = isA_CFBoolean(CFDictionaryGetValue(ups_info, CFSTR(kIOPSIsPresentKey)));
-        if(!isPresent || !CFBooleanGetValue(isPresent))
-        {
-#if HAVE_CF_USER_NOTIFICATION
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif
-            // If UPS isn't active or connected we shouldn't base policy decisions on it
-            goto _exit_PowerSourcesHaveChanged_;
-        }
-        
-        // Check Power Source
-        power_source = isA_CFString(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceStateKey)));
-        if(!power_source || !CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue)))
-        {
-#if HAVE_CF_USER_NOTIFICATION
-            // Running off of AC Power
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif                
-            // we have to be draining the internal battery to do a shutdown, so we'll just exit from here.
-            goto _exit_PowerSourcesHaveChanged_;
-        }
-        
-        // UPS is running off of internal battery power. Show warning if we just switched from AC to battery.
-        if(_kIOUPSExternalPowerBit == last_ups_power_source)
-        {
-            _switchedToUPSPowerTime = CFAbsoluteTimeGetCurrent();
-            
-            if( _thresh->haltafter[kHaltEnabled] ) {    
-                // If there's a "shutdown after X minutes on UPS power" threshold, 
-                // set a timer to remind us to check UPS state again after X minutes
-                _reEvaluatePowerSourcesLater(5 + (60*_thresh->haltafter[kHaltValue]));
-            }
-            
-#if HAVE_CF_USER_NOTIFICATION
-            if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
-#endif 
+        CFNumberRef     ups_id;
+        CFBooleanRef    isPresent;
+        CFStringRef     power_source;
 
-        }
-        
-        if(_batteryCount() > 0)
-        {
-            // Do not do UPS shutdown if internal battery is present.
-            // Internal battery may still be providing power. 
-            // Don't do any further UPS shutdown processing.
-            // PMU will cause an emergency sleep when the battery runs out - we fall back on that
-            // in the battery case.
-            goto _exit_PowerSourcesHaveChanged_;                
-        }
-        
-        // ******
-        // ****** Perform emergency shutdown if any of the shutdown thresholds is true
-        
-        // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
-        // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
-        // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
-        if(_secondsSpentOnUPSPower() < 10) {
-            _reEvaluatePowerSourcesLater(10);
-            goto _exit_PowerSourcesHaveChanged_;
-         }
-        
-        // Calculate battery percentage remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSCurrentCapacityKey)));
-        n2 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSMaxCapacityKey)));
-        if(n1 && n2)
-        {
-            if( CFNumberGetValue(n1, kCFNumberIntType, &t1) &&
-                CFNumberGetValue(n2, kCFNumberIntType, &t2)) {
-                percent_remaining = (int)(100.0* ((double)t1) / ((double)t2) );
-    
-                if( _thresh->haltpercent[kHaltEnabled] ) {
-                    if( percent_remaining <= _thresh->haltpercent[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
-            }
-        }
-        
-        // Get UPS's estimated time remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSTimeToEmptyKey)));
-        if(n1)
-        {
-            if(CFNumberGetValue(n1, kCFNumberIntType, &minutes_remaining))
-            {
-                if( _thresh->haltremain[kHaltEnabled] ) {
-                    if( minutes_remaining <= _thresh->haltremain[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
-            }
-        }
+        ups_id = isA_CFNumber(CFDictionaryGetValue(ups_list[i], CFSTR(kIOPSPowerSourceIDKey)));
+        if(!ups_id) continue;
 
-        // Determine how long we've been running on UPS power
-        if( _thresh->haltafter[kHaltEnabled] ) {
-            if(_minutesSpentOnUPSPower() >= _thresh->haltafter[kHaltValue]) {
-                _doPowerEmergencyShutdown(ups_id);
-            }
-        }
-        
-    } else {
-        // No "active UPS" detected. 
-        // One could have just disappeared - if we're showing an alert, clear it.
+        // If UPS isn't active or connected we shouldn't base policy decisions on it
+        isPresent = isA_CFBoolean(CFDictionaryGetValue(ups_list[i], CFSTR(kIOPSIsPresentKey)));
+        if(!isPresent || !CFBooleanGetValue(isPresent)) continue;
+
+        present_count++;
+
+        power_source = isA_CFString(CFDictionaryGetValue(ups_list[i], CFSTR(kIOPSPowerSourceStateKey)));
+        if(!power_source || !CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue))) continue;
+
+        ups_ids[battery_count++] = ups_id;
+        _addUPSRuntime(&combined, ups_list[i]);
+    }
+
+    if((0 == present_count) || (battery_count < present_count))
+    {
+        // No UPS attached, or at least one of them is still running off
+        // of AC power. One could have just disappeared or recovered -
+        // if we're showing an alert, clear it.
 #if HAVE_CF_USER_NOTIFICATION
         if(_UPSAlert)
         {
@@ -262,20 +207,149 @@ UPSLowPowerPSChange(void)
             _UPSAlert = 0;
         }
 #endif
+        // we have to be draining the UPS batteries to do a shutdown, so we'll just exit from here.
+        goto _exit_PowerSourcesHaveChanged_;
     }
-    
+
+    ups_power_source = _kIOUPSInternalPowerBit;
+
+    // Every UPS is running off of internal battery power. Show warning if we just switched from AC to battery.
+    if(_kIOUPSExternalPowerBit == last_ups_power_source)
+    {
+        _switchedToUPSPowerTime = now;
+
+#if HAVE_CF_USER_NOTIFICATION
+        if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
+#endif
+    }
+
+    if(_batteryCount() > 0)
+    {
+        // Do not do UPS shutdown if internal battery is present.
+        // Internal battery may still be providing power.
+        // Don't do any further UPS shutdown processing.
+        // PMU will cause an emergency sleep when the battery runs out - we fall back on that
+        // in the battery case.
+        goto _exit_PowerSourcesHaveChanged_;
+    }
+
+    // ******
+    // ****** Perform emergency shutdown once the earliest shutdown threshold is reached
+
+    // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
+    // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
+    // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
+    if(now < _switchedToUPSPowerTime + kUPSTransientGuardSeconds) {
+        deadline = _switchedToUPSPowerTime + kUPSTransientGuardSeconds;
+        goto _exit_PowerSourcesHaveChanged_;
+    }
+
+    deadline = _shutdownDeadline(&combined, now);
+    if((0.0 != deadline) && (deadline <= now))
+    {
+        deadline = 0.0;
+        _doPowerEmergencyShutdown(ups_ids, battery_count);
+    }
+
     // exit point
     _exit_PowerSourcesHaveChanged_:
-    
-    if(power_source && CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue))) {
-        last_ups_power_source = _kIOUPSInternalPowerBit;
-    } else {
-        last_ups_power_source = _kIOUPSExternalPowerBit;
-    }
-    
+
+    last_ups_power_source = ups_power_source;
+
+    // Re-arms or parks the one policy timer
+    _armPolicyTimer(deadline);
+
     return;
 }
- 
+
+/* _addUPSRuntime
+ *
+ * Folds one on-battery UPS into the combined runtime. Capacities add up.
+ * The supplies share the system's load, so the combined time-to-empty is
+ * the average of what each UPS reports at its share of the load. A UPS
+ * that is still calculating its estimate doesn't contribute one.
+ */
+static void
+_addUPSRuntime(ups_runtime_struct *combined, CFDictionaryRef ups_info)
+{
+    CFNumberRef     n1, n2;
+    int             t1, t2;
+
+    n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSCurrentCapacityKey)));
+    n2 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSMaxCapacityKey)));
+    if( n1 && n2 &&
+        CFNumberGetValue(n1, kCFNumberIntType, &t1) &&
+        CFNumberGetValue(n2, kCFNumberIntType, &t2) &&
+        (t2 > 0))
+    {
+        combined->currentCapacity += t1;
+        combined->maxCapacity += t2;
+    }
+
+    n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSTimeToEmptyKey)));
+    if( n1 &&
+        CFNumberGetValue(n1, kCFNumberIntType, &t1) &&
+        (t1 >= 0))
+    {
+        combined->minutesSum += t1;
+        combined->minutesCount++;
+    }
+}
+
+/* _shutdownDeadline
+ *
+ * Returns the absolute time at which the earliest enabled shutdown
+ * threshold is crossed, or 0.0 if no threshold can be evaluated.
+ *
+ * "Minutes on UPS power" is exact. "Minutes remaining" and "percent
+ * remaining" are projected from the current combined estimate, assuming
+ * a steady drain; they move with every power source update, and the
+ * timer is re-armed each time.
+ */
+static CFAbsoluteTime
+_shutdownDeadline(ups_runtime_struct *combined, CFAbsoluteTime now)
+{
+    CFAbsoluteTime  deadline = 0.0;
+    CFAbsoluteTime  when;
+    double          minutes_remaining = -1.0;
+    double          percent_remaining;
+
+    if(combined->minutesCount > 0) {
+        minutes_remaining = (double)combined->minutesSum / (double)combined->minutesCount;
+    }
+
+    // Determine when we'll have been running on UPS power long enough
+    if( _thresh->haltafter[kHaltEnabled] ) {
+        when = _switchedToUPSPowerTime + 60.0*_thresh->haltafter[kHaltValue];
+        if((0.0 == deadline) || (when < deadline)) deadline = when;
+    }
+
+    // Get UPS's estimated time remaining
+    if( _thresh->haltremain[kHaltEnabled] && (minutes_remaining >= 0.0) ) {
+        if( minutes_remaining <= _thresh->haltremain[kHaltValue] ) {
+            when = now;
+        } else {
+            when = now + 60.0*(minutes_remaining - _thresh->haltremain[kHaltValue]);
+        }
+        if((0.0 == deadline) || (when < deadline)) deadline = when;
+    }
+
+    // Calculate battery percentage remaining
+    if( _thresh->haltpercent[kHaltEnabled] && (combined->maxCapacity > 0) ) {
+        percent_remaining = 100.0 * (double)combined->currentCapacity / (double)combined->maxCapacity;
+        when = 0.0;
+        if( percent_remaining <= _thresh->haltpercent[kHaltValue] ) {
+            when = now;
+        } else if(minutes_remaining >= 0.0) {
+            when = now + 60.0*minutes_remaining
+                    * (percent_remaining - _thresh->haltpercent[kHaltValue]) / percent_remaining;
+        }
+        if((0.0 != when) && ((0.0 == deadline) || (when < deadline))) deadline = when;
+    }
+
+    return deadline;
+}
+
 /* _doPowerEmergencyShutdown()
  *
  Performs a semi-complicated proecdure to get machines experiencing power failure
@@ -301,7 +375,7 @@ UPSLowPowerPSChange(void)
  *
  */
 static void 
-_doPowerEmergencyShutdown(CFNumberRef ups_id)
+_doPowerEmergencyShutdown(CFNumberRef *ups_ids, int ups_count)
 {
     static int      _alreadyShuttingDown = 0;
     CFDictionaryRef _ESSettings = NULL;
@@ -310,6 +384,7 @@ _doPowerEmergencyShutdown(CFNumberRef ups_id)
     IOReturn        error;
     bool            upsRestart = false;
     int             restart_setting;
+    int             i;
     
     if(_alreadyShuttingDown) 
         return;
@@ -337,12 +412,16 @@ _doPowerEmergencyShutdown(CFNumberRef ups_id)
         goto shutdown;
     }
 
-    // Does the attached UPS support RemovePowerDelayed?
-    if(_upsSupports(ups_id, CFSTR(kIOPSCommandDelayedRemovePowerKey)))
+    // The system stays powered until every UPS feeding it removes power,
+    // so each UPS that supports RemovePowerDelayed gets the request.
+    for (i=0; i<ups_count; i++)
     {
+        if(!_upsSupports(ups_ids[i], CFSTR(kIOPSCommandDelayedRemovePowerKey)))
+            continue;
+
         syslog(LOG_INFO, "System will restart when external power is restored to UPS.");
 
-        error = _upsCommand(ups_id, 
+        error = _upsCommand(ups_ids[i], 
                     CFSTR(kIOPSCommandStartupDelayKey), 
                     _delayBeforeStartupMinutes);
 
@@ -351,17 +430,17 @@ _doPowerEmergencyShutdown(CFNumberRef ups_id)
             // Attempt to set "startup when power restored" delay failed
             syslog(LOG_INFO, "UPS Emergency shutdown: error 0x%08x requesting UPS startup delay of %d minutes\n", 
                                 error, _delayBeforeStartupMinutes);
-            goto shutdown;
+            continue;
         }
 
-        error = _upsCommand(ups_id, CFSTR(kIOPSCommandDelayedRemovePowerKey), _delayedRemovePowerMinutes);
+        error = _upsCommand(ups_ids[i], CFSTR(kIOPSCommandDelayedRemovePowerKey), _delayedRemovePowerMinutes);
         if(kIOReturnSuccess != error)
         {
             // We tried telling the UPS to auto-restart us, but since that's 
             // failing we're just going to do an old school shutdown that 
             // requires human intervention to power on.
             syslog(LOG_INFO, "UPS Emergency shutdown: error 0x%08x communicating shutdown time to UPS\n", error);
-            goto shutdown;
+            continue;
         }
     }
     
@@ -384,20 +463,66 @@ shutdown:
 }
 
 
+#ifndef STANDALONE
+/* _upsConnection
+ *
+ * Returns the ioupsd server port, looking it up only when we don't
+ * already hold one.
+ */
+static mach_port_t
+_upsConnection(void)
+{
+    mach_port_t                 bootstrap_port = MACH_PORT_NULL;
+    int                         i;
+
+    if (MACH_PORT_NULL != _upsConnect)
+        return _upsConnect;
+
+    if (!IOUPSMIGServerIsRunning(&bootstrap_port, &_upsConnect))
+    {
+        _upsConnect = MACH_PORT_NULL;
+        return _upsConnect;
+    }
+
+    // A new ioupsd may have a different UPS in each slot; forget
+    // everything learned from the previous one.
+    for (i = 0; i < kMaxTrackedUPS; i++) {
+        if (_upsCaps[i].capabilities) CFRelease(_upsCaps[i].capabilities);
+        _upsCaps[i].capabilities = NULL;
+        _upsCaps[i].generation = 0;
+    }
+    return _upsConnect;
+}
+
+/* _upsConnectionFailed
+ *
+ * ioupsd exits when its last UPS goes away; drop our port so the next
+ * request looks it up again.
+ */
+static void
+_upsConnectionFailed(IOReturn ret)
+{
+    if ((MACH_SEND_INVALID_DEST == ret) && (MACH_PORT_NULL != _upsConnect)) {
+        mach_port_deallocate(mach_task_self(), _upsConnect);
+        _upsConnect = MACH_PORT_NULL;
+    }
+}
+#endif
+
 static int
 _upsSupports(CFNumberRef whichUPS, CFStringRef  command)
 {
 #ifdef STANDALONE
     return true;
 #else
-    mach_port_t                 bootstrap_port = MACH_PORT_NULL;
-    mach_port_t                 connect = MACH_PORT_NULL;
+    mach_port_t                 connect;
     int                         prop_supported;
-    CFSetRef                    cap_set;
+    CFSetRef                    cap_set = NULL;
+    uint64_t                    generation = 0;
     int                         _id;
     IOReturn                    ret;
 
-    if (!IOUPSMIGServerIsRunning(&bootstrap_port, &connect))
+    if (MACH_PORT_NULL == (connect = _upsConnection()))
     {
         return 0;
     }
@@ -405,8 +530,29 @@ _upsSupports(CFNumberRef whichUPS, CFStringRef  command)
     if(whichUPS) CFNumberGetValue(whichUPS, kCFNumberIntType, &_id);
     else _id = 0;
 
-    ret = IOUPSGetCapabilities(connect, _id, &cap_set);
-    if(kIOReturnSuccess != ret) return false;
+    // Ask for capabilities only if they changed since we last looked
+    if((_id >= 0) && (_id < kMaxTrackedUPS)) {
+        generation = _upsCaps[_id].generation;
+    }
+
+    ret = IOUPSGetCapabilitiesSince(connect, _id, &generation, &cap_set);
+    if(kIOReturnSuccess != ret) {
+        _upsConnectionFailed(ret);
+        return false;
+    }
+
+    if((_id >= 0) && (_id < kMaxTrackedUPS)) {
+        if(cap_set) {
+            if(_upsCaps[_id].capabilities) CFRelease(_upsCaps[_id].capabilities);
+            _upsCaps[_id].capabilities = cap_set;
+        }
+        _upsCaps[_id].generation = generation;
+        cap_set = _upsCaps[_id].capabilities;
+        if(!cap_set) return false;
+        return (int)CFSetContainsValue(cap_set, command);
+    }
+
+    if(!cap_set) return false;
     prop_supported = (int)CFSetContainsValue(cap_set, command);
     CFRelease(cap_set);
     return prop_supported;
@@ -421,12 +567,11 @@ _upsCommand(CFNumberRef whichUPS, CFStringRef command, int arg)
 #else
     CFMutableDictionaryRef      command_dict;
     IOReturn                    ret = kIOReturnNoMemory;
-    mach_port_t                 bootstrap_port = MACH_PORT_NULL;
-    mach_port_t                 connect = MACH_PORT_NULL;
+    mach_port_t                 connect;
     CFNumberRef                 minutes = NULL;
     int                         _id;
 
-    if (!IOUPSMIGServerIsRunning(&bootstrap_port, &connect))
+    if (MACH_PORT_NULL == (connect = _upsConnection()))
     {
         return kIOReturnNoDevice;
     }
@@ -448,6 +593,7 @@ _upsCommand(CFNumberRef whichUPS, CFStringRef command, int arg)
     CFDictionarySetValue(command_dict, command, minutes);
     
     ret = IOUPSSendCommand(connect, _id, command_dict);
+    _upsConnectionFailed(ret);
 
 exit:
     if (minutes)
@@ -560,43 +706,38 @@ _itIsLaterNow(CFRunLoopTimerRef tmr, void *info)
 }
 
 
+/* _armPolicyTimer
+ *
+ * Points the one policy timer at 'when', or parks it if 'when' is 0.0.
+ * The timer repeats at a huge interval so it stays valid after firing
+ * and can be re-armed without being recreated.
+ */
 static void
-_reEvaluatePowerSourcesLater(int seconds)
+_armPolicyTimer(CFAbsoluteTime when)
 {
-    CFRunLoopTimerRef       later_tmr;
-    CFAbsoluteTime          when;
-    
-    when = CFAbsoluteTimeGetCurrent() + (CFTimeInterval)seconds;
-    
-    later_tmr = CFRunLoopTimerCreate(kCFAllocatorDefault,
-        when,   // fire date
-        0.0,    // interval
-        0,      // options
-        0,      // order
-        &_itIsLaterNow,     // callout
-        0);     // callout
-    
-    if(later_tmr) {
-        CFRunLoopAddTimer(CFRunLoopGetCurrent(), later_tmr, kCFRunLoopDefaultMode);
-        CFRelease(later_tmr);
+    if(0.0 == when) {
+        if(_policyTimer) {
+            CFRunLoopTimerSetNextFireDate(_policyTimer,
+                        CFAbsoluteTimeGetCurrent() + kUPSPolicyTimerParked);
+        }
+        return;
     }
-    return;
-}
-
-
-static int
-_minutesSpentOnUPSPower(void)
-{
-    CFAbsoluteTime         now = CFAbsoluteTimeGetCurrent();
-    return (int)((now - _switchedToUPSPowerTime)/60);
-}
 
+    if(!_policyTimer) {
+        _policyTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+            when,                       // fire date
+            kUPSPolicyTimerParked,      // interval
+            0,                          // options
+            0,                          // order
+            &_itIsLaterNow,             // callout
+            0);                         // context
+        if(!_policyTimer) return;
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), _policyTimer, kCFRunLoopDefaultMode);
+        return;
+    }
 
-static int
-_secondsSpentOnUPSPower(void)
-{
-    CFAbsoluteTime         now = CFAbsoluteTimeGetCurrent();
-    return (int)((now - _switchedToUPSPowerTime));
+    CFRunLoopTimerSetNextFireDate(_policyTimer, when);
+    return;
 }
 
 
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2007 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _WakeCoalesce_h_
+#define _WakeCoalesce_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdbool.h>
+
+/*
+ * Sleep-time wake request coalescing, used by PMConnection.c. Kept in a
+ * header of static functions so BATS/wakecoalesce-unit can exercise it
+ * without the rest of powerd.
+ */
+
+/* Array indices & for PMChooseScheduledEvent */
+typedef enum {
+    kChooseFullWake         = 0,
+    kChooseMaintenance      = 1,
+    kChooseSleepServiceWake = 2,
+    kChooseTimerPlugin      = 3,
+    kChooseWakeTypeCount    = 4
+} wakeType_e;
+
+/* WakeCandidate
+ * One wake request considered at sleep time. A WakeCandidateHeap orders
+ * them by 'when'; each may be served as late as 'deadline', which is 'when'
+ * plus the requester's declared leeway.
+ */
+typedef struct {
+    CFAbsoluteTime          when;
+    CFAbsoluteTime          deadline;
+    wakeType_e              type;
+    int                     reqIndex;   // index into the ASL wake request log
+} WakeCandidate;
+
+typedef struct {
+    WakeCandidate           *candidates;
+    int                     count;
+    int                     capacity;
+} WakeCandidateHeap;
+
+static void wakeHeapPush(
+    WakeCandidateHeap       *heap,
+    CFAbsoluteTime          when,
+    CFTimeInterval          leeway,
+    wakeType_e              type,
+    int                     reqIndex)
+{
+    CFAbsoluteTime          earliest = CFAbsoluteTimeGetCurrent() + 60;
+    WakeCandidate           c;
+    int                     i, parent;
+
+    if (heap->count >= heap->capacity)
+        return;
+
+    // Make sure that wake request is at least 1 min from now
+    c.when = (when < earliest) ? earliest : when;
+    c.deadline = c.when + leeway;
+    c.type = type;
+    c.reqIndex = reqIndex;
+
+    for (i = heap->count++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (heap->candidates[parent].when <= c.when)
+            break;
+        heap->candidates[i] = heap->candidates[parent];
+    }
+    heap->candidates[i] = c;
+}
+
+static bool wakeHeapPop(WakeCandidateHeap *heap, WakeCandidate *out)
+{
+    WakeCandidate           last;
+    int                     i, child;
+
+    if (0 == heap->count)
+        return false;
+
+    *out = heap->candidates[0];
+    last = heap->candidates[--heap->count];
+
+    for (i = 0; (child = 2 * i + 1) < heap->count; i = child) {
+        if ((child + 1 < heap->count)
+            && (heap->candidates[child + 1].when < heap->candidates[child].when))
+            child++;
+        if (last.when <= heap->candidates[child].when)
+            break;
+        heap->candidates[i] = heap->candidates[child];
+    }
+    heap->candidates[i] = last;
+    return true;
+}
+
+/* wakeHeapCoalesce
+ *
+ * Picks one RTC wake for every candidate in the heap that can share it.
+ * Candidates are taken earliest first for as long as one is requested no
+ * later than the tightest deadline seen so far. The wake fires at the latest
+ * 'when' taken, which every taken deadline allows, so a lone request fires
+ * at its own time however much leeway it has. A user wake among them makes
+ * it a full wake; otherwise the type is that of the tightest deadline.
+ * Returns kCFAbsoluteTimeIntervalSince1904 if the heap is empty.
+ */
+static CFAbsoluteTime wakeHeapCoalesce(
+    WakeCandidateHeap       *heap,
+    wakeType_e              *type,
+    int                     *chosenReq,
+    int                     *coalescedCount)
+{
+    CFAbsoluteTime          fireAt = kCFAbsoluteTimeIntervalSince1904;
+    CFAbsoluteTime          deadline = kCFAbsoluteTimeIntervalSince1904;
+    WakeCandidate           c;
+    bool                    fullWake = false;
+
+    *coalescedCount = 0;
+
+    while (heap->count && (heap->candidates[0].when <= deadline))
+    {
+        wakeHeapPop(heap, &c);
+        (*coalescedCount)++;
+        fireAt = c.when;
+
+        if (c.deadline < deadline) {
+            deadline = c.deadline;
+            if (!fullWake) {
+                *type = c.type;
+                *chosenReq = c.reqIndex;
+            }
+        }
+        if (!fullWake && (kChooseFullWake == c.type)) {
+            fullWake = true;
+            *type = c.type;
+            *chosenReq = c.reqIndex;
+        }
+    }
+
+    return fireAt;
+}
+
+
+#endif
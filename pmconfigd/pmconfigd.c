@@ -44,6 +44,9 @@
 #include <IOKit/hid/IOHIDKeys.h>
 
 #include <Security/SecTask.h>
+#include <libkern/OSAtomic.h>
+#include <IOKit/IOReportMacros.h>
+#include <IOReport.h>
 
 #include "powermanagementServer.h" // mig generated
 
@@ -156,6 +159,35 @@ extern TCPKeepAliveStruct           *gTCPKeepAlive;
 // defined by MiG
 extern boolean_t powermanagement_server(mach_msg_header_t *, mach_msg_header_t *);
 
+/*
+ * MIG requests are received on gMIGReceiveQueue and handed on from there:
+ * the read-only routines below to gMIGConcurrentQueue, everything else to
+ * the main queue in the order it arrived. Read-only routines only read reply
+ * snapshots off the main queue (see PMReplySnapshotCopy), and hop onto the
+ * main queue for anything else, so a slow query no longer holds up the run
+ * loop behind it. Each routine's queue delay and service time are kept for
+ * kPMMIGCopyQueueStats.
+ */
+static const char *             gMIGReadOnlyRoutines[] = {
+    "io_pm_assertion_copy_details",
+    "io_pm_assertion_activity_aggregate",
+    "io_ps_copy_powersources_info",
+    "io_ps_copy_chargelog"
+};
+
+typedef struct {
+    const char                  *name;
+    bool                        concurrent;
+    int64_t                     delay[kPMPerfHistogramBuckets];
+    int64_t                     service[kPMPerfHistogramBuckets];
+} MIGRoutineStats;
+
+static MIGRoutineStats          *gMIGStats                          = NULL;
+static dispatch_queue_t         gMIGReceiveQueue                    = NULL;
+static dispatch_queue_t         gMIGConcurrentQueue                 = NULL;
+static dispatch_source_t        gMIGSource                          = NULL;
+static mach_timebase_info_data_t gMIGTimebase;
+
 
 // foward declarations
 static void initializeESPrefsDynamicStore(void);
@@ -187,6 +219,9 @@ static void broadcastGMTOffset(void);
 
 static void pushNewSleepWakeUUID(void);
 
+static void startupRunSteps(bool deferred);
+static void startupRunDeferred(int next);
+
 static void calendarRTCDidResync(
                 CFMachPortRef port, 
                 void *msg,
@@ -217,11 +252,12 @@ static boolean_t pm_mig_demux(
                 mach_msg_header_t * request,
                 mach_msg_header_t * reply);
 
-static void mig_server_callback(
-                CFMachPortRef port, 
-                void *msg, 
-                CFIndex size, 
-                void *info);
+static void mig_server_start(void);
+static void mig_server_receive(void);
+static void mig_server_serve(
+                mig_reply_error_t *bufRequest,
+                MIGRoutineStats *stats,
+                uint64_t received);
 
 static void incoming_XPC_connection(xpc_connection_t);
 static void xpc_register(void);
@@ -261,6 +297,196 @@ __private_extern__ void dynamicStoreNotifyCallBack(
                 void                *info);
 
 
+/*
+ * Startup steps
+ *
+ * Each step names the steps it needs to have run first. main() runs every
+ * step that isn't deferred, in dependency order, before the MIG server
+ * starts answering. Anything that shows up in a reply, such as the
+ * assertions ExternalMedia and TTYKeepAwake raise, is set up by then,
+ * though ExternalMedia only learns of mounted disks once DiskArbitration
+ * calls back on the run loop. Deferred steps only set up UI, UPS shutdown
+ * monitoring and the like, and run once the run loop is up, one per main
+ * queue turn, so requests that arrive meanwhile are served between them.
+ *
+ * All steps run on the main thread. They register run loop sources and
+ * set up state that's only touched from the main queue, so none of them
+ * may run alongside each other.
+ */
+enum {
+    kStartupPMStore = 0,
+    kStartupESPrefs,
+    kStartupInterest,
+    kStartupTimezone,
+    kStartupCalendarResync,
+    kStartupShutdown,
+    kStartupRootDomainInterest,
+    kStartupSleepWake,
+    kStartupSleepWakeUUID,
+    kStartupBatteryTimeRemaining,
+    kStartupPMSettings,
+    kStartupAutoWake,
+    kStartupPMAssertions,
+    kStartupPMSystemEvents,
+    kStartupSystemLoad,
+    kStartupPMConnection,
+    kStartupBootAssertions,
+    kStartupTTYKeepAwake,
+    kStartupExternalMedia,
+    kStartupAnnounce,
+    kStartupUserNotifications,
+    kStartupOneOffHacks,
+    kStartupUPSLowPower,
+    kStartupSleepWakeWdog,
+    kStartupStepCount
+};
+
+#define kStartupDep(step)       (1 << (step))
+
+typedef struct {
+    const char          *name;
+    void                (*prime)(void);
+    uint32_t            deps;
+    bool                deferred;
+    bool                done;
+    uint64_t            elapsed;        // mach time
+} StartupStep;
+
+static void startupAnnounce(void);
+
+static StartupStep      gStartupSteps[kStartupStepCount] = {
+    [kStartupPMStore]               = { "PMStore",          PMStoreLoad, 0, false },
+    [kStartupESPrefs]               = { "ESPrefs",          initializeESPrefsDynamicStore,
+                                        kStartupDep(kStartupPMStore), false },
+    [kStartupInterest]              = { "Interest",         initializeInterestNotifications, 0, false },
+    [kStartupTimezone]              = { "Timezone",         initializeTimezoneChangeNotifications, 0, false },
+    [kStartupCalendarResync]        = { "CalendarResync",   initializeCalendarResyncNotification, 0, false },
+    [kStartupShutdown]              = { "Shutdown",         initializeShutdownNotifications, 0, false },
+    [kStartupRootDomainInterest]    = { "RootDomain",       initializeRootDomainInterestNotifications, 0, false },
+    [kStartupSleepWake]             = { "SleepWake",        initializeSleepWakeNotifications, 0, false },
+    [kStartupSleepWakeUUID]         = { "SleepWakeUUID",    pushNewSleepWakeUUID,
+                                        kStartupDep(kStartupPMStore), false },
+    [kStartupBatteryTimeRemaining]  = { "PowerSources",     BatteryTimeRemaining_prime,
+                                        kStartupDep(kStartupPMStore), false },
+    [kStartupPMSettings]            = { "PMSettings",       PMSettings_prime,
+                                        kStartupDep(kStartupESPrefs), false },
+    [kStartupAutoWake]              = { "AutoWake",         AutoWake_prime,
+                                        kStartupDep(kStartupPMSettings), false },
+    [kStartupPMAssertions]          = { "PMAssertions",     PMAssertions_prime,
+                                        kStartupDep(kStartupPMSettings)
+                                        | kStartupDep(kStartupBatteryTimeRemaining), false },
+    [kStartupPMSystemEvents]        = { "PMSystemEvents",   PMSystemEvents_prime, 0, false },
+    [kStartupSystemLoad]            = { "SystemLoad",       SystemLoad_prime,
+                                        kStartupDep(kStartupPMAssertions)
+                                        | kStartupDep(kStartupBatteryTimeRemaining), false },
+    [kStartupPMConnection]          = { "PMConnection",     PMConnection_prime,
+                                        kStartupDep(kStartupPMAssertions)
+                                        | kStartupDep(kStartupSleepWake), false },
+#if !TARGET_OS_EMBEDDED
+    [kStartupBootAssertions]        = { "BootAssertions",   createOnBootAssertions,
+                                        kStartupDep(kStartupPMAssertions), false },
+    [kStartupTTYKeepAwake]          = { "TTYKeepAwake",     TTYKeepAwake_prime,
+                                        kStartupDep(kStartupPMAssertions), false },
+    [kStartupExternalMedia]         = { "ExternalMedia",    ExternalMedia_prime,
+                                        kStartupDep(kStartupPMAssertions), false },
+#endif
+    [kStartupAnnounce]              = { "Announce",         startupAnnounce,
+                                        kStartupDep(kStartupPMConnection)
+                                        | kStartupDep(kStartupPMAssertions), false },
+#if !TARGET_OS_EMBEDDED
+    [kStartupUserNotifications]     = { "UserNotifications", initializeUserNotifications,
+                                        kStartupDep(kStartupPMStore), true },
+    [kStartupOneOffHacks]           = { "OneOffHacks",      _oneOffHacksSetup, 0, true },
+    [kStartupUPSLowPower]           = { "UPSLowPower",      UPSLowPower_prime,
+                                        kStartupDep(kStartupBatteryTimeRemaining), true },
+    [kStartupSleepWakeWdog]         = { "SleepWakeWdog",    enableSleepWakeWdog,
+                                        kStartupDep(kStartupSleepWake), true },
+#endif
+};
+
+static mach_timebase_info_data_t    gStartupTimebase;
+
+static void startupAnnounce(void)
+{
+    _unclamp_silent_running(false);
+    notify_post(kIOUserAssertionReSync);
+    logASLMessagePMStart();
+}
+
+static void startupRun(int i)
+{
+    StartupStep     *step = &gStartupSteps[i];
+    uint64_t        start;
+    int             dep;
+
+    if (step->done || !step->prime)
+        return;
+
+    // Mark it first, so a cycle in the table can't recurse forever
+    step->done = true;
+    for (dep = 0; dep < kStartupStepCount; dep++) {
+        if (step->deps & kStartupDep(dep))
+            startupRun(dep);
+    }
+
+    start = mach_absolute_time();
+    step->prime();
+    step->elapsed = mach_absolute_time() - start;
+}
+
+static void startupRunSteps(bool deferred)
+{
+    int     i;
+
+    if (gStartupTimebase.denom == 0)
+        mach_timebase_info(&gStartupTimebase);
+
+    for (i = 0; i < kStartupStepCount; i++) {
+        if (gStartupSteps[i].deferred == deferred)
+            startupRun(i);
+    }
+}
+
+/*
+ * Runs deferred step 'next', or logs how long each step took once they've
+ * all run.
+ */
+static void startupRunDeferred(int next)
+{
+    char        buf[1024];
+    size_t      len = 0;
+    uint64_t    total = 0;
+    int         i;
+
+    while ((next < kStartupStepCount)
+           && (!gStartupSteps[next].deferred || gStartupSteps[next].done))
+    {
+        next++;
+    }
+
+    if (next < kStartupStepCount) {
+        startupRun(next);
+        dispatch_async(dispatch_get_main_queue(), ^{ startupRunDeferred(next + 1); });
+        return;
+    }
+
+    for (i = 0; i < kStartupStepCount; i++) {
+        total += gStartupSteps[i].elapsed;
+    }
+    len = snprintf(buf, sizeof(buf), "powerd startup took %llu ms:",
+                   total * gStartupTimebase.numer / gStartupTimebase.denom / NSEC_PER_MSEC);
+    for (i = 0; (i < kStartupStepCount) && (len < sizeof(buf)); i++) {
+        if (!gStartupSteps[i].prime)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s%s=%lluus",
+                        gStartupSteps[i].name, gStartupSteps[i].deferred ? "*" : "",
+                        gStartupSteps[i].elapsed * gStartupTimebase.numer
+                        / gStartupTimebase.denom / NSEC_PER_USEC);
+    }
+    asl_log(0, 0, ASL_LEVEL_NOTICE, "%s\n", buf);
+}
+
+
 /* load
  *
  * configd entry point
@@ -271,7 +497,6 @@ __private_extern__ void dynamicStoreNotifyCallBack(
 
 int main(int argc __unused, char *argv[] __unused)
 {
-    CFRunLoopSourceRef      cfmp_rls = 0;
     CFMachPortContext       context  = { 0, (void *)1, NULL, NULL, serverMPCopyDescription };
     kern_return_t           kern_result = 0;
     
@@ -312,62 +537,24 @@ int main(int argc __unused, char *argv[] __unused)
 
     if (MACH_PORT_NULL != serverPort)
     {
-        // Finish setting up mig handler callback on pmServerMachPort
+        // pmServerMachPort only names the port for dead name notifications;
+        // requests are received by mig_server_start()'s dispatch source.
         pmServerMachPort = _SC_CFMachPortCreateWithPort(
                                 "PowerManagement",
                                 serverPort, 
-                                mig_server_callback, 
+                                NULL, 
                                 &context);
     }
-    if (pmServerMachPort) {
-        cfmp_rls = CFMachPortCreateRunLoopSource(0, pmServerMachPort, 0);
-        if (cfmp_rls) {
-            CFRunLoopAddSource(CFRunLoopGetCurrent(), cfmp_rls, kCFRunLoopDefaultMode);
-            CFRelease(cfmp_rls);
-        }
-    }
 
     _getPMRunLoop();
-    
-    PMStoreLoad();
-    
-    initializeESPrefsDynamicStore();
-    initializeInterestNotifications();
-    initializeTimezoneChangeNotifications();
-    initializeCalendarResyncNotification();    
-    initializeShutdownNotifications();
-    initializeRootDomainInterestNotifications();
-    
-#if !TARGET_OS_EMBEDDED
-    initializeUserNotifications();
-    _oneOffHacksSetup();
-#endif
-    
-    initializeSleepWakeNotifications();
-
-    // Prime the messagetracer UUID pump
-    pushNewSleepWakeUUID();
-    
-    BatteryTimeRemaining_prime();
-    PMSettings_prime();
-    AutoWake_prime();
-    PMAssertions_prime();
-    PMSystemEvents_prime();
-    SystemLoad_prime();
-    PMConnection_prime();
 
-#if !TARGET_OS_EMBEDDED
-    UPSLowPower_prime();
-    TTYKeepAwake_prime();
-    ExternalMedia_prime();
+    // Everything MIG clients can query is up before the server starts
+    // answering; the rest follows from the main queue.
+    startupRunSteps(false);
 
-    createOnBootAssertions();
-    enableSleepWakeWdog();
-#endif
+    mig_server_start();
 
-    _unclamp_silent_running(false);
-    notify_post(kIOUserAssertionReSync);
-    logASLMessagePMStart();
+    dispatch_async(dispatch_get_main_queue(), ^{ startupRunDeferred(0); });
 
     CFRunLoopRun();
     return 0;
@@ -403,6 +590,7 @@ static void ioregBatteryMatch(
         tracking->msg_port = notification_ref;
         IOObjectRelease(battery);
     }
+    BatteryTimeRemainingBatteryMatched();
     InternalEvaluateAssertions();
     InternalEvalConnections();
 }
@@ -503,6 +691,7 @@ SleepWakeCallback(
             }
             // Fall thru
         case kIOMessageCanSystemSleep:
+            PMAssertions_FlushKernelUpdates();
             IOAllowPowerChange(_pm_ack_port, (long)acknowledgementToken);
             break;
 
@@ -908,6 +1097,18 @@ static void incoming_XPC_connection(xpc_connection_t peer)
                      {
                          AppClaimWakeReason(inEvent);
                      }
+                     else if (xpc_dictionary_get_value(event, kAssertionBatchKey))
+                     {
+                         PMAssertions_HandleBatchRequest(peer, event, token);
+                     }
+                     else if (xpc_dictionary_get_value(event, kPSCopyChangedSinceKey))
+                     {
+                         BatteryTimeRemaining_HandleCopyChanged(peer, event);
+                     }
+                     else if (xpc_dictionary_get_value(event, kPSSharedMemoryRequestKey))
+                     {
+                         BatteryTimeRemaining_HandleSharedMemoryRequest(peer, event, token);
+                     }
                  }
 
                  if (secTask) {
@@ -988,20 +1189,143 @@ pm_mig_demux(
 
 
 
+static MIGRoutineStats *mig_stats_for(mach_msg_id_t msgid)
+{
+    if (!gMIGStats
+        || (msgid < (mach_msg_id_t)_powermanagement_subsystem.start)
+        || (msgid >= (mach_msg_id_t)_powermanagement_subsystem.end))
+    {
+        return NULL;
+    }
+    return &gMIGStats[msgid - _powermanagement_subsystem.start];
+}
+
+static void mig_stats_record(int64_t *hist, uint64_t elapsed)
+{
+    uint64_t    usecs = elapsed * gMIGTimebase.numer / gMIGTimebase.denom / NSEC_PER_USEC;
+    int         bucket = 0;
+
+    while (usecs && (bucket < kPMPerfHistogramBuckets - 1)) {
+        usecs >>= 1;
+        bucket++;
+    }
+    OSAtomicIncrement64(&hist[bucket]);
+}
+
+static void mig_server_start(void)
+{
+    int         count = _powermanagement_subsystem.end - _powermanagement_subsystem.start;
+
+    if (MACH_PORT_NULL == serverPort)
+        return;
+
+    mach_timebase_info(&gMIGTimebase);
+
+    gMIGStats = calloc(count, sizeof(MIGRoutineStats));
+#ifdef subsystem_to_name_map_powermanagement
+    {
+        static const struct {
+            const char      *name;
+            mach_msg_id_t   msgid;
+        } names[] = { subsystem_to_name_map_powermanagement };
+        MIGRoutineStats     *stats;
+        int                 i, j;
+
+        for (i=0; gMIGStats && (i < (int)(sizeof(names)/sizeof(names[0]))); i++) {
+            if (!(stats = mig_stats_for(names[i].msgid)))
+                continue;
+            stats->name = names[i].name;
+            for (j=0; j < (int)(sizeof(gMIGReadOnlyRoutines)/sizeof(gMIGReadOnlyRoutines[0])); j++) {
+                if (!strcmp(names[i].name, gMIGReadOnlyRoutines[j]))
+                    stats->concurrent = true;
+            }
+        }
+    }
+#endif
+
+    gMIGReceiveQueue = dispatch_queue_create("com.apple.powermanagement.mig", DISPATCH_QUEUE_SERIAL);
+    gMIGConcurrentQueue = dispatch_queue_create("com.apple.powermanagement.mig.readonly",
+                                                DISPATCH_QUEUE_CONCURRENT);
+    gMIGSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MACH_RECV, serverPort, 0, gMIGReceiveQueue);
+    if (!gMIGReceiveQueue || !gMIGConcurrentQueue || !gMIGSource) {
+        asl_log(0, 0, ASL_LEVEL_ERR, "PM configd: failed to set up the MIG server queues\n");
+        return;
+    }
+
+    dispatch_source_set_event_handler(gMIGSource, ^{
+        mig_server_receive();
+    });
+    dispatch_resume(gMIGSource);
+}
+
+/*
+ * Drains serverPort, handing each request to the queue that serves it.
+ * Requests need an audit trailer for the ServerAuditToken routines.
+ */
+static void mig_server_receive(void)
+{
+    mach_msg_size_t     size = _powermanagement_subsystem.maxsize + MAX_TRAILER_SIZE;
+    mig_reply_error_t   *bufRequest;
+    MIGRoutineStats     *stats;
+    mach_msg_return_t   mr;
+    uint64_t            received;
+    dispatch_queue_t    q;
+
+    while (1)
+    {
+        bufRequest = malloc(size);
+        if (!bufRequest)
+            return;
+
+        mr = mach_msg(&bufRequest->Head,
+                      MACH_RCV_MSG | MACH_RCV_TIMEOUT
+                      | MACH_RCV_TRAILER_TYPE(MACH_MSG_TRAILER_FORMAT_0)
+                      | MACH_RCV_TRAILER_ELEMENTS(MACH_RCV_TRAILER_AUDIT),
+                      0, size, serverPort, 0, MACH_PORT_NULL);
+        if (MACH_MSG_SUCCESS != mr) {
+            free(bufRequest);
+            if (MACH_RCV_TOO_LARGE == mr) {
+                // The kernel has already dropped it
+                continue;
+            }
+            if (MACH_RCV_TIMED_OUT != mr) {
+                asl_log(0, 0, ASL_LEVEL_ERR, "PM configd: MIG receive error 0x%x\n", mr);
+            }
+            return;
+        }
+
+        received = mach_absolute_time();
+        stats = mig_stats_for(bufRequest->Head.msgh_id);
+        q = (stats && stats->concurrent) ? gMIGConcurrentQueue : dispatch_get_main_queue();
+
+        dispatch_async(q, ^{
+            mig_server_serve(bufRequest, stats, received);
+        });
+    }
+}
+
+/*
+ * Demuxes one request and sends its reply. Frees bufRequest.
+ */
 static void
-mig_server_callback(CFMachPortRef port, void *msg, CFIndex size, void *info)
+mig_server_serve(mig_reply_error_t *bufRequest, MIGRoutineStats *stats, uint64_t received)
 {
-    mig_reply_error_t * bufRequest = msg;
     mig_reply_error_t * bufReply = CFAllocatorAllocate(
         NULL, _powermanagement_subsystem.maxsize, 0);
     mach_msg_return_t   mr;
     int                 options;
+    uint64_t            started = mach_absolute_time();
 
-    __MACH_PORT_DEBUG(true, "mig_server_callback", serverPort);
+    __MACH_PORT_DEBUG(true, "mig_server_serve", serverPort);
     
     /* we have a request message */
     (void) pm_mig_demux(&bufRequest->Head, &bufReply->Head);
 
+    if (stats) {
+        mig_stats_record(stats->delay, started - received);
+        mig_stats_record(stats->service, mach_absolute_time() - started);
+    }
+
     if (!(bufReply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX) &&
          (bufReply->RetCode != KERN_SUCCESS)) {
 
@@ -1073,10 +1397,97 @@ mig_server_callback(CFMachPortRef port, void *msg, CFIndex size, void *info)
 
 out:
     CFAllocatorDeallocate(NULL, bufReply);
+    free(bufRequest);
     return;
 
 }
 
+/*
+ * IOReport samples of every routine that has served a request. Safe on any
+ * queue; counts are read without stopping the servers.
+ */
+__private_extern__ CFDictionaryRef copyMIGQueueStats(void)
+{
+    CFMutableDictionaryRef  legend = NULL;
+    CFMutableDataRef        bufs = NULL;
+    CFDictionaryRef         samples = NULL;
+    CFStringRef             providerName = NULL;
+    CFStringRef             channelName = NULL;
+    size_t                  nbytes = SIMPLEARRAY_BUFSIZE(kPMPerfHistogramBuckets);
+    void                    *buf = NULL;
+    void                    *ptr2cpy = NULL;
+    uint32_t                size2cpy = 0;
+    uint64_t                chType, chID;
+    MIGRoutineStats         *stats;
+    int64_t                 *hist;
+    int                     count, i, b, kind;
+    bool                    used;
+
+    if (!gMIGStats)
+        return NULL;
+
+    providerName = IOReportCopyCurrentProcessName();
+    legend = IOReportCreateAggregate(0);
+    bufs = CFDataCreateMutable(NULL, 0);
+    buf = malloc(nbytes);
+    if (!providerName || !legend || !bufs || !buf)
+        goto exit;
+
+    chType = IOREPORT_MAKECHTYPE(kIOReportFormatSimpleArray, kIOReportCategoryPower, kPMPerfHistogramBuckets);
+    count = _powermanagement_subsystem.end - _powermanagement_subsystem.start;
+    for (i=0; i<count; i++)
+    {
+        stats = &gMIGStats[i];
+        used = false;
+        for (b=0; b<kPMPerfHistogramBuckets && !used; b++) {
+            used = (stats->delay[b] != 0);
+        }
+        if (!used)
+            continue;
+
+        if (stats->name) {
+            channelName = CFStringCreateWithCString(0, stats->name, kCFStringEncodingUTF8);
+        } else {
+            channelName = CFStringCreateWithFormat(0, 0, CFSTR("%d"), _powermanagement_subsystem.start + i);
+        }
+
+        for (kind = 0; kind < 2; kind++)
+        {
+            chID = kPMMIGStatsChannelID(_powermanagement_subsystem.start + i,
+                                        (kind ? kPMMIGStatsChannelService : 0)
+                                        | (stats->concurrent ? kPMMIGStatsChannelConcurrent : 0));
+            hist = kind ? stats->service : stats->delay;
+
+            if (IOReportAddChannelDescription(legend, getpid(), providerName, chID,
+                                              chType, channelName,
+                                              CFSTR("I/O Kit Power Management"),
+                                              kind ? CFSTR("MIG Service Time") : CFSTR("MIG Queue Delay"),
+                                              NULL, NULL) != kIOReturnSuccess)
+            {
+                CFRelease(channelName);
+                goto exit;
+            }
+
+            SIMPLEARRAY_INIT(kPMPerfHistogramBuckets, buf, nbytes, getpid(), chID, kIOReportCategoryPower);
+            for (b=0; b<kPMPerfHistogramBuckets; b++) {
+                SIMPLEARRAY_SETVALUE(buf, b, hist[b]);
+            }
+            SIMPLEARRAY_UPDATEPREP(buf, ptr2cpy, size2cpy);
+            CFDataAppendBytes(bufs, ptr2cpy, size2cpy);
+        }
+        CFRelease(channelName);
+    }
+
+    samples = IOReportCreateSamplesRaw(legend, bufs, NULL);
+
+exit:
+    if (providerName) CFRelease(providerName);
+    if (legend) CFRelease(legend);
+    if (bufs) CFRelease(bufs);
+    if (buf) free(buf);
+    return samples;
+}
+
 /* dynamicStoreNotifyCallBack
  *
  * Changed Keys in dynamic store
@@ -1113,7 +1524,8 @@ kern_return_t _io_pm_set_value_int(
     int           *result)
 {
     uid_t   callerUID;
-    audit_token_to_au32(token, NULL, NULL, NULL, &callerUID, 0, 0, NULL, NULL);
+    pid_t   callerPID;
+    audit_token_to_au32(token, NULL, NULL, NULL, &callerUID, 0, &callerPID, NULL, NULL);
     
     *result = kIOReturnSuccess;
     switch (selector) {
@@ -1134,6 +1546,42 @@ kern_return_t _io_pm_set_value_int(
             *result = kIOReturnNotPrivileged;
         else 
             *result = setReservePwrMode(inValue);
+        break;
+
+    case kPMSetKernelAssertionCoalesceDelay:
+        if (callerUID != 0)
+            *result = kIOReturnNotPrivileged;
+        else
+            *result = setKernelAssertionCoalesceDelay(inValue);
+        break;
+
+    case kPMSetTimeRemainingEstimator:
+        if (callerUID != 0)
+            *result = kIOReturnNotPrivileged;
+        else
+            *result = setTimeRemainingEstimator(inValue);
+        break;
+
+    case kPMSetTimeRemainingHorizon:
+        if (callerUID != 0)
+            *result = kIOReturnNotPrivileged;
+        else
+            *result = setTimeRemainingHorizon(inValue);
+        break;
+
+    case kPMSetSimulatedCapabilityChange:
+        if (callerUID != 0)
+            *result = kIOReturnNotPrivileged;
+        else
+            *result = PMConnectionSimulateCapabilityChange(callerPID, (IOPMCapabilityBits)inValue);
+        break;
+
+    case kPMSetMemoryCap:
+        if (callerUID != 0)
+            *result = kIOReturnNotPrivileged;
+        else
+            *result = PMMemorySetCap(inValue);
+        break;
 
     default:
         break;
@@ -1190,6 +1638,46 @@ kern_return_t _io_pm_get_value_int(
 #endif
             
 #endif
+    case kPMGetKernelAssertionUpdates:
+            *outValue = (int)getKernelAssertionUpdateCount(false);
+            break;
+
+    case kPMGetKernelAssertionUpdatesSuppressed:
+            *outValue = (int)getKernelAssertionUpdateCount(true);
+            break;
+
+    case kPMGetKernelAssertionCoalesceDelay:
+            *outValue = (int)getKernelAssertionCoalesceDelay();
+            break;
+
+    case kPMGetAssertionAggregatesGeneration:
+            *outValue = (int)getAssertionAggregatesGeneration();
+            break;
+
+    case kPMGetAssertionsGeneration:
+            *outValue = (int)getAssertionsGeneration();
+            break;
+
+    case kPMGetPowerSourcesGeneration:
+            *outValue = (int)getPowerSourcesGeneration();
+            break;
+
+    case kPMGetTimeRemainingEstimator:
+            *outValue = getTimeRemainingEstimator();
+            break;
+
+    case kPMGetTimeRemainingHorizon:
+            *outValue = getTimeRemainingHorizon();
+            break;
+
+    case kPMGetSimulatedChangeDuration:
+            *outValue = PMConnectionSimulatedChangeDuration();
+            break;
+
+    case kPMGetSimulatedChangeTimeouts:
+            *outValue = PMConnectionSimulatedChangeTimeouts();
+            break;
+
       default:
          *outValue = 0;
          break;
@@ -1824,6 +2312,7 @@ RootDomainInterest(
         {
             // We keep a copy of the newly published UUID string
             _uuidString = IOPMSleepWakeCopyUUID();
+            PMConnectionSleepWakeUUIDChanged(_uuidString);
 
             // xnu kernel PM has just published a sleep/Wake UUID. 
             // We must replenish it with a new one (which we generate in user space)
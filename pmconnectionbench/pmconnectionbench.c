@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*************************************************************************/
+/*
+
+ pmconnectionbench measures how powerd's IOPMConnection fan-out scales with
+ client count. It spawns synthetic IOPMConnection clients across several
+ processes, asks powerd to run simulated capability changes past them
+ (kPMSetSimulatedCapabilityChange), and reports:
+
+    notify      fan-out start to each client's handler running
+    ack         each client's IOPMConnectionAcknowledgeEvent round trip
+    powerd      connectionFireNotification() to checkResponses() completion,
+                as measured inside powerd
+    total       request to the completion notification arriving here
+
+ Simulated changes reach only this tool's clients (powerd scopes them to our
+ process group), and never reach the kernel or the wake schedule.
+
+ Common invocations
+
+ pmconnectionbench --clients 500 --processes 8 --iterations 30
+ pmconnectionbench --clients 200 --mixed --delay 5 --jitter 20
+ pmconnectionbench --clients 50 --noack 10        # exercise the 30s timeout
+
+ Must be run as root.
+
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <servers/bootstrap.h>
+#include <getopt.h>
+#include <notify.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../pmconfigd/PrivateLib.h"
+#include "powermanagement.h"
+
+/*************************************************************************/
+
+#define kFullWakeCapabilities   (kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork \
+                                 | kIOPMCapabilityAudio | kIOPMCapabilityVideo)
+#define kDarkWakeCapabilities   (kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork)
+#define kSleepCapabilities      0
+
+// Each round moves to the next of these
+static const IOPMCapabilityBits kRoundCapabilities[] = {
+    kSleepCapabilities,
+    kDarkWakeCapabilities,
+    kFullWakeCapabilities
+};
+static const char *kRoundNames[] = { "sleep", "darkwake", "fullwake" };
+static const int kRoundKinds = sizeof(kRoundCapabilities)/sizeof(IOPMCapabilityBits);
+
+// Interest sets handed out round-robin by --mixed
+static const IOPMCapabilityBits kMixedInterests[] = {
+    kFullWakeCapabilities,
+    kIOPMCapabilityCPU,
+    kIOPMCapabilityDisk | kIOPMCapabilityNetwork,
+    kIOPMCapabilityAudio | kIOPMCapabilityVideo,
+    kIOPMCapabilityVideo
+};
+static const int kMixedInterestsCount = sizeof(kMixedInterests)/sizeof(IOPMCapabilityBits);
+
+// Longer than powerd's own per-client timeout, so rounds with --noack complete
+static const int64_t kRoundTimeoutSec = 45;
+
+struct args_struct {
+    int                 clients;
+    int                 processes;
+    int                 iterations;
+    IOPMCapabilityBits  interests;
+    bool                mixed;
+    int                 delayMS;
+    int                 jitterMS;
+    int                 noackPercent;
+    int                 intervalMS;
+};
+typedef struct args_struct args_struct;
+
+static args_struct args = { 200, 4, 12, kFullWakeCapabilities, false, 0, 0, 0, 100 };
+
+/* One slot per client per round, written by the client and read by the
+ * controller once the round completes. Lives in memory shared by all
+ * processes.
+ */
+typedef struct {
+    uint64_t            received;       // mach_absolute_time the handler ran, 0 if never
+    uint64_t            ackCall;        // duration of IOPMConnectionAcknowledgeEvent
+    int                 ackReturn;
+} ClientSample;
+
+typedef struct {
+    volatile int        round;
+    volatile uint64_t   fired;          // mach_absolute_time the round was requested
+} SharedControl;
+
+static SharedControl                *gControl = NULL;
+static ClientSample                 *gSamples = NULL;
+static mach_timebase_info_data_t    gTimebase;
+
+static double machToMS(uint64_t t)
+{
+    return ((double)t * gTimebase.numer / gTimebase.denom) / 1000000.0;
+}
+
+static IOPMCapabilityBits clientInterests(int client)
+{
+    return args.mixed ? kMixedInterests[client % kMixedInterestsCount] : args.interests;
+}
+
+static int clientDelayMS(void)
+{
+    return args.delayMS + (args.jitterMS ? (int)(arc4random_uniform(args.jitterMS + 1)) : 0);
+}
+
+static bool clientAcks(int client)
+{
+    return (client % 100) >= args.noackPercent;
+}
+
+/*************************************************************************/
+/* Synthetic clients */
+
+static void clientHandler(
+    void                                *param,
+    IOPMConnection                      connection,
+    IOPMConnectionMessageToken          token,
+    IOPMSystemPowerStateCapabilities    capabilities)
+{
+    int             client = (int)(intptr_t)param;
+    int             round = gControl->round;
+    ClientSample    *sample = &gSamples[round * args.clients + client];
+    int             delay;
+
+    if (!token) {
+        return;
+    }
+    sample->received = mach_absolute_time();
+
+    if (!clientAcks(client)) {
+        return;
+    }
+
+    delay = clientDelayMS();
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)delay * NSEC_PER_MSEC),
+                   dispatch_get_main_queue(), ^{
+        uint64_t    t0 = mach_absolute_time();
+
+        sample->ackReturn = IOPMConnectionAcknowledgeEvent(connection, token);
+        sample->ackCall = mach_absolute_time() - t0;
+    });
+}
+
+static void clientProcess(int first, int count, int ready)
+{
+    IOPMConnection  connection;
+    IOReturn        ret;
+    char            name[64];
+    char            ok = 1;
+    int             i;
+
+    for (i=first; i<first+count; i++)
+    {
+        CFStringRef cfname;
+
+        snprintf(name, sizeof(name), "pmconnectionbench.%d", i);
+        cfname = CFStringCreateWithCString(0, name, kCFStringEncodingUTF8);
+
+        ret = IOPMConnectionCreate(cfname, clientInterests(i), &connection);
+        CFRelease(cfname);
+        if (kIOReturnSuccess != ret) {
+            printf("[FAIL] Error 0x%08x from IOPMConnectionCreate for client %d\n", ret, i);
+            ok = 0;
+            break;
+        }
+
+        ret = IOPMConnectionSetNotification(connection, (void *)(intptr_t)i,
+                                            (IOPMEventHandlerType)clientHandler);
+        if (kIOReturnSuccess == ret) {
+            ret = IOPMConnectionScheduleWithRunLoop(connection, CFRunLoopGetCurrent(),
+                                                    kCFRunLoopDefaultMode);
+        }
+        if (kIOReturnSuccess != ret) {
+            printf("[FAIL] Error 0x%08x scheduling IOPMConnection for client %d\n", ret, i);
+            ok = 0;
+            break;
+        }
+    }
+
+    (void)write(ready, &ok, 1);
+    close(ready);
+    if (!ok) {
+        _exit(1);
+    }
+
+    // Killed by the controller when the benchmark is done
+    CFRunLoopRun();
+    _exit(0);
+}
+
+/*************************************************************************/
+/* Controller */
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void printDistribution(const char *label, double *values, int count)
+{
+    if (!count) {
+        printf("  %-8s      (no samples)\n", label);
+        return;
+    }
+    qsort(values, count, sizeof(double), compareDoubles);
+    printf("  %-8s n=%-6d p50 %8.3fms   p99 %8.3fms   max %8.3fms\n",
+           label, count,
+           values[(int)(0.50 * (count - 1))],
+           values[(int)(0.99 * (count - 1))],
+           values[count - 1]);
+}
+
+static IOReturn requestSimulatedChange(mach_port_t pm_server, IOPMCapabilityBits capabilities)
+{
+    int         rc = kIOReturnBusy;
+    int         tries = 0;
+
+    // A real transition may be in flight; wait for it.
+    while (tries++ < 100) {
+        if (KERN_SUCCESS != io_pm_set_value_int(pm_server, kPMSetSimulatedCapabilityChange,
+                                                (int)capabilities, &rc)) {
+            return kIOReturnError;
+        }
+        if (kIOReturnBusy != rc) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    return rc;
+}
+
+static int runBenchmark(mach_port_t pm_server)
+{
+    dispatch_semaphore_t    done = dispatch_semaphore_create(0);
+    int                     token = 0;
+    int                     rounds = args.iterations + 1;
+    double                  *notifyMS = calloc((size_t)args.clients * rounds, sizeof(double));
+    double                  *ackMS = calloc((size_t)args.clients * rounds, sizeof(double));
+    double                  *powerdMS[kRoundKinds];
+    double                  *totalMS[kRoundKinds];
+    int                     perKind[kRoundKinds];
+    int                     notifyCount = 0, ackCount = 0;
+    int                     failures = 0;
+    int                     r, c, k;
+
+    for (k=0; k<kRoundKinds; k++) {
+        powerdMS[k] = calloc(rounds, sizeof(double));
+        totalMS[k] = calloc(rounds, sizeof(double));
+        perKind[k] = 0;
+    }
+
+    if (NOTIFY_STATUS_OK != notify_register_dispatch(kPMSimulatedChangeDoneNotifyString, &token,
+                                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+                                   ^(int t) { dispatch_semaphore_signal(done); }))
+    {
+        printf("[FAIL] Unable to register for %s\n", kPMSimulatedChangeDoneNotifyString);
+        return 1;
+    }
+
+    /* Round 0 moves powerd's simulated state to full wake, so every measured
+     * round starts from a known state. It isn't reported.
+     */
+    for (r=0; r<rounds; r++)
+    {
+        IOPMCapabilityBits  caps;
+        IOPMCapabilityBits  previous;
+        IOReturn            ret;
+        uint64_t            completed;
+        int                 durationUS = 0;
+        int                 timeouts = 0;
+        int                 expected = 0, received = 0;
+
+        k = r ? (r - 1) % kRoundKinds : kRoundKinds - 1;
+        caps = kRoundCapabilities[k];
+        previous = r ? kRoundCapabilities[(k + kRoundKinds - 1) % kRoundKinds] : caps;
+
+        gControl->round = r;
+        gControl->fired = mach_absolute_time();
+        ret = requestSimulatedChange(pm_server, caps);
+        if (kIOReturnSuccess != ret) {
+            printf("[FAIL] Error 0x%08x requesting simulated change (are you root?)\n", ret);
+            failures++;
+            break;
+        }
+
+        if (dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, kRoundTimeoutSec * NSEC_PER_SEC))) {
+            printf("[FAIL] Round %d: powerd didn't complete the simulated change in %llds\n",
+                   r, (long long)kRoundTimeoutSec);
+            failures++;
+            break;
+        }
+        completed = mach_absolute_time();
+
+        io_pm_get_value_int(pm_server, kPMGetSimulatedChangeDuration, &durationUS);
+        io_pm_get_value_int(pm_server, kPMGetSimulatedChangeTimeouts, &timeouts);
+
+        // Let delayed acks that raced the completion land before reading samples
+        usleep(args.intervalMS * 1000);
+
+        if (0 == r) {
+            continue;
+        }
+
+        if (durationUS == -2) {
+            printf("Round %d (%s): preempted by a real sleep/wake; not counted\n", r, kRoundNames[k]);
+            continue;
+        }
+
+        for (c=0; c<args.clients; c++)
+        {
+            ClientSample *s = &gSamples[r * args.clients + c];
+
+            if (clientInterests(c) & (caps ^ previous)) {
+                expected++;
+            }
+            if (!s->received) {
+                continue;
+            }
+            received++;
+            notifyMS[notifyCount++] = machToMS(s->received - gControl->fired);
+            if (s->ackCall) {
+                ackMS[ackCount++] = machToMS(s->ackCall);
+                if (kIOReturnSuccess != s->ackReturn) {
+                    printf("[FAIL] Round %d: client %d ack returned 0x%08x\n", r, c, s->ackReturn);
+                    failures++;
+                }
+            }
+        }
+
+        if (received != expected) {
+            printf("[FAIL] Round %d (%s): %d of %d interested clients were notified\n",
+                   r, kRoundNames[k], received, expected);
+            failures++;
+        }
+
+        powerdMS[k][perKind[k]] = durationUS / 1000.0;
+        totalMS[k][perKind[k]] = machToMS(completed - gControl->fired);
+        perKind[k]++;
+
+        printf("Round %3d %-9s notified %5d   powerd %9.3fms   total %9.3fms   timeouts %d\n",
+               r, kRoundNames[k], received, durationUS / 1000.0,
+               machToMS(completed - gControl->fired), timeouts);
+    }
+
+    notify_cancel(token);
+
+    printf("\n%d clients in %d processes; interests %s; ack delay %dms + up to %dms; %d%% never ack\n",
+           args.clients, args.processes, args.mixed ? "mixed" : "fixed",
+           args.delayMS, args.jitterMS, args.noackPercent);
+    printDistribution("notify", notifyMS, notifyCount);
+    printDistribution("ack", ackMS, ackCount);
+    for (k=0; k<kRoundKinds; k++) {
+        printf(" %s:\n", kRoundNames[k]);
+        printDistribution("powerd", powerdMS[k], perKind[k]);
+        printDistribution("total", totalMS[k], perKind[k]);
+    }
+
+    return failures ? 1 : 0;
+}
+
+/*************************************************************************/
+
+static void usage(void)
+{
+    printf("usage: pmconnectionbench [--clients N] [--processes N] [--iterations N]\n"
+           "                         [--interests <hex> | --mixed]\n"
+           "                         [--delay ms] [--jitter ms] [--noack percent] [--interval ms]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        { "clients",    required_argument,  NULL, 'c' },
+        { "processes",  required_argument,  NULL, 'p' },
+        { "iterations", required_argument,  NULL, 'n' },
+        { "interests",  required_argument,  NULL, 'i' },
+        { "mixed",      no_argument,        NULL, 'm' },
+        { "delay",      required_argument,  NULL, 'd' },
+        { "jitter",     required_argument,  NULL, 'j' },
+        { "noack",      required_argument,  NULL, 'x' },
+        { "interval",   required_argument,  NULL, 'w' },
+        { "help",       no_argument,        NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    mach_port_t     pm_server = MACH_PORT_NULL;
+    pid_t           *children = NULL;
+    int             ready[2];
+    int             ch, p, status;
+    int             first = 0;
+    size_t          samplesSize;
+
+    while ((ch = getopt_long(argc, argv, "c:p:n:i:md:j:x:w:h", long_opts, NULL)) != -1) {
+        switch (ch) {
+            case 'c':   args.clients = atoi(optarg);                            break;
+            case 'p':   args.processes = atoi(optarg);                          break;
+            case 'n':   args.iterations = atoi(optarg);                         break;
+            case 'i':   args.interests = (IOPMCapabilityBits)strtoul(optarg, NULL, 16); break;
+            case 'm':   args.mixed = true;                                      break;
+            case 'd':   args.delayMS = atoi(optarg);                            break;
+            case 'j':   args.jitterMS = atoi(optarg);                           break;
+            case 'x':   args.noackPercent = atoi(optarg);                       break;
+            case 'w':   args.intervalMS = atoi(optarg);                         break;
+            default:    usage();                                                exit(1);
+        }
+    }
+    if ((args.clients < 1) || (args.processes < 1) || (args.processes > args.clients)
+        || (args.iterations < 1) || (args.delayMS < 0) || (args.jitterMS < 0)
+        || (args.noackPercent < 0) || (args.noackPercent > 100) || (args.intervalMS < 0))
+    {
+        usage();
+        exit(1);
+    }
+
+    mach_timebase_info(&gTimebase);
+
+    // powerd notifies only our process group
+    setpgid(0, 0);
+
+    samplesSize = (size_t)args.clients * (args.iterations + 1) * sizeof(ClientSample);
+    gControl = mmap(NULL, sizeof(SharedControl), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    gSamples = mmap(NULL, samplesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if ((MAP_FAILED == gControl) || (MAP_FAILED == gSamples)) {
+        printf("[FAIL] Unable to allocate %zu bytes of sample space\n", samplesSize);
+        exit(1);
+    }
+
+    /* Fork every client process before this one touches CF or IOKit */
+    if (pipe(ready) != 0) {
+        printf("[FAIL] pipe() failed\n");
+        exit(1);
+    }
+    children = calloc(args.processes, sizeof(pid_t));
+    for (p=0; p<args.processes; p++)
+    {
+        int count = args.clients / args.processes + (p < (args.clients % args.processes) ? 1 : 0);
+
+        children[p] = fork();
+        if (children[p] == 0) {
+            close(ready[0]);
+            clientProcess(first, count, ready[1]);
+        }
+        first += count;
+    }
+    close(ready[1]);
+
+    status = 0;
+    for (p=0; p<args.processes; p++) {
+        char ok = 0;
+        if ((read(ready[0], &ok, 1) != 1) || !ok) {
+            status = 1;
+        }
+    }
+    close(ready[0]);
+
+    if (!status) {
+        if (KERN_SUCCESS != bootstrap_look_up2(bootstrap_port, kIOPMServerBootstrapName,
+                                               &pm_server, 0, BOOTSTRAP_PRIVILEGED_SERVER))
+        {
+            printf("[FAIL] Unable to look up powerd\n");
+            status = 1;
+        } else {
+            printf("Created %d IOPMConnection clients in %d processes; running %d simulated changes.\n",
+                   args.clients, args.processes, args.iterations);
+            status = runBenchmark(pm_server);
+            mach_port_deallocate(mach_task_self(), pm_server);
+        }
+    }
+
+    for (p=0; p<args.processes; p++) {
+        if (children[p] > 0) {
+            kill(children[p], SIGTERM);
+            waitpid(children[p], NULL, 0);
+        }
+    }
+
+    printf("%s pmconnectionbench\n", status ? "[FAIL]" : "[PASS]");
+    return status;
+}
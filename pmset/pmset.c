@@ -47,7 +47,10 @@
     IOReturn DisplayServicesResetAmbientLightAll( void );
 #endif
 
+#include <xpc/xpc.h>
+
 #include "../pmconfigd/PrivateLib.h"
+#include "../pmconfigd/BatteryTimeRemaining.h"
 
 // dynamically mig generated
 #include "powermanagement.h"
@@ -152,12 +155,19 @@
 #define ARG_THERMLOG        "thermlog"
 #define ARG_ASSERTIONS      "assertions"
 #define ARG_ASSERTIONSLOG   "assertionslog"
+#define ARG_ASSERTIONUPDATES "assertionupdates"
+#define ARG_ASSERTIONPERF   "assertionperf"
+#define ARG_MIGPERF         "migperf"
+#define ARG_MEMORY          "memory"
+#define ARG_TRANSITIONPROFILE "transitionprofile"
+#define ARG_SNAPSHOT        "snapshot"
 #define ARG_SYSLOAD         "sysload"
 #define ARG_SYSLOADLOG      "sysloadlog"
 #define ARG_USERACTIVITYLOG "useractivitylog"
 #define ARG_USERACTIVITY    "useractivity"
 #define ARG_LOG             "log"
 #define ARG_LISTEN          "listen"
+#define ARG_MONITOR         "monitor"
 #define ARG_HISTORY         "history"
 #define ARG_HISTORY_DETAILED "historydetailed"
 #define ARG_HID_NULL        "hidnull"
@@ -198,6 +208,8 @@
 #define ARG_MT2BOOK         "mt2book"
 #define ARG_SETSAAFLAGS     "saaflags"
 #define ARG_NOPOLL          "nopoll"
+#define ARG_ASSERTIONCOALESCE "assertioncoalesce"
+#define ARG_MEMORYCAP       "memorycap"
 
 // special system
 #define ARG_DISABLESLEEP    "disablesleep"
@@ -374,9 +386,10 @@ static void log_useractivity_presentActive(bool runOnce);
 static void log_useractivity_level(bool runOnce);
 static void show_useractivity_level(uint64_t lev, uint64_t msb);
 
-static void show_log(void);
+static void show_log(char **argv);
 static void show_uuid(bool keep_running);
 static void listen_for_everything(void);
+static void monitor_everything(void);
 static bool is_display_dim_captured(void);
 static void show_power_adapter(void);
 static void show_getters(void);
@@ -392,7 +405,7 @@ static void show_NULL_HID_events(void);
 static void show_everything(char **);
 
 static void show_power_event_history(void);
-static void show_power_event_history_detailed(void);
+static void show_power_event_history_detailed(char **argv);
 static void set_new_power_bookmark(void);
 static void set_debugFlags(char **argv);
 static void set_btInterval(char **argv);
@@ -403,11 +416,40 @@ static void show_root_domain_user_clients(void);
 static void mt2bookmark(void);
 static bool isBatteryPollingStopped(void);
 static void set_nopoll(void);
+static void show_kernel_assertion_updates(void);
+static void show_assertion_perf(void);
+static void show_mig_perf(void);
+static void show_memory(void);
+static void set_memory_cap(char **argv);
+static void show_transition_profile(void);
+static void show_snapshot(char **argv);
+static void set_kernel_assertion_coalesce(char **argv);
 
 static void print_pretty_date(CFAbsoluteTime t, bool newline);
 static void print_short_date(CFAbsoluteTime t, bool newline);
 static void print_date_with_style(const char *, CFDateFormatterStyle dayStyle, CFDateFormatterStyle timeStyle, CFAbsoluteTime t, bool newline);
 
+/* Machine-readable output for log and historydetailed */
+typedef enum {
+    kFormatText = 0,
+    kFormatNDJSON
+} output_format_t;
+
+typedef struct {
+    output_format_t     format;
+    double              since;      // Unix time; 0 == from the beginning
+} stream_options_t;
+
+#define kStreamFormatArg            "--format="
+#define kStreamSinceArg             "--since="
+#define kStreamFormatNDJSON         "ndjson"
+#define kLogStreamBatchSize         256
+
+static bool parse_stream_options(char **argv, stream_options_t *opts);
+static void print_json_string(const char *str);
+static void print_json_cf(CFTypeRef obj);
+static void print_json_date(CFAbsoluteTime t);
+
 static void sleepWakeCallback(
         void *refcon, 
         io_service_t y __unused,
@@ -544,14 +586,21 @@ static CommandAndAction the_getters[] =
     	{kActionGetLog,         ARG_THERMLOG,       ^(char **arg){ log_thermal_events(); }},
     	{kActionGetOnceNoArgs,  ARG_ASSERTIONS,     ^(char **arg){ show_assertions(NULL); }},
     	{kActionGetLog,         ARG_ASSERTIONSLOG,  ^(char **arg){ log_assertions(); }},
+        {kActionGetOnceNoArgs,  ARG_ASSERTIONUPDATES, ^(char **arg){ show_kernel_assertion_updates(); }},
+        {kActionGetOnceNoArgs,  ARG_ASSERTIONPERF,  ^(char **arg){ show_assertion_perf(); }},
+        {kActionGetOnceNoArgs,  ARG_MIGPERF,        ^(char **arg){ show_mig_perf(); }},
+        {kActionGetOnceNoArgs,  ARG_MEMORY,         ^(char **arg){ show_memory(); }},
+        {kActionGetOnceNoArgs,  ARG_TRANSITIONPROFILE, ^(char **arg){ show_transition_profile(); }},
+        {kActionGetOnceNoArgs,  ARG_SNAPSHOT,       ^(char **arg){ show_snapshot(arg); }},
     	{kActionGetOnceNoArgs,  ARG_SYSLOAD,        ^(char **arg){ show_systemload(); }},
     	{kActionGetLog,         ARG_SYSLOADLOG,     ^(char **arg){ log_systemload(); }},
     	{kActionGetLog,         ARG_USERACTIVITYLOG,^(char **arg){ log_useractivity_presentActive(kRunLoop); }},
     	{kActionGetOnceNoArgs,  ARG_USERACTIVITY   ,^(char **arg){ log_useractivity_presentActive(kRunOnce); }},
-    	{kActionGetOnceNoArgs,  ARG_LOG,            ^(char **arg){ show_log(); }},
+    	{kActionGetOnceNoArgs,  ARG_LOG,            ^(char **arg){ show_log(arg); }},
     	{kActionGetLog,         ARG_LISTEN,         ^(char **arg){ listen_for_everything(); }},
+    	{kActionGetLog,         ARG_MONITOR,        ^(char **arg){ monitor_everything(); }},
     	{kActionGetOnceNoArgs,  ARG_HISTORY,        ^(char **arg){ show_power_event_history(); }},
-    	{kActionGetOnceNoArgs,  ARG_HISTORY_DETAILED, ^(char **arg){ show_power_event_history_detailed(); }},
+    	{kActionGetOnceNoArgs,  ARG_HISTORY_DETAILED, ^(char **arg){ show_power_event_history_detailed(arg); }},
 #if !TARGET_OS_EMBEDDED
     	{kActionGetOnceNoArgs,  ARG_HID_NULL,       ^(char **arg){ show_NULL_HID_events(); }},
         {kActionNotForEverything, ARG_FBA,          ^(char **arg){print_fba(arg); }},
@@ -2398,16 +2447,18 @@ exit:
 
 static void print_pretty_date(CFAbsoluteTime t, bool newline)
 {
-    CFDateFormatterRef  date_format;
+    static CFDateFormatterRef   date_format = NULL;
     CFStringRef         time_date;
     char                _date[60];
  
-    date_format = CFDateFormatterCreate (NULL, NULL, kCFDateFormatterNoStyle, kCFDateFormatterNoStyle);
-    CFDateFormatterSetFormat(date_format, CFSTR("yyyy-MM-dd HH:mm:ss ZZZ"));
+    // Log output calls this once per line; create the formatter only once.
+    if (!date_format) {
+        date_format = CFDateFormatterCreate (NULL, NULL, kCFDateFormatterNoStyle, kCFDateFormatterNoStyle);
+        CFDateFormatterSetFormat(date_format, CFSTR("yyyy-MM-dd HH:mm:ss ZZZ"));
+    }
 
     time_date = CFDateFormatterCreateStringWithAbsoluteTime(kCFAllocatorDefault,
         date_format, t);
-    CFRelease(date_format);
 
     if(time_date)
     {
@@ -2434,22 +2485,34 @@ static void print_compact_date(CFAbsoluteTime t, bool newline)
 
 static void print_date_with_style(const char *dsf, CFDateFormatterStyle dayStyle, CFDateFormatterStyle timeStyle, CFAbsoluteTime t, bool newline)
 {
-    CFDateFormatterRef  date_format;
+    static CFDateFormatterRef   date_format = NULL;
+    static CFDateFormatterStyle date_format_day;
+    static CFDateFormatterStyle date_format_time;
     CFTimeZoneRef       tz;
     CFStringRef         time_date;
     CFLocaleRef         loc;
     char                _date[60];
  
-    loc = CFLocaleCopyCurrent();
-    date_format = CFDateFormatterCreate(kCFAllocatorDefault, loc,
-        dayStyle, timeStyle);
-    CFRelease(loc);
-    tz = CFTimeZoneCopySystem();
-    CFDateFormatterSetProperty(date_format, kCFDateFormatterTimeZone, tz);
-    CFRelease(tz);
+    // Keep the last formatter around; callers rarely switch styles.
+    if (date_format &&
+        ((dayStyle != date_format_day) || (timeStyle != date_format_time)))
+    {
+        CFRelease(date_format);
+        date_format = NULL;
+    }
+    if (!date_format) {
+        loc = CFLocaleCopyCurrent();
+        date_format = CFDateFormatterCreate(kCFAllocatorDefault, loc,
+            dayStyle, timeStyle);
+        CFRelease(loc);
+        tz = CFTimeZoneCopySystem();
+        CFDateFormatterSetProperty(date_format, kCFDateFormatterTimeZone, tz);
+        CFRelease(tz);
+        date_format_day = dayStyle;
+        date_format_time = timeStyle;
+    }
     time_date = CFDateFormatterCreateStringWithAbsoluteTime(kCFAllocatorDefault,
         date_format, t);
-    CFRelease(date_format);
 
     if(time_date)
     {
@@ -2462,6 +2525,177 @@ static void print_date_with_style(const char *dsf, CFDateFormatterStyle dayStyle
 
 /******************************************************************************/
 
+/*
+ * Picks up --format=<text|ndjson> and --since=<Unix time> from argv.
+ * Other arguments are left for the caller. Returns false on a bad option.
+ */
+static bool parse_stream_options(char **argv, stream_options_t *opts)
+{
+    const char  *val;
+    char        *end;
+    int         i;
+
+    opts->format = kFormatText;
+    opts->since = 0;
+
+    for (i = 0; argv && argv[i]; i++)
+    {
+        if (!strncmp(argv[i], kStreamFormatArg, strlen(kStreamFormatArg))) {
+            val = argv[i] + strlen(kStreamFormatArg);
+            if (!strcmp(val, kStreamFormatNDJSON)) {
+                opts->format = kFormatNDJSON;
+            } else if (strcmp(val, "text")) {
+                fprintf(stderr, "Error: unknown format %s\n", val);
+                return false;
+            }
+        } else if (!strncmp(argv[i], kStreamSinceArg, strlen(kStreamSinceArg))) {
+            val = argv[i] + strlen(kStreamSinceArg);
+            opts->since = strtod(val, &end);
+            if ((end == val) || *end || (opts->since < 0)) {
+                fprintf(stderr, "Error: --since takes seconds since 1970, not %s\n", val);
+                return false;
+            }
+        }
+    }
+
+    if ((opts->since > 0) && (kFormatNDJSON != opts->format)) {
+        fprintf(stderr, "Error: --since requires %s%s\n", kStreamFormatArg, kStreamFormatNDJSON);
+        return false;
+    }
+
+    return true;
+}
+
+static void print_json_string(const char *str)
+{
+    const unsigned char *c;
+
+    if (!str) {
+        printf("null");
+        return;
+    }
+
+    putchar('"');
+    for (c = (const unsigned char *)str; *c; c++)
+    {
+        switch (*c) {
+            case '"':   fputs("\\\"", stdout); break;
+            case '\\':  fputs("\\\\", stdout); break;
+            case '\n':  fputs("\\n", stdout); break;
+            case '\r':  fputs("\\r", stdout); break;
+            case '\t':  fputs("\\t", stdout); break;
+            default:
+                if (*c < 0x20) printf("\\u%04x", *c);
+                else putchar(*c);
+                break;
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * ISO 8601, UTC. The formatter is created on first use.
+ */
+static void print_json_date(CFAbsoluteTime t)
+{
+    static CFDateFormatterRef   date_format = NULL;
+    CFTimeZoneRef       tz;
+    CFStringRef         time_date;
+    char                _date[60];
+
+    if (!date_format) {
+        date_format = CFDateFormatterCreate(kCFAllocatorDefault, CFLocaleGetSystem(),
+                            kCFDateFormatterNoStyle, kCFDateFormatterNoStyle);
+        CFDateFormatterSetFormat(date_format, CFSTR("yyyy-MM-dd'T'HH:mm:ss'Z'"));
+        tz = CFTimeZoneCreateWithTimeIntervalFromGMT(kCFAllocatorDefault, 0.0);
+        CFDateFormatterSetProperty(date_format, kCFDateFormatterTimeZone, tz);
+        CFRelease(tz);
+    }
+
+    time_date = CFDateFormatterCreateStringWithAbsoluteTime(kCFAllocatorDefault,
+        date_format, t);
+    if (time_date && CFStringGetCString(time_date, _date, sizeof(_date), kCFStringEncodingUTF8)) {
+        print_json_string(_date);
+    } else {
+        printf("null");
+    }
+    if (time_date) CFRelease(time_date);
+}
+
+static void print_json_dict_entry(const void *key, const void *value, void *context)
+{
+    bool    *first = (bool *)context;
+
+    if (!isA_CFString(key))
+        return;
+    if (!*first) printf(",");
+    *first = false;
+    print_json_cf(key);
+    printf(":");
+    print_json_cf(value);
+}
+
+static void print_json_cf(CFTypeRef obj)
+{
+    CFTypeID    type;
+    char        buf[256];
+    char        *str;
+    CFIndex     len;
+    CFIndex     i;
+    bool        first;
+
+    if (!obj) {
+        printf("null");
+        return;
+    }
+
+    type = CFGetTypeID(obj);
+    if (type == CFStringGetTypeID()) {
+        if (CFStringGetCString(obj, buf, sizeof(buf), kCFStringEncodingUTF8)) {
+            print_json_string(buf);
+        } else {
+            len = CFStringGetMaximumSizeForEncoding(CFStringGetLength(obj), kCFStringEncodingUTF8) + 1;
+            str = malloc(len);
+            if (str && CFStringGetCString(obj, str, len, kCFStringEncodingUTF8)) {
+                print_json_string(str);
+            } else {
+                printf("null");
+            }
+            free(str);
+        }
+    } else if (type == CFBooleanGetTypeID()) {
+        printf("%s", CFBooleanGetValue(obj) ? "true" : "false");
+    } else if (type == CFNumberGetTypeID()) {
+        if (CFNumberIsFloatType(obj)) {
+            double d = 0.0;
+            CFNumberGetValue(obj, kCFNumberDoubleType, &d);
+            printf("%.17g", d);
+        } else {
+            long long ll = 0;
+            CFNumberGetValue(obj, kCFNumberLongLongType, &ll);
+            printf("%lld", ll);
+        }
+    } else if (type == CFDateGetTypeID()) {
+        print_json_date(CFDateGetAbsoluteTime(obj));
+    } else if (type == CFArrayGetTypeID()) {
+        printf("[");
+        for (i = 0; i < CFArrayGetCount(obj); i++) {
+            if (i) printf(",");
+            print_json_cf(CFArrayGetValueAtIndex(obj, i));
+        }
+        printf("]");
+    } else if (type == CFDictionaryGetTypeID()) {
+        first = true;
+        printf("{");
+        CFDictionaryApplyFunction(obj, print_json_dict_entry, &first);
+        printf("}");
+    } else {
+        printf("null");
+    }
+}
+
+/******************************************************************************/
+
 static void show_assertions_system_aggregates(bool updates_only)
 {
     /*
@@ -3865,6 +4099,411 @@ static void listen_for_everything(void)
     // should never return from CFRunLoopRun
 }
 
+/******************************************************************************/
+
+/*
+ * pmset -g monitor
+ *
+ * Subscribes once to every PM notification. Each handler fetches only the
+ * data its notification covers, compares it with what it saw last time, and
+ * prints one timestamped line per value that changed.
+ */
+
+static void monitor_prefix(const char *what)
+{
+    print_pretty_date(CFAbsoluteTimeGetCurrent(), false);
+    printf("%-12s ", what);
+}
+
+static void monitor_print_delta(const char *what, const char *name,
+                                CFDictionaryRef prev, CFDictionaryRef cur)
+{
+    CFIndex     count, i;
+    const void  **keys = NULL;
+    const void  **vals = NULL;
+
+    // Changed and added keys
+    count = cur ? CFDictionaryGetCount(cur) : 0;
+    if (count && (keys = malloc(count * sizeof(void *))) && (vals = malloc(count * sizeof(void *))))
+    {
+        CFDictionaryGetKeysAndValues(cur, keys, vals);
+        for (i = 0; i < count; i++) {
+            CFTypeRef old = prev ? CFDictionaryGetValue(prev, keys[i]) : NULL;
+            if (old && CFEqual(old, vals[i]))
+                continue;
+            monitor_prefix(what);
+            if (name) printf("%s ", name);
+            print_json_cf(keys[i]);
+            printf(" ");
+            print_json_cf(old);
+            printf(" -> ");
+            print_json_cf(vals[i]);
+            printf("\n");
+        }
+    }
+    free(keys); keys = NULL;
+    free(vals); vals = NULL;
+
+    // Removed keys
+    count = prev ? CFDictionaryGetCount(prev) : 0;
+    if (count && (keys = malloc(count * sizeof(void *))) && (vals = malloc(count * sizeof(void *))))
+    {
+        CFDictionaryGetKeysAndValues(prev, keys, vals);
+        for (i = 0; i < count; i++) {
+            if (cur && CFDictionaryContainsKey(cur, keys[i]))
+                continue;
+            monitor_prefix(what);
+            if (name) printf("%s ", name);
+            print_json_cf(keys[i]);
+            printf(" ");
+            print_json_cf(vals[i]);
+            printf(" -> null\n");
+        }
+    }
+    free(keys);
+    free(vals);
+    fflush(stdout);
+}
+
+/* Swaps *saved for cur and prints what changed between them. Takes cur. */
+static void monitor_update(const char *what, const char *name,
+                           CFDictionaryRef *saved, CFDictionaryRef cur)
+{
+    monitor_print_delta(what, name, *saved, cur);
+    if (*saved)
+        CFRelease(*saved);
+    *saved = cur;
+}
+
+static void monitor_assertion_status(void)
+{
+    static CFDictionaryRef  saved = NULL;
+    CFDictionaryRef         cur = NULL;
+
+    if (kIOReturnSuccess != IOPMCopyAssertionsStatus(&cur))
+        return;
+    monitor_update("Aggregates", NULL, &saved, cur);
+}
+
+static void monitor_assertion_activity(bool init_only)
+{
+    static uint32_t     cursor = UINT_MAX;
+    CFArrayRef          log = NULL;
+    CFDictionaryRef     entry;
+    CFIndex             cnt, i;
+    bool                of = false;
+    char                str[200];
+    CFStringRef         str_cf;
+    CFNumberRef         num_cf;
+    int                 pid;
+
+    if (kIOReturnSuccess != IOPMCopyAssertionActivityUpdate(&log, &of, &cursor) || !log)
+        return;
+    if (init_only)
+        goto exit;
+
+    if (of) {
+        monitor_prefix("Assertion");
+        printf("activity log overflowed, some changes are not shown\n");
+    }
+
+    cnt = isA_CFArray(log) ? CFArrayGetCount(log) : 0;
+    for (i = 0; i < cnt; i++)
+    {
+        entry = isA_CFDictionary(CFArrayGetValueAtIndex(log, i));
+        if (!entry) continue;
+
+        monitor_prefix("Assertion");
+
+        str[0] = 0;
+        if ((str_cf = isA_CFString(CFDictionaryGetValue(entry, kIOPMAssertionActivityAction))))
+            CFStringGetCString(str_cf, str, sizeof(str), kCFStringEncodingUTF8);
+        printf("%-10s ", str);
+
+        str[0] = 0;
+        if ((str_cf = isA_CFString(CFDictionaryGetValue(entry, kIOPMAssertionTypeKey))))
+            CFStringGetCString(str_cf, str, sizeof(str), kCFStringEncodingUTF8);
+        printf("%-30s ", str);
+
+        pid = -1;
+        if ((num_cf = isA_CFNumber(CFDictionaryGetValue(entry, kIOPMAssertionPIDKey))))
+            CFNumberGetValue(num_cf, kCFNumberIntType, &pid);
+        printf("pid %-6d ", pid);
+
+        str[0] = 0;
+        if ((str_cf = isA_CFString(CFDictionaryGetValue(entry, kIOPMAssertionNameKey))))
+            CFStringGetCString(str_cf, str, sizeof(str), kCFStringEncodingUTF8);
+        printf("%s\n", str);
+    }
+    fflush(stdout);
+
+exit:
+    CFRelease(log);
+}
+
+/*
+ * Power sources use powerd's changed-since request: only descriptions that
+ * changed since the generation we last saw come back.
+ */
+static xpc_connection_t         gMonitorPowerd = NULL;
+static CFMutableDictionaryRef   gMonitorSources = NULL;
+static uint64_t                 gMonitorPSGeneration = 0;
+static bool                     gMonitorPSInFlight = false;
+static bool                     gMonitorPSAgain = false;
+
+static void monitor_power_sources_reply(xpc_object_t reply)
+{
+    xpc_object_t            sources;
+    CFMutableSetRef         seen = NULL;
+    bool                    full;
+
+    if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY)
+        return;
+
+    full = xpc_dictionary_get_bool(reply, kPSCopyChangedFullKey);
+    gMonitorPSGeneration = xpc_dictionary_get_uint64(reply, kPSCopyChangedGenerationKey);
+    sources = xpc_dictionary_get_value(reply, kPSCopyChangedSourcesKey);
+    if (full)
+        seen = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
+
+    if (sources && (xpc_get_type(sources) == XPC_TYPE_ARRAY))
+    {
+        xpc_array_apply(sources, ^bool(size_t index, xpc_object_t entry) {
+            const void      *bytes;
+            size_t          len = 0;
+            int64_t         psid;
+            CFNumberRef     key;
+            CFDataRef       data;
+            CFDictionaryRef desc = NULL;
+            CFDictionaryRef prev;
+            CFStringRef     name_cf;
+            char            name[64];
+
+            psid = xpc_dictionary_get_int64(entry, kPSCopyChangedIDKey);
+            bytes = xpc_dictionary_get_data(entry, kPSCopyChangedDescriptionKey, &len);
+            if (!bytes || !len)
+                return true;
+
+            data = CFDataCreateWithBytesNoCopy(0, bytes, len, kCFAllocatorNull);
+            if (data) {
+                desc = CFPropertyListCreateWithData(0, data, 0, NULL, NULL);
+                CFRelease(data);
+            }
+            if (!isA_CFDictionary(desc)) {
+                if (desc) CFRelease(desc);
+                return true;
+            }
+
+            key = CFNumberCreate(0, kCFNumberSInt64Type, &psid);
+            if (seen) CFSetAddValue(seen, key);
+
+            snprintf(name, sizeof(name), "%lld", (long long)psid);
+            if ((name_cf = isA_CFString(CFDictionaryGetValue(desc, CFSTR(kIOPSNameKey)))))
+                CFStringGetCString(name_cf, name, sizeof(name), kCFStringEncodingUTF8);
+
+            prev = CFDictionaryGetValue(gMonitorSources, key);
+            monitor_print_delta("PowerSource", name, prev, desc);
+            CFDictionarySetValue(gMonitorSources, key, desc);
+
+            CFRelease(desc);
+            CFRelease(key);
+            return true;
+        });
+    }
+
+    if (seen) {
+        CFIndex     count = CFDictionaryGetCount(gMonitorSources);
+        const void  **keys = malloc(count * sizeof(void *));
+
+        if (keys) {
+            CFDictionaryGetKeysAndValues(gMonitorSources, keys, NULL);
+            for (CFIndex i = 0; i < count; i++) {
+                if (CFSetContainsValue(seen, keys[i]))
+                    continue;
+                monitor_prefix("PowerSource");
+                print_json_cf(keys[i]);
+                printf(" removed\n");
+                CFDictionaryRemoveValue(gMonitorSources, keys[i]);
+            }
+            free(keys);
+        }
+        CFRelease(seen);
+    }
+    fflush(stdout);
+}
+
+static void monitor_power_sources(void)
+{
+    xpc_object_t    msg;
+
+    // Coalesce notifications that arrive while a request is outstanding
+    if (gMonitorPSInFlight) {
+        gMonitorPSAgain = true;
+        return;
+    }
+
+    if (!(msg = xpc_dictionary_create(NULL, NULL, 0)))
+        return;
+    xpc_dictionary_set_uint64(msg, kPSCopyChangedSinceKey, gMonitorPSGeneration);
+
+    gMonitorPSInFlight = true;
+    xpc_connection_send_message_with_reply(gMonitorPowerd, msg, dispatch_get_main_queue(),
+                                           ^(xpc_object_t reply) {
+        gMonitorPSInFlight = false;
+        monitor_power_sources_reply(reply);
+        if (gMonitorPSAgain) {
+            gMonitorPSAgain = false;
+            monitor_power_sources();
+        }
+    });
+    xpc_release(msg);
+}
+
+static void monitor_system_load(void)
+{
+    static CFDictionaryRef  saved = NULL;
+
+    monitor_update("SystemLoad", NULL, &saved, IOCopySystemLoadAdvisoryDetailed());
+}
+
+static void monitor_cpu_power(void)
+{
+    static CFDictionaryRef  saved = NULL;
+    CFDictionaryRef         cur = NULL;
+
+    if (kIOReturnSuccess != IOPMCopyCPUPowerStatus(&cur))
+        cur = NULL;
+    monitor_update("CPUPower", NULL, &saved, cur);
+}
+
+static void monitor_thermal_warning(bool init_only)
+{
+    static uint32_t     saved = 0;
+    uint32_t            level = 0;
+
+    if (kIOReturnSuccess != IOPMGetThermalWarningLevel(&level))
+        return;
+    if (!init_only && (level != saved)) {
+        monitor_prefix("Thermal");
+        printf("warning level %u -> %u\n", saved, level);
+        fflush(stdout);
+    }
+    saved = level;
+}
+
+static void monitor_settings(void)
+{
+    static CFDictionaryRef  saved = NULL;
+
+    monitor_update("Settings", NULL, &saved, IOPMCopyActivePMPreferences());
+}
+
+static void monitor_register(const char *name, void (^handler)(int token))
+{
+    int         token;
+    uint32_t    status;
+
+    status = notify_register_dispatch(name, &token, dispatch_get_main_queue(), handler);
+    if (NOTIFY_STATUS_OK != status) {
+        fprintf(stderr, "Registration failed for \"%s\" with (%u)\n", name, status);
+    }
+}
+
+static void monitorPMConnectionHandler(
+    void *param, 
+    IOPMConnection                      connection,
+    IOPMConnectionMessageToken          token, 
+    IOPMSystemPowerStateCapabilities    capabilities)
+{
+#if !TARGET_OS_EMBEDDED
+    char    stateDescriptionStr[100];
+
+    IOPMGetCapabilitiesDescription(stateDescriptionStr, sizeof(stateDescriptionStr), (uint64_t)capabilities);
+    monitor_prefix("SleepWake");
+    printf("%s caps:0x%x\n", stateDescriptionStr, capabilities);
+    fflush(stdout);
+
+    IOPMConnectionAcknowledgeEvent(connection, token);
+#endif
+}
+
+static void monitorPrefsCallBack(void *context)
+{
+    monitor_settings();
+}
+
+static void monitor_everything(void)
+{
+    CFRunLoopSourceRef  prefsSrc = NULL;
+#if !TARGET_OS_EMBEDDED
+    IOPMConnection      connection = NULL;
+#endif
+
+    gMonitorSources = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                &kCFTypeDictionaryValueCallBacks);
+    gMonitorPowerd = xpc_connection_create_mach_service("com.apple.iokit.powerdxpc",
+                                                        dispatch_get_main_queue(), 0);
+    if (!gMonitorSources || !gMonitorPowerd) {
+        fprintf(stderr, "Failed to connect to powerd\n");
+        return;
+    }
+    xpc_connection_set_event_handler(gMonitorPowerd, ^(xpc_object_t event) { });
+    xpc_connection_resume(gMonitorPowerd);
+
+    IOPMAssertionNotify(kIOPMAssertionsAnyChangedNotifyString, kIOPMNotifyRegister);
+    IOPMSetAssertionActivityLog(true);
+
+    monitor_register(kIOPMAssertionsAnyChangedNotifyString, ^(int t) { monitor_assertion_activity(false); });
+    monitor_register(kIOPMAssertionsChangedNotifyString, ^(int t) { monitor_assertion_status(); });
+    monitor_register(kIOPSNotifyAnyPowerSource, ^(int t) { monitor_power_sources(); });
+    monitor_register(kIOSystemLoadAdvisoryNotifyName, ^(int t) { monitor_system_load(); });
+    monitor_register(kIOPMCPUPowerNotificationKey, ^(int t) { monitor_cpu_power(); });
+    monitor_register(kIOPMThermalWarningNotificationKey, ^(int t) { monitor_thermal_warning(false); });
+    monitor_register(kIOPMSleepServiceActiveNotifyName, ^(int t) {
+        monitor_prefix("SleepService");
+        printf("%s\n", IOPMGetSleepServicesActive() ? "on" : "off");
+        fflush(stdout);
+    });
+    monitor_register(kIOUserActivityNotifyName, ^(int t) {
+        uint64_t state = 0;
+        notify_get_state(t, &state);
+        monitor_prefix("UserActive");
+        printf("%s\n", (state == kIOUserIsIdle) ? "idle" : "active");
+        fflush(stdout);
+    });
+
+#if !TARGET_OS_EMBEDDED
+    if ((kIOReturnSuccess == IOPMConnectionCreate(CFSTR("pmset monitor"),
+                                kIOPMCapabilityCPU | kIOPMCapabilityDisk
+                                | kIOPMCapabilityNetwork | kIOPMCapabilityAudio
+                                | kIOPMCapabilityVideo | kIOPMEarlyWakeNotification,
+                                &connection))
+        && (kIOReturnSuccess == IOPMConnectionSetNotification(connection, NULL,
+                                (IOPMEventHandlerType)monitorPMConnectionHandler)))
+    {
+        IOPMConnectionScheduleWithRunLoop(connection, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+    }
+#endif
+
+    prefsSrc = IOPMPrefsNotificationCreateRunLoopSource(monitorPrefsCallBack, NULL);
+    if (prefsSrc) {
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), prefsSrc, kCFRunLoopDefaultMode);
+        CFRelease(prefsSrc);
+    }
+
+    // Current state first, printed as changes from nothing
+    printf("pmset is monitoring power management changes. Hit ctrl-c to exit.\n");
+    monitor_settings();
+    monitor_assertion_status();
+    monitor_assertion_activity(true);
+    monitor_power_sources();
+    monitor_system_load();
+    monitor_cpu_power();
+    monitor_thermal_warning(true);
+
+    CFRunLoopRun();
+}
+
 static void log_thermal_events(void)
 {
     int             powerConstraintNotifyToken = 0;
@@ -5020,6 +5659,20 @@ static int parseArgs(int argc,
           {
               set_nopoll();
               goto exit;
+          } else if (0 == strncmp(argv[i], ARG_ASSERTIONCOALESCE, kMaxArgStringLength))
+          {
+              if(argv[i+1])
+                  set_kernel_assertion_coalesce(&argv[i+1]);
+              else
+                  printf("Error: You need to specify a delay in milliseconds\n");
+              goto exit;
+          } else if (0 == strncmp(argv[i], ARG_MEMORYCAP, kMaxArgStringLength))
+          {
+              if(argv[i+1] && argv[i+2])
+                  set_memory_cap(&argv[i+1]);
+              else
+                  printf("Error: You need to specify a subsystem and a cap in kilobytes\n");
+              goto exit;
          } else if(0 == strncmp(argv[i], ARG_BOOT, kMaxArgStringLength))
           {
               // Tell kernel power management that bootup is complete
@@ -5823,34 +6476,130 @@ static int32_t _getNextSleepTime(asl_object_t pmresponse, const char *curr_domai
 
 #define kPMASLStorePath                 "/var/log/powermanagement"
 
-static asl_object_t open_pm_asl_store(void)
+/*
+ * Query matching PM messages logged at or after 'since' (Unix time),
+ * or all of them if 'since' is 0.
+ */
+static asl_object_t create_pm_asl_query(double since)
+{
+    asl_object_t        query;
+    asl_object_t        cq;
+    char                since_str[32];
+
+    query = asl_new(ASL_TYPE_LIST);
+    if (query == NULL)
+        return NULL;
+
+    cq = asl_new(ASL_TYPE_QUERY);
+    if (cq == NULL) {
+        asl_release(query);
+        return NULL;
+    }
+
+    asl_set_query(cq, ASL_KEY_FACILITY, kPMFacility, ASL_QUERY_OP_EQUAL);
+    if (since > 0) {
+        snprintf(since_str, sizeof(since_str), "%lld", (long long)since);
+        asl_set_query(cq, ASL_KEY_TIME, since_str,
+                      ASL_QUERY_OP_GREATER_EQUAL | ASL_QUERY_OP_NUMERIC);
+    }
+    asl_append(query, cq);
+    asl_release(cq);
+
+    return query;
+}
+
+static asl_object_t open_pm_asl_store(void)
 {
     asl_object_t        response = NULL;
     size_t              endMessageID;
     
-    asl_object_t query = asl_new(ASL_TYPE_LIST);
+    asl_object_t query = create_pm_asl_query(0);
     if (query != NULL)
     {
-		asl_object_t cq = asl_new(ASL_TYPE_QUERY);
-		if (cq != NULL)
-		{
-			asl_set_query(cq, ASL_KEY_FACILITY, kPMFacility, ASL_QUERY_OP_EQUAL);
-			asl_append(query, cq);
-			asl_release(cq);
-			
-			asl_object_t pmstore = asl_open_path(kPMASLStorePath, 0);
-			if (pmstore != NULL) {
-				response = asl_match(pmstore, query, &endMessageID, 0, 0, 0, ASL_MATCH_DIRECTION_FORWARD);
-			}
-			asl_release(pmstore);
-		}
+        asl_object_t pmstore = asl_open_path(kPMASLStorePath, 0);
+        if (pmstore != NULL) {
+            response = asl_match(pmstore, query, &endMessageID, 0, 0, 0, ASL_MATCH_DIRECTION_FORWARD);
+        }
+        asl_release(pmstore);
 		
-		asl_release(query);
+        asl_release(query);
     }
 
     return response;
 }
 
+/*
+ * Writes one ASL message as a JSON object on its own line.
+ */
+static void print_asl_message_ndjson(asl_object_t m)
+{
+    const char  *key;
+    const char  *val;
+    uint32_t    i;
+
+    printf("{");
+    if ((val = asl_get(m, ASL_KEY_TIME))) {
+        printf("\"date\":");
+        print_json_date((CFAbsoluteTime)(atol(val) - kCFAbsoluteTimeIntervalSince1970));
+        printf(",");
+    }
+    for (i = 0; (key = asl_key(m, i)); i++)
+    {
+        if (i) printf(",");
+        print_json_string(key);
+        printf(":");
+        print_json_string(asl_get(m, key));
+    }
+    printf("}\n");
+}
+
+/*
+ * Streams the PM ASL store as NDJSON, kLogStreamBatchSize messages at a
+ * time. Each batch resumes from the last message ID the store handed back,
+ * so nothing is held in memory beyond one batch.
+ */
+static void stream_log_ndjson(double since)
+{
+    asl_object_t        pmstore = NULL;
+    asl_object_t        query = NULL;
+    asl_object_t        response;
+    asl_object_t        m;
+    size_t              start_id = 0;
+    size_t              end_id = 0;
+    size_t              count;
+
+    if (!(query = create_pm_asl_query(since)))
+        goto exit;
+
+    if (!(pmstore = asl_open_path(kPMASLStorePath, 0))) {
+        fprintf(stderr, "Error - can't open PM ASL data store at: %s\n", kPMASLStorePath);
+        goto exit;
+    }
+
+    do {
+        response = asl_match(pmstore, query, &end_id, start_id,
+                             kLogStreamBatchSize, 0, ASL_MATCH_DIRECTION_FORWARD);
+        if (!response)
+            break;
+
+        count = 0;
+        while ((m = asl_next(response))) {
+            print_asl_message_ndjson(m);
+            count++;
+        }
+        asl_release(response);
+        fflush(stdout);
+
+        start_id = end_id + 1;
+    } while (count == kLogStreamBatchSize);
+
+exit:
+    if (pmstore)
+        asl_release(pmstore);
+    if (query)
+        asl_release(query);
+}
+
 static void pmlog_print_claimedwakes(CFAbsoluteTime  abs_time, asl_object_t m)
 {
     int i=0;
@@ -5968,7 +6717,7 @@ static void printStatsMsg(asl_object_t m)
 }
 
 /* All PM messages in ASL log */
-static void show_log(void)
+static void show_log(char **argv)
 {
     asl_object_t        m = NULL;
     char                uuid[100];
@@ -5978,6 +6727,15 @@ static void show_log(void)
     CFAbsoluteTime      boot_time = 0;
 
     asl_object_t        response = NULL;
+    stream_options_t    opts;
+
+    if (!parse_stream_options(argv, &opts))
+        return;
+
+    if (kFormatNDJSON == opts.format) {
+        stream_log_ndjson(opts.since);
+        return;
+    }
 
     response = open_pm_asl_store();
     if (!response)
@@ -6389,7 +7147,649 @@ static void mt2bookmark(void)
 }
 
 
-static void show_power_event_history_detailed(void)
+static void show_kernel_assertion_updates(void)
+{
+    mach_port_t     connectIt = MACH_PORT_NULL;
+    int             sent = 0;
+    int             suppressed = 0;
+    int             delay = 0;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        printf("Failed to connect to powerd\n");
+        return;
+    }
+
+    io_pm_get_value_int(connectIt, kPMGetKernelAssertionUpdates, &sent);
+    io_pm_get_value_int(connectIt, kPMGetKernelAssertionUpdatesSuppressed, &suppressed);
+    io_pm_get_value_int(connectIt, kPMGetKernelAssertionCoalesceDelay, &delay);
+    _pm_disconnect(connectIt);
+
+    printf("Kernel assertion updates:\n");
+    printf(" %-24s %d\n", "Sent", sent);
+    printf(" %-24s %d\n", "Coalesced", suppressed);
+    if (delay)
+        printf(" %-24s %d ms\n", "Coalescing delay", delay);
+    else
+        printf(" %-24s %s\n", "Coalescing delay", "end of run loop turn");
+}
+
+static void print_perf_bucket(int bucket)
+{
+    char    label[16];
+
+    if (bucket < 0)
+        snprintf(label, sizeof(label), "-");
+    else if (bucket == 0)
+        snprintf(label, sizeof(label), "<1");
+    else if (bucket == kPMPerfHistogramBuckets - 1)
+        snprintf(label, sizeof(label), ">=%d", 1 << (bucket - 1));
+    else
+        snprintf(label, sizeof(label), "<%d", 1 << bucket);
+
+    printf(" %9s", label);
+}
+
+/*
+ * Returns the bucket holding the p50, p90, p99 and maximum samples of an
+ * IOReport latency histogram channel, or -1 for each if it's empty.
+ */
+static int64_t perf_percentiles(IOReportSampleRef ch, int *pcts)
+{
+    int64_t     counts[kPMPerfHistogramBuckets];
+    int64_t     total = 0, seen = 0;
+    int         i;
+
+    pcts[0] = pcts[1] = pcts[2] = pcts[3] = -1;
+    for (i = 0; i < kPMPerfHistogramBuckets; i++) {
+        counts[i] = IOReportArrayGetValueAtIndex(ch, i);
+        if (counts[i] < 0) counts[i] = 0;
+        total += counts[i];
+        if (counts[i]) pcts[3] = i;
+    }
+
+    for (i = 0; (i < kPMPerfHistogramBuckets) && total; i++) {
+        seen += counts[i];
+        if ((pcts[0] < 0) && (seen * 100 >= total * 50)) pcts[0] = i;
+        if ((pcts[1] < 0) && (seen * 100 >= total * 90)) pcts[1] = i;
+        if ((pcts[2] < 0) && (seen * 100 >= total * 99)) pcts[2] = i;
+    }
+    return total;
+}
+
+static void show_assertion_perf(void)
+{
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             data = 0;
+    mach_msg_type_number_t  size = 0;
+    int                     rc = kIOReturnError;
+    CFDataRef               unfolder = NULL;
+    CFDictionaryRef         samples = NULL;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        printf("Failed to connect to powerd\n");
+        return;
+    }
+
+    io_pm_assertion_copy_details(connectIt, 0, kPMAssertionMIGCopyPerf, &data, &size, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((rc != kIOReturnSuccess) || !data) {
+        printf("No assertion latency data available\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)data, size, kCFAllocatorNull);
+    if (unfolder) {
+        samples = (CFDictionaryRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFDictionary(samples)) {
+        printf("Failed to read assertion latency data\n");
+        goto exit;
+    }
+
+    printf("Assertion latency in microseconds:\n");
+    printf(" %-16s %9s %9s %9s %9s %9s\n", "Operation", "Count", "p50", "p90", "p99", "Max");
+    IOReportIterate(samples, ^(IOReportSampleRef ch) {
+        int         pcts[4];
+        int64_t     total;
+        char        name[32];
+
+        total = perf_percentiles(ch, pcts);
+
+        name[0] = 0;
+        CFStringGetCString(IOReportChannelGetChannelName(ch), name, sizeof(name), kCFStringEncodingUTF8);
+        printf(" %-16s %9lld", name, total);
+        print_perf_bucket(pcts[0]);
+        print_perf_bucket(pcts[1]);
+        print_perf_bucket(pcts[2]);
+        print_perf_bucket(pcts[3]);
+        printf("\n");
+
+        return kIOReportIterOk;
+    });
+
+exit:
+    if (samples)
+        CFRelease(samples);
+    if (data)
+        vm_deallocate(mach_task_self(), data, size);
+}
+
+static void show_mig_perf(void)
+{
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             data = 0;
+    mach_msg_type_number_t  size = 0;
+    int                     rc = kIOReturnError;
+    CFDataRef               unfolder = NULL;
+    CFDictionaryRef         samples = NULL;
+    __block int             delayP50 = -1, delayP99 = -1, delayMax = -1;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        printf("Failed to connect to powerd\n");
+        return;
+    }
+
+    io_pm_assertion_copy_details(connectIt, 0, kPMMIGCopyQueueStats, &data, &size, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((rc != kIOReturnSuccess) || !data) {
+        printf("No MIG request data available\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)data, size, kCFAllocatorNull);
+    if (unfolder) {
+        samples = (CFDictionaryRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFDictionary(samples)) {
+        printf("Failed to read MIG request data\n");
+        goto exit;
+    }
+
+    // Each routine has a queue delay channel followed by a service time channel
+    printf("powerd MIG requests in microseconds (* served on the concurrent queue):\n");
+    printf(" %-40s %9s %9s %9s %9s %9s %9s %9s\n", "Routine", "Count",
+           "Wait p50", "Wait p99", "Wait max", "Serve p50", "Serve p99", "Serve max");
+    IOReportIterate(samples, ^(IOReportSampleRef ch) {
+        uint64_t    chID = IOReportChannelGetChannelID(ch);
+        int         pcts[4];
+        int64_t     total;
+        char        name[64];
+
+        if (!(chID & kPMMIGStatsChannelService)) {
+            perf_percentiles(ch, pcts);
+            delayP50 = pcts[0];
+            delayP99 = pcts[2];
+            delayMax = pcts[3];
+            return kIOReportIterOk;
+        }
+        total = perf_percentiles(ch, pcts);
+
+        name[0] = 0;
+        CFStringGetCString(IOReportChannelGetChannelName(ch), name, sizeof(name), kCFStringEncodingUTF8);
+        printf(" %-39s%s %9lld", name, (chID & kPMMIGStatsChannelConcurrent) ? "*" : " ", total);
+        print_perf_bucket(delayP50);
+        print_perf_bucket(delayP99);
+        print_perf_bucket(delayMax);
+        print_perf_bucket(pcts[0]);
+        print_perf_bucket(pcts[2]);
+        print_perf_bucket(pcts[3]);
+        printf("\n");
+
+        return kIOReportIterOk;
+    });
+
+exit:
+    if (samples)
+        CFRelease(samples);
+    if (data)
+        vm_deallocate(mach_task_self(), data, size);
+}
+
+static CFArrayRef copy_memory_accounting(void)
+{
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             data = 0;
+    mach_msg_type_number_t  size = 0;
+    int                     rc = kIOReturnError;
+    CFDataRef               unfolder = NULL;
+    CFArrayRef              subsystems = NULL;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        printf("Failed to connect to powerd\n");
+        return NULL;
+    }
+
+    io_pm_assertion_copy_details(connectIt, 0, kPMMemoryMIGCopyStats, &data, &size, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((rc == kIOReturnSuccess) && data) {
+        unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)data, size, kCFAllocatorNull);
+        if (unfolder) {
+            subsystems = (CFArrayRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+            CFRelease(unfolder);
+        }
+    }
+    if (data)
+        vm_deallocate(mach_task_self(), data, size);
+
+    if (subsystems && !isA_CFArray(subsystems)) {
+        CFRelease(subsystems);
+        subsystems = NULL;
+    }
+    if (!subsystems)
+        printf("Failed to read powerd memory accounting\n");
+
+    return subsystems;
+}
+
+static int64_t memory_value(CFDictionaryRef subsystem, const char *key, int64_t absent)
+{
+    CFStringRef     keyStr = CFStringCreateWithCString(0, key, kCFStringEncodingUTF8);
+    CFNumberRef     num = NULL;
+    int64_t         value = absent;
+
+    if (keyStr) {
+        num = isA_CFNumber(CFDictionaryGetValue(subsystem, keyStr));
+        if (num)
+            CFNumberGetValue(num, kCFNumberSInt64Type, &value);
+        CFRelease(keyStr);
+    }
+    return value;
+}
+
+static void show_memory(void)
+{
+    CFArrayRef          subsystems = NULL;
+    CFDictionaryRef     subsystem;
+    CFStringRef         name;
+    char                nameBuf[64];
+    char                capBuf[16];
+    int64_t             cap, bytes, total = 0;
+    CFIndex             count, i;
+
+    if (!(subsystems = copy_memory_accounting()))
+        return;
+
+    printf("powerd memory by subsystem, in bytes:\n");
+    printf(" %-24s %10s %10s %10s %10s\n", "Subsystem", "Current", "Peak", "Cap", "Evictions");
+
+    count = CFArrayGetCount(subsystems);
+    for (i = 0; i < count; i++)
+    {
+        subsystem = isA_CFDictionary(CFArrayGetValueAtIndex(subsystems, i));
+        if (!subsystem)
+            continue;
+
+        nameBuf[0] = 0;
+        name = isA_CFString(CFDictionaryGetValue(subsystem, CFSTR(kPMMemoryNameKey)));
+        if (name)
+            CFStringGetCString(name, nameBuf, sizeof(nameBuf), kCFStringEncodingUTF8);
+
+        bytes = memory_value(subsystem, kPMMemoryBytesKey, 0);
+        total += bytes;
+
+        cap = memory_value(subsystem, kPMMemoryCapKey, -1);
+        if (cap < 0)
+            snprintf(capBuf, sizeof(capBuf), "-");
+        else if (cap == 0)
+            snprintf(capBuf, sizeof(capBuf), "none");
+        else
+            snprintf(capBuf, sizeof(capBuf), "%lld", cap);
+
+        printf(" %-24s %10lld %10lld %10s", nameBuf, bytes,
+               memory_value(subsystem, kPMMemoryPeakKey, 0), capBuf);
+        if (cap >= 0)
+            printf(" %10lld", memory_value(subsystem, kPMMemoryEvictionsKey, 0));
+        printf("\n");
+    }
+    printf(" %-24s %10lld\n", "Total", total);
+
+    CFRelease(subsystems);
+}
+
+/* pmset memorycap <subsystem> <kilobytes> */
+static void set_memory_cap(char **argv)
+{
+    mach_port_t         connectIt = MACH_PORT_NULL;
+    CFArrayRef          subsystems = NULL;
+    CFDictionaryRef     subsystem;
+    CFStringRef         name;
+    char                nameBuf[64];
+    int                 index = -1;
+    long                kbytes;
+    int                 ret = kIOReturnError;
+    CFIndex             count, i;
+
+    errno = 0;
+    kbytes = strtol(argv[1], NULL, 0);
+    if ((errno == EINVAL) || (kbytes < 0) || (kbytes > kPMMemoryCapMaxKB)) {
+        printf("Invalid argument\n");
+        return;
+    }
+
+    // Subsystems are listed in powerd's order, so a name's index is its subsystem
+    if (!(subsystems = copy_memory_accounting()))
+        return;
+    count = CFArrayGetCount(subsystems);
+    for (i = 0; (i < count) && (index < 0); i++)
+    {
+        subsystem = isA_CFDictionary(CFArrayGetValueAtIndex(subsystems, i));
+        name = subsystem ? isA_CFString(CFDictionaryGetValue(subsystem, CFSTR(kPMMemoryNameKey))) : NULL;
+        if (name && CFStringGetCString(name, nameBuf, sizeof(nameBuf), kCFStringEncodingUTF8)
+            && (0 == strcasecmp(nameBuf, argv[0])))
+        {
+            if (!CFDictionaryContainsKey(subsystem, CFSTR(kPMMemoryCapKey))) {
+                printf("%s can't be capped\n", nameBuf);
+                CFRelease(subsystems);
+                return;
+            }
+            index = (int)i;
+        }
+    }
+    CFRelease(subsystems);
+
+    if (index < 0) {
+        printf("Unknown subsystem '%s'\n", argv[0]);
+        return;
+    }
+
+    if (kIOReturnSuccess == _pm_connect(&connectIt)) {
+        io_pm_set_value_int(connectIt, kPMSetMemoryCap, kPMMemoryCapValue(index, (int)kbytes), &ret);
+        _pm_disconnect(connectIt);
+    }
+
+    if (ret == kIOReturnNotPrivileged)
+        printf("'%s' must be run as root\n", ARG_MEMORYCAP);
+    else if (ret != kIOReturnSuccess)
+        printf("Failed to set memory cap. err=0x%x\n", ret);
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void show_transition_profile(void)
+{
+    static const char *kindNames[kPMTransitionKindCount] = { "Sleep", "DarkWake", "FullWake" };
+    static const char *phaseNames[kPMTransitionPhaseCount] = {
+        "WakeReason", "Fanout", "FirstAck", "LastAck", "ScheduleWake", "KernelAck" };
+
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             data = 0;
+    mach_msg_type_number_t  size = 0;
+    int                     rc = kIOReturnError;
+    CFDataRef               unfolder = NULL;
+    CFArrayRef              profile = NULL;
+    CFIndex                 count, i;
+    int32_t                 *values = NULL;
+    int                     kind, phase;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        printf("Failed to connect to powerd\n");
+        return;
+    }
+
+    io_pm_assertion_copy_details(connectIt, 0, kPMTransitionMIGCopyProfile, &data, &size, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((rc != kIOReturnSuccess) || !data) {
+        printf("No sleep/wake transitions recorded\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)data, size, kCFAllocatorNull);
+    if (unfolder) {
+        profile = (CFArrayRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFArray(profile)) {
+        printf("Failed to read transition profile\n");
+        goto exit;
+    }
+
+    count = CFArrayGetCount(profile);
+    values = calloc(count, sizeof(int32_t));
+    if (!values)
+        goto exit;
+
+    printf("Sleep/wake transition profile for the last %ld transitions\n", (long)count);
+    printf("Phase times in milliseconds since the kernel notification:\n");
+
+    for (kind = 0; kind < kPMTransitionKindCount; kind++)
+    {
+        bool printedKind = false;
+
+        for (phase = 0; phase < kPMTransitionPhaseCount; phase++)
+        {
+            int n = 0;
+
+            for (i = 0; i < count; i++) {
+                CFDictionaryRef one = isA_CFDictionary(CFArrayGetValueAtIndex(profile, i));
+                CFNumberRef     num;
+                CFArrayRef      phases;
+                int             k = -1;
+                int32_t         us = -1;
+
+                if (!one)
+                    continue;
+                num = isA_CFNumber(CFDictionaryGetValue(one, CFSTR(kPMTransitionKindKey)));
+                if (!num || !CFNumberGetValue(num, kCFNumberIntType, &k) || (k != kind))
+                    continue;
+                phases = isA_CFArray(CFDictionaryGetValue(one, CFSTR(kPMTransitionPhasesKey)));
+                if (!phases || (CFArrayGetCount(phases) <= phase))
+                    continue;
+                num = isA_CFNumber(CFArrayGetValueAtIndex(phases, phase));
+                if (num && CFNumberGetValue(num, kCFNumberSInt32Type, &us) && (us >= 0))
+                    values[n++] = us;
+            }
+
+            if (0 == n)
+                continue;
+
+            if (!printedKind) {
+                printf("%s\n", kindNames[kind]);
+                printf("  %-14s %7s %10s %10s %10s\n", "Phase", "Count", "p50", "p99", "Max");
+                printedKind = true;
+            }
+
+            qsort(values, n, sizeof(int32_t), compare_int32);
+            printf("  %-14s %7d %10.1f %10.1f %10.1f\n", phaseNames[phase], n,
+                   values[(n - 1) * 50 / 100] / 1000.0,
+                   values[(n - 1) * 99 / 100] / 1000.0,
+                   values[n - 1] / 1000.0);
+        }
+    }
+
+    printf("Recent transitions:\n");
+    for (i = (count > 5) ? count - 5 : 0; i < count; i++) {
+        CFDictionaryRef one = isA_CFDictionary(CFArrayGetValueAtIndex(profile, i));
+        CFStringRef     uuid;
+        CFNumberRef     num;
+        CFArrayRef      phases;
+        char            uuidStr[64] = "-";
+        int             k = -1;
+        int32_t         us = -1;
+
+        if (!one)
+            continue;
+        if ((uuid = isA_CFString(CFDictionaryGetValue(one, CFSTR(kPMTransitionUUIDKey)))))
+            CFStringGetCString(uuid, uuidStr, sizeof(uuidStr), kCFStringEncodingUTF8);
+        if ((num = isA_CFNumber(CFDictionaryGetValue(one, CFSTR(kPMTransitionKindKey)))))
+            CFNumberGetValue(num, kCFNumberIntType, &k);
+        phases = isA_CFArray(CFDictionaryGetValue(one, CFSTR(kPMTransitionPhasesKey)));
+        if (phases && (CFArrayGetCount(phases) > kPMTransitionPhaseKernelAck)
+            && (num = isA_CFNumber(CFArrayGetValueAtIndex(phases, kPMTransitionPhaseKernelAck))))
+            CFNumberGetValue(num, kCFNumberSInt32Type, &us);
+
+        printf("  %-36s %-9s ", uuidStr, ((k >= 0) && (k < kPMTransitionKindCount)) ? kindNames[k] : "?");
+        if (us >= 0)
+            printf("%10.1f ms\n", us / 1000.0);
+        else
+            printf("%10s\n", "-");
+    }
+
+exit:
+    if (values)
+        free(values);
+    if (profile)
+        CFRelease(profile);
+    if (data)
+        vm_deallocate(mach_task_self(), data, size);
+}
+
+/*
+ * Settings, assertions, power sources, scheduled events, UPS thresholds,
+ * system load and thermal state, fetched from powerd in one request.
+ * Printed as an XML plist, or as a single JSON line with --format=ndjson.
+ */
+static void show_snapshot(char **argv)
+{
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             data = 0;
+    mach_msg_type_number_t  size = 0;
+    int                     rc = kIOReturnError;
+    CFDataRef               unfolder = NULL;
+    CFDictionaryRef         snapshot = NULL;
+    CFDataRef               xml = NULL;
+    stream_options_t        opts;
+
+    if (!parse_stream_options(argv, &opts))
+        return;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        fprintf(stderr, "Failed to connect to powerd\n");
+        return;
+    }
+
+    io_pm_assertion_copy_details(connectIt, 0, kPMSnapshotMIGCopyAll, &data, &size, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((rc != kIOReturnSuccess) || !data) {
+        fprintf(stderr, "Failed to read snapshot from powerd (0x%08x)\n", rc);
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)data, size, kCFAllocatorNull);
+    if (unfolder) {
+        snapshot = (CFDictionaryRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFDictionary(snapshot)) {
+        fprintf(stderr, "Failed to read snapshot from powerd\n");
+        goto exit;
+    }
+
+    if (kFormatNDJSON == opts.format) {
+        print_json_cf(snapshot);
+        printf("\n");
+    } else if ((xml = CFPropertyListCreateData(0, snapshot,
+                                kCFPropertyListXMLFormat_v1_0, 0, NULL))) {
+        fwrite(CFDataGetBytePtr(xml), 1, CFDataGetLength(xml), stdout);
+        CFRelease(xml);
+    }
+    fflush(stdout);
+
+exit:
+    if (snapshot)
+        CFRelease(snapshot);
+    if (data)
+        vm_deallocate(mach_task_self(), data, size);
+}
+
+static void set_kernel_assertion_coalesce(char **argv)
+{
+    mach_port_t     connectIt = MACH_PORT_NULL;
+    int             delay;
+    int             ret = kIOReturnError;
+
+    errno = 0;
+    delay = (int)strtol(argv[0], NULL, 0);
+    if ((errno == EINVAL) || (delay < 0)) {
+        printf("Invalid argument\n");
+        return;
+    }
+
+    if (kIOReturnSuccess == _pm_connect(&connectIt)) {
+        io_pm_set_value_int(connectIt, kPMSetKernelAssertionCoalesceDelay, delay, &ret);
+        _pm_disconnect(connectIt);
+    }
+
+    if (ret == kIOReturnNotPrivileged)
+        printf("'%s' must be run as root\n", ARG_ASSERTIONCOALESCE);
+    else if (ret != kIOReturnSuccess)
+        printf("Failed to set kernel assertion coalescing delay. err=0x%x\n", ret);
+}
+
+/*
+ * Writes each event of each power history UUID as one JSON object per line.
+ * UUID details are fetched from the kernel one UUID at a time, and skipped
+ * if the UUID completed before opts->since.
+ */
+static void stream_power_event_history_ndjson(CFArrayRef powpowHistory, stream_options_t *opts)
+{
+    CFIndex         uuid_count = CFArrayGetCount(powpowHistory);
+    CFIndex         uuid_index;
+    CFAbsoluteTime  since = 0.0;
+
+    if (opts->since > 0) {
+        since = (CFAbsoluteTime)(opts->since - kCFAbsoluteTimeIntervalSince1970);
+    }
+
+    for (uuid_index = 0; uuid_index < uuid_count; uuid_index++)
+    {
+        CFDictionaryRef summary;
+        CFDictionaryRef uuid_details = NULL;
+        CFStringRef     uuid;
+        CFNumberRef     timestamp;
+        CFAbsoluteTime  clear_time = 0.0;
+        CFArrayRef      event_array;
+        CFIndex         event_index, event_count;
+
+        summary = isA_CFDictionary(CFArrayGetValueAtIndex(powpowHistory, uuid_index));
+        if (!summary)
+            continue;
+        uuid = isA_CFString(CFDictionaryGetValue(summary, CFSTR(kIOPMPowerHistoryUUIDKey)));
+        if (!uuid)
+            continue;
+
+        if (kIOReturnSuccess != IOPMCopyPowerHistoryDetailed(uuid, &uuid_details) || !uuid_details)
+            continue;
+
+        timestamp = isA_CFNumber(CFDictionaryGetValue(uuid_details,
+                                    CFSTR(kIOPMPowerHistoryTimestampCompletedKey)));
+        if (timestamp)
+            CFNumberGetValue(timestamp, kCFNumberDoubleType, &clear_time);
+
+        if ((since > 0.0) && (clear_time < since)) {
+            CFRelease(uuid_details);
+            continue;
+        }
+
+        event_array = isA_CFArray(CFDictionaryGetValue(uuid_details,
+                                    CFSTR(kIOPMPowerHistoryEventArrayKey)));
+        event_count = event_array ? CFArrayGetCount(event_array) : 0;
+        for (event_index = 0; event_index < event_count; event_index++)
+        {
+            printf("{\"uuid\":");
+            print_json_cf(uuid);
+            printf(",\"event\":");
+            print_json_cf(CFArrayGetValueAtIndex(event_array, event_index));
+            printf("}\n");
+        }
+
+        CFRelease(uuid_details);
+        fflush(stdout);
+    }
+}
+
+static void show_power_event_history_detailed(char **argv)
 {
     IOReturn        ret;
     CFArrayRef      powpowHistory = NULL;
@@ -6398,7 +7798,11 @@ static void show_power_event_history_detailed(void)
     CFDictionaryRef uuid_details;
     int             uuid_index;
     CFIndex         uuid_count;
+    stream_options_t    opts;
     
+    if (!parse_stream_options(argv, &opts))
+        return;
+
     ret = IOPMCopyPowerHistory(&powpowHistory);
     
     if (kIOReturnSuccess == kIOReturnNotFound) 
@@ -6411,6 +7815,12 @@ static void show_power_event_history_detailed(void)
         goto exit;
     }
     
+    if (kFormatNDJSON == opts.format) {
+        stream_power_event_history_ndjson(powpowHistory, &opts);
+        CFRelease(powpowHistory);
+        goto exit;
+    }
+
     uuid_count = CFArrayGetCount(powpowHistory);
     
     //Bold lettering, on supported systems
@@ -28,10 +28,15 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <sys/dir.h>
 #include <string.h>
 #include <sys/sysctl.h>
 
+extern char **environ;
+
 /* Log files generated by RootDomain */
 #define RD_STACKS "/var/log/SleepWakeStacks.dump"
 #define RD_LOG    "/var/log/SleepWakeLog.dump"
@@ -43,32 +48,70 @@
 #define APPLEOSXWATCHDOG_FILENAMETOKEN "progress watchdog"
 #define SLEEP_WAKE_FILENAMETOKEN "Sleep Wake Failure"
 
+#define DIAGNOSTIC_REPORTS_DIR "/Library/Logs/DiagnosticReports"
 #define PANIC_FILE "/var/db/PanicReporter/current.panic"
 
-void process_logfiles(char *stacksfile, char *logfile)
+#define SPINDUMP_PATH "/usr/sbin/spindump"
+
+typedef struct {
+    char    *stacksfile;
+    char    *logfile;
+    char    *stacksArg;         // spindump option naming the stackshot file
+    char    *dataArg;           // spindump option naming the data file
+    char    *reportToken;       // prefix of the report spindump writes
+    bool    processed;
+    long    crtime;             // birth time of the newest matching report
+    char    report[128];
+} failure_kind_t;
+
+static failure_kind_t failureKinds[] = {
+    { RD_STACKS, RD_LOG,
+      "-sleepwakefailure_stackshot_file", "-sleepwakefailure_data_file",
+      SLEEP_WAKE_FILENAMETOKEN },
+    { RD_APPLEOSXWATCHDOG_STACKS, RD_APPLEOSXWATCHDOG_LOG,
+      "-progress_watchdog_stackshot_file", "-progress_watchdog_data_file",
+      APPLEOSXWATCHDOG_FILENAMETOKEN },
+};
+
+#define FAILURE_KIND_COUNT (sizeof(failureKinds) / sizeof(failureKinds[0]))
+
+static void run_spindump(failure_kind_t *kind)
+{
+    char    *args[] = { SPINDUMP_PATH,
+                        kind->stacksArg, kind->stacksfile,
+                        kind->dataArg, kind->logfile,
+                        NULL };
+    pid_t   pid;
+    int     status;
+
+    if (posix_spawn(&pid, SPINDUMP_PATH, NULL, NULL, args, environ) != 0)
+        return;
+
+    while ((waitpid(pid, &status, 0) == -1) && (errno == EINTR))
+        ;
+}
+
+/*
+ * Hands one pair of RootDomain dumps to spindump. spindump consumes the
+ * files in place; swd removes them once it is done.
+ */
+static void process_logfiles(failure_kind_t *kind)
 {
     struct stat stacks;
     struct stat logs;
-    char cmd[200];
-    DIR *dirp;
-    struct dirent *dp;
-    char fname[128], swfile[128];
-    long crtime = 0;
-    struct stat fstats, pfstat;
-    struct timeval sleeptime, boottime;
-    size_t size;
-    bool isAppleOSXWatchdog = false;
+    int fd;
 
-
-    if ((lstat(logfile, &logs) != 0) || !S_ISREG(logs.st_mode))
+    if ((lstat(kind->logfile, &logs) != 0) || !S_ISREG(logs.st_mode))
         return;
 
-    if (lstat(stacksfile, &stacks)) {
+    if (lstat(kind->stacksfile, &stacks)) {
         // For cases where there is no stack file generated
-        snprintf(cmd, sizeof(cmd), "/usr/bin/touch %s", stacksfile);
-        system(cmd);
+        fd = open(kind->stacksfile, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+        if (fd == -1)
+            return;
+        close(fd);
     }
-    else if (!S_ISREG(S_IFREG)) {
+    else if (!S_ISREG(stacks.st_mode)) {
         // If file exists, it should be a regular file with no links
         return;
     }
@@ -77,80 +120,101 @@ void process_logfiles(char *stacksfile, char *logfile)
      * We need to differentiate Sleep/Wake failure from AppleOSXWatchdog failure. Indeed,
      * currently spindump has a different interface for both watchdogs.
      */
-    isAppleOSXWatchdog = (stacksfile == RD_APPLEOSXWATCHDOG_STACKS || logfile == RD_APPLEOSXWATCHDOG_LOG);
-    
-    if (isAppleOSXWatchdog) {
-        snprintf(cmd, sizeof(cmd),
-                 "/usr/sbin/spindump -progress_watchdog_stackshot_file %s -progress_watchdog_data_file %s",
-                 stacksfile, logfile);
-    } else {
-        snprintf(cmd, sizeof(cmd),
-                 "/usr/sbin/spindump -sleepwakefailure_stackshot_file %s -sleepwakefailure_data_file %s",
-                 stacksfile, logfile);
-    }
-    
-    // Invoke spindump.
-    system(cmd);
+    run_spindump(kind);
 
 
-    unlink(stacksfile);
-    unlink(logfile);
+    unlink(kind->stacksfile);
+    unlink(kind->logfile);
 
+    kind->processed = true;
+}
 
-    // Due diligence check to make sure this file is not generated due to system sleep
-    size = sizeof(sleeptime);
-    if ((sysctlbyname("kern.sleeptime", &sleeptime, &size, NULL, 0) != 0) || (sleeptime.tv_sec != 0))
-        return;
+/*
+ * Finds the most recently created report for every processed failure
+ * kind, with a single pass over the DiagnosticReports directory.
+ */
+static void find_reports(void)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    char fname[128];
+    struct stat fstats;
+    failure_kind_t *kind;
+    unsigned int i;
 
-    // For RD_LOG files, trigger a pop-up dialog to report that
-    // system has rebooted due to Sleep Wake failure.
-    //
-    // Look for most recently created Sleep Wake Failure file
-    dirp = opendir("/Library/Logs/DiagnosticReports");
+    dirp = opendir(DIAGNOSTIC_REPORTS_DIR);
     if (dirp == NULL) {
         return ;
     }
 
     while ((dp = readdir(dirp)) != NULL) {
-        char *filename      = isAppleOSXWatchdog ? APPLEOSXWATCHDOG_FILENAMETOKEN : SLEEP_WAKE_FILENAMETOKEN;
-        size_t filename_len = isAppleOSXWatchdog ? sizeof(APPLEOSXWATCHDOG_FILENAMETOKEN) : sizeof(SLEEP_WAKE_FILENAMETOKEN);
-        
-        if ((strnstr(dp->d_name, filename, filename_len) == dp->d_name)
-                    && (dp->d_type == DT_REG)) {
-            snprintf(fname, sizeof(fname), "/Library/Logs/DiagnosticReports/%s", dp->d_name);
-            stat(fname, &fstats);
-
-            if (S_ISREG(fstats.st_mode) && (crtime < fstats.st_birthtime)) {
-                crtime = fstats.st_birthtime;
-                strncpy(swfile, fname, sizeof(swfile));
+        if (dp->d_type != DT_REG)
+            continue;
+
+        for (i = 0; i < FAILURE_KIND_COUNT; i++) {
+            kind = &failureKinds[i];
+
+            if (!kind->processed
+                || (strnstr(dp->d_name, kind->reportToken, strlen(kind->reportToken) + 1) != dp->d_name))
+                continue;
+
+            snprintf(fname, sizeof(fname), "%s/%s", DIAGNOSTIC_REPORTS_DIR, dp->d_name);
+            if (stat(fname, &fstats) != 0)
+                break;
+
+            if (S_ISREG(fstats.st_mode) && (kind->crtime < fstats.st_birthtime)) {
+                kind->crtime = fstats.st_birthtime;
+                strncpy(kind->report, fname, sizeof(kind->report));
             }
+            break;
         }
     }
+    closedir(dirp);
+}
 
-    // Check for existence of SleepWakeFailure log file
-    if (crtime == 0)
-        return;     
+int main(int argc, char **argv)
+{
+    struct stat pfstat;
+    struct timeval sleeptime, boottime;
+    size_t size;
+    bool processed = false;
+    unsigned int i;
 
-    // Due diligence check to make sure this file is generated after system boot
-    size = sizeof(boottime);
-    if ((sysctlbyname("kern.boottime", &boottime, &size, NULL, 0) != 0) || (boottime.tv_sec > crtime))
-        return;
+    for (i = 0; i < FAILURE_KIND_COUNT; i++) {
+        process_logfiles(&failureKinds[i]);
+        processed |= failureKinds[i].processed;
+    }
+    if (!processed)
+        return 0;
 
-    // If panic file link already exists, skip linking this Sleep Wake failure file
-    if (lstat(PANIC_FILE, &pfstat) == 0)
-        return;
+    // Due diligence check to make sure this file is not generated due to system sleep
+    size = sizeof(sleeptime);
+    if ((sysctlbyname("kern.sleeptime", &sleeptime, &size, NULL, 0) != 0) || (sleeptime.tv_sec != 0))
+        return 0;
+
+    // For RD_LOG files, trigger a pop-up dialog to report that
+    // system has rebooted due to Sleep Wake failure.
+    //
+    // Look for most recently created Sleep Wake Failure file
+    find_reports();
 
-    symlink(swfile, PANIC_FILE);
+    size = sizeof(boottime);
+    if (sysctlbyname("kern.boottime", &boottime, &size, NULL, 0) != 0)
+        return 0;
 
-}
+    for (i = 0; i < FAILURE_KIND_COUNT; i++) {
+        // Check for existence of the failure log file, and make sure it
+        // was generated after system boot
+        if ((failureKinds[i].crtime == 0) || (boottime.tv_sec > failureKinds[i].crtime))
+            continue;
 
-int main(int argc, char **argv)
-{
+        // If panic file link already exists, skip linking this failure file
+        if (lstat(PANIC_FILE, &pfstat) == 0)
+            break;
 
-    process_logfiles(RD_STACKS, RD_LOG);
-    
-    /* AppleOSXWatchdog */
-    process_logfiles(RD_APPLEOSXWATCHDOG_STACKS, RD_APPLEOSXWATCHDOG_LOG);
+        symlink(failureKinds[i].report, PANIC_FILE);
+        break;
+    }
 
     return 0;
 }